@@ -1,8 +1,13 @@
+#include "gssapiP_eap.h"
+
 #include <shibsp/AbstractSPRequest.h>
 #include <shibsp/Application.h>
 #include <shibsp/SPConfig.h>
 #include <shibsp/ServiceProvider.h>
 #include <shibsp/attribute/Attribute.h>
+#include <shibsp/attribute/filtering/AttributeFilter.h>
+#include <shibsp/attribute/filtering/BasicFilteringContext.h>
+#include <shibsp/attribute/resolver/AttributeExtractor.h>
 #include <shibsp/attribute/resolver/ResolutionContext.h>
 #include <shibsp/handler/Handler.h>
 #include <shibsp/handler/AssertionConsumerService.h>
@@ -19,26 +24,38 @@
 #include <saml/saml2/metadata/Metadata.h>
 #include <saml/saml2/metadata/MetadataCredentialCriteria.h>
 #include <saml/saml2/metadata/MetadataProvider.h>
+#include <saml/saml2/metadata/ObservableMetadataProvider.h>
 #include <saml/signature/ContentReference.h>
 #include <saml/util/SAMLConstants.h>
 #include <xercesc/dom/DOM.hpp>
+#include <xercesc/util/Base64.hpp>
 #include <xercesc/util/XMLUniDefs.hpp>
+#include <xsec/enc/XSECCryptoKey.hpp>
 #include <xmltooling/exceptions.h>
 #include <xmltooling/soap/SOAP.h>
 #include <xmltooling/XMLToolingConfig.h>
 #include <xmltooling/impl/AnyElement.h>
 #include <xmltooling/security/Credential.h>
 #include <xmltooling/security/CredentialResolver.h>
+#include <xmltooling/security/KeyInfoResolver.h>
+#include <xmltooling/security/SecurityHelper.h>
+#include <xmltooling/security/SignatureTrustEngine.h>
 #include <xmltooling/signature/Signature.h>
+#include <xmltooling/signature/SignatureValidator.h>
 #include <xmltooling/util/ParserPool.h>
 #include <xmltooling/util/XMLHelper.h>
 #include <xmltooling/util/XMLConstants.h>
 #include <xmltooling/validation/ValidatorSuite.h>
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <set>
 #include <sstream>
+#include <vector>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <openssl/crypto.h>
 
 using namespace opensaml::saml2;
 using namespace opensaml::saml2p;
@@ -54,30 +71,35 @@ using namespace xmltooling::logging;
 using namespace xmltooling;
 using namespace std;
 
-// Taken from http://stackoverflow.com/questions/504810/
-const char* getfqdn() 
+/*
+ * Resolve the canonical name of the local host. This may block on the
+ * resolver, so it is only consulted when the ACS URL for an Application
+ * is first computed, and then only if no better source is configured.
+ */
+static string
+getfqdn(void)
 {
-    const char* retstr;
-    struct addrinfo hints, *info, *p;
-    int gai_result;
-
     char hostname[1024];
-    hostname[1023] = '\0';
-    gethostname(hostname, 1023);
+    struct addrinfo hints, *info = NULL;
+    string fqdn;
+
+    if (gethostname(hostname, sizeof(hostname)) != 0)
+        return string("localhost");
+    hostname[sizeof(hostname) - 1] = '\0';
+    fqdn = hostname;
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC; /*either IPV4 or IPV6*/
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_CANONNAME;
 
-    if ((gai_result = getaddrinfo(hostname, "http", &hints, &info)) != 0) {
-        retstr = "localhost";
+    if (getaddrinfo(hostname, "http", &hints, &info) == 0) {
+        if (info != NULL && info->ai_canonname != NULL)
+            fqdn = info->ai_canonname;
+        freeaddrinfo(info);
     }
 
-    for (p = info; p != NULL; p = p->ai_next) {
-        retstr = p->ai_canonname;
-    }
-    return retstr;
+    return fqdn;
 }
 
 // Taken from AbstractHandler.cpp
@@ -97,6 +119,1223 @@ void generateRandomHex(std::string& buf, unsigned int len) {
     }
 }
 
+/*
+ * Build the SOAP envelope carrying an ECP AuthnRequest for app, naming
+ * acsURL as the response location. The request ID and IssueInstant are left for the caller to set (or for the
+ * marshaller to generate); *pRequest is owned by the returned envelope.
+ */
+static Envelope *
+buildECPRequest(const Application *app,
+                const Handler *ACS,
+                const string &acsURL,
+                const char *relayState,
+                AuthnRequest **pRequest)
+{
+    pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
+        pair<const EntityDescriptor*,const RoleDescriptor*>(nullptr,nullptr);
+
+    // Build up AuthnRequest section of the SOAP message
+    auto_ptr<AuthnRequest> request(AuthnRequestBuilder::buildAuthnRequest());
+
+    auto_ptr_XMLCh acsLocation(acsURL.c_str());
+    request->setAssertionConsumerServiceURL(acsLocation.get());
+
+    Issuer* issuer = IssuerBuilder::buildIssuer();
+    request->setIssuer(issuer);
+    issuer->setName(app->getRelyingParty(entity.first)->getXMLString("entityID").second);
+
+    auto_ptr_XMLCh acsBinding((ACS->getString("Binding")).second);
+    request->setProtocolBinding(acsBinding.get());
+
+    NameIDPolicy* namepol = NameIDPolicyBuilder::buildNameIDPolicy();
+    namepol->AllowCreate(true);
+    request->setNameIDPolicy(namepol);
+
+    // Call into opensaml's SAML2ECPEncoder.cpp
+    // return encoder.encode(httpResponse,requestobj,dest.get()[=nullptr],
+    //                       entity2[=nullptr],relayState.c_str(),&app)
+    auto_ptr<Envelope> env(EnvelopeBuilder::buildEnvelope());
+    Header* header = HeaderBuilder::buildHeader();
+    env->setHeader(header);
+    Body* body = BodyBuilder::buildBody();
+    env->setBody(body);
+    body->getUnknownXMLObjects().push_back(request.get());
+    *pRequest = request.release();
+
+    ElementProxy* hdrblock;
+    xmltooling::QName qMU(SOAP11ENV_NS, Header::MUSTUNDERSTAND_ATTRIB_NAME,
+                          SOAP11ENV_PREFIX);
+    xmltooling::QName qActor(SOAP11ENV_NS, Header::ACTOR_ATTRIB_NAME, 
+                             SOAP11ENV_PREFIX);
+    
+    // Create paos:Request header.
+    AnyElementBuilder m_anyBuilder;
+    auto_ptr_XMLCh m_actor("http://schemas.xmlsoap.org/soap/actor/next");
+    static const XMLCh service[] = UNICODE_LITERAL_7(s,e,r,v,i,c,e);
+    static const XMLCh responseConsumerURL[] = UNICODE_LITERAL_19(r,e,s,p,o,n,s,e,C,o,n,s,u,m,e,r,U,R,L);
+    hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(PAOS_NS, saml1p::Request::LOCAL_NAME, PAOS_PREFIX));
+    hdrblock->setAttribute(qMU, XML_ONE);
+    hdrblock->setAttribute(qActor, m_actor.get());
+    hdrblock->setAttribute(xmltooling::QName(nullptr, service), SAML20ECP_NS);
+    hdrblock->setAttribute(xmltooling::QName(nullptr, responseConsumerURL), (*pRequest)->getAssertionConsumerServiceURL());
+    header->getUnknownXMLObjects().push_back(hdrblock);
+
+    // Create ecp:Request header.
+    static const XMLCh IsPassive[] = UNICODE_LITERAL_9(I,s,P,a,s,s,i,v,e);
+    hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(SAML20ECP_NS, saml1p::Request::LOCAL_NAME, SAML20ECP_PREFIX));
+    hdrblock->setAttribute(qMU, XML_ONE);
+    hdrblock->setAttribute(qActor, m_actor.get());
+    if (!(*pRequest)->IsPassive())
+        hdrblock->setAttribute(xmltooling::QName(nullptr,IsPassive), XML_ZERO);
+    hdrblock->getUnknownXMLObjects().push_back((*pRequest)->getIssuer()->clone());
+    if ((*pRequest)->getScoping() && (*pRequest)->getScoping()->getIDPList())
+        hdrblock->getUnknownXMLObjects().push_back((*pRequest)->getScoping()->getIDPList()->clone());
+    header->getUnknownXMLObjects().push_back(hdrblock);
+
+    // Create samlec:SessionKey header, offering the enctypes we can key
+    // per-message protection with. It is not mustUnderstand, so an IdP
+    // that does not implement it simply issues an unkeyed assertion.
+    auto_ptr_XMLCh samlecNS(SAMLEC_NS);
+    auto_ptr_XMLCh samlecPrefix(SAMLEC_PREFIX);
+    static const XMLCh SessionKey[] = UNICODE_LITERAL_10(S,e,s,s,i,o,n,K,e,y);
+    static const XMLCh EncType[] = UNICODE_LITERAL_7(E,n,c,T,y,p,e);
+    hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(samlecNS.get(), SessionKey, samlecPrefix.get()));
+    hdrblock->setAttribute(qActor, m_actor.get());
+    static const int enctypes[] = {
+        ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+        ENCTYPE_AES128_CTS_HMAC_SHA1_96
+    };
+    for (size_t i = 0; i < sizeof(enctypes) / sizeof(enctypes[0]); i++) {
+        ElementProxy* et = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(samlecNS.get(), EncType, samlecPrefix.get()));
+        auto_ptr_XMLCh name(gssEapEnctypeToString(enctypes[i]));
+        et->setTextContent(name.get());
+        hdrblock->getUnknownXMLObjects().push_back(et);
+    }
+    header->getUnknownXMLObjects().push_back(hdrblock);
+
+    if (relayState && *relayState) {
+        // Create ecp:RelayState header.
+        static const XMLCh RelayState[] = UNICODE_LITERAL_10(R,e,l,a,y,S,t,a,t,e);
+        hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(SAML20ECP_NS, RelayState, SAML20ECP_PREFIX));
+        hdrblock->setAttribute(qMU, XML_ONE);
+        hdrblock->setAttribute(qActor, m_actor.get());
+        auto_ptr_XMLCh rs(relayState);
+        hdrblock->setTextContent(rs.get());
+        header->getUnknownXMLObjects().push_back(hdrblock);
+    }
+
+    return env.release();
+}
+
+/*
+ * Serialized unsigned ECP request with the per-request fields (request
+ * ID, IssueInstant and RelayState) cut out. It is built once per
+ * Application, along with the rest of the cached state, so that each
+ * AuthnRequest is produced by splicing those fields back in rather than
+ * by building and marshalling a DOM.
+ */
+class gss_eap_saml_request_template {
+public:
+    enum field {
+        FIELD_REQUEST_ID,
+        FIELD_ISSUE_INSTANT,
+        FIELD_RELAY_STATE,
+        FIELD_MAX
+    };
+
+    gss_eap_saml_request_template(void) {}
+
+    bool init(const Application *app, const Handler *ACS,
+              const string &acsURL);
+    bool valid(void) const { return !m_xml.empty(); }
+    void render(const string fields[FIELD_MAX], string &out) const;
+
+private:
+    struct splice {
+        size_t offset;
+        size_t length;
+        enum field which;
+
+        bool operator<(const splice &other) const {
+            return offset < other.offset;
+        }
+    };
+
+    bool addSplice(const string &xml, size_t offset, size_t length,
+                   enum field which);
+
+    string m_xml;
+    vector<splice> m_splices;
+};
+
+#define REQUEST_TEMPLATE_ID             "_GSSEAPREQUESTID"
+#define REQUEST_TEMPLATE_RELAY_STATE    "GSSEAPRELAYSTATE"
+#define REQUEST_TEMPLATE_ISSUE_INSTANT  "IssueInstant=\""
+
+bool
+gss_eap_saml_request_template::addSplice(const string &xml,
+                                         size_t offset,
+                                         size_t length,
+                                         enum field which)
+{
+    splice sp;
+
+    if (offset == string::npos || offset + length > xml.length())
+        return false;
+
+    sp.offset = offset;
+    sp.length = length;
+    sp.which = which;
+
+    m_splices.push_back(sp);
+
+    return true;
+}
+
+bool
+gss_eap_saml_request_template::init(const Application *app,
+                                    const Handler *ACS,
+                                    const string &acsURL)
+{
+    AuthnRequest *request;
+    string xml;
+    size_t offset, end;
+
+    m_xml.clear();
+    m_splices.clear();
+
+    auto_ptr<Envelope> env(buildECPRequest(app, ACS, acsURL,
+                                           REQUEST_TEMPLATE_RELAY_STATE,
+                                           &request));
+    auto_ptr_XMLCh requestID(REQUEST_TEMPLATE_ID);
+
+    request->setID(requestID.get());
+    request->setIssueInstant((time_t)0);
+
+    stringstream s;
+    s << *(env->marshall());
+    xml = s.str();
+
+    offset = xml.find(REQUEST_TEMPLATE_ID);
+    if (!addSplice(xml, offset, strlen(REQUEST_TEMPLATE_ID),
+                   FIELD_REQUEST_ID))
+        return false;
+
+    offset = xml.find(REQUEST_TEMPLATE_ISSUE_INSTANT);
+    if (offset != string::npos) {
+        offset += strlen(REQUEST_TEMPLATE_ISSUE_INSTANT);
+        end = xml.find('"', offset);
+        if (end == string::npos ||
+            !addSplice(xml, offset, end - offset, FIELD_ISSUE_INSTANT))
+            return false;
+    } else {
+        return false;
+    }
+
+    offset = xml.find(REQUEST_TEMPLATE_RELAY_STATE);
+    if (!addSplice(xml, offset, strlen(REQUEST_TEMPLATE_RELAY_STATE),
+                   FIELD_RELAY_STATE))
+        return false;
+
+    sort(m_splices.begin(), m_splices.end());
+    m_xml = xml;
+
+    return true;
+}
+
+void
+gss_eap_saml_request_template::render(const string fields[FIELD_MAX],
+                                      string &out) const
+{
+    size_t length = m_xml.length(), offset = 0;
+
+    GSSEAP_ASSERT(valid());
+
+    for (vector<splice>::const_iterator sp = m_splices.begin();
+         sp != m_splices.end();
+         ++sp)
+        length += fields[sp->which].length() - sp->length;
+
+    out.erase();
+    out.reserve(length);
+
+    for (vector<splice>::const_iterator sp = m_splices.begin();
+         sp != m_splices.end();
+         ++sp) {
+        out.append(m_xml, offset, sp->offset - offset);
+        out.append(fields[sp->which]);
+        offset = sp->offset + sp->length;
+    }
+
+    out.append(m_xml, offset, string::npos);
+}
+
+/*
+ * Cache of issuer metadata lookups for an Application, keyed by role and
+ * entityID. Lookups are made with the metadata provider locked (as the
+ * policy evaluation that follows needs it locked anyway), and the cache
+ * is flushed from the provider's change event, which is raised under the
+ * provider's exclusive lock. Cached descriptors therefore never outlive
+ * the metadata they came from.
+ */
+#define GSSEAP_ISSUER_CACHE_MAX     64
+
+class gss_eap_issuer_cache : public ObservableMetadataProvider::Observer {
+public:
+    gss_eap_issuer_cache(MetadataProvider *provider);
+    ~gss_eap_issuer_cache(void);
+
+    pair<const EntityDescriptor*,const RoleDescriptor*>
+    lookup(SecurityPolicy &policy, const XMLCh *entityID);
+
+    void onEvent(const ObservableMetadataProvider &provider) const;
+
+    /* Called when the provider has been destroyed along with its Application */
+    void detach(void) { m_provider = NULL; }
+
+private:
+    gss_eap_issuer_cache(const gss_eap_issuer_cache &);
+    gss_eap_issuer_cache &operator=(const gss_eap_issuer_cache &);
+
+    typedef map<string, pair<const EntityDescriptor*,const RoleDescriptor*> > entry_map;
+
+    ObservableMetadataProvider *m_provider;
+    mutable GSSEAP_RWLOCK m_lock;
+    mutable entry_map m_entries;
+};
+
+gss_eap_issuer_cache::gss_eap_issuer_cache(MetadataProvider *provider)
+    : m_provider(dynamic_cast<ObservableMetadataProvider *>(provider))
+{
+    GSSEAP_RWLOCK_INIT(&m_lock);
+
+    /* Without change events, entries cannot be invalidated safely */
+    if (m_provider != NULL)
+        m_provider->addObserver(this);
+}
+
+gss_eap_issuer_cache::~gss_eap_issuer_cache(void)
+{
+    if (m_provider != NULL)
+        m_provider->removeObserver(this);
+
+    GSSEAP_RWLOCK_DESTROY(&m_lock);
+}
+
+void
+gss_eap_issuer_cache::onEvent(const ObservableMetadataProvider &provider) const
+{
+    GSSEAP_RWLOCK_WRLOCK(&m_lock);
+    m_entries.clear();
+    GSSEAP_RWLOCK_WRUNLOCK(&m_lock);
+}
+
+/*
+ * Resolve the issuer's role descriptor for policy, which must have its
+ * metadata provider locked.
+ */
+pair<const EntityDescriptor*,const RoleDescriptor*>
+gss_eap_issuer_cache::lookup(SecurityPolicy &policy, const XMLCh *entityID)
+{
+    pair<const EntityDescriptor*,const RoleDescriptor*> entity(nullptr,nullptr);
+    auto_ptr_char name(entityID);
+    string key;
+    entry_map::const_iterator e;
+
+    if (name.get() == NULL)
+        return entity;
+
+    key = policy.getRole()->toString() + " " + name.get();
+
+    if (m_provider != NULL) {
+        GSSEAP_RWLOCK_RDLOCK(&m_lock);
+        e = m_entries.find(key);
+        if (e != m_entries.end())
+            entity = e->second;
+        GSSEAP_RWLOCK_RDUNLOCK(&m_lock);
+
+        if (entity.second != NULL)
+            return entity;
+    }
+
+    MetadataProvider::Criteria& mc = policy.getMetadataProviderCriteria();
+    mc.entityID_unicode = entityID;
+    mc.role = policy.getRole();
+    mc.protocol = samlconstants::SAML20P_NS;
+    entity = policy.getMetadataProvider()->getEntityDescriptor(mc);
+
+    if (m_provider != NULL && entity.second != NULL) {
+        GSSEAP_RWLOCK_WRLOCK(&m_lock);
+        if (m_entries.size() >= GSSEAP_ISSUER_CACHE_MAX)
+            m_entries.clear();
+        m_entries[key] = entity;
+        GSSEAP_RWLOCK_WRUNLOCK(&m_lock);
+    }
+
+    return entity;
+}
+
+/*
+ * Signature trust engine that remembers, per issuer role, the public keys
+ * that have verified that role's signatures. A message signed with a
+ * remembered key is checked with a single signature verification, rather
+ * than by the configured engine re-resolving and decoding the role's
+ * KeyDescriptors (or building a certificate path) each time. Keys are
+ * held as ready-to-use XSECCryptoKeys, keyed by role and key fingerprint,
+ * and are forgotten when metadata is reloaded or after
+ * GSSEAP_KEY_CACHE_TTL seconds, whichever is sooner.
+ *
+ * Anything the cache cannot answer is passed to the configured engine;
+ * when that succeeds, the key that verified the signature is remembered.
+ */
+#define GSSEAP_KEY_CACHE_MAX        64
+#define GSSEAP_KEY_CACHE_TTL        600
+
+class gss_eap_key_cache_trust_engine
+    : public SignatureTrustEngine,
+      public ObservableMetadataProvider::Observer {
+public:
+    gss_eap_key_cache_trust_engine(const SignatureTrustEngine *engine,
+                                   MetadataProvider *provider);
+    ~gss_eap_key_cache_trust_engine(void);
+
+    bool validate(Signature &sig,
+                  const CredentialResolver &credResolver,
+                  CredentialCriteria *criteria = nullptr) const;
+    bool validate(const XMLCh *sigAlgorithm,
+                  const char *sig,
+                  KeyInfo *keyInfo,
+                  const char *in,
+                  unsigned int in_len,
+                  const CredentialResolver &credResolver,
+                  CredentialCriteria *criteria = nullptr) const {
+        return m_engine->validate(sigAlgorithm, sig, keyInfo, in, in_len,
+                                  credResolver, criteria);
+    }
+
+    void onEvent(const ObservableMetadataProvider &provider) const;
+
+    /* Called when the provider has been destroyed along with its Application */
+    void detach(void) { m_provider = NULL; }
+
+private:
+    gss_eap_key_cache_trust_engine(const gss_eap_key_cache_trust_engine &);
+    gss_eap_key_cache_trust_engine &operator=(const gss_eap_key_cache_trust_engine &);
+
+    struct entry {
+        XSECCryptoKey *key;
+        time_t expiry;
+    };
+    typedef map<pair<const RoleDescriptor *, string>, entry> entry_map;
+
+    static bool verify(const Signature &sig, XSECCryptoKey *key);
+    bool validateCached(const Signature &sig, const RoleDescriptor *role) const;
+    void remember(const Signature &sig, const RoleDescriptor *role,
+                  const CredentialResolver &credResolver,
+                  CredentialCriteria *criteria) const;
+    void flush(void) const;
+
+    const SignatureTrustEngine *m_engine;
+    ObservableMetadataProvider *m_provider;
+    mutable GSSEAP_RWLOCK m_lock;
+    mutable entry_map m_entries;
+};
+
+gss_eap_key_cache_trust_engine::gss_eap_key_cache_trust_engine(const SignatureTrustEngine *engine,
+                                                               MetadataProvider *provider)
+    : m_engine(engine),
+      m_provider(dynamic_cast<ObservableMetadataProvider *>(provider))
+{
+    GSSEAP_RWLOCK_INIT(&m_lock);
+
+    if (m_provider != NULL)
+        m_provider->addObserver(this);
+}
+
+gss_eap_key_cache_trust_engine::~gss_eap_key_cache_trust_engine(void)
+{
+    if (m_provider != NULL)
+        m_provider->removeObserver(this);
+
+    flush();
+    GSSEAP_RWLOCK_DESTROY(&m_lock);
+}
+
+void
+gss_eap_key_cache_trust_engine::flush(void) const
+{
+    for (entry_map::iterator e = m_entries.begin(); e != m_entries.end(); ++e)
+        delete e->second.key;
+    m_entries.clear();
+}
+
+void
+gss_eap_key_cache_trust_engine::onEvent(const ObservableMetadataProvider &provider) const
+{
+    GSSEAP_RWLOCK_WRLOCK(&m_lock);
+    flush();
+    GSSEAP_RWLOCK_WRUNLOCK(&m_lock);
+}
+
+bool
+gss_eap_key_cache_trust_engine::verify(const Signature &sig, XSECCryptoKey *key)
+{
+    try {
+        SignatureValidator validator(key);
+
+        validator.validate(&sig);
+    } catch (ValidationException &e) {
+        return false;
+    }
+
+    return true;
+}
+
+bool
+gss_eap_key_cache_trust_engine::validateCached(const Signature &sig,
+                                               const RoleDescriptor *role) const
+{
+    time_t now = time(NULL);
+    bool ret = false;
+
+    GSSEAP_RWLOCK_RDLOCK(&m_lock);
+
+    for (entry_map::const_iterator e =
+            m_entries.lower_bound(make_pair(role, string()));
+         e != m_entries.end() && e->first.first == role;
+         ++e) {
+        if (e->second.expiry > now && verify(sig, e->second.key)) {
+            ret = true;
+            break;
+        }
+    }
+
+    GSSEAP_RWLOCK_RDUNLOCK(&m_lock);
+
+    return ret;
+}
+
+/*
+ * Having had the configured engine accept sig, find the key that verifies
+ * it -- from the signature's own KeyInfo, or else among the credentials
+ * the resolver holds for the role -- and remember it.
+ */
+void
+gss_eap_key_cache_trust_engine::remember(const Signature &sig,
+                                         const RoleDescriptor *role,
+                                         const CredentialResolver &credResolver,
+                                         CredentialCriteria *criteria) const
+{
+    const KeyInfoResolver *kiResolver = m_engine->getKeyInfoResolver();
+    vector<const Credential *> creds;
+    auto_ptr<Credential> sigCred;
+    XSECCryptoKey *key = NULL;
+    entry ent;
+
+    if (kiResolver == NULL)
+        kiResolver = XMLToolingConfig::getConfig().getKeyInfoResolver();
+
+    if (kiResolver != NULL && sig.getKeyInfo() != NULL) {
+        sigCred.reset(kiResolver->resolve(&sig, Credential::RESOLVE_KEYS));
+        if (sigCred.get() != NULL && sigCred->getPublicKey() != NULL &&
+            verify(sig, sigCred->getPublicKey()))
+            key = sigCred->getPublicKey();
+    }
+
+    if (key == NULL) {
+        credResolver.resolve(creds, criteria);
+        for (vector<const Credential *>::const_iterator c = creds.begin();
+             c != creds.end();
+             ++c) {
+            if ((*c)->getPublicKey() != NULL &&
+                verify(sig, (*c)->getPublicKey())) {
+                key = (*c)->getPublicKey();
+                break;
+            }
+        }
+    }
+
+    if (key == NULL)
+        return;
+
+    ent.key = key->clone();
+    ent.expiry = time(NULL) + GSSEAP_KEY_CACHE_TTL;
+
+    pair<const RoleDescriptor *, string> id(role, SecurityHelper::getDEREncoding(*key, "SHA1"));
+
+    GSSEAP_RWLOCK_WRLOCK(&m_lock);
+    if (m_entries.size() >= GSSEAP_KEY_CACHE_MAX)
+        flush();
+    entry_map::iterator e = m_entries.find(id);
+    if (e != m_entries.end()) {
+        delete e->second.key;
+        e->second = ent;
+    } else {
+        m_entries[id] = ent;
+    }
+    GSSEAP_RWLOCK_WRUNLOCK(&m_lock);
+}
+
+bool
+gss_eap_key_cache_trust_engine::validate(Signature &sig,
+                                         const CredentialResolver &credResolver,
+                                         CredentialCriteria *criteria) const
+{
+    MetadataCredentialCriteria *mcc =
+        dynamic_cast<MetadataCredentialCriteria *>(criteria);
+    const RoleDescriptor *role = NULL;
+
+    /* Without metadata change events, keys cannot be forgotten in time */
+    if (m_provider != NULL && mcc != NULL)
+        role = &mcc->getRole();
+
+    if (role != NULL && validateCached(sig, role))
+        return true;
+
+    if (!m_engine->validate(sig, credResolver, criteria))
+        return false;
+
+    if (role != NULL) {
+        try {
+            remember(sig, role, credResolver, criteria);
+        } catch (exception &e) {
+        }
+    }
+
+    return true;
+}
+
+/*
+ * SecurityPolicy objects for an Application. The rule list is fetched
+ * from the SP and ordered once; policies are recycled through a small
+ * free list and reset between messages, so a response costs neither a
+ * policy construction nor a copy of the rules.
+ *
+ * Rules that verify signatures are moved after the others (keeping their
+ * relative order), so that a response failing the cheap message checks
+ * is rejected before any cryptography is done.
+ */
+#define GSSEAP_POLICY_POOL_MAX      16
+
+class gss_eap_policy_pool {
+public:
+    gss_eap_policy_pool(const Application *app, const TrustEngine *trust);
+    ~gss_eap_policy_pool(void);
+
+    SecurityPolicy *get(void);
+    void put(SecurityPolicy *policy);
+
+private:
+    gss_eap_policy_pool(const gss_eap_policy_pool &);
+    gss_eap_policy_pool &operator=(const gss_eap_policy_pool &);
+
+    static bool isCheapRule(const SecurityPolicyRule *rule);
+
+    MetadataProvider *m_metadata;
+    const TrustEngine *m_trust;
+    xmltooling::QName m_role;
+    vector<const SecurityPolicyRule*> m_rules;
+    GSSEAP_MUTEX m_mutex;
+    vector<SecurityPolicy*> m_idle;
+};
+
+bool
+gss_eap_policy_pool::isCheapRule(const SecurityPolicyRule *rule)
+{
+    const char *type = rule->getType();
+
+    return type == NULL ||
+           (strcmp(type, XMLSIGNING_POLICY_RULE) != 0 &&
+            strcmp(type, SIMPLESIGNING_POLICY_RULE) != 0 &&
+            strcmp(type, CLIENTCERTAUTH_POLICY_RULE) != 0);
+}
+
+gss_eap_policy_pool::gss_eap_policy_pool(const Application *app,
+                                         const TrustEngine *trust)
+    : m_metadata(app->getMetadataProvider(false)),
+      m_trust(trust),
+      m_role(samlconstants::SAML20MD_NS, IDPSSODescriptor::LOCAL_NAME)
+{
+    const vector<const SecurityPolicyRule*> &rules =
+        app->getServiceProvider().getPolicyRules(app->getString("policyId").second);
+
+    m_rules.assign(rules.begin(), rules.end());
+    stable_partition(m_rules.begin(), m_rules.end(), isCheapRule);
+
+    GSSEAP_MUTEX_INIT(&m_mutex);
+}
+
+gss_eap_policy_pool::~gss_eap_policy_pool(void)
+{
+    for (vector<SecurityPolicy*>::iterator p = m_idle.begin();
+         p != m_idle.end();
+         ++p)
+        delete *p;
+
+    GSSEAP_MUTEX_DESTROY(&m_mutex);
+}
+
+SecurityPolicy *
+gss_eap_policy_pool::get(void)
+{
+    SecurityPolicy *policy = NULL;
+
+    GSSEAP_MUTEX_LOCK(&m_mutex);
+    if (!m_idle.empty()) {
+        policy = m_idle.back();
+        m_idle.pop_back();
+    }
+    GSSEAP_MUTEX_UNLOCK(&m_mutex);
+
+    if (policy == NULL) {
+        policy = new SecurityPolicy(m_metadata, &m_role, m_trust, false);
+        policy->getRules().assign(m_rules.begin(), m_rules.end());
+    }
+
+    return policy;
+}
+
+void
+gss_eap_policy_pool::put(SecurityPolicy *policy)
+{
+    policy->reset(false);
+
+    GSSEAP_MUTEX_LOCK(&m_mutex);
+    if (m_idle.size() < GSSEAP_POLICY_POOL_MAX) {
+        m_idle.push_back(policy);
+        policy = NULL;
+    }
+    GSSEAP_MUTEX_UNLOCK(&m_mutex);
+
+    delete policy;
+}
+
+/*
+ * Borrows a SecurityPolicy from a pool for the lifetime of the object.
+ */
+class gss_eap_policy_ref {
+public:
+    gss_eap_policy_ref(gss_eap_policy_pool *pool)
+        : m_pool(pool), m_policy(pool->get()) {}
+    ~gss_eap_policy_ref(void) { m_pool->put(m_policy); }
+
+    SecurityPolicy &policy(void) const { return *m_policy; }
+
+private:
+    gss_eap_policy_ref(const gss_eap_policy_ref &);
+    gss_eap_policy_ref &operator=(const gss_eap_policy_ref &);
+
+    gss_eap_policy_pool *m_pool;
+    SecurityPolicy *m_policy;
+};
+
+/*
+ * The acceptor's ServiceProvider is loaded on first use and shared by all
+ * contexts. Each user holds a reference for the duration of its call; the
+ * initial reference is dropped by gssEapSamlSPFinalize(), and the SP is
+ * torn down when the last reference goes away. A load that fails is
+ * retried by the next caller, so a broken shibboleth2.xml can be fixed
+ * without restarting the process.
+ */
+static GSSEAP_THREAD_ONCE gssEapSamlSPInitOnce = GSSEAP_ONCE_INITIALIZER;
+static OM_uint32 gssEapSamlSPInitStatus = GSS_S_UNAVAILABLE;
+static GSSEAP_MUTEX gssEapSamlSPMutex;
+static unsigned int gssEapSamlSPRefCount = 0; /* 0 if not loaded */
+static bool gssEapSamlSPFinalized = false;
+static string gssEapSamlSPAcceptorHost; /* protected by gssEapSamlSPMutex */
+
+/*
+ * Per-Application state derived from the SP configuration. Acceptors
+ * read it concurrently under the shared state lock; it is only rebuilt,
+ * under the exclusive lock, after the SP has reloaded its configuration
+ * (which replaces the Application objects).
+ */
+struct gss_eap_sp_app_state {
+    uint64_t generation;
+    const Application *app;
+    const Handler *acs;
+    string acsURL;
+    gss_eap_saml_request_template requestTemplate;
+    gss_eap_issuer_cache *issuers;
+    gss_eap_key_cache_trust_engine *trust;
+    gss_eap_policy_pool *policies;
+    set<string> loginAttributes;
+};
+
+static GSSEAP_RWLOCK gssEapSamlSPStateLock;
+static map<string, gss_eap_sp_app_state *> gssEapSamlSPAppStates;
+
+/*
+ * Count of SP configurations unloaded. A reload releases the DOM of the
+ * old configuration after deleting its Applications, so each state
+ * attaches a handler to its Application's element and is stale once the
+ * count moves on. Comparing Application pointers is not enough, as a new
+ * Application may be allocated where an old one was freed.
+ */
+static uint64_t gssEapSamlSPGeneration = 0;
+
+static const XMLCh gssEapSamlSPStateKey[] = UNICODE_LITERAL_6(g,s,s,e,a,p);
+
+class gss_eap_sp_unload_handler : public DOMUserDataHandler {
+public:
+    void handle(DOMOperationType operation, const XMLCh *const key,
+                void *data, const DOMNode *src, DOMNode *dst) {
+        if (operation == NODE_DELETED)
+            GSSEAP_ATOMIC_FETCH_ADD64(&gssEapSamlSPGeneration, 1);
+    }
+};
+
+static gss_eap_sp_unload_handler gssEapSamlSPUnloadHandler;
+
+static bool
+gssEapSamlAppStateIsCurrent(const gss_eap_sp_app_state *state)
+{
+    return state->generation == GSSEAP_ATOMIC_LOAD64(&gssEapSamlSPGeneration);
+}
+
+GSSEAP_ONCE_CALLBACK(gssEapSamlSPInitInternal)
+{
+    GSSEAP_ASSERT(gssEapSamlSPInitStatus == GSS_S_UNAVAILABLE);
+
+    if (GSSEAP_MUTEX_INIT(&gssEapSamlSPMutex) == 0 &&
+        GSSEAP_RWLOCK_INIT(&gssEapSamlSPStateLock) == 0)
+        gssEapSamlSPInitStatus = GSS_S_COMPLETE;
+    else
+        gssEapSamlSPInitStatus = GSS_S_FAILURE;
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+/*
+ * Load the SP configuration unless it is already loaded, taking the
+ * initial reference. Called with gssEapSamlSPMutex held.
+ */
+static bool
+gssEapSamlSPLoad(void)
+{
+    SPConfig& conf = SPConfig::getConfig();
+    bool initialized = false;
+
+    if (gssEapSamlSPRefCount != 0)
+        return true;
+    if (gssEapSamlSPFinalized)
+        return false;
+
+    // Initialization code taken from resolvertest.cpp::main()
+    conf.setFeatures(
+        SPConfig::Metadata |
+        SPConfig::Trust |
+        SPConfig::AttributeResolution |
+        SPConfig::Credentials |
+        SPConfig::OutOfProcess |
+        SPConfig::Caching |
+        SPConfig::Logging |
+        SPConfig::Handlers
+    );
+    try {
+        if (conf.init()) {
+            initialized = true;
+            if (conf.instantiate()) {
+                gssEapSamlSPRefCount = 1;
+                return true;
+            }
+            cerr << "Unable to load the Shibboleth SP configuration." << endl;
+        } else {
+            cerr << "Unable to initialize the Shibboleth SP library." << endl;
+        }
+    } catch (exception &e) {
+        cerr << "Unable to load the Shibboleth SP configuration: "
+             << e.what() << endl;
+    }
+
+    if (initialized) {
+        try {
+            conf.term();
+        } catch (exception &e) {
+            cerr << "Unable to unload the Shibboleth SP configuration: "
+                 << e.what() << endl;
+        }
+    }
+
+    return false;
+}
+
+static ServiceProvider *
+gssEapSamlSPAcquire(void)
+{
+    ServiceProvider *sp = NULL;
+
+    GSSEAP_ONCE(&gssEapSamlSPInitOnce, gssEapSamlSPInitInternal);
+
+    if (GSS_ERROR(gssEapSamlSPInitStatus))
+        return NULL;
+
+    GSSEAP_MUTEX_LOCK(&gssEapSamlSPMutex);
+    if (gssEapSamlSPLoad()) {
+        gssEapSamlSPRefCount++;
+        sp = SPConfig::getConfig().getServiceProvider();
+    }
+    GSSEAP_MUTEX_UNLOCK(&gssEapSamlSPMutex);
+
+    return sp;
+}
+
+static void
+gssEapSamlReleaseAppState(gss_eap_sp_app_state *state, bool appAlive)
+{
+    if (!appAlive) {
+        if (state->issuers != NULL)
+            state->issuers->detach();
+        if (state->trust != NULL)
+            state->trust->detach();
+    }
+    delete state->policies;
+    delete state->issuers;
+    delete state->trust;
+    delete state;
+}
+
+static void
+gssEapSamlSPRelease(void)
+{
+    bool last;
+
+    GSSEAP_MUTEX_LOCK(&gssEapSamlSPMutex);
+    GSSEAP_ASSERT(gssEapSamlSPRefCount != 0);
+    last = (--gssEapSamlSPRefCount == 0);
+    GSSEAP_MUTEX_UNLOCK(&gssEapSamlSPMutex);
+
+    if (last) {
+        for (map<string, gss_eap_sp_app_state *>::iterator s =
+                gssEapSamlSPAppStates.begin();
+             s != gssEapSamlSPAppStates.end();
+             ++s)
+            gssEapSamlReleaseAppState(s->second,
+                                      gssEapSamlAppStateIsCurrent(s->second));
+        gssEapSamlSPAppStates.clear();
+
+        SPConfig::getConfig().term();
+    }
+}
+
+#define SAML_EC_ACS_URL "SAML_EC_ACS_URL"
+#define SAML_EC_LOGIN_ATTRIBUTES "SAML_EC_LOGIN_ATTRIBUTES"
+
+/*
+ * Compute the AssertionConsumerService URL advertised in requests for
+ * app; this follows AbstractSPRequest::getHandlerURL(), except that there
+ * is no HTTP request to take the host from. In order of preference, the
+ * URL is taken from the SAML_EC_ACS_URL environment variable, an absolute
+ * handlerURL in the <Sessions> element, the host named by the acceptor
+ * credential, or failing those the canonical name of the local host.
+ */
+static string
+gssEapSamlComputeACSURL(const Application *app, const Handler *ACS)
+{
+    const char *override = getenv(SAML_EC_ACS_URL);
+    const char *handler = nullptr;
+    string url, host, path;
+
+    if (override != NULL && *override != '\0')
+        return string(override);
+
+    const PropertySet* props = app->getPropertySet("Sessions");
+    if (props) {
+        pair<bool,const char*> p2 = props->getString("handlerURL");
+        if (p2.first) {
+            handler = p2.second;
+        }
+    }
+
+    if (!handler) {
+        handler = "/Shibboleth.sso";
+    } else if (*handler!='/' && strncmp(handler,"http:",5) && strncmp(handler,"https:",6)) {
+        throw XMLToolingException(
+              "Invalid handlerURL property <Sessions> element for Application");
+    }
+
+    if (*handler != '/') {
+        // break apart the handler into protocol, host, and "the rest"
+        const char* colon = strchr(handler, ':') + 3;
+        const char* slash = strchr(colon, '/');
+
+        host.assign(colon, (slash ? slash-colon : strlen(colon)));
+        path = (slash ? slash : "");
+    } else {
+        path = handler;
+    }
+
+    if (host.empty()) {
+        GSSEAP_MUTEX_LOCK(&gssEapSamlSPMutex);
+        host = gssEapSamlSPAcceptorHost;
+        GSSEAP_MUTEX_UNLOCK(&gssEapSamlSPMutex);
+    }
+    if (host.empty())
+        host = getfqdn();
+
+    url = "https://" + host + path;
+
+    pair<bool,const char*> prop = ACS->getString("Location");
+    if (prop.first) {
+        url += prop.second;
+    }
+
+    return url;
+}
+
+/*
+ * Build the cached state for an Application. Called with the state lock
+ * held exclusively.
+ */
+static gss_eap_sp_app_state *
+gssEapSamlBuildAppState(const Application *app)
+{
+    gss_eap_sp_app_state *state = new gss_eap_sp_app_state;
+    const TrustEngine *trust;
+    const DOMElement *e;
+
+    state->generation = GSSEAP_ATOMIC_LOAD64(&gssEapSamlSPGeneration);
+    state->app = app;
+    state->acs = app->getAssertionConsumerServiceByProtocol(SAML20P_NS, SAML20_BINDING_PAOS);
+    state->issuers = NULL;
+    state->trust = NULL;
+    state->policies = NULL;
+
+    try {
+        e = app->getElement();
+        if (e != NULL)
+            const_cast<DOMElement *>(e)->setUserData(gssEapSamlSPStateKey,
+                                                     &gssEapSamlSPGeneration,
+                                                     &gssEapSamlSPUnloadHandler);
+
+        if (state->acs != NULL) {
+            state->acsURL = gssEapSamlComputeACSURL(app, state->acs);
+
+            try {
+                state->requestTemplate.init(app, state->acs, state->acsURL);
+            } catch (exception &e) {
+                /* fall back to building each request */
+            }
+        }
+
+        state->issuers = new gss_eap_issuer_cache(app->getMetadataProvider(false));
+
+        trust = app->getTrustEngine(false);
+
+        const SignatureTrustEngine *sigTrust =
+            dynamic_cast<const SignatureTrustEngine *>(trust);
+        if (sigTrust != NULL) {
+            state->trust = new gss_eap_key_cache_trust_engine(sigTrust, app->getMetadataProvider(false));
+            trust = state->trust;
+        }
+
+        state->policies = new gss_eap_policy_pool(app, trust);
+
+        /*
+         * SAML attribute names that are mapped to local-login-user, as a
+         * space or comma separated list, enabling the fast path for the
+         * login name.
+         */
+        const char *loginAttributes = getenv(SAML_EC_LOGIN_ATTRIBUTES);
+        if (loginAttributes != NULL) {
+            string names(loginAttributes);
+            size_t start = 0, end;
+
+            while ((start = names.find_first_not_of(", ", start)) != string::npos) {
+                end = names.find_first_of(", ", start);
+                state->loginAttributes.insert(names.substr(start, end - start));
+                start = end;
+            }
+        }
+    } catch (exception &e) {
+        gssEapSamlReleaseAppState(state, true);
+        throw;
+    }
+
+    return state;
+}
+
+static gss_eap_sp_app_state *
+gssEapSamlLookupAppState(const char *appId, const Application *app)
+{
+    map<string, gss_eap_sp_app_state *>::const_iterator s =
+        gssEapSamlSPAppStates.find(appId);
+
+    if (s == gssEapSamlSPAppStates.end() ||
+        !gssEapSamlAppStateIsCurrent(s->second) ||
+        s->second->app != app)
+        return NULL;
+
+    return s->second;
+}
+
+/*
+ * Holds a reference to the shared ServiceProvider for the lifetime of
+ * the object, together with the SP's own (shared) lock and a shared lock
+ * on the cached state for the requested Application. Per-request work
+ * therefore never excludes other acceptors; only rebuilding the cached
+ * state after a configuration reload takes the exclusive lock.
+ *
+ * state() returns NULL if the SP could not be loaded or the Application
+ * does not exist.
+ */
+class gss_eap_sp_ref {
+public:
+    gss_eap_sp_ref(const char *appId = "default")
+        : m_sp(gssEapSamlSPAcquire()), m_app(NULL), m_state(NULL) {
+        if (m_sp == NULL)
+            return;
+
+        m_sp->lock();
+
+        try {
+            m_app = m_sp->getApplication(appId);
+            if (m_app != NULL)
+                m_state = lockAppState(appId, m_app);
+        } catch (exception &e) {
+        }
+    }
+
+    ~gss_eap_sp_ref(void) {
+        if (m_state != NULL)
+            GSSEAP_RWLOCK_RDUNLOCK(&gssEapSamlSPStateLock);
+        if (m_sp != NULL) {
+            m_sp->unlock();
+            gssEapSamlSPRelease();
+        }
+    }
+
+    ServiceProvider *sp(void) const { return m_sp; }
+    const Application *app(void) const { return m_app; }
+    const gss_eap_sp_app_state *state(void) const { return m_state; }
+
+private:
+    gss_eap_sp_ref(const gss_eap_sp_ref &);
+    gss_eap_sp_ref &operator=(const gss_eap_sp_ref &);
+
+    /*
+     * Returns the state for app with the state lock held shared. Because
+     * the caller holds the SP lock, app cannot be replaced whilst we loop.
+     */
+    static gss_eap_sp_app_state *
+    lockAppState(const char *appId, const Application *app) {
+        gss_eap_sp_app_state *state;
+
+        GSSEAP_RWLOCK_RDLOCK(&gssEapSamlSPStateLock);
+
+        while ((state = gssEapSamlLookupAppState(appId, app)) == NULL) {
+            GSSEAP_RWLOCK_RDUNLOCK(&gssEapSamlSPStateLock);
+            GSSEAP_RWLOCK_WRLOCK(&gssEapSamlSPStateLock);
+
+            if (gssEapSamlLookupAppState(appId, app) == NULL) {
+                try {
+                    state = gssEapSamlBuildAppState(app);
+                } catch (exception &e) {
+                    GSSEAP_RWLOCK_WRUNLOCK(&gssEapSamlSPStateLock);
+                    return NULL;
+                }
+
+                gss_eap_sp_app_state *&slot = gssEapSamlSPAppStates[appId];
+                if (slot != NULL) /* the old configuration has been unloaded */
+                    gssEapSamlReleaseAppState(slot, false);
+                slot = state;
+            }
+
+            GSSEAP_RWLOCK_WRUNLOCK(&gssEapSamlSPStateLock);
+            GSSEAP_RWLOCK_RDLOCK(&gssEapSamlSPStateLock);
+        }
+
+        return state;
+    }
+
+    ServiceProvider *m_sp;
+    const Application *m_app;
+    const gss_eap_sp_app_state *m_state;
+};
+
+/*
+ * Extract the host from an acceptor name of the form service@host or
+ * service/host[@REALM].
+ */
+static string
+gssEapSamlAcceptorHost(gss_name_t acceptorName)
+{
+    string name, host;
+    size_t p;
+
+    if (acceptorName == GSS_C_NO_NAME || acceptorName->username.length == 0)
+        return host;
+
+    name.assign((const char *)acceptorName->username.value,
+                acceptorName->username.length);
+
+    if ((p = name.find('/')) != string::npos) {
+        host = name.substr(p + 1);
+        if ((p = host.find_first_of("/@")) != string::npos)
+            host.erase(p);
+    } else if ((p = name.find('@')) != string::npos) {
+        host = name.substr(p + 1);
+    }
+
+    return host;
+}
+
+extern "C" OM_uint32
+gssEapSamlSPInit(OM_uint32 *minor, gss_name_t acceptorName)
+{
+    string host;
+
+    bool loaded;
+
+    GSSEAP_ONCE(&gssEapSamlSPInitOnce, gssEapSamlSPInitInternal);
+
+    if (GSS_ERROR(gssEapSamlSPInitStatus)) {
+        *minor = GSSEAP_SHIB_INIT_FAILURE;
+        return gssEapSamlSPInitStatus;
+    }
+
+    /*
+     * The first named acceptor credential supplies the host used in the
+     * ACS URL, unless the configuration names one explicitly.
+     */
+    host = gssEapSamlAcceptorHost(acceptorName);
+
+    GSSEAP_MUTEX_LOCK(&gssEapSamlSPMutex);
+    loaded = gssEapSamlSPLoad();
+    if (!host.empty() && gssEapSamlSPAcceptorHost.empty())
+        gssEapSamlSPAcceptorHost = host;
+    GSSEAP_MUTEX_UNLOCK(&gssEapSamlSPMutex);
+
+    if (!loaded) {
+        *minor = GSSEAP_SHIB_INIT_FAILURE;
+        return GSS_S_FAILURE;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+extern "C" OM_uint32
+gssEapSamlSPFinalize(OM_uint32 *minor)
+{
+    bool loaded = false;
+
+    if (gssEapSamlSPInitStatus == GSS_S_COMPLETE) {
+        GSSEAP_MUTEX_LOCK(&gssEapSamlSPMutex);
+        if (!gssEapSamlSPFinalized) {
+            gssEapSamlSPFinalized = true;
+            loaded = (gssEapSamlSPRefCount != 0);
+        }
+        GSSEAP_MUTEX_UNLOCK(&gssEapSamlSPMutex);
+
+        if (loaded)
+            gssEapSamlSPRelease();
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 // Taken from resolvertest.cpp
 // This is necessary since resolveAttributes is protected and thus cannot be called 
 // from a local instance of a Handler/AssertionConsumerService object.
@@ -136,549 +1375,666 @@ private:
     }
 };
 
+#define LOCAL_LOGIN_USER "local-login-user"
 
-extern "C" char* getSAMLRequest2(void)
+/*
+ * Append the values of attr to user if it carries the local-login-user
+ * alias. Values are separated by semicolons.
+ */
+static void
+appendLocalLoginUser(const shibsp::Attribute *attr, string &user)
 {
-    string retstr = "";
+    const vector<string> &aliases = attr->getAliases();
 
-    // Initialization code taken from resolvertest.cpp::main()
-    SPConfig& conf = SPConfig::getConfig();
-    conf.setFeatures(
-        SPConfig::Metadata |
-        SPConfig::Trust |
-        SPConfig::AttributeResolution |
-        SPConfig::Credentials |
-        SPConfig::OutOfProcess |
-        SPConfig::Caching |
-        SPConfig::Logging |
-        SPConfig::Handlers
-    );
-    if (conf.init()) {
-        if (conf.instantiate()) {
-            ServiceProvider* sp = conf.getServiceProvider();
-            sp->lock();
-            const Application* app = sp->getApplication("default");
-            if (app) {
-
-                // Taken from constructor SAML2SessionInitiator::SAML2SessionInitiator()
-                // BUT, e is "const DOMElement*" and I have no idea what
-                // actually calls the constructor, so no idea what 'e' is.
-                // Thus the encoder may be incomplete.
-                DOMElement* e;
-                const MessageEncoder* encoder = nullptr;
-                try {
-                    encoder = SAMLConfig::getConfig().MessageEncoderManager.newPlugin(SAML20_BINDING_PAOS, pair<const DOMElement*,const XMLCh*>(e,nullptr));
-                } catch (exception & ex) {
-                }
-                
-                // Now in SAML2SessionInitiator::doRequest()
-                pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
-                    pair<const EntityDescriptor*,const RoleDescriptor*>(nullptr,nullptr);
-                const IDPSSODescriptor* role = nullptr;
-                const EndpointType* ep = nullptr;
-
-                MetadataProvider* m = app->getMetadataProvider();
-                Locker mlocker(m);
-
-                // Taken from AbstractHandler.cpp Handler::preserveRelayState()
-                string relayStateStr = "";
-                string rsKey;
-                generateRandomHex(rsKey,5);
-                relayStateStr = "cookie:" + rsKey;
-                const char* relayState = relayStateStr.c_str();
-
-                // Get the AssertionConsumerService
-                const Handler* ACS=nullptr;
-                ACS = app->getAssertionConsumerServiceByProtocol(SAML20P_NS,SAML20_BINDING_PAOS);
-                if (!ACS)
-                    throw XMLToolingException("Unable to locate PAOS response endpoint.");
-
-                // Build up AuthnRequest section of the SOAP message
-                auto_ptr<AuthnRequest> request(AuthnRequestBuilder::buildAuthnRequest());
-                
-                // Taken from AbstractSPRequest::getHandlerURL()
-                string m_handlerURL;
-                const char* fqdn = getfqdn();
-                string resourcestr;
-                const char* resource;
-                resourcestr = "https://" + string(fqdn) + "/";
-                resource = resourcestr.c_str();
-                const char* handler = nullptr;
-                const PropertySet* props = app->getPropertySet("Sessions");
-                if (props) {
-                    pair<bool,const char*> p2 = props->getString("handlerURL");
-                    if (p2.first) {
-                        handler = p2.second;
-                    }
-                }
+    if (find(aliases.begin(), aliases.end(), LOCAL_LOGIN_USER) == aliases.end())
+        return;
 
-                if (!handler) {
-                    handler = "/Shibboleth.sso";
-                } else if (*handler!='/' && strncmp(handler,"http:",5) && strncmp(handler,"https:",6)) {
-                    throw XMLToolingException(
-                          "Invalid handlerURL property <Sessions> element for Application");
-                }
+    for (vector<string>::const_iterator v = attr->getSerializedValues().begin();
+         v != attr->getSerializedValues().end();
+         ++v) {
+        if (!user.empty())
+            user += ";";
+        user += *v;
+    }
+}
 
-                const char* path = nullptr;
-                const char* prot;
-                if (*handler != '/') {
-                    prot = handler;
-                } else {
-                    prot = resource;
-                    path = handler;
-                }
+/*
+ * Fast path for the login name: decode only the SAML attributes named
+ * in SAML_EC_LOGIN_ATTRIBUTES, through the Application's attribute
+ * extractor, and pass them through its attribute filter, instead of
+ * running the full resolution pipeline over every attribute. Returns
+ * false if none of those attributes yields a local-login-user value that
+ * the filter policy lets through, in which case the caller falls back to
+ * full resolution.
+ */
+static bool
+extractLocalLoginUser(const gss_eap_sp_app_state *state,
+                      const RoleDescriptor *issuer,
+                      const vector<saml2::Assertion*> &assertions,
+                      string &user)
+{
+    AttributeExtractor *extractor = state->app->getAttributeExtractor();
+    AttributeFilter *filter = state->app->getAttributeFilter();
+    vector<shibsp::Attribute*> extracted;
+    bool filtered = false;
 
-                // break apart the "protocol" string into protocol, host, and "the rest"
-                const char* colon=strchr(prot,':');
-                colon += 3;
-                const char* slash=strchr(colon,'/');
-                if (!path) {
-                    path = slash;
-                }
+    if (state->loginAttributes.empty() || extractor == NULL)
+        return false;
 
-                // Compute the actual protocol and store in m_handlerURL.
-                m_handlerURL.assign("https://");
-                // create the "host" from either the colon/slash or from the target string
-                // If prot == handler then we're in either #1 or #2, else #3.
-                // If slash == colon then we're in #2.
-                if (prot != handler || slash == colon) {
-                    colon = strchr(resource, ':');
-                    colon += 3;      // Get past the ://
-                    slash = strchr(colon, '/');
-                }
-                string host(colon, (slash ? slash-colon : strlen(colon)));
+    try {
+        Locker extlocker(extractor);
 
-                // Build the handler URL
-                m_handlerURL += host + path;
-                // END code from AbstractSPRequest::getHandlerURL()
+        for (vector<saml2::Assertion*>::const_iterator a = assertions.begin();
+             a != assertions.end();
+             ++a) {
+            const vector<AttributeStatement*> &statements = (*a)->getAttributeStatements();
 
-                pair<bool,const char*> prop;
-                prop = ACS->getString("Location");
-                if (prop.first) {
-                    m_handlerURL += prop.second;
-                }
+            for (vector<AttributeStatement*>::const_iterator st = statements.begin();
+                 st != statements.end();
+                 ++st) {
+                const vector<saml2::Attribute*> &attrs = (*st)->getAttributes();
 
-                // auto_ptr_XMLCh acsLocation("https://test.cilogon.org/Shibboleth.sso/SAML2/ECP");
-                auto_ptr_XMLCh acsLocation(m_handlerURL.c_str());
-                request->setAssertionConsumerServiceURL(acsLocation.get());
-
-                Issuer* issuer = IssuerBuilder::buildIssuer();
-                request->setIssuer(issuer);
-                issuer->setName(app->getRelyingParty(entity.first)->getXMLString("entityID").second);
-
-                auto_ptr_XMLCh acsBinding((ACS->getString("Binding")).second);
-                request->setProtocolBinding(acsBinding.get());
-
-                NameIDPolicy* namepol = NameIDPolicyBuilder::buildNameIDPolicy();
-                namepol->AllowCreate(true);
-                request->setNameIDPolicy(namepol);
-
-                XMLObject* requestobj = request.get();
-             
-                // Taken from AbstractHandler.cpp
-                // sendMessage(*encoder,requestobj,relayState.c_str(),dest.get()[=nullptr],
-                //             role[=nullptr],app,httpResponse,false);
-                const EntityDescriptor* entity2 = nullptr;
-                const PropertySet* relyingParty = app->getRelyingParty(entity2);
-                pair<bool,const char*> flag = relyingParty->getString("signing");
-                const Credential* cred = nullptr;
-                pair<bool,const char*> keyName;
-                pair<bool,const XMLCh*> sigalg;
-                pair<bool,const XMLCh*> digalg;
-                if ((flag.first) && (!strcmp(flag.second,"true"))) {
-                    CredentialResolver* credResolver = app->getCredentialResolver();
-                    if (credResolver) {
-                        Locker credLocker(credResolver);
-                        keyName = relyingParty->getString("keyName");
-                        sigalg = relyingParty->getXMLString("signingAlg");
-                        CredentialCriteria cc;
-                        cc.setUsage(Credential::SIGNING_CREDENTIAL);
-                        if (keyName.first) {
-                            cc.getKeyNames().insert(keyName.second);
-                        }
-                        if (sigalg.first) {
-                            cc.setXMLAlgorithm(sigalg.second);
-                        }
-                        cred = credResolver->resolve(&cc);
-                        if (cred) {
-                            // Signed request.
-                            digalg = relyingParty->getXMLString("digestAlg");
-                        }
-                    }
-                }
-                // Call into opensaml's SAML2ECPEncoder.cpp
-                // return encoder.encode(httpResponse,requestobj,dest.get()[=nullptr],
-                //                       entity2[=nullptr],relayState.c_str(),&app)
-                Envelope* env = EnvelopeBuilder::buildEnvelope();
-                Header* header = HeaderBuilder::buildHeader();
-                env->setHeader(header);
-                Body* body = BodyBuilder::buildBody();
-                env->setBody(body);
-                body->getUnknownXMLObjects().push_back(requestobj);
-
-                ElementProxy* hdrblock;
-                xmltooling::QName qMU(SOAP11ENV_NS, Header::MUSTUNDERSTAND_ATTRIB_NAME,
-                                      SOAP11ENV_PREFIX);
-                xmltooling::QName qActor(SOAP11ENV_NS, Header::ACTOR_ATTRIB_NAME, 
-                                         SOAP11ENV_PREFIX);
-                
-                // Create paos:Request header.
-                AnyElementBuilder m_anyBuilder;
-                auto_ptr_XMLCh m_actor("http://schemas.xmlsoap.org/soap/actor/next");
-                static const XMLCh service[] = UNICODE_LITERAL_7(s,e,r,v,i,c,e);
-                static const XMLCh responseConsumerURL[] = UNICODE_LITERAL_19(r,e,s,p,o,n,s,e,C,o,n,s,u,m,e,r,U,R,L);
-                hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(PAOS_NS, saml1p::Request::LOCAL_NAME, PAOS_PREFIX));
-                hdrblock->setAttribute(qMU, XML_ONE);
-                hdrblock->setAttribute(qActor, m_actor.get());
-                hdrblock->setAttribute(xmltooling::QName(nullptr, service), SAML20ECP_NS);
-                hdrblock->setAttribute(xmltooling::QName(nullptr, responseConsumerURL), request->getAssertionConsumerServiceURL());
-                header->getUnknownXMLObjects().push_back(hdrblock);
-
-                // Create ecp:Request header.
-                static const XMLCh IsPassive[] = UNICODE_LITERAL_9(I,s,P,a,s,s,i,v,e);
-                hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(SAML20ECP_NS, saml1p::Request::LOCAL_NAME, SAML20ECP_PREFIX));
-                hdrblock->setAttribute(qMU, XML_ONE);
-                hdrblock->setAttribute(qActor, m_actor.get());
-                if (!request->IsPassive())
-                    hdrblock->setAttribute(xmltooling::QName(nullptr,IsPassive), XML_ZERO);
-                hdrblock->getUnknownXMLObjects().push_back(request->getIssuer()->clone());
-                if (request->getScoping() && request->getScoping()->getIDPList())
-                    hdrblock->getUnknownXMLObjects().push_back(request->getScoping()->getIDPList()->clone());
-                header->getUnknownXMLObjects().push_back(hdrblock);
-
-                if (relayState && *relayState) {
-                    // Create ecp:RelayState header.
-                    static const XMLCh RelayState[] = UNICODE_LITERAL_10(R,e,l,a,y,S,t,a,t,e);
-                    hdrblock = dynamic_cast<ElementProxy*>(m_anyBuilder.buildObject(SAML20ECP_NS, RelayState, SAML20ECP_PREFIX));
-                    hdrblock->setAttribute(qMU, XML_ONE);
-                    hdrblock->setAttribute(qActor, m_actor.get());
-                    auto_ptr_XMLCh rs(relayState);
-                    hdrblock->setTextContent(rs.get());
-                    header->getUnknownXMLObjects().push_back(hdrblock);
+                for (vector<saml2::Attribute*>::const_iterator at = attrs.begin();
+                     at != attrs.end();
+                     ++at) {
+                    auto_ptr_char name((*at)->getName());
+
+                    if (name.get() == NULL ||
+                        state->loginAttributes.find(name.get()) == state->loginAttributes.end())
+                        continue;
+
+                    extractor->extractAttributes(*state->app, issuer, **at, extracted);
                 }
+            }
+        }
+
+        // As in AssertionConsumerService::resolveAttributes(), the filter
+        // deletes the attributes whose values it removes entirely.
+        if (filter != NULL && !extracted.empty()) {
+            BasicFilteringContext fc(*state->app, extracted, issuer);
+            Locker filtlocker(filter);
+            filter->filterAttributes(fc, extracted);
+        }
+        filtered = true;
+    } catch (exception &ex) {
+        cerr << "unable to extract the login name: " << ex.what() << endl;
+    }
 
-                try {
-                    DOMElement* rootElement = nullptr;
-                    if (cred) {
-                        // Build a Signature.
-                        Signature* sig = SignatureBuilder::buildSignature();
-                        request->setSignature(sig);    
-                        if (sigalg.first && sigalg.second)
-                            sig->setSignatureAlgorithm(sigalg.second);
-                        if (digalg.first && digalg.second) {
-                            opensaml::ContentReference* cr = dynamic_cast<opensaml::ContentReference*>(sig->getContentReference());
-                            if (cr) {
-                                cr->setDigestAlgorithm(digalg.second);
-                            }
-                        }
-                
-                        // Sign message while marshalling.
-                        vector<Signature*> sigs(1,sig);
-                        rootElement = env->marshall((DOMDocument*)nullptr,&sigs,cred);
+    for (vector<shibsp::Attribute*>::iterator e = extracted.begin();
+         e != extracted.end();
+         ++e) {
+        if (filtered)
+            appendLocalLoginUser(*e, user);
+        delete *e;
+    }
+
+    return !user.empty();
+}
+
+
+/*
+ * The login name from assertions already authenticated: through the
+ * fast path if it finds one, otherwise from full attribute resolution.
+ * Taken from resolvertest.cpp.
+ */
+static void
+resolveLocalLoginUser(const gss_eap_sp_app_state *state,
+                      const RoleDescriptor *issuer,
+                      const vector<saml2::Assertion*> &assertions,
+                      string &user)
+{
+    if (extractLocalLoginUser(state, issuer, assertions, user))
+        return;
+
+    saml2::Assertion* a2 = assertions.front();
+    const XMLCh* protocol = samlconstants::SAML20P_NS;
+    saml2::NameID* v2name = a2->getSubject()?a2->getSubject()->getNameID():nullptr;
+    vector<const opensaml::Assertion*> tokens;
+    tokens.assign(assertions.begin(),assertions.end());
+
+    LocalResolver lr(nullptr,nullptr);
+    ResolutionContext* ctx = lr.resolveAttributes(
+        *state->app,issuer,protocol,nullptr,v2name,
+            nullptr,nullptr,&tokens);
+    auto_ptr<ResolutionContext> wrapper(ctx);
+    for (vector<shibsp::Attribute*>::const_iterator a = ctx->getResolvedAttributes().begin();
+         a != ctx->getResolvedAttributes().end();
+         ++a)
+        appendLocalLoginUser(*a, user);
+}
+
+/*
+ * Format t as an xsd:dateTime in UTC, as DateTime would marshall it.
+ */
+static string
+formatIssueInstant(time_t t)
+{
+    struct tm tm;
+    char buf[32];
+
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
 
-                    } else {
-                        rootElement = env->marshall();
+    return string(buf);
+}
+
+extern "C" char* getSAMLRequest2(void)
+{
+    string retstr = "";
+    Category& log = Category::getInstance(SHIBSP_LOGCAT".getSAMLRequest");
+
+    gss_eap_sp_ref spRef("default");
+    const gss_eap_sp_app_state* state = spRef.state();
+    if (state != NULL) {
+        const Application* app = state->app;
+
+        // Taken from AbstractHandler.cpp Handler::preserveRelayState()
+        string relayStateStr = "";
+        string rsKey;
+        generateRandomHex(rsKey,5);
+        relayStateStr = "cookie:" + rsKey;
+        const char* relayState = relayStateStr.c_str();
+
+        // Get the AssertionConsumerService
+        const Handler* ACS = state->acs;
+        if (!ACS)
+            throw XMLToolingException("Unable to locate PAOS response endpoint.");
+
+        // Taken from AbstractHandler.cpp
+        // sendMessage(*encoder,requestobj,relayState.c_str(),dest.get()[=nullptr],
+        //             role[=nullptr],app,httpResponse,false);
+        const EntityDescriptor* entity2 = nullptr;
+        const PropertySet* relyingParty = app->getRelyingParty(entity2);
+        pair<bool,const char*> flag = relyingParty->getString("signing");
+        const Credential* cred = nullptr;
+        pair<bool,const char*> keyName;
+        pair<bool,const XMLCh*> sigalg;
+        pair<bool,const XMLCh*> digalg;
+        CredentialResolver* credResolver = nullptr;
+        if ((flag.first) && (!strcmp(flag.second,"true"))) {
+            credResolver = app->getCredentialResolver();
+        }
+        Locker credLocker(credResolver);
+        if (credResolver) {
+            keyName = relyingParty->getString("keyName");
+            sigalg = relyingParty->getXMLString("signingAlg");
+            CredentialCriteria cc;
+            cc.setUsage(Credential::SIGNING_CREDENTIAL);
+            if (keyName.first) {
+                cc.getKeyNames().insert(keyName.second);
+            }
+            if (sigalg.first) {
+                cc.setXMLAlgorithm(sigalg.second);
+            }
+            cred = credResolver->resolve(&cc);
+            if (cred) {
+                // Signed request.
+                digalg = relyingParty->getXMLString("digestAlg");
+            }
+        }
+
+        try {
+            if (!cred && state->requestTemplate.valid()) {
+                // Unsigned request: splice the per-request fields into
+                // the cached serialization.
+                string fields[gss_eap_saml_request_template::FIELD_MAX];
+                XMLCh* id = SAMLConfig::getConfig().generateIdentifier();
+                auto_ptr_char idstr(id);
+                XMLString::release(&id);
+
+                fields[gss_eap_saml_request_template::FIELD_REQUEST_ID] = idstr.get();
+                fields[gss_eap_saml_request_template::FIELD_ISSUE_INSTANT] = formatIssueInstant(time(nullptr));
+                fields[gss_eap_saml_request_template::FIELD_RELAY_STATE] = relayStateStr;
+
+                state->requestTemplate.render(fields, retstr);
+            } else {
+                AuthnRequest* request = nullptr;
+                auto_ptr<Envelope> env(buildECPRequest(app, ACS, state->acsURL, relayState, &request));
+                DOMElement* rootElement = nullptr;
+
+                if (cred) {
+                    // Build a Signature.
+                    Signature* sig = SignatureBuilder::buildSignature();
+                    request->setSignature(sig);    
+                    if (sigalg.first && sigalg.second)
+                        sig->setSignatureAlgorithm(sigalg.second);
+                    if (digalg.first && digalg.second) {
+                        opensaml::ContentReference* cr = dynamic_cast<opensaml::ContentReference*>(sig->getContentReference());
+                        if (cr) {
+                            cr->setDigestAlgorithm(digalg.second);
+                        }
                     }
+            
+                    // Sign message while marshalling.
+                    vector<Signature*> sigs(1,sig);
+                    rootElement = env->marshall((DOMDocument*)nullptr,&sigs,cred);
 
-                    stringstream s;
-                    s << *rootElement;
-
-                    retstr = s.str();
-                    
-                    // long ret = genericResponse.sendResponse(s);
-                
-                    // Cleanup by destroying XML.
-                    // NOTE THAT THIS CAUSES A CRASH RIGHT NOW!!!
-                    // *** glibc detected *** /home/tfleury/develop/github.com/mech_saml_ec/gss-sample/.libs/lt-gss-server: free(): invalid pointer: 0x0000000001295108 ***
-                    // delete env;
-                }
-                catch (XMLToolingException&) {
+                } else {
+                    rootElement = env->marshall();
                 }
 
+                stringstream s;
+                s << *rootElement;
+
+                retstr = s.str();
             }
-            sp->unlock();
+        }
+        catch (XMLToolingException&) {
+        }
 
-        } 
-        conf.term();
     }
 
     char* cstr = strdup(retstr.c_str());
-    fprintf(stderr,"--- GETSAMLREQUEST2() RETURNING XML: ---\n%s\n",cstr);
+    log.debug("returning PAOS request:\n%s", cstr);
     return cstr; //  Must free() returned char*
 }
 
-extern "C" int verifySAMLResponse(const char* saml, int len, char* username) 
+/*
+ * Decrypt the response's EncryptedAssertions with the SP's credentials,
+ * adding them to decrypted, which the caller then owns. Those that cannot
+ * be decrypted are skipped.
+ */
+static void
+decryptAssertions(const Application *app,
+                  const SecurityPolicy &policy,
+                  const Response &response,
+                  vector<saml2::Assertion*> &decrypted)
+{
+    const vector<EncryptedAssertion*>& encrypted = response.getEncryptedAssertions();
+
+    if (encrypted.empty())
+        return;
+
+    CredentialResolver* cr = app->getCredentialResolver();
+    if (cr == nullptr) {
+        cerr << "no CredentialResolver available, unable to decrypt assertion" << endl;
+        return;
+    }
+
+    Locker credlocker(cr);
+    const XMLCh* recipient = app->getRelyingParty(nullptr)->getXMLString("entityID").second;
+    auto_ptr<MetadataCredentialCriteria> mcc(
+        policy.getIssuerMetadata() ? new MetadataCredentialCriteria(*policy.getIssuerMetadata()) : nullptr);
+
+    for (vector<EncryptedAssertion*>::const_iterator ea = encrypted.begin(); ea != encrypted.end(); ++ea) {
+        auto_ptr<XMLObject> object;
+
+        try {
+            object.reset((*ea)->decrypt(*cr, recipient, mcc.get()));
+        } catch (exception& ex) {
+            cerr << "unable to decrypt assertion: " << ex.what() << endl;
+            continue;
+        }
+
+        saml2::Assertion* assertion = dynamic_cast<saml2::Assertion*>(object.get());
+        if (assertion != nullptr) {
+            decrypted.push_back(assertion);
+            object.release();
+        }
+    }
+}
+
+/*
+ * Add to trusted those of assertions that pass the policy in their own
+ * right, as Shibboleth's SAML 2.0 AssertionConsumerService does: each is
+ * evaluated as a message of its own, which also checks that its Issuer
+ * is the response's, and kept if it was authenticated then (by its own
+ * signature) or if the response carrying it was, as the response's
+ * signature covers it. Those that fail are logged and left out.
+ */
+static void
+selectTrustedAssertions(SecurityPolicy &policy,
+                        const vector<saml2::Assertion*> &assertions,
+                        bool responseAuthenticated,
+                        vector<saml2::Assertion*> &trusted)
+{
+    for (vector<saml2::Assertion*>::const_iterator a = assertions.begin(); a != assertions.end(); ++a) {
+        try {
+            policy.setAuthenticated(false);
+            policy.reset(true);
+            policy.setMessageID((*a)->getID());
+            policy.setIssueInstant((*a)->getIssueInstantEpoch());
+            if ((*a)->getIssuer() != nullptr)
+                policy.setIssuer((*a)->getIssuer());
+
+            policy.evaluate(**a);
+
+            if (responseAuthenticated || policy.isAuthenticated())
+                trusted.push_back(*a);
+            else
+                cerr << "unable to establish security of assertion, ignoring it" << endl;
+        } catch (exception& ex) {
+            cerr << "assertion rejected by policy: " << ex.what() << endl;
+        }
+    }
+}
+
+/*
+ * Find the samlec:SessionKey the IdP placed in the Advice of an encrypted
+ * assertion. Encryption to the SP keeps the key from the client and
+ * anyone else on the way, but says nothing of who made it: the caller
+ * must pass only assertions whose IdP signature has been verified, on
+ * the assertion or on the response carrying it. Returns false if a key
+ * was present but unusable; *enctype is left as ENCTYPE_NULL if there
+ * was none.
+ */
+static bool
+extractSessionKey(const vector<saml2::Assertion*> &decrypted,
+                  int *enctype,
+                  unsigned char *key,
+                  size_t *keyLength)
+{
+    static const XMLCh SessionKey[] = UNICODE_LITERAL_10(S,e,s,s,i,o,n,K,e,y);
+    static const XMLCh EncType[] = UNICODE_LITERAL_7(E,n,c,T,y,p,e);
+    static const XMLCh GeneratedKey[] = UNICODE_LITERAL_12(G,e,n,e,r,a,t,e,d,K,e,y);
+    auto_ptr_XMLCh samlecNS(SAMLEC_NS);
+
+    *enctype = ENCTYPE_NULL;
+    *keyLength = 0;
+
+    for (vector<saml2::Assertion*>::const_iterator d = decrypted.begin(); d != decrypted.end(); ++d) {
+        const Advice* advice = (*d)->getAdvice();
+        if (advice == nullptr)
+            continue;
+
+        const vector<XMLObject*>& blocks = advice->getUnknownXMLObjects();
+        vector<XMLObject*>::const_iterator a =
+            find_if(blocks.begin(), blocks.end(), hasQName(xmltooling::QName(samlecNS.get(), SessionKey)));
+        const ElementProxy* sk = dynamic_cast<const ElementProxy*>(a != blocks.end() ? *a : nullptr);
+        if (sk == nullptr)
+            continue;
+
+        const vector<XMLObject*>& children = sk->getUnknownXMLObjects();
+        vector<XMLObject*>::const_iterator e =
+            find_if(children.begin(), children.end(), hasQName(xmltooling::QName(samlecNS.get(), EncType)));
+        vector<XMLObject*>::const_iterator g =
+            find_if(children.begin(), children.end(), hasQName(xmltooling::QName(samlecNS.get(), GeneratedKey)));
+        const ElementProxy* et = dynamic_cast<const ElementProxy*>(e != children.end() ? *e : nullptr);
+        const ElementProxy* gk = dynamic_cast<const ElementProxy*>(g != children.end() ? *g : nullptr);
+        if (et == nullptr || gk == nullptr || gk->getTextContent() == nullptr) {
+            cerr << "malformed samlec:SessionKey in assertion advice" << endl;
+            return false;
+        }
+
+        auto_ptr_char etName(et->getTextContent());
+        *enctype = gssEapEnctypeFromString(etName.get());
+        if (*enctype == ENCTYPE_NULL) {
+            cerr << "unsupported session key enctype " << etName.get() << endl;
+            return false;
+        }
+
+        auto_ptr_char encoded(gk->getTextContent());
+        XMLSize_t decodedLength = 0;
+        XMLByte* decoded = Base64::decode(reinterpret_cast<const XMLByte*>(encoded.get()), &decodedLength);
+        if (decoded == nullptr || decodedLength == 0 || decodedLength > RFC3961_KEY_MAX) {
+            if (decoded != nullptr)
+                XMLString::release(&decoded);
+            *enctype = ENCTYPE_NULL;
+            cerr << "malformed samlec:GeneratedKey in assertion advice" << endl;
+            return false;
+        }
+
+        memcpy(key, decoded, decodedLength);
+        *keyLength = decodedLength;
+        OPENSSL_cleanse(decoded, decodedLength);
+        XMLString::release(&decoded);
+        return true;
+    }
+
+    return true;
+}
+
+/*
+ * On success, *username is set to the login name, which the caller must
+ * free().
+ */
+extern "C" int verifySAMLResponse(const char* saml, int len, char** username,
+                                  int* enctype, unsigned char* key, size_t* keyLength)
 {
     int retbool = 1;
     string localLoginUser = "";
 
-    XMLToolingConfig::getConfig().log_config("DEBUG");
-    Category& log = Category::getInstance(SHIBSP_LOGCAT".verifySAMLResponse");
-
-    fprintf(stderr,"--- VERIFYSAMLRESPONSE() GOT XML: ---\n%s\n",saml);
+    *username = NULL;
+    *enctype = ENCTYPE_NULL;
+    *keyLength = 0;
 
-    // Initialization code taken from resolvertest.cpp::main()
-    SPConfig& conf = SPConfig::getConfig();
-    conf.setFeatures(
-        SPConfig::Metadata |
-        SPConfig::Trust |
-        SPConfig::AttributeResolution |
-        SPConfig::Credentials |
-        SPConfig::OutOfProcess |
-        SPConfig::Caching |
-        SPConfig::Logging |
-        SPConfig::Handlers
-    );
-    if (conf.init()) {
-        if (conf.instantiate()) {
-            ServiceProvider* sp = conf.getServiceProvider();
-            sp->lock();
-            const Application* app = sp->getApplication("default");
-            if (app) {
-                // Get the AssertionConsumerService
-                const Handler* ACS=nullptr;
-                ACS = app->getAssertionConsumerServiceByProtocol(SAML20P_NS,SAML20_BINDING_PAOS);
-                if (!ACS) {
-                    cerr << "Unable to locate PAOS response endpoint." << endl;
-                    retbool = 0;
-                }
+    Category& log = Category::getInstance(SHIBSP_LOGCAT".verifySAMLResponse");
 
-                if (retbool) {
-                    MetadataProvider* m = app->getMetadataProvider();
-                    Locker mlocker(m);
-                    TrustEngine* trust = app->getTrustEngine();
-                    xmltooling::QName idprole(samlconstants::SAML20MD_NS,IDPSSODescriptor::LOCAL_NAME);
-                    SecurityPolicy policy(m,&idprole,trust,false);
-                    // Create policy rule list, a combination of code from 
-                    // opensaml-2.5/samltest/binding.h setUp(), lines 86-88
-                    // shibboleth-2.5/shibsp/security/SecurityPolicy.cpp, lines 35-37
-                    // SAML2POSTTEST.h line 38
-                    vector<const SecurityPolicyRule*> rules =
-                        app->getServiceProvider().getPolicyRules(app->getString("policyId").second);
-                    policy.getRules().assign(rules.begin(), rules.end());
-
-                    // Taken from util/resolvertest.cpp and SAML2ECPDecoder::decode()
-                    try {
-                        string samlstr(saml);
-                        istringstream samlstream(samlstr);
-                       
-                        // Taken from SAML2ECPDecoder::decode()
+    log.debug("verifying ECP response:\n%.*s", len, saml);
+
+    gss_eap_sp_ref spRef("default");
+    const gss_eap_sp_app_state* state = spRef.state();
+    if (state != NULL) {
+        const Application* app = state->app;
+        // Get the AssertionConsumerService
+        const Handler* ACS = state->acs;
+        if (!ACS) {
+            cerr << "Unable to locate PAOS response endpoint." << endl;
+            retbool = 0;
+        }
+
+        if (retbool) {
+            MetadataProvider* m = app->getMetadataProvider();
+            Locker mlocker(m);
+            // The policy and its rule list are prepared once per Application,
+            // see gss_eap_policy_pool.
+            gss_eap_policy_ref policyRef(state->policies);
+            SecurityPolicy& policy = policyRef.policy();
+            vector<saml2::Assertion*> decrypted;
+            const RoleDescriptor* issuerRole = nullptr;
+
+            // Taken from util/resolvertest.cpp and SAML2ECPDecoder::decode()
+            try {
+                // Taken from SAML2ECPDecoder::decode(), but parsing the
+                // token in place rather than through a string copy.
 			cerr << "parsing samlstream..." << endl;
-                        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(samlstream);
+                DOMDocument* doc = gssEapParseXml(saml, len);
 			cerr << "samlstream parsing succeeded!" << endl;
-                        XercesJanitor<DOMDocument> docjan(doc);
-                        auto_ptr<XMLObject> token(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
-                        docjan.release();
-
-                        Envelope* env = dynamic_cast<Envelope*>(token.get());
-                        if (env) {
-                            SchemaValidators.validate(env);
-
-                            Body* body = env->getBody();
-                            if (body && body->hasChildren()) {
-                                Response* response = dynamic_cast<Response*>(body->getUnknownXMLObjects().front());
-                                if (response) {
-                                    // Run through the policy at two layers.
-                                    /*
-                                    extractMessageDetails(*env, genericRequest, samlconstants::SAML20P_NS, policy);
-                                    policy.evaluate(*env, &genericRequest);
-                                    policy.reset(true);
-                                    extractMessageDetails(*response, genericRequest, samlconstants::SAML20P_NS, policy);
-                                    policy.evaluate(*response, &genericRequest);
-                                    */
-                                    // Don't bother with extractMessageDetails(*env,...) since env is not a SAML20P_NS
-                                    // Instead, call SAML2MessageDecoder::extractMessageDetails(*response,...)
-                                    const xmltooling::QName& q = response->getElementQName();
-                                    if (XMLString::equals(q.getNamespaceURI(), samlconstants::SAML20P_NS)) {
-                                        try {
-                                            const saml2::RootObject& samlRoot = dynamic_cast<const saml2::RootObject&>(*response);
-                                            const vector<saml2::Assertion*>& assertions = dynamic_cast<const Response&>(samlRoot).getAssertions();
-                                            policy.setMessageID(samlRoot.getID());
-                                            policy.setIssueInstant(samlRoot.getIssueInstantEpoch());
-
-                                            const Issuer* issuer = samlRoot.getIssuer();
+                XercesJanitor<DOMDocument> docjan(doc);
+                auto_ptr<XMLObject> token(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
+                docjan.release();
+
+                Envelope* env = dynamic_cast<Envelope*>(token.get());
+                if (env) {
+                    SchemaValidators.validate(env);
+
+                    Body* body = env->getBody();
+                    if (body && body->hasChildren()) {
+                        Response* response = dynamic_cast<Response*>(body->getUnknownXMLObjects().front());
+                        if (response) {
+                            // Run through the policy at two layers.
+                            /*
+                            extractMessageDetails(*env, genericRequest, samlconstants::SAML20P_NS, policy);
+                            policy.evaluate(*env, &genericRequest);
+                            policy.reset(true);
+                            extractMessageDetails(*response, genericRequest, samlconstants::SAML20P_NS, policy);
+                            policy.evaluate(*response, &genericRequest);
+                            */
+                            // Don't bother with extractMessageDetails(*env,...) since env is not a SAML20P_NS
+                            // Instead, call SAML2MessageDecoder::extractMessageDetails(*response,...)
+                            const xmltooling::QName& q = response->getElementQName();
+                            if (XMLString::equals(q.getNamespaceURI(), samlconstants::SAML20P_NS)) {
+                                try {
+                                    const saml2::RootObject& samlRoot = dynamic_cast<const saml2::RootObject&>(*response);
+                                    const vector<saml2::Assertion*>& assertions = dynamic_cast<const Response&>(samlRoot).getAssertions();
+                                    policy.setMessageID(samlRoot.getID());
+                                    policy.setIssueInstant(samlRoot.getIssueInstantEpoch());
+
+                                    const Issuer* issuer = samlRoot.getIssuer();
+                                    if (issuer) {
+                                        policy.setIssuer(issuer);
+                                    } else if (XMLString::equals(q.getLocalPart(), Response::LOCAL_NAME)) {
+                                        // No issuer in the message, so we have to try the Response approach.
+                                        if (!assertions.empty()) {
+                                            issuer = assertions.front()->getIssuer();
                                             if (issuer) {
                                                 policy.setIssuer(issuer);
-                                            } else if (XMLString::equals(q.getLocalPart(), Response::LOCAL_NAME)) {
-                                                // No issuer in the message, so we have to try the Response approach.
-                                                if (!assertions.empty()) {
-                                                    issuer = assertions.front()->getIssuer();
-                                                    if (issuer) {
-                                                        policy.setIssuer(issuer);
-                                                    }
-                                                }
                                             }
-                                            if (!issuer) {
-                                                cerr << "Issuer identity not extracted!" << endl;
-                                                retbool = 0;
-                                            }
-
-                                            if (retbool) {
-                                                auto_ptr_char iname(issuer->getName());
-                                                cout << "issuer = " << iname.get() << endl;
-
-                                                if (policy.getIssuerMetadata()) {
-                                                    cerr << "metadata for issuer already set, leaving in place." << endl;
-                                                    // return;
-                                                }
-
-                                                if (policy.getMetadataProvider() && policy.getRole()) {
-                                                    if (issuer->getFormat() && !XMLString::equals(issuer->getFormat(), 
-                                                                                                  NameIDType::ENTITY)) {
-                                                        cerr << "non-system entity issuer, skipping metadata lookup!" << endl;
-                                                        // return;
-                                                    }
-
-                                                    cerr << "searching metadata for message issuer... ";
-                                                    MetadataProvider::Criteria& mc = policy.getMetadataProviderCriteria();
-                                                    mc.entityID_unicode = issuer->getName();
-                                                    mc.role = policy.getRole();
-                                                    mc.protocol = samlconstants::SAML20P_NS;
-                                                    pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
-                                                        policy.getMetadataProvider()->getEntityDescriptor(mc);
-                                                    if (!entity.first) {
-                                                        auto_ptr_char temp(issuer->getName());
-                                                        cerr << "no metadata found, can't establish identity of issuer (" <<
-                                                                temp.get() << ")" << endl;
-                                                        retbool = 0;
-                                                    }
-                                                    else if (!entity.second) {
-                                                        cerr << "unable to find compatible role (" << 
-                                                                policy.getRole()->toString().c_str() << ") in metadata" << endl;
-                                                        retbool = 0;
-                                                    } else {
-                                                        policy.setIssuerMetadata(entity.second);
-                                                        cerr << "Done!" << endl;
-                                                    }
-
-                                                    // Attempt to extract local-login-user attribute
-                                                    // Taken from resolvertest.cpp
-                                                    if (retbool) {
-                                                        if (!assertions.empty()) {
-                                                            saml2::Assertion* a2 = assertions.front();
-                                                            const XMLCh* protocol = samlconstants::SAML20P_NS;
-                                                            saml2::NameID* v2name = a2->getSubject()?a2->getSubject()->getNameID():nullptr;
-                                                            vector<const opensaml::Assertion*> tokens;
-                                                            tokens.assign(assertions.begin(),assertions.end());
-
-                                                            LocalResolver lr(nullptr,nullptr);
-                                                            ResolutionContext* ctx = lr.resolveAttributes(
-                                                                *app,entity.second,protocol,nullptr,v2name,
-                                                                    nullptr,nullptr,&tokens);
-                                                            auto_ptr<ResolutionContext> wrapper(ctx);
-                                                            for (vector<shibsp::Attribute*>::const_iterator a = ctx->getResolvedAttributes().begin(); 
-                                                                 a != ctx->getResolvedAttributes().end(); 
-                                                                 ++a) {
-                                                                for (vector<string>::const_iterator s = (*a)->getAliases().begin(); 
-                                                                     s != (*a)->getAliases().end(); 
-                                                                     ++s) {
-                                                                    if (s->compare("local-login-user") == 0) {
-                                                                        for (vector<string>::const_iterator v=(*a)->getSerializedValues().begin();
-                                                                             v != (*a)->getSerializedValues().end(); 
-                                                                             ++v) {
-                                                                            if (v != (*a)->getSerializedValues().begin())
-                                                                                localLoginUser += ";";
-                                                                            localLoginUser += *v;
-                                                                        }
-                                                                    }
-                                                                }
-                                                            }
-                                                        } else {
-                                                            retbool = 0;
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        } catch (bad_cast&) {
-                                            cerr << "caught a bad_cast while extracting message details" << endl;
                                         }
-                                    } else { // Message is not SAML20P_NS - problem!
-                                        retbool = 0;
                                     }
-                                    // End SAML2MessageDecoder::extractMessageDetails(*response,...)
-                                  
-                                    // Next, call policy.evaluate(*response, &genericRequest);
-                                    /* void SecurityPolicy::evaluate(const XMLObject&,const GenericRequest*)
-                                     * {
-                                     *     for (vector<const SecurityPolicyRule*>::const_iterator i=m_rules.begin(); 
-                                     *          i!=m_rules.end(); 
-                                     *          ++i)
-                                     *         (*i)->evaluate(message,request,*this);
-                                     * }
-                                     * Here (*i)->evaluate() calls (e.g.) XMLSigningRule:evaluate(...)
-                                     * Each of which returns false if that evaluate() call does not apply to the message,
-                                     *                       true if the message was successfully evaluated by the rule,
-                                     *                       throw exception if rejected by rule. UGH!!!
-                                     * Unfortunately, m_rules is a private member, so can't get at it from here!
-                                     */
-                                    if (retbool) {
-                                        try {
-                                            const XMLObject* responseobj = dynamic_cast<const XMLObject*>(response);
-                                            policy.evaluate(*responseobj);
-                                            cerr << "Successfully called policy.evaluate(*responseobj)" << endl;
-                                        } catch (exception& ex) {
-                                            retbool = 0;
-                                        }
+                                    if (!issuer) {
+                                        cerr << "Issuer identity not extracted!" << endl;
+                                        retbool = 0;
                                     }
 
                                     if (retbool) {
-                                        // Check destination URL.
-                                        auto_ptr_char dest(response->getDestination());
-                                        if (response->getSignature() && (!dest.get() || !*(dest.get()))) {
-                                            cerr << "Signed SAML message missing Destination attribute!" << endl;
-                                            // return 0;
-                                            retbool = 0;
+                                        auto_ptr_char iname(issuer->getName());
+                                        log.debug("message issuer: %s", iname.get());
+
+                                        if (policy.getIssuerMetadata()) {
+                                            cerr << "metadata for issuer already set, leaving in place." << endl;
+                                            // return;
                                         }
-                                    }
 
-                                    // Check for RelayState header.
-                                    // Do we need to do something "useful" with the RelayState?
-                                    string relayState;
-                                    if ((retbool) && (env->getHeader())) {
-                                        static const XMLCh RelayState[] = UNICODE_LITERAL_10(R,e,l,a,y,S,t,a,t,e);
-                                        const vector<XMLObject*>& blocks = const_cast<const Header*>(env->getHeader())->getUnknownXMLObjects();
-                                        vector<XMLObject*>::const_iterator h =
-                                            find_if(blocks.begin(), blocks.end(), hasQName(xmltooling::QName(samlconstants::SAML20ECP_NS, RelayState)));
-                                        const ElementProxy* ep = dynamic_cast<const ElementProxy*>(h != blocks.end() ? *h : nullptr);
-                                        if (ep) {
-                                            auto_ptr_char rs(ep->getTextContent());
-                                            if (rs.get())
-                                                relayState = rs.get();
+                                        if (policy.getMetadataProvider() && policy.getRole()) {
+                                            if (issuer->getFormat() && !XMLString::equals(issuer->getFormat(), 
+                                                                                          NameIDType::ENTITY)) {
+                                                cerr << "non-system entity issuer, skipping metadata lookup!" << endl;
+                                                // return;
+                                            }
+
+                                            cerr << "searching metadata for message issuer... ";
+                                            pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
+                                                state->issuers->lookup(policy, issuer->getName());
+                                            if (!entity.first) {
+                                                auto_ptr_char temp(issuer->getName());
+                                                cerr << "no metadata found, can't establish identity of issuer (" <<
+                                                        temp.get() << ")" << endl;
+                                                retbool = 0;
+                                            }
+                                            else if (!entity.second) {
+                                                cerr << "unable to find compatible role (" << 
+                                                        policy.getRole()->toString().c_str() << ") in metadata" << endl;
+                                                retbool = 0;
+                                            } else {
+                                                policy.setIssuerMetadata(entity.second);
+                                                issuerRole = entity.second;
+                                                cerr << "Done!" << endl;
+                                                decryptAssertions(app, policy, *response, decrypted);
+                                            }
                                         }
                                     }
-                                    cout << "relayState = " << relayState << endl;
+                                } catch (bad_cast&) {
+                                    cerr << "caught a bad_cast while extracting message details" << endl;
+                                }
+                            } else { // Message is not SAML20P_NS - problem!
+                                retbool = 0;
+                            }
+                            // End SAML2MessageDecoder::extractMessageDetails(*response,...)
+                          
+                            // Check destination URL before evaluating the policy, so
+                            // that a malformed response is rejected cheaply.
+                            if (retbool) {
+                                auto_ptr_char dest(response->getDestination());
+                                if (response->getSignature() && (!dest.get() || !*(dest.get()))) {
+                                    cerr << "Signed SAML message missing Destination attribute!" << endl;
+                                    // return 0;
+                                    retbool = 0;
+                                }
+                            }
 
-                                    token.release();
-                                    body->detach(); // frees Envelope
-                                    response->detach();   // frees Body
+                            // Next, call policy.evaluate(*response, &genericRequest);
+                            /* void SecurityPolicy::evaluate(const XMLObject&,const GenericRequest*)
+                             * {
+                             *     for (vector<const SecurityPolicyRule*>::const_iterator i=m_rules.begin(); 
+                             *          i!=m_rules.end(); 
+                             *          ++i)
+                             *         (*i)->evaluate(message,request,*this);
+                             * }
+                             * Here (*i)->evaluate() calls (e.g.) XMLSigningRule:evaluate(...)
+                             * Each of which returns false if that evaluate() call does not apply to the message,
+                             *                       true if the message was successfully evaluated by the rule,
+                             *                       throw exception if rejected by rule. UGH!!!
+                             * Unfortunately, m_rules is a private member, so can't get at it from here!
+                             */
+                            if (retbool) {
+                                try {
+                                    const XMLObject* responseobj = dynamic_cast<const XMLObject*>(response);
+                                    policy.evaluate(*responseobj);
+                                    cerr << "Successfully called policy.evaluate(*responseobj)" << endl;
+                                } catch (exception& ex) {
+                                    retbool = 0;
                                 }
                             }
-                        } else {
-                            cerr << "-----" << endl << "Decoded message was not a SOAP 1.1 Envelope" << endl << "-----" << endl;
-                        }
 
-                        /*
-                        DOMElement *elem = doc->getDocumentElement();
-                        stringstream s;
-                        s << *elem;
-                        cerr << "-----" << endl << "s = " << s << endl << "-----" << endl;
-                        */
+                            // Nothing is taken from an assertion, encrypted or
+                            // not, unless the response or the assertion itself
+                            // was authenticated.
+                            vector<saml2::Assertion*> trusted, trustedDecrypted;
+                            if (retbool) {
+                                bool responseAuthenticated = policy.isAuthenticated();
+
+                                selectTrustedAssertions(policy, response->getAssertions(),
+                                                        responseAuthenticated, trusted);
+                                selectTrustedAssertions(policy, decrypted,
+                                                        responseAuthenticated, trustedDecrypted);
+                                trusted.insert(trusted.end(), trustedDecrypted.begin(), trustedDecrypted.end());
+                                if (trusted.empty()) {
+                                    cerr << "no authenticated assertion in the response" << endl;
+                                    retbool = 0;
+                                }
+                            }
 
+                            // The key the IdP generated for this session
+                            if (retbool &&
+                                !extractSessionKey(trustedDecrypted, enctype, key, keyLength))
+                                retbool = 0;
+
+                            if (retbool)
+                                resolveLocalLoginUser(state, issuerRole, trusted, localLoginUser);
+
+                            // Check for RelayState header.
+                            // Do we need to do something "useful" with the RelayState?
+                            string relayState;
+                            if ((retbool) && (env->getHeader())) {
+                                static const XMLCh RelayState[] = UNICODE_LITERAL_10(R,e,l,a,y,S,t,a,t,e);
+                                const vector<XMLObject*>& blocks = const_cast<const Header*>(env->getHeader())->getUnknownXMLObjects();
+                                vector<XMLObject*>::const_iterator h =
+                                    find_if(blocks.begin(), blocks.end(), hasQName(xmltooling::QName(samlconstants::SAML20ECP_NS, RelayState)));
+                                const ElementProxy* ep = dynamic_cast<const ElementProxy*>(h != blocks.end() ? *h : nullptr);
+                                if (ep) {
+                                    auto_ptr_char rs(ep->getTextContent());
+                                    if (rs.get())
+                                        relayState = rs.get();
+                                }
+                            }
+                            log.debug("relay state: %s", relayState.c_str());
 
-                    } catch (exception & ex) {
-                        retbool = 0;
-			cerr << ex.what() << endl;
+                            token.release();
+                            body->detach(); // frees Envelope
+                            response->detach();   // frees Body
+                        }
                     }
-
+                } else {
+                    cerr << "-----" << endl << "Decoded message was not a SOAP 1.1 Envelope" << endl << "-----" << endl;
                 }
+
+                /*
+                DOMElement *elem = doc->getDocumentElement();
+                stringstream s;
+                s << *elem;
+                cerr << "-----" << endl << "s = " << s << endl << "-----" << endl;
+                */
+
+
+            } catch (exception & ex) {
+                retbool = 0;
+			cerr << ex.what() << endl;
             }
-            sp->unlock();
 
-        } 
-        conf.term();
+            for (vector<saml2::Assertion*>::iterator d = decrypted.begin(); d != decrypted.end(); ++d)
+                delete *d;
+
+        }
+    } else {
+        retbool = 0;
     }
 
-    strcpy(username,localLoginUser.c_str());
+    if (retbool) {
+        *username = strdup(localLoginUser.c_str());
+        if (*username == NULL)
+            retbool = 0;
+    }
 
     return retbool;
 }
@@ -37,8 +37,7 @@
 
 #include "gssapiP_eap.h"
 
-char* getSAMLRequest2(void);
-int verifySAMLResponse(const char*,int,char*);
+#include <openssl/crypto.h>
 
 #if MECH_EAP
 /*
@@ -878,12 +877,14 @@ gssEapAcceptSecContext(OM_uint32 *minor,
         }
     } else {
 
-        // Allocate space for username string. MUST FREE LATER!!!
-        // TODO: have verifySAMLResponse allocate for username
-        char* username = calloc(128,sizeof(char));
+        char* username = NULL;
+        unsigned char key[RFC3961_KEY_MAX];
+        size_t keyLength = 0;
+        int enctype = ENCTYPE_NULL;
         int result = verifySAMLResponse((char*)input_token->value,
                                         (int)input_token->length,
-                                        username);
+                                        &username,
+                                        &enctype, key, &keyLength);
 
         if (result) {
             gss_buffer_desc buf = {0, NULL};
@@ -892,12 +893,16 @@ gssEapAcceptSecContext(OM_uint32 *minor,
             if (major == GSS_S_COMPLETE)
                 major = gss_import_name(minor, &buf, GSS_C_NT_USER_NAME,
                                  &ctx->initiatorName);
-            major = GSS_S_COMPLETE;
+            gss_release_buffer(&tmpMinor, &buf);
+            if (major == GSS_S_COMPLETE)
+                major = gssEapSamlContextReady(minor, ctx, enctype,
+                                               key, keyLength);
         } else {
             major = GSS_S_FAILURE;
             *minor = GSSEAP_PEER_AUTH_FAILURE;
         }
 
+        OPENSSL_cleanse(key, sizeof(key));
         free(username); username = NULL;
     }
 #endif
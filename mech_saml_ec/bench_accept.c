@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Acceptor throughput against thread count.
+ *
+ * Each thread repeatedly accepts the initiator's first token, which is
+ * the leg that looks up the shared per-Application state and builds an
+ * AuthnRequest from it, and the number of legs completed per second is
+ * reported for 1, 2, 4... threads up to twice the number of CPUs. The
+ * acceptor's second leg is not measured, as it needs a fresh assertion
+ * from the IdP for every context.
+ *
+ * The SP is configured as for gss-server (see README); run with
+ *
+ *     make bench-accept
+ *
+ * or bench_accept [-t max threads] [-s seconds per run].
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <gssapi/gssapi.h>
+#include <gssapi/gssapi_ext.h>
+
+#include "t_idp.h"
+
+static gss_buffer_desc initialToken = GSS_C_EMPTY_BUFFER;
+static volatile int stopping;
+
+struct bench_thread {
+    pthread_t thread;
+    unsigned long count;
+    OM_uint32 major, minor;
+};
+
+/*
+ * The first token carries no credentials, so any user name and password
+ * will do.
+ */
+static OM_uint32
+makeInitialToken(OM_uint32 *minor)
+{
+    OM_uint32 major, tmpMinor;
+    gss_buffer_desc nameBuf = { 5, "bench" };
+    gss_buffer_desc password = { 5, "bench" };
+    gss_name_t name = GSS_C_NO_NAME;
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+    gss_ctx_id_t ctx = GSS_C_NO_CONTEXT;
+
+    major = gss_import_name(minor, &nameBuf, GSS_C_NT_USER_NAME, &name);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = gss_acquire_cred_with_password(minor, name, &password,
+                                           GSS_C_INDEFINITE, GSS_C_NO_OID_SET,
+                                           GSS_C_INITIATE, &cred, NULL, NULL);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = gss_init_sec_context(minor, cred, &ctx, GSS_C_NO_NAME,
+                                 GSS_C_NO_OID, 0, GSS_C_INDEFINITE,
+                                 GSS_C_NO_CHANNEL_BINDINGS, GSS_C_NO_BUFFER,
+                                 NULL, &initialToken, NULL, NULL);
+    if (major == GSS_S_CONTINUE_NEEDED)
+        major = GSS_S_COMPLETE;
+
+cleanup:
+    gss_delete_sec_context(&tmpMinor, &ctx, GSS_C_NO_BUFFER);
+    gss_release_cred(&tmpMinor, &cred);
+    gss_release_name(&tmpMinor, &name);
+
+    return major;
+}
+
+static void *
+acceptLoop(void *arg)
+{
+    struct bench_thread *t = (struct bench_thread *)arg;
+    OM_uint32 tmpMinor;
+
+    while (!stopping) {
+        gss_ctx_id_t ctx = GSS_C_NO_CONTEXT;
+        gss_buffer_desc outputToken = GSS_C_EMPTY_BUFFER;
+
+        t->major = gss_accept_sec_context(&t->minor, &ctx, GSS_C_NO_CREDENTIAL,
+                                          &initialToken,
+                                          GSS_C_NO_CHANNEL_BINDINGS,
+                                          NULL, NULL, &outputToken,
+                                          NULL, NULL, NULL);
+        gss_release_buffer(&tmpMinor, &outputToken);
+        gss_delete_sec_context(&tmpMinor, &ctx, GSS_C_NO_BUFFER);
+
+        if (t->major != GSS_S_CONTINUE_NEEDED)
+            break;
+
+        t->count++;
+    }
+
+    return NULL;
+}
+
+static int
+runThreads(int nthreads, int seconds, double *rate)
+{
+    struct bench_thread *threads;
+    struct timeval start, end;
+    unsigned long total = 0;
+    int i, started, failed = 0;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL)
+        return -1;
+
+    stopping = 0;
+    gettimeofday(&start, NULL);
+
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started].thread, NULL,
+                           acceptLoop, &threads[started]) != 0)
+            break;
+    }
+
+    sleep(seconds);
+    stopping = 1;
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].major != GSS_S_CONTINUE_NEEDED && !failed) {
+            testDisplayStatus("bench_accept", "gss_accept_sec_context",
+                              threads[i].major, threads[i].minor);
+            failed = 1;
+        }
+        total += threads[i].count;
+    }
+
+    gettimeofday(&end, NULL);
+    free(threads);
+
+    if (started < nthreads || failed)
+        return -1;
+
+    *rate = total / ((end.tv_sec - start.tv_sec) +
+                     (end.tv_usec - start.tv_usec) / 1e6);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    OM_uint32 major, minor;
+    int c, nthreads, maxThreads, seconds = 3;
+    double rate, base = 0.0;
+
+    maxThreads = 2 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((c = getopt(argc, argv, "t:s:")) != -1) {
+        switch (c) {
+        case 't':
+            maxThreads = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t max threads] [-s seconds]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (maxThreads < 1 || seconds < 1) {
+        fprintf(stderr, "%s: thread count and duration must be positive\n",
+                argv[0]);
+        return 2;
+    }
+
+    major = makeInitialToken(&minor);
+    if (GSS_ERROR(major)) {
+        testDisplayStatus("bench_accept", "gss_init_sec_context",
+                          major, minor);
+        return 1;
+    }
+
+    /* Load the SP configuration before timing anything */
+    if (runThreads(1, 1, &rate) != 0)
+        return 1;
+
+    printf("%8s %12s %8s\n", "threads", "accepts/s", "speedup");
+
+    for (nthreads = 1; nthreads <= maxThreads; nthreads *= 2) {
+        if (runThreads(nthreads, seconds, &rate) != 0)
+            return 1;
+        if (nthreads == 1)
+            base = rate;
+        printf("%8d %12.0f %8.2f\n", nthreads, rate, rate / base);
+        fflush(stdout);
+    }
+
+    gss_release_buffer(&minor, &initialToken);
+
+    return 0;
+}
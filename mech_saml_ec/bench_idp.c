@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Initiator latency and connection use against concurrency.
+ *
+ * 1, 16 and 256 threads each run contexts back to back, all with one
+ * credential, against a stand-in IdP on the loopback interface that
+ * answers every request after a fixed delay (see t_idp.c). For each
+ * level the number of TLS connections the IdP accepted is reported,
+ * along with the median and 99th percentile time of the second leg,
+ * which is the one that relays the SP's request to the IdP. With HTTP/2
+ * multiplexing, concurrent contexts should share a connection or a few,
+ * rather than open one each.
+ *
+ * Run with
+ *
+ *     make bench-idp
+ *
+ * or bench_idp [-d IdP delay ms] [-n contexts per level].
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <gssapi/gssapi.h>
+#include <gssapi/gssapi_ext.h>
+
+#include "t_idp.h"
+
+static gss_cred_id_t sharedCred = GSS_C_NO_CREDENTIAL;
+static FILE *results;
+
+struct bench_thread {
+    pthread_t thread;
+    int rounds;
+    double *latency;            /* of each second leg, in ms */
+    OM_uint32 major, minor;
+    const char *what;
+};
+
+static void *
+initLoop(void *arg)
+{
+    struct bench_thread *t = (struct bench_thread *)arg;
+    int i;
+
+    for (i = 0; i < t->rounds; i++) {
+        t->major = testInitContext(&t->minor, sharedCred, NULL, &t->what,
+                                   &t->latency[i]);
+        if (GSS_ERROR(t->major))
+            break;
+    }
+
+    return NULL;
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Run nthreads threads of rounds contexts each against a fresh IdP, so
+ * that the connections it counts are this level's alone.
+ */
+static int
+runLevel(int nthreads, int rounds, unsigned int delayMs)
+{
+    struct test_idp *idp;
+    struct test_idp_stats stats;
+    struct bench_thread *threads;
+    double *latency;
+    size_t samples = (size_t)nthreads * rounds;
+    int i, started, failed = 0;
+
+    if (testIdpStart(delayMs, &idp) != 0) {
+        fprintf(stderr, "bench_idp: cannot start the stand-in IdP\n");
+        return -1;
+    }
+    /* The IdP is named afresh for each request, its CA once */
+    setenv("SAML_EC_IDP", testIdpUrl(idp), 1);
+    setenv("SAML_EC_IDP_CA_FILE", testIdpCaFile(idp), 1);
+
+    threads = calloc(nthreads, sizeof(*threads));
+    latency = calloc(samples, sizeof(*latency));
+    if (threads == NULL || latency == NULL) {
+        failed = 1;
+        goto cleanup;
+    }
+
+    for (started = 0; started < nthreads; started++) {
+        threads[started].rounds = rounds;
+        threads[started].latency = &latency[(size_t)started * rounds];
+        if (pthread_create(&threads[started].thread, NULL,
+                           initLoop, &threads[started]) != 0)
+            break;
+    }
+    if (started < nthreads)
+        failed = 1;
+
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (GSS_ERROR(threads[i].major) && !failed) {
+            testDisplayStatus("bench_idp", threads[i].what,
+                              threads[i].major, threads[i].minor);
+            failed = 1;
+        }
+    }
+
+    if (!failed) {
+        testIdpStats(idp, &stats);
+        qsort(latency, samples, sizeof(*latency), compareDouble);
+        fprintf(results, "%8d %12lu %10lu %10.1f %10.1f\n", nthreads,
+                stats.connections, stats.requests,
+                latency[samples / 2], latency[(samples * 99) / 100]);
+        fflush(results);
+    }
+
+cleanup:
+    free(latency);
+    free(threads);
+    testIdpStop(idp);
+
+    return failed ? -1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int levels[] = { 1, 16, 256 };
+    OM_uint32 major, minor, tmpMinor;
+    gss_buffer_desc nameBuf = { 5, "bench" };
+    gss_buffer_desc password = { 5, "bench" };
+    gss_name_t name = GSS_C_NO_NAME;
+    int c, i, delayMs = 20, contexts = 1024, ret = 0;
+
+    while ((c = getopt(argc, argv, "d:n:")) != -1) {
+        switch (c) {
+        case 'd':
+            delayMs = atoi(optarg);
+            break;
+        case 'n':
+            contexts = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d IdP delay ms] "
+                    "[-n contexts per level]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (delayMs < 0 || contexts < 1) {
+        fprintf(stderr, "%s: delay and context count must be positive\n",
+                argv[0]);
+        return 2;
+    }
+
+    /*
+     * The mechanism traces every message to stdout; keep that out of
+     * the results, and its cost out of the timings.
+     */
+    fflush(stdout);
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (results == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("bench_idp");
+        return 1;
+    }
+
+    major = gss_import_name(&minor, &nameBuf, GSS_C_NT_USER_NAME, &name);
+    if (!GSS_ERROR(major))
+        major = gss_acquire_cred_with_password(&minor, name, &password,
+                                               GSS_C_INDEFINITE,
+                                               GSS_C_NO_OID_SET,
+                                               GSS_C_INITIATE, &sharedCred,
+                                               NULL, NULL);
+    gss_release_name(&tmpMinor, &name);
+    if (GSS_ERROR(major)) {
+        testDisplayStatus("bench_idp",
+                          "gss_acquire_cred_with_password", major, minor);
+        return 1;
+    }
+
+    fprintf(results, "IdP delay %d ms, %d contexts per level\n",
+            delayMs, contexts);
+    fprintf(results, "%8s %12s %10s %10s %10s\n",
+            "contexts", "connections", "requests", "p50 ms", "p99 ms");
+
+    for (i = 0; i < (int)(sizeof(levels) / sizeof(levels[0])); i++) {
+        int rounds = (contexts + levels[i] - 1) / levels[i];
+
+        if (runLevel(levels[i], rounds, delayMs) != 0) {
+            ret = 1;
+            break;
+        }
+    }
+
+    gss_release_cred(&tmpMinor, &sharedCred);
+
+    return ret;
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replay window cost per message. Sequence numbers go through
+ * sequenceCheck() in order, and then in blocks of 16 and 64 that each
+ * arrive in reverse, as from a transport spreading messages over
+ * several streams, and the time per check is reported for each window
+ * width.
+ *
+ * Run with
+ *
+ *     make bench-ordering
+ *
+ * or bench_ordering [-n checks per measurement].
+ */
+
+#include "gssapiP_eap.h"
+
+#include <sys/time.h>
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Check count sequence numbers arriving in blocks of span, each block
+ * reversed, and return the time per check in nanoseconds, or a negative
+ * number if any was refused.
+ */
+static double
+runStream(long count, long span)
+{
+    OM_uint32 major, minor;
+    void *vqueue = NULL;
+    long i, j, refused = 0;
+    double t;
+
+    major = sequenceInit(&minor, &vqueue, 0, 1, 1, 1);
+    if (GSS_ERROR(major))
+        return -1.0;
+
+    t = now();
+    for (i = 0; i + span <= count; i += span) {
+        for (j = span - 1; j >= 0; j--) {
+            major = sequenceCheck(&minor, &vqueue, i + j);
+            if (major == GSS_S_OLD_TOKEN || major == GSS_S_DUPLICATE_TOKEN ||
+                GSS_ERROR(major))
+                refused++;
+        }
+    }
+    t = now() - t;
+
+    sequenceFree(&minor, &vqueue);
+
+    return refused ? -1.0 : t / i * 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const char *widths[] = { "64", "256", "1024", "4096" };
+    static const long spans[] = { 1, 16, 64 };
+    long count = 20000000;
+    size_t i, j;
+    double ns;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n checks per measurement]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (count < spans[sizeof(spans) / sizeof(spans[0]) - 1]) {
+        fprintf(stderr, "%s: need at least %ld checks\n", argv[0],
+                spans[sizeof(spans) / sizeof(spans[0]) - 1]);
+        return 2;
+    }
+
+    printf("%6s %14s %14s %14s\n", "width", "in order", "reversed 16",
+           "reversed 64");
+
+    for (i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        setenv("SAML_EC_REPLAY_WINDOW", widths[i], 1);
+        printf("%6s", widths[i]);
+
+        for (j = 0; j < sizeof(spans) / sizeof(spans[0]); j++) {
+            ns = runStream(count, spans[j]);
+            if (ns < 0) {
+                printf("\n");
+                fprintf(stderr, "%s: in-window numbers were refused\n",
+                        argv[0]);
+                return 1;
+            }
+            printf(" %11.1f ns", ns);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    return 0;
+}
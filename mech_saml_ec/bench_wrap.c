@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Message protection throughput.
+ *
+ * Messages of 64 bytes, 1 KiB, 16 KiB and 1 MiB are wrapped with
+ * confidentiality through gss_wrap_iov() and unwrapped through
+ * gss_unwrap_iov(), with replay and sequence detection on, and the
+ * throughput of each is reported in GB/s of message data. The same
+ * messages are then put through gss_eap_wrap_iov_batch() and
+ * gss_eap_unwrap_iov_batch() up to 4096 at a time, for comparison with
+ * the per-message loop.
+ *
+ * Established contexts come only from a round trip through the IdP, so
+ * this links the per-message sources directly and makes a pair of
+ * contexts sharing a key by hand (see t_context.h).
+ *
+ * Run with
+ *
+ *     make bench-wrap
+ *
+ * or bench_wrap [-e enctype] [-m MiB per measurement].
+ */
+
+#include "gssapiP_eap.h"
+
+#include <sys/time.h>
+
+#include "t_context.h"
+
+/* Messages wrapped before they are unwrapped, at most */
+#define BENCH_BATCH_MAX     4096
+#define BENCH_BATCH_BYTES   (16 * 1024 * 1024)
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+layoutIov(gss_iov_buffer_desc (*iov)[3], size_t count,
+          unsigned char *data, size_t length,
+          unsigned char *tokens, size_t headerLength, size_t trailerLength)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        unsigned char *token = tokens + i * (headerLength + trailerLength);
+
+        iov[i][0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+        iov[i][0].buffer.length = headerLength;
+        iov[i][0].buffer.value = token;
+        iov[i][1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[i][1].buffer.length = length;
+        iov[i][1].buffer.value = data + i * length;
+        iov[i][2].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+        iov[i][2].buffer.length = trailerLength;
+        iov[i][2].buffer.value = token + headerLength;
+    }
+}
+
+/*
+ * Wrap and then unwrap count messages of length bytes each, in place,
+ * until total bytes have gone through, and report the rates of doing so
+ * one message per call and count messages per call.
+ */
+static int
+runSize(gss_ctx_id_t initiator, gss_ctx_id_t acceptor,
+        size_t length, size_t total)
+{
+    OM_uint32 major = GSS_S_FAILURE, minor = ENOMEM;
+    gss_iov_buffer_desc (*iov)[3] = NULL;
+    gss_eap_iov_set_desc *sets = NULL;
+    unsigned char *data = NULL, *tokens = NULL;
+    size_t count, headerLength, trailerLength, done, i;
+    double wrapTime = 0.0, unwrapTime = 0.0;
+    double batchWrapTime = 0.0, batchUnwrapTime = 0.0, t;
+    int confState, ret = -1;
+    gss_qop_t qop;
+
+    count = BENCH_BATCH_BYTES / length;
+    if (count > BENCH_BATCH_MAX)
+        count = BENCH_BATCH_MAX;
+    if (count == 0)
+        count = 1;
+
+    iov = GSSEAP_CALLOC(count, sizeof(*iov));
+    sets = GSSEAP_CALLOC(count, sizeof(*sets));
+    data = GSSEAP_MALLOC(count * length);
+    if (iov == NULL || sets == NULL || data == NULL)
+        goto cleanup;
+    memset(data, 'x', count * length);
+
+    iov[0][0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    iov[0][1].type = GSS_IOV_BUFFER_TYPE_DATA;
+    iov[0][1].buffer.length = length;
+    iov[0][2].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+    major = gss_wrap_iov_length(&minor, initiator, 1, GSS_C_QOP_DEFAULT,
+                                &confState, iov[0], 3);
+    if (GSS_ERROR(major))
+        goto cleanup;
+    headerLength = iov[0][0].buffer.length;
+    trailerLength = iov[0][2].buffer.length;
+
+    tokens = GSSEAP_MALLOC(count * (headerLength + trailerLength));
+    if (tokens == NULL)
+        goto cleanup;
+
+    for (i = 0; i < count; i++) {
+        sets[i].iov = iov[i];
+        sets[i].iov_count = 3;
+    }
+
+    for (done = 0; done < total; done += count * length) {
+        layoutIov(iov, count, data, length,
+                  tokens, headerLength, trailerLength);
+
+        t = now();
+        for (i = 0; i < count; i++) {
+            major = gss_wrap_iov(&minor, initiator, 1, GSS_C_QOP_DEFAULT,
+                                 &confState, iov[i], 3);
+            if (GSS_ERROR(major))
+                goto cleanup;
+        }
+        wrapTime += now() - t;
+
+        t = now();
+        for (i = 0; i < count; i++) {
+            major = gss_unwrap_iov(&minor, acceptor, &confState, &qop,
+                                   iov[i], 3);
+            if (major != GSS_S_COMPLETE)
+                goto cleanup;
+        }
+        unwrapTime += now() - t;
+
+        layoutIov(iov, count, data, length,
+                  tokens, headerLength, trailerLength);
+
+        t = now();
+        major = gss_eap_wrap_iov_batch(&minor, initiator, 1,
+                                       GSS_C_QOP_DEFAULT, sets, count);
+        if (GSS_ERROR(major))
+            goto cleanup;
+        batchWrapTime += now() - t;
+
+        t = now();
+        major = gss_eap_unwrap_iov_batch(&minor, acceptor, sets, count);
+        if (major != GSS_S_COMPLETE)
+            goto cleanup;
+        batchUnwrapTime += now() - t;
+    }
+
+    printf("%10lu %12.2f %12.2f %12.2f %12.2f\n", (unsigned long)length,
+           done / wrapTime / 1e9, done / batchWrapTime / 1e9,
+           done / unwrapTime / 1e9, done / batchUnwrapTime / 1e9);
+    fflush(stdout);
+    ret = 0;
+
+cleanup:
+    if (ret != 0)
+        fprintf(stderr, "bench_wrap: %lu byte messages failed (major %08x, "
+                "minor %u)\n", (unsigned long)length, major, minor);
+    GSSEAP_FREE(tokens);
+    GSSEAP_FREE(data);
+    GSSEAP_FREE(sets);
+    GSSEAP_FREE(iov);
+
+    return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 64, 1024, 16 * 1024, 1024 * 1024 };
+    gss_ctx_id_t initiator = GSS_C_NO_CONTEXT, acceptor = GSS_C_NO_CONTEXT;
+    unsigned char keyData[RFC3961_KEY_MAX];
+    int c, enctype = ENCTYPE_AES256_CTS_HMAC_SHA1_96, mebibytes = 256, ret = 1;
+    size_t i, keyLength;
+
+    while ((c = getopt(argc, argv, "e:m:")) != -1) {
+        switch (c) {
+        case 'e':
+            enctype = atoi(optarg);
+            break;
+        case 'm':
+            mebibytes = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e enctype] [-m MiB per measurement]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (mebibytes < 1) {
+        fprintf(stderr, "%s: the amount of data must be positive\n", argv[0]);
+        return 2;
+    }
+
+    keyLength = (enctype == ENCTYPE_AES128_CTS_HMAC_SHA1_96) ? 16 : 32;
+    for (i = 0; i < keyLength; i++)
+        keyData[i] = (unsigned char)(i * 7 + 1);
+
+    initiator = testMakeContext(enctype, keyData, keyLength, 1);
+    acceptor = testMakeContext(enctype, keyData, keyLength, 0);
+    if (initiator == GSS_C_NO_CONTEXT || acceptor == GSS_C_NO_CONTEXT) {
+        fprintf(stderr, "%s: unsupported enctype %d\n", argv[0], enctype);
+        goto cleanup;
+    }
+
+    printf("enctype %d, %d MiB per measurement\n", enctype, mebibytes);
+    printf("%10s %12s %12s %12s %12s\n", "bytes", "wrap GB/s", "batch",
+           "unwrap GB/s", "batch");
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (runSize(initiator, acceptor, sizes[i],
+                    (size_t)mebibytes * 1024 * 1024) != 0)
+            goto cleanup;
+    }
+
+    ret = 0;
+
+cleanup:
+    testReleaseContext(initiator);
+    testReleaseContext(acceptor);
+
+    return ret;
+}
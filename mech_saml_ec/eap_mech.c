@@ -56,10 +56,14 @@ gssEapFinalize(void)
     OM_uint32 minor;
 
     gssEapAttrProvidersFinalize(&minor);
+#if defined(HAVE_SHIBRESOLVER) && !defined(MECH_EAP)
+    gssEapSamlSPFinalize(&minor);
+#endif
 #endif
 #ifdef MECH_EAP
     eap_peer_unregister_methods();
 #endif
+    gssEapHttpFinalize();
 }
 
 #ifdef GSSEAP_CONSTRUCTOR
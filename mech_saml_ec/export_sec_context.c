@@ -177,11 +177,13 @@ gssEapExportSecContext(OM_uint32 *minor,
     p = store_buffer(&acceptorName,        p, 0);
 
     store_uint64_be(ctx->expiryTime,       &p[0]);
-    store_uint64_be(ctx->sendSeq,          &p[8]);
+    store_uint64_be(GSSEAP_ATOMIC_LOAD64(&ctx->sendSeq), &p[8]);
     store_uint64_be(ctx->recvSeq,          &p[16]);
     p += 24;
 
+    GSSEAP_MUTEX_LOCK(&ctx->seqMutex);
     major = sequenceExternalize(minor, ctx->seqState, &p, &length);
+    GSSEAP_MUTEX_UNLOCK(&ctx->seqMutex);
     if (GSS_ERROR(major))
         goto cleanup;
 
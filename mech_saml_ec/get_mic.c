@@ -43,7 +43,6 @@ gss_get_mic(OM_uint32 *minor,
             gss_buffer_t message_buffer,
             gss_buffer_t message_token)
 {
-#ifdef MECH_EAP
     OM_uint32 major;
     gss_iov_buffer_desc iov[2];
 
@@ -62,8 +61,6 @@ gss_get_mic(OM_uint32 *minor,
     message_token->value = NULL;
     message_token->length = 0;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSEAP_CONTEXT_INCOMPLETE;
@@ -77,17 +74,12 @@ gss_get_mic(OM_uint32 *minor,
     iov[1].buffer.value = NULL;
     iov[1].buffer.length = 0;
 
-    major = gssEapWrapOrGetMIC(minor, ctx, FALSE, NULL, iov, 2, TOK_TYPE_MIC);
+    major = gssEapWrapOrGetMIC(minor, ctx, 0, NULL, iov, 2, TOK_TYPE_MIC);
     if (GSS_ERROR(major))
         goto cleanup;
 
     *message_token = iov[1].buffer;
 
 cleanup:
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
-#else
-    return GSS_S_UNAVAILABLE;
-#endif
 }
@@ -152,6 +152,7 @@ struct gss_cred_id_struct
     gss_buffer_desc caCertificate;
     gss_buffer_desc subjectNameConstraint;
     gss_buffer_desc subjectAltNameConstraint;
+    struct gss_eap_assertion_cache *assertionCache; /* for initiator */
 };
 
 #define CTX_FLAG_INITIATOR                  0x00000001
@@ -176,6 +177,7 @@ struct gss_cred_id_struct
 struct gss_eap_initiator_ctx {
     unsigned int idleWhile;
     struct eap_sm *eap;
+    struct gss_eap_saml_pending *samlPending;
 };
 
 #ifdef GSSEAP_ENABLE_ACCEPTOR
@@ -196,6 +198,12 @@ struct gss_ctx_id_t_desc_struct
 struct gss_ctx_id_struct
 #endif
 {
+    /*
+     * mutex protects the context while it is being established. After
+     * that, per-message calls run without it: the state, flags, names
+     * and key no longer change, sendSeq is advanced atomically and
+     * seqMutex protects seqState.
+     */
     GSSEAP_MUTEX mutex;
     enum gss_eap_state state;
     OM_uint32 flags;
@@ -204,7 +212,9 @@ struct gss_ctx_id_struct
     gss_name_t initiatorName;
     gss_name_t acceptorName;
     time_t expiryTime;
+    struct gss_eap_rfc3961_key *rfc3961Key;
     uint64_t sendSeq, recvSeq;
+    GSSEAP_MUTEX seqMutex;
     void *seqState;
     gss_cred_id_t cred;
     union {
@@ -258,7 +268,39 @@ gssEapInitSecContext(OM_uint32 *minor,
                      OM_uint32 *ret_flags,
                      OM_uint32 *time_rec);
 
+void
+gssEapReleaseSamlPending(struct gss_eap_saml_pending *pending);
+
+OM_uint32
+gssEapCreateAssertionCache(OM_uint32 *minor,
+                           struct gss_eap_assertion_cache **pCache);
+
+void
+gssEapReleaseAssertionCache(struct gss_eap_assertion_cache *cache);
+
+struct gss_eap_http_request *
+gssEapPendingIdPRequest(gss_ctx_id_t ctx);
+
 /* wrap_iov.c */
+OM_uint32
+gssEapWrapTokenCheckIov(OM_uint32 *minor,
+                        gss_ctx_id_t ctx,
+                        int conf_req_flag,
+                        gss_iov_buffer_desc *iov,
+                        int iov_count,
+                        enum gss_eap_token_type toktype);
+
+OM_uint32
+gssEapWrapToken(OM_uint32 *minor,
+                gss_ctx_id_t ctx,
+                int conf_req_flag,
+                int *conf_state,
+                gss_iov_buffer_desc *iov,
+                int iov_count,
+                enum gss_eap_token_type toktype,
+                uint64_t seqnum,
+                const unsigned char *confounder);
+
 OM_uint32
 gssEapWrapOrGetMIC(OM_uint32 *minor,
                    gss_ctx_id_t ctx,
@@ -268,6 +310,16 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
                    int iov_count,
                    enum gss_eap_token_type toktype);
 
+OM_uint32
+gssEapUnwrapToken(OM_uint32 *minor,
+                  gss_ctx_id_t ctx,
+                  int *conf_state,
+                  gss_qop_t *qop_state,
+                  gss_iov_buffer_desc *iov,
+                  int iov_count,
+                  enum gss_eap_token_type toktype,
+                  uint64_t *pSeqnum);
+
 OM_uint32
 gssEapUnwrapOrVerifyMIC(OM_uint32 *minor_status,
                         gss_ctx_id_t ctx,
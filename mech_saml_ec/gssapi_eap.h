@@ -83,6 +83,107 @@ extern gss_OID GSS_EAP_CRED_SET_CRED_PASSWORD;
  */
 #define GSS_EAP_DISABLE_LOCAL_ATTRS_FLAG    0x00000001
 
+/*
+ * Credentials flag requesting that the initiator's request to the
+ * IdP not block. While it is in flight, gss_init_sec_context()
+ * returns GSS_S_CONTINUE_NEEDED with an empty output token and a
+ * minor status of GSSEAP_IDP_REQUEST_PENDING; the caller waits as
+ * described by GSS_EAP_INQ_IDP_POLL_SET and then calls it again.
+ */
+#define GSS_EAP_ASYNC_IDP_FLAG              0x00000002
+
+/*
+ * Credentials flag enabling a small cache of IdP responses on the
+ * credential, so that a repeat login to the same SP can skip the IdP.
+ * Only responses that the IdP has not bound to one request (no
+ * InResponseTo, no OneTimeUse) are reused, until their NotOnOrAfter.
+ * A reused response carries the same Response and Assertion IDs and
+ * IssueInstant as before, so the SP's policy must not check for replay
+ * or limit the age of messages (for Shibboleth, a MessageFlow rule with
+ * checkReplay="false" and expires at least the assertions' lifetime).
+ */
+#define GSS_EAP_CACHE_IDP_FLAG              0x00000004
+
+/*
+ * A pending IdP request (GSS_EAP_ASYNC_IDP_FLAG) is signalled by all
+ * three of:
+ *
+ *   - a major status of GSS_S_CONTINUE_NEEDED;
+ *   - an output token of length zero;
+ *   - a minor status of GSSEAP_IDP_REQUEST_PENDING.
+ *
+ * No other leg of this mechanism returns GSS_S_CONTINUE_NEEDED with an
+ * empty token, so the empty token alone tells "pending" apart from a
+ * token for the acceptor; it must not be sent to the acceptor. Callers
+ * that cannot compare the minor status, such as those behind a mechglue
+ * that remaps it, can confirm by asking for GSS_EAP_INQ_IDP_POLL_SET,
+ * which succeeds only while a request is pending and otherwise fails
+ * with GSS_S_UNAVAILABLE. Until the request completes, the input token
+ * to gss_init_sec_context() is ignored.
+ *
+ * What an in-flight IdP request is waiting for. The first element
+ * is a timeout in milliseconds as a 32-bit integer in network byte
+ * order (0xFFFFFFFF if none), after which the caller should call
+ * gss_init_sec_context() regardless. Each further element is a
+ * socket descriptor followed by GSS_EAP_POLL_* flags, both 32-bit
+ * integers in network byte order. Only the sockets of this context's
+ * own request are listed, however many there are; where requests share
+ * a connection, its socket is listed for each of them. A request with
+ * no socket yet (waiting for a shared connection) lists none and has a
+ * short timeout.
+ */
+extern gss_OID GSS_EAP_INQ_IDP_POLL_SET;
+
+#define GSS_EAP_POLL_IN                     0x00000001
+#define GSS_EAP_POLL_OUT                    0x00000002
+
+#ifdef GSS_IOV_BUFFER_TYPE_EMPTY
+
+#ifdef GSSAPI_CALLCONV
+#define GSS_EAP_CALLCONV                    GSSAPI_CALLCONV
+#else
+#define GSS_EAP_CALLCONV                    KRB5_CALLCONV
+#endif
+
+/*
+ * One message for gss_eap_wrap_iov_batch() or gss_eap_unwrap_iov_batch():
+ * its IOV buffers, laid out as for gss_wrap_iov() or gss_unwrap_iov(),
+ * and, on return, the status and confidentiality state of that message.
+ */
+typedef struct gss_eap_iov_set_desc_struct {
+    gss_iov_buffer_desc *iov;
+    int iov_count;
+    int conf_state;
+    OM_uint32 major_status;
+    OM_uint32 minor_status;
+} gss_eap_iov_set_desc, *gss_eap_iov_set_t;
+
+/*
+ * Wrap or unwrap count messages on one context in a single call. The
+ * messages are processed as if by gss_wrap_iov() or gss_unwrap_iov() in
+ * array order; wrapped messages take consecutive sequence numbers, and
+ * one whose buffers are laid out wrongly fails without taking one. The
+ * call returns GSS_S_COMPLETE if every message succeeded, and otherwise
+ * the status of the first that did not. These take this mechanism's own
+ * context handle, so they are for applications linked directly against
+ * the mechanism rather than through a mechglue.
+ */
+OM_uint32 GSS_EAP_CALLCONV
+gss_eap_wrap_iov_batch(OM_uint32 *minor,
+                       gss_ctx_id_t ctx,
+                       int conf_req_flag,
+                       gss_qop_t qop_req,
+                       gss_eap_iov_set_desc *iov_sets,
+                       size_t count);
+
+OM_uint32 GSS_EAP_CALLCONV
+gss_eap_unwrap_iov_batch(OM_uint32 *minor,
+                         gss_ctx_id_t ctx,
+                         gss_eap_iov_set_desc *iov_sets,
+                         size_t count);
+
+#endif /* GSS_IOV_BUFFER_TYPE_EMPTY */
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
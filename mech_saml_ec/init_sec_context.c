@@ -37,8 +37,12 @@
 
 #include "gssapiP_eap.h"
 
-#include <libxml/xmlreader.h>
-#include <curl/curl.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <openssl/crypto.h>
 
 #define SAML_EC_IDP	"SAML_EC_IDP"
 
@@ -536,390 +540,1403 @@ eapGssSmInitIdentity(OM_uint32 *minor,
 }
 
 
-static xmlNode *
-getElement(xmlNode *a_node, char *name)
+static OM_uint32
+checkSAMLRequestParams(OM_uint32 *minor, const char *idp, const char *user)
 {
-    xmlNode *cur_node = NULL;
-    xmlNode *ret_node = NULL;
+    fprintf(stdout, "IdP IS (%s)\n", idp?:"");
+    fprintf(stdout, "USER IS (%s)\n", user?:"");
 
-    for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
-            printf("node type: %d, name: %s (%s)\n", cur_node->type, cur_node->name, cur_node->content?(cur_node->content):"");
-        if (cur_node->type == XML_ELEMENT_NODE && !strcmp(cur_node->name, name)) {
-                return cur_node;
-        }
+    if (idp == NULL) {
+        fprintf(stderr, "ERROR: NO IDP specified; please specify an IdP"
+                "using the environment variable (%s)\n", SAML_EC_IDP);
+        *minor = GSSEAP_BAD_SERVICE_NAME;
+        return GSS_S_FAILURE;
+    }
 
-        ret_node = getElement(cur_node->children, name);
-        if (ret_node)
-            return ret_node;
+    if (user == NULL) {
+        /* TODO: check for a non-NULL password as well? */
+        fprintf(stderr, "ERROR: NO user/password info in credential; "
+                        "please supply a credential acquired with "
+                        "gss_acquire_cred_with_password() or variants\n");
+        *minor = GSSEAP_BAD_CRED_OPTION;
+        return GSS_S_FAILURE;
     }
-    return NULL;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
 }
 
-static void
-freeChildren(xmlNode *a_node)
+/*
+ * Optional per-credential cache of IdP responses (GSS_EAP_CACHE_IDP_FLAG),
+ * keyed by IdP, SP entityID and AssertionConsumerServiceURL, so that a
+ * repeat login to the same SP can skip the IdP round trip. Only responses
+ * whose assertions are not bound to a request (no InResponseTo), are not
+ * marked OneTimeUse and carry a NotOnOrAfter are kept, and only until
+ * the earliest such NotOnOrAfter less an allowance for clock skew.
+ *
+ * The response is relayed again byte for byte, IDs and IssueInstant
+ * included: it is signed, so nothing in it can be refreshed. An SP that
+ * detects replay or limits message age, as Shibboleth's default
+ * MessageFlow rule does, rejects the second login; see gssapi_eap.h.
+ */
+#define GSSEAP_ASSERTION_CACHE_MAX  8
+#define GSSEAP_ASSERTION_CACHE_SKEW 30 /* seconds */
+
+struct gss_eap_assertion_entry {
+    char *key;
+    time_t expiryTime;
+    gss_buffer_desc response;
+};
+
+struct gss_eap_assertion_cache {
+    GSSEAP_MUTEX mutex;
+    unsigned int count;
+    struct gss_eap_assertion_entry entries[GSSEAP_ASSERTION_CACHE_MAX];
+};
+
+OM_uint32
+gssEapCreateAssertionCache(OM_uint32 *minor,
+                           struct gss_eap_assertion_cache **pCache)
 {
-    xmlNode *cur_node = NULL;
+    struct gss_eap_assertion_cache *cache;
+
+    cache = GSSEAP_CALLOC(1, sizeof(*cache));
+    if (cache == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
 
-    cur_node = a_node->children;
-    while (cur_node) {
-          xmlNode *next_node = cur_node->next;
-          xmlUnlinkNode(cur_node);
-          xmlFreeNode(cur_node);          cur_node = next_node;
+    if (GSSEAP_MUTEX_INIT(&cache->mutex) != 0) {
+        *minor = GSSEAP_GET_LAST_ERROR();
+        GSSEAP_FREE(cache);
+        return GSS_S_FAILURE;
     }
+
+    *pCache = cache;
+    *minor = 0;
+    return GSS_S_COMPLETE;
 }
 
-size_t
-write_data(void *buffer, size_t size, size_t nmemb, void *userp)
+static void
+releaseAssertionEntry(struct gss_eap_assertion_entry *entry)
 {
-    int numbytes = size * nmemb;
     OM_uint32 tmpMinor;
 
-    if (addToStringBuffer(&tmpMinor, buffer, numbytes, userp) == GSS_S_COMPLETE)
-        return numbytes;
-    else
-        return -1;
+    GSSEAP_FREE(entry->key);
+    if (entry->response.value != NULL)
+        memset(entry->response.value, 0, entry->response.length);
+    gss_release_buffer(&tmpMinor, &entry->response);
+    memset(entry, 0, sizeof(*entry));
 }
 
-char curl_err_msg[CURL_ERROR_SIZE+1];
+void
+gssEapReleaseAssertionCache(struct gss_eap_assertion_cache *cache)
+{
+    unsigned int i;
 
-OM_uint32
-sendToIdP(OM_uint32 *minor, xmlDocPtr doc, char *idp,
-          char *user, char *password, gss_buffer_t response)
-{
-    CURL *curl = NULL;
-    CURLcode res = 0;
-    xmlChar *mem = NULL;
-    int size = 0;
-    char userpw[514] = ""; /* TODO VSY: fix this */
-    OM_uint32 major = GSS_S_COMPLETE;
-
-    xmlDocDumpFormatMemory(doc, &mem, &size, 0);
-    if (mem == NULL || size == 0) {
-        fprintf(stderr, "ERROR: xmlDocDumpFormatMemory failed to parse "
-                        "the XML doc to be sent to IdP\n");
-        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
-        return GSS_S_FAILURE;
-    }
+    if (cache == NULL)
+        return;
 
-    curl = curl_easy_init();
+    for (i = 0; i < cache->count; i++)
+        releaseAssertionEntry(&cache->entries[i]);
 
-    if (!curl) {
-        fprintf(stderr, "ERROR: curl_easy_init failed\n");
-        *minor = GSSEAP_BAD_USAGE;
-        major = GSS_S_FAILURE;
-    }
+    GSSEAP_MUTEX_DESTROY(&cache->mutex);
+    GSSEAP_FREE(cache);
+}
 
-    fprintf(stdout, "DOING HTTP POST to IdP (%s) using Basic Auth user"
-                    " (%s)\n", idp, user);
-    sprintf(userpw, "%s:%s", user, password);
-    if ((res = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_msg)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_URL, idp)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_USERPWD, userpw)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_POST, 1)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, mem)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, size)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, response)) != CURLE_OK ||
-        (res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data)) != CURLE_OK) {
-        fprintf(stderr, "ERROR: curl_easy_setopt failure; %s\n", curl_easy_strerror(res));
-        *minor = GSSEAP_BAD_USAGE;
-        major = GSS_S_FAILURE;
-        goto cleanup;
+/* Parse an xsd:dateTime in UTC, as SAML requires, into a time_t */
+static time_t
+parseSAMLTime(const char *s)
+{
+    int year, month, day, hour, minute, second, n = 0;
+    long days;
+
+    if (sscanf(s, "%4d-%2d-%2dT%2d:%2d:%2d%n",
+               &year, &month, &day, &hour, &minute, &second, &n) != 6)
+        return 0;
+
+    s += n;
+    if (*s == '.') {
+        for (s++; *s >= '0' && *s <= '9'; s++)
+            ;
     }
+    if (strcmp(s, "Z") != 0 || month < 1 || month > 12)
+        return 0;
 
-    res = curl_easy_perform(curl);
-    if (res) {
-        fprintf(stderr, "ERROR: curl_easy_perform failed with return code "
-                        "(%d) and error (%s)\n", res, curl_err_msg);
-        *minor = GSSEAP_BAD_USAGE;
-        major = GSS_S_FAILURE;
-        goto cleanup;
+    /* Days since the epoch in the proleptic Gregorian calendar */
+    if (month <= 2) {
+        year--;
+        month += 12;
     }
+    days = 365L * year + year / 4 - year / 100 + year / 400 +
+           (153 * (month - 3) + 2) / 5 + day - 719469;
 
-    major = GSS_S_COMPLETE;
+    return (time_t)(days * 86400 + hour * 3600 + minute * 60 + second);
+}
 
-cleanup:
-    if (mem)
-        xmlFree(mem);
-    mem = NULL;
+/*
+ * Each ECP message is read in one streaming (SAX) pass that notes the
+ * byte offsets of the few elements we need. The message for the IdP and
+ * the token for the SP are then made by splicing byte ranges of what was
+ * received, so signed content is passed on exactly as it arrived and is
+ * never reparsed or reserialised.
+ */
+#define SOAP11_NS   "http://schemas.xmlsoap.org/soap/envelope/"
+#define PAOS_NS     "urn:liberty:paos:2003-08"
+#define ECP_NS      "urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp"
+#define SAML2_NS    "urn:oasis:names:tc:SAML:2.0:assertion"
+
+/* An element's bytes are [start, end); its start tag closes at tagEnd */
+struct gss_eap_xml_span {
+    size_t start;
+    size_t tagEnd;
+    size_t end;
+};
 
-    if (curl)
-        curl_easy_cleanup(curl);
-    curl = NULL;
+struct gss_eap_ecp_scan {
+    xmlParserCtxtPtr ctxt;
+    const char *base;
+    size_t length;
+    int depth;
+    int error;
+
+    /* SOAP Header of either message */
+    struct gss_eap_xml_span header;
+    char *headerName;
+    int inHeader;
+
+    /* SP's request */
+    struct gss_eap_xml_span relayState;
+    int relayStateDepth;
+    gss_buffer_desc relayStateNs;
+    struct gss_eap_xml_span sessionKey;
+    gss_buffer_desc sessionKeyNs;
+    char *responseConsumerURL;
+    gss_buffer_desc issuer;
+    int issuerDepth;
+
+    /* samlec:SessionKey, in either message */
+    int sessionKeyDepth;
+    gss_buffer_t sessionKeyText;
+    gss_buffer_desc encType;
+    gss_buffer_desc generatedKey;
+
+    /* IdP's response */
+    char *assertionConsumerServiceURL;
+    time_t notOnOrAfter;
+    int assertions;
+    int noReuse;
+};
 
-    return major;
+/* The SP's request, as needed to send it on and relay the response */
+struct gss_eap_ecp_request {
+    char *responseConsumerURL;
+    char *issuer;
+    gss_buffer_desc relayState;
+    gss_buffer_desc sessionKey;
+    gss_buffer_desc body;
+};
+
+/* The key the IdP generated for this context, if it supports samlec */
+struct gss_eap_session_key {
+    int enctype;
+    size_t length;
+    unsigned char key[RFC3961_KEY_MAX];
+};
+
+static size_t
+scanOffset(struct gss_eap_ecp_scan *scan)
+{
+    xmlParserInputPtr input = scan->ctxt->input;
+
+    return (size_t)input->consumed + (size_t)(input->cur - input->base);
 }
 
-OM_uint32
-processSAMLRequest(OM_uint32 *minor, gss_cred_id_t cred,
-                 gss_buffer_t request, gss_buffer_t response)
+static int
+nameIs(const xmlChar *URI, const xmlChar *localname,
+       const char *ns, const char *name)
 {
-    char *idp = getenv(SAML_EC_IDP);
-    char *user = cred->name->username.value;
-    char *password = cred->password.value;
-    xmlDocPtr doc_from_sp = NULL;
-    xmlDocPtr doc_from_idp = NULL;
-    xmlNode *header_from_sp = NULL;
-    gss_buffer_desc response_from_idp = {0, NULL};
-    OM_uint32 major = GSS_S_COMPLETE;
-    OM_uint32 tmpMinor = 0;
+    return URI != NULL && strcmp((const char *)URI, ns) == 0 &&
+           strcmp((const char *)localname, name) == 0;
+}
 
-    fprintf(stdout, "IdP IS (%s)\n", idp?:"");
-    fprintf(stdout, "USER IS (%s)\n", user);
+static char *
+copyXmlString(const xmlChar *value, const xmlChar *end)
+{
+    size_t len = end - value;
+    char *s;
 
-    if (idp == NULL) {
-        fprintf(stderr, "ERROR: NO IDP specified; please specify an IdP"
-                "using the environment variable (%s)\n", SAML_EC_IDP);
-        *minor = GSSEAP_BAD_SERVICE_NAME;
-        return GSS_S_FAILURE;
+    s = GSSEAP_MALLOC(len + 1);
+    if (s != NULL) {
+        memcpy(s, value, len);
+        s[len] = '\0';
     }
 
-    if (user == NULL) {
-        /* TODO: check for a non-NULL password as well? */
-        fprintf(stderr, "ERROR: NO user/password info in credential; "
-                        "please supply a credential acquired with "
-                        "gss_acquire_cred_with_password() or variants\n");
-        *minor = GSSEAP_BAD_CRED_OPTION;
-        return GSS_S_FAILURE;
-    }
+    return s;
+}
 
-    doc_from_sp = xmlReadMemory(request->value, request->length, "FROMSP", NULL, 0);
-    if (doc_from_sp != NULL) {
-        fprintf(stdout, "\n\nREQUEST FROM SP AS SEEN BY XML:\n");
-        xmlDocDump(stdout, doc_from_sp);
-    } else {
-        fprintf(stderr, "ERROR: Failure parsing document from SP\n");
-        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
-        return GSS_S_FAILURE;
+/*
+ * Find an unqualified attribute in a SAX2 attribute array, which holds
+ * (localname, prefix, URI, value, end) for each. Returns a copy.
+ */
+static int
+getAttribute(int nb_attributes, const xmlChar **attributes,
+             const char *name, char **pValue)
+{
+    int i;
+
+    for (i = 0; i < nb_attributes; i++, attributes += 5) {
+        if (attributes[1] == NULL &&
+            strcmp((const char *)attributes[0], name) == 0) {
+            if (pValue != NULL)
+                *pValue = copyXmlString(attributes[3], attributes[4]);
+            return 1;
+        }
     }
 
-    /* Exclude header */
-    header_from_sp = getElement(xmlDocGetRootElement(doc_from_sp), "Header");
-    if (header_from_sp == NULL) {
-        fprintf(stderr, "ERROR: No Header in SAML Request from SP\n");
-        *minor = GSSEAP_BAD_TOK_HEADER;
-        major = GSS_S_FAILURE;
-        goto cleanup;
-    }
-    xmlUnlinkNode(header_from_sp);
-    fprintf(stdout, "\nSENDING TO IDP:\n");
-    xmlDocDump(stdout, doc_from_sp);
+    return 0;
+}
 
-    /* Send doc to IdP */
-    /* TODO: Error checking here and elsewhere */
-    major = sendToIdP(minor, doc_from_sp, idp, user, password, &response_from_idp);
-    if (major != GSS_S_COMPLETE) {
-        fprintf(stderr, "ERROR: Failure sending SAML Request to IdP\n");
-        goto cleanup;
-    }
+static int
+declaresPrefix(int nb_namespaces, const xmlChar **namespaces,
+               const xmlChar *prefix)
+{
+    int i;
 
-    if (response_from_idp.value == NULL) {
-        fprintf(stderr, "ERROR: No response from IdP\n");
-        *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
-        major = GSS_S_FAILURE;
-        goto cleanup;
+    for (i = 0; i < nb_namespaces; i++) {
+        const xmlChar *p = namespaces[2 * i];
+
+        if (p == prefix ||
+            (p != NULL && prefix != NULL && xmlStrEqual(p, prefix)))
+            return 1;
     }
 
-    fprintf(stdout, "\n\nRECEIVED FROM IDP:\n%s\n", (char *) response_from_idp.value);
+    return 0;
+}
 
-    /* Empty the header from IdP and populate with RelayState from
-     *     header received from SP */
-    doc_from_idp = xmlReadMemory(response_from_idp.value,
-                  response_from_idp.length, "FROMIDP", NULL, 0);
-    if (doc_from_idp == NULL) {
-        fprintf(stderr, "ERROR: No response from IdP\n");
-        *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
-        major = GSS_S_FAILURE;
-        goto cleanup;
-    } else {
-        xmlNode *header_from_idp = NULL;
-        xmlNode *relay_state = NULL;
-        xmlNode *request_from_sp = NULL;
-        xmlNode *response_from_idp = NULL;
-        char *responseConsumerURL = NULL;
-        char *AssertionConsumerServiceURL = NULL;
-
-        fprintf(stdout, "AS SEEN BY XML:\n");
-        xmlDocDump(stdout, doc_from_idp);
-
-        /* Compare responseConsumerURL from original request with
-         * AssertionConsumerServiceURL from response from IdP */
-        request_from_sp = getElement(header_from_sp, "Request");
-        if (request_from_sp == NULL) {
-            fprintf(stderr, "ERROR: No Request element in SAML Request Header from SP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        }
+static int
+appendNsDecl(gss_buffer_t decls, const xmlChar *prefix, const xmlChar *URI)
+{
+    OM_uint32 tmpMinor;
+    const char *s;
+
+    if (prefix != NULL) {
+        if (GSS_ERROR(addToStringBuffer(&tmpMinor, " xmlns:", 7, decls)) ||
+            GSS_ERROR(addToStringBuffer(&tmpMinor, (const char *)prefix,
+                                        strlen((const char *)prefix), decls)))
+            return -1;
+    } else if (GSS_ERROR(addToStringBuffer(&tmpMinor, " xmlns", 6, decls)))
+        return -1;
 
-        responseConsumerURL = xmlGetProp(request_from_sp, "responseConsumerURL");
-        if (responseConsumerURL == NULL) {
-            fprintf(stderr, "ERROR: No responseConsumerURL attribute in SAML Request Header from SP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        }
+    if (GSS_ERROR(addToStringBuffer(&tmpMinor, "=\"", 2, decls)))
+        return -1;
 
-        response_from_idp = getElement(xmlDocGetRootElement(doc_from_idp), "Response");
-        if (response_from_idp == NULL) {
-            fprintf(stderr, "ERROR: No Response element in SAML Response from IdP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        }
+    for (s = (const char *)URI; *s != '\0'; s++) {
+        const char *esc = NULL;
 
-        AssertionConsumerServiceURL = xmlGetProp(response_from_idp, "AssertionConsumerServiceURL");
-        if (AssertionConsumerServiceURL == NULL) {
-            fprintf(stderr, "ERROR: No AssertionConsumerServiceURL attribute in SAML Response from IdP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
+        switch (*s) {
+        case '"': esc = "&quot;"; break;
+        case '&': esc = "&amp;";  break;
+        case '<': esc = "&lt;";   break;
         }
+        if (GSS_ERROR(addToStringBuffer(&tmpMinor, esc ? esc : s,
+                                        esc ? strlen(esc) : 1, decls)))
+            return -1;
+    }
 
-        if(strcmp(responseConsumerURL, AssertionConsumerServiceURL)) {
-            fprintf(stderr, "ERROR: responseConsumerURL (%s) and "
-                    "AssertionConsumerServiceURL (%s) do not match\n",
-                    responseConsumerURL, AssertionConsumerServiceURL);
-            *minor = GSSEAP_PEER_AUTH_FAILURE;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        } else
-            fprintf(stdout, "NOTE: responseConsumerURL (%s) and "
-                    "AssertionConsumerServiceURL (%s) match\n",
-                    responseConsumerURL, AssertionConsumerServiceURL);
-
-        header_from_idp = getElement(xmlDocGetRootElement(doc_from_idp), "Header");
-        if (header_from_idp == NULL) {
-            fprintf(stderr, "ERROR: No Header element in SAML Response from IdP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        }
+    if (GSS_ERROR(addToStringBuffer(&tmpMinor, "\"", 1, decls)))
+        return -1;
 
-        freeChildren(header_from_idp);
-        relay_state = getElement(header_from_sp, "RelayState");
-        if (relay_state == NULL) {
-            fprintf(stderr, "ERROR: No RelayState element in SAML Request from SP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        }
+    return 0;
+}
 
-        if (xmlAddChild(header_from_idp, xmlCopyNode(relay_state, 1)) == NULL) {
-            fprintf(stderr, "ERROR: Failure adding RelayState to Header from IdP\n");
-            *minor = GSSEAP_BAD_TOK_HEADER;
-            major = GSS_S_FAILURE;
-            goto cleanup;
-        }
+/*
+ * The RelayState and SessionKey elements are moved into other documents,
+ * so declare the namespaces they use that they inherited from their
+ * ancestors.
+ */
+static int
+collectInheritedNs(gss_buffer_t decls,
+                   const xmlChar *prefix, const xmlChar *URI,
+                   int nb_namespaces, const xmlChar **namespaces,
+                   int nb_attributes, const xmlChar **attributes)
+{
+    int i, j;
+
+    if (URI != NULL && !declaresPrefix(nb_namespaces, namespaces, prefix) &&
+        appendNsDecl(decls, prefix, URI) != 0)
+        return -1;
 
-        fprintf(stdout, "SENDING TO SP >>>>>>>>>>>>>>>>>>>\n");
-        xmlDocDump(stdout, doc_from_idp);
+    for (i = 0; i < nb_attributes; i++) {
+        const xmlChar **attr = &attributes[5 * i];
+        int seen = (attr[1] == NULL) ||
+                   declaresPrefix(nb_namespaces, namespaces, attr[1]) ||
+                   (prefix != NULL && xmlStrEqual(attr[1], prefix));
 
-        xmlDocDumpMemory(doc_from_idp, (char *)&response->value,
-                  (int *)&response->length);
-        major = GSS_S_COMPLETE;
+        for (j = 0; j < i && !seen; j++)
+            seen = xmlStrEqual(attributes[5 * j + 1], attr[1]);
+        if (!seen && appendNsDecl(decls, attr[1], attr[2]) != 0)
+            return -1;
     }
 
-cleanup:
-    if (doc_from_sp)
-        xmlFreeDoc(doc_from_sp);
+    return 0;
+}
+
+/*
+ * Narrow the reuse window to the NotOnOrAfter attribute of an element,
+ * if it has one.
+ */
+static void
+narrowExpiry(struct gss_eap_ecp_scan *scan,
+             int nb_attributes, const xmlChar **attributes)
+{
+    char *value = NULL;
+    time_t t;
 
-    if (doc_from_idp)
-        xmlFreeDoc(doc_from_idp);
+    if (!getAttribute(nb_attributes, attributes, "NotOnOrAfter", &value))
+        return;
 
-    if (response_from_idp.value)
-        gss_release_buffer(&tmpMinor, &response_from_idp);
+    t = (value != NULL) ? parseSAMLTime(value) : 0;
+    GSSEAP_FREE(value);
 
-    return major;
+    if (t == 0)
+        scan->noReuse = 1;
+    else if (scan->notOnOrAfter == 0 || t < scan->notOnOrAfter)
+        scan->notOnOrAfter = t;
 }
 
-static OM_uint32
-eapGssSmInitAuthenticate(OM_uint32 *minor,
-                         gss_cred_id_t cred GSSEAP_UNUSED,
-                         gss_ctx_id_t ctx,
-                         gss_name_t target GSSEAP_UNUSED,
-                         gss_OID mech GSSEAP_UNUSED,
-                         OM_uint32 reqFlags GSSEAP_UNUSED,
-                         OM_uint32 timeReq GSSEAP_UNUSED,
-                         gss_channel_bindings_t chanBindings GSSEAP_UNUSED,
-                         gss_buffer_t inputToken GSSEAP_UNUSED,
-                         gss_buffer_t outputToken,
-                         OM_uint32 *smFlags)
+/* Note what the IdP has said about reusing its response */
+static void
+scanReusePolicy(struct gss_eap_ecp_scan *scan, const xmlChar *localname,
+                int nb_attributes, const xmlChar **attributes)
 {
-    OM_uint32 major;
-    OM_uint32 tmpMinor;
-    struct wpabuf *resp = NULL;
-    char *saml_response = NULL;
+    const char *name = (const char *)localname;
 
-    *minor = 0;
+    if (strcmp(name, "EncryptedAssertion") == 0 ||
+        strcmp(name, "OneTimeUse") == 0)
+        scan->noReuse = 1;
 
-    GSSEAP_ASSERT(inputToken != GSS_C_NO_BUFFER);
+    if ((strcmp(name, "Response") == 0 ||
+         strcmp(name, "SubjectConfirmationData") == 0) &&
+        getAttribute(nb_attributes, attributes, "InResponseTo", NULL))
+        scan->noReuse = 1;
 
-#ifdef MECH_EAP
-    major = peerConfigInit(minor, ctx);
-    if (GSS_ERROR(major))
-        goto cleanup;
+    if (strcmp(name, "Assertion") == 0)
+        scan->assertions++;
 
-    GSSEAP_ASSERT(ctx->initiatorCtx.eap != NULL);
-    GSSEAP_ASSERT(ctx->flags & CTX_FLAG_EAP_PORT_ENABLED);
+    if (strcmp(name, "Conditions") == 0 ||
+        strcmp(name, "SubjectConfirmationData") == 0)
+        narrowExpiry(scan, nb_attributes, attributes);
+}
 
-    ctx->flags |= CTX_FLAG_EAP_REQ; /* we have a Request from the acceptor */
+static void
+ecpScanStart(void *ctx,
+             const xmlChar *localname,
+             const xmlChar *prefix,
+             const xmlChar *URI,
+             int nb_namespaces,
+             const xmlChar **namespaces,
+             int nb_attributes,
+             int nb_defaulted GSSEAP_UNUSED,
+             const xmlChar **attributes)
+{
+    struct gss_eap_ecp_scan *scan = ctx;
+    struct gss_eap_xml_span span;
+    size_t nameLen;
+    int depth = scan->depth++;
 
-    wpabuf_set(&ctx->initiatorCtx.reqData,
-               inputToken->value, inputToken->length);
+    if (scan->error)
+        return;
 
-    major = GSS_S_CONTINUE_NEEDED;
+    /* Offsets are only meaningful if the input is not being transcoded */
+    if (scan->ctxt->input->buf != NULL &&
+        scan->ctxt->input->buf->encoder != NULL) {
+        scan->error = 1;
+        return;
+    }
 
-    eap_peer_sm_step(ctx->initiatorCtx.eap);
-    if (ctx->flags & CTX_FLAG_EAP_RESP) {
-        ctx->flags &= ~(CTX_FLAG_EAP_RESP);
+    /* The parser stops at the '>' or "/>" closing the start tag */
+    span.tagEnd = scanOffset(scan);
+    span.end = 0;
+    if (span.tagEnd >= scan->length ||
+        (scan->base[span.tagEnd] != '>' && scan->base[span.tagEnd] != '/')) {
+        scan->error = 1;
+        return;
+    }
 
-        resp = eap_get_eapRespData(ctx->initiatorCtx.eap);
-    } else if (ctx->flags & CTX_FLAG_EAP_SUCCESS) {
-        major = initReady(minor, ctx, reqFlags);
-        if (GSS_ERROR(major))
-            goto cleanup;
+    /* A start tag can only contain '<' as its first character */
+    for (span.start = span.tagEnd;
+         span.start > 0 && scan->base[span.start] != '<';
+         span.start--)
+        ;
+    nameLen = (prefix != NULL ? xmlStrlen(prefix) + 1 : 0) + xmlStrlen(localname);
+    if (scan->base[span.start] != '<' || span.start + 1 + nameLen > span.tagEnd) {
+        scan->error = 1;
+        return;
+    }
 
-        ctx->flags &= ~(CTX_FLAG_EAP_SUCCESS);
-        major = GSS_S_CONTINUE_NEEDED;
-        GSSEAP_SM_TRANSITION_NEXT(ctx);
-    } else if (ctx->flags & CTX_FLAG_EAP_FAIL) {
-        major = GSS_S_DEFECTIVE_CREDENTIAL;
-        *minor = GSSEAP_PEER_AUTH_FAILURE;
-    } else {
-        major = GSS_S_DEFECTIVE_TOKEN;
-        *minor = GSSEAP_PEER_BAD_MESSAGE;
+    if (depth == 1 && nameIs(URI, localname, SOAP11_NS, "Header")) {
+        scan->header = span;
+        scan->headerName = copyXmlString((const xmlChar *)&scan->base[span.start + 1],
+                                         (const xmlChar *)&scan->base[span.start + 1 + nameLen]);
+        scan->inHeader = 1;
+        if (scan->headerName == NULL)
+            scan->error = 1;
+    } else if (scan->inHeader) {
+        if (nameIs(URI, localname, PAOS_NS, "Request") &&
+            scan->responseConsumerURL == NULL) {
+            getAttribute(nb_attributes, attributes, "responseConsumerURL",
+                         &scan->responseConsumerURL);
+        } else if (nameIs(URI, localname, ECP_NS, "Response") &&
+                   scan->assertionConsumerServiceURL == NULL) {
+            getAttribute(nb_attributes, attributes, "AssertionConsumerServiceURL",
+                         &scan->assertionConsumerServiceURL);
+        } else if (nameIs(URI, localname, ECP_NS, "RelayState") &&
+                   scan->relayStateDepth == 0) {
+            scan->relayState = span;
+            scan->relayStateDepth = depth;
+            if (collectInheritedNs(&scan->relayStateNs, prefix, URI,
+                                   nb_namespaces, namespaces,
+                                   nb_attributes, attributes) != 0)
+                scan->error = 1;
+        } else if (nameIs(URI, localname, SAMLEC_NS, "SessionKey") &&
+                   scan->sessionKeyDepth == 0 && scan->sessionKey.end == 0) {
+            scan->sessionKey = span;
+            scan->sessionKeyDepth = depth;
+            /* A key generated for us is good for this context only */
+            scan->noReuse = 1;
+            if (collectInheritedNs(&scan->sessionKeyNs, prefix, URI,
+                                   nb_namespaces, namespaces,
+                                   nb_attributes, attributes) != 0)
+                scan->error = 1;
+        } else if (scan->sessionKeyDepth != 0 &&
+                   depth == scan->sessionKeyDepth + 1) {
+            if (nameIs(URI, localname, SAMLEC_NS, "EncType") &&
+                scan->encType.value == NULL)
+                scan->sessionKeyText = &scan->encType;
+            else if (nameIs(URI, localname, SAMLEC_NS, "GeneratedKey") &&
+                     scan->generatedKey.value == NULL)
+                scan->sessionKeyText = &scan->generatedKey;
+        }
+    } else if (nameIs(URI, localname, SAML2_NS, "Issuer") &&
+               scan->issuerDepth == 0 && scan->issuer.value == NULL) {
+        scan->issuerDepth = depth;
     }
 
-cleanup:
-    if (resp != NULL) {
-        OM_uint32 tmpMajor;
-        gss_buffer_desc respBuf;
+    scanReusePolicy(scan, localname, nb_attributes, attributes);
+}
 
-        GSSEAP_ASSERT(major == GSS_S_CONTINUE_NEEDED);
+static void
+ecpScanEnd(void *ctx,
+           const xmlChar *localname GSSEAP_UNUSED,
+           const xmlChar *prefix GSSEAP_UNUSED,
+           const xmlChar *URI GSSEAP_UNUSED)
+{
+    struct gss_eap_ecp_scan *scan = ctx;
+    int depth = --scan->depth;
+    size_t end;
 
-        respBuf.length = wpabuf_len(resp);
-        respBuf.value = (void *)wpabuf_head(resp);
+    if (scan->error)
+        return;
 
-        tmpMajor = duplicateBuffer(&tmpMinor, &respBuf, outputToken);
-        if (GSS_ERROR(tmpMajor)) {
-            major = tmpMajor;
-            *minor = tmpMinor;
-        }
+    /* The parser has just consumed the end tag, or the "/>" */
+    end = scanOffset(scan);
+    if (end == 0 || end > scan->length || scan->base[end - 1] != '>') {
+        scan->error = 1;
+        return;
+    }
 
-        *smFlags |= SM_FLAG_OUTPUT_TOKEN_CRITICAL;
+    if (scan->inHeader && depth == 1) {
+        scan->header.end = end;
+        scan->inHeader = 0;
+    } else if (scan->relayStateDepth != 0 && depth == scan->relayStateDepth &&
+               scan->relayState.end == 0) {
+        scan->relayState.end = end;
+    } else if (scan->sessionKeyDepth != 0 && depth == scan->sessionKeyDepth) {
+        scan->sessionKey.end = end;
+        scan->sessionKeyDepth = 0;
+    } else if (scan->sessionKeyText != NULL &&
+               depth == scan->sessionKeyDepth + 1) {
+        OM_uint32 tmpMinor;
+
+        /* Remember that we have seen it, even if it was empty */
+        if (scan->sessionKeyText->value == NULL &&
+            GSS_ERROR(addToStringBuffer(&tmpMinor, "", 0, scan->sessionKeyText)))
+            scan->error = 1;
+        scan->sessionKeyText = NULL;
+    } else if (scan->issuerDepth != 0 && depth == scan->issuerDepth) {
+        scan->issuerDepth = 0;
+        if (scan->issuer.value == NULL) {
+            OM_uint32 tmpMinor;
+
+            /* Issuer was empty; remember that we have seen it */
+            if (GSS_ERROR(addToStringBuffer(&tmpMinor, "", 0, &scan->issuer)))
+                scan->error = 1;
+        }
     }
+}
 
-    wpabuf_set(&ctx->initiatorCtx.reqData, NULL, 0);
-    peerConfigFree(&tmpMinor, ctx);
+static void
+ecpScanCharacters(void *ctx, const xmlChar *ch, int len)
+{
+    struct gss_eap_ecp_scan *scan = ctx;
+    OM_uint32 tmpMinor;
 
-    GSSEAP_SM_TRANSITION_NEXT(ctx);
-        *smFlags |= SM_FLAG_OUTPUT_TOKEN_CRITICAL;
-#else
-    major = GSS_S_UNAVAILABLE;
-#endif
+    if (scan->issuerDepth != 0 && scan->depth == scan->issuerDepth + 1 &&
+        GSS_ERROR(addToStringBuffer(&tmpMinor, (const char *)ch, len, &scan->issuer)))
+        scan->error = 1;
+
+    if (scan->sessionKeyText != NULL &&
+        scan->depth == scan->sessionKeyDepth + 2 &&
+        GSS_ERROR(addToStringBuffer(&tmpMinor, (const char *)ch, len,
+                                    scan->sessionKeyText)))
+        scan->error = 1;
+}
+
+/* ECP messages have no business with a DTD, and entities would move offsets */
+static void
+ecpScanInternalSubset(void *ctx,
+                      const xmlChar *name GSSEAP_UNUSED,
+                      const xmlChar *ExternalID GSSEAP_UNUSED,
+                      const xmlChar *SystemID GSSEAP_UNUSED)
+{
+    struct gss_eap_ecp_scan *scan = ctx;
+
+    scan->error = 1;
+    xmlStopParser(scan->ctxt);
+}
+
+static void
+releaseECPScan(struct gss_eap_ecp_scan *scan)
+{
+    OM_uint32 tmpMinor;
+
+    GSSEAP_FREE(scan->headerName);
+    GSSEAP_FREE(scan->responseConsumerURL);
+    GSSEAP_FREE(scan->assertionConsumerServiceURL);
+    gss_release_buffer(&tmpMinor, &scan->relayStateNs);
+    gss_release_buffer(&tmpMinor, &scan->sessionKeyNs);
+    gss_release_buffer(&tmpMinor, &scan->issuer);
+    gss_release_buffer(&tmpMinor, &scan->encType);
+    if (scan->generatedKey.value != NULL)
+        OPENSSL_cleanse(scan->generatedKey.value, scan->generatedKey.length);
+    gss_release_buffer(&tmpMinor, &scan->generatedKey);
+    memset(scan, 0, sizeof(*scan));
+}
+
+static OM_uint32
+scanECPMessage(OM_uint32 *minor, gss_buffer_t message,
+               struct gss_eap_ecp_scan *scan)
+{
+    xmlParserCtxtPtr ctxt;
+    int wellFormed;
+
+    memset(scan, 0, sizeof(*scan));
+
+    if (message->value == NULL || message->length == 0 ||
+        message->length > INT_MAX) {
+        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    ctxt = xmlCreateMemoryParserCtxt(message->value, (int)message->length);
+    if (ctxt == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    xmlCtxtUseOptions(ctxt, XML_PARSE_NONET);
+
+    /* Events only; no tree is built */
+    memset(ctxt->sax, 0, sizeof(*ctxt->sax));
+    ctxt->sax->initialized = XML_SAX2_MAGIC;
+    ctxt->sax->internalSubset = ecpScanInternalSubset;
+    ctxt->sax->startElementNs = ecpScanStart;
+    ctxt->sax->endElementNs = ecpScanEnd;
+    ctxt->sax->characters = ecpScanCharacters;
+    ctxt->userData = scan;
+
+    scan->ctxt = ctxt;
+    scan->base = message->value;
+    scan->length = message->length;
+
+    xmlParseDocument(ctxt);
+
+    wellFormed = ctxt->wellFormed;
+    xmlFreeParserCtxt(ctxt);
+    scan->ctxt = NULL;
+
+    if (!wellFormed || scan->error) {
+        releaseECPScan(scan);
+        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static OM_uint32
+appendSpan(OM_uint32 *minor, const char *base, size_t start, size_t end,
+           gss_buffer_t buffer)
+{
+    GSSEAP_ASSERT(start <= end);
+
+    return addToStringBuffer(minor, base + start, end - start, buffer);
+}
+
+/*
+ * Copy an element out of its document: "<" and the element name, the
+ * namespaces it inherited, then the rest of it.
+ */
+static OM_uint32
+appendElement(OM_uint32 *minor, const char *base,
+              const struct gss_eap_xml_span *span, gss_buffer_t nsDecls,
+              gss_buffer_t buffer)
+{
+    size_t nameLen;
+    OM_uint32 major;
+
+    nameLen = strcspn(base + span->start + 1, " \t\r\n/>");
+    major = appendSpan(minor, base, span->start,
+                       span->start + 1 + nameLen, buffer);
+    if (GSS_ERROR(major))
+        return major;
+    if (nsDecls->length != 0) {
+        major = addToStringBuffer(minor, nsDecls->value, nsDecls->length,
+                                  buffer);
+        if (GSS_ERROR(major))
+            return major;
+    }
+
+    return appendSpan(minor, base, span->start + 1 + nameLen,
+                      span->end, buffer);
+}
+
+/*
+ * Copy a scanned message, with the contents of its SOAP header replaced
+ * by contents.
+ */
+static OM_uint32
+appendWithHeader(OM_uint32 *minor, struct gss_eap_ecp_scan *scan,
+                 gss_buffer_t contents, gss_buffer_t buffer)
+{
+    OM_uint32 major;
+
+    /* Everything up to the header's start tag, less any "/>" ... */
+    major = appendSpan(minor, scan->base, 0, scan->header.tagEnd, buffer);
+    if (GSS_ERROR(major))
+        return major;
+    /* ... the new contents ... */
+    major = addToStringBuffer(minor, ">", 1, buffer);
+    if (GSS_ERROR(major))
+        return major;
+    major = addToStringBuffer(minor, contents->value, contents->length, buffer);
+    if (GSS_ERROR(major))
+        return major;
+    major = addToStringBuffer(minor, "</", 2, buffer);
+    if (GSS_ERROR(major))
+        return major;
+    major = addToStringBuffer(minor, scan->headerName,
+                              strlen(scan->headerName), buffer);
+    if (GSS_ERROR(major))
+        return major;
+    major = addToStringBuffer(minor, ">", 1, buffer);
+    if (GSS_ERROR(major))
+        return major;
+    /* ... and everything after the header, byte for byte */
+    return appendSpan(minor, scan->base, scan->header.end, scan->length, buffer);
+}
+
+static void
+releaseECPRequest(struct gss_eap_ecp_request *ecp)
+{
+    OM_uint32 tmpMinor;
+
+    GSSEAP_FREE(ecp->responseConsumerURL);
+    GSSEAP_FREE(ecp->issuer);
+    gss_release_buffer(&tmpMinor, &ecp->relayState);
+    gss_release_buffer(&tmpMinor, &ecp->sessionKey);
+    gss_release_buffer(&tmpMinor, &ecp->body);
+    memset(ecp, 0, sizeof(*ecp));
+}
+
+static OM_uint32
+sendToIdP(OM_uint32 *minor, gss_buffer_t body, const char *idp,
+          const char *user, const char *password, gss_buffer_t response)
+{
+    fprintf(stdout, "DOING HTTP POST to IdP (%s) using Basic Auth user"
+                    " (%s)\n", idp, user);
+
+    return gssEapHttpPost(minor, idp, user, password,
+                          body->value, body->length, response);
+}
+
+/*
+ * Scan the request from the SP, keeping what is needed to relay the
+ * IdP's response, and cut out its header, which is not for the IdP
+ * except for any samlec:SessionKey block.
+ */
+static OM_uint32
+prepareSAMLRequest(OM_uint32 *minor, gss_buffer_t request,
+                   struct gss_eap_ecp_request *ecp)
+{
+    struct gss_eap_ecp_scan scan;
+    const char *base = request->value;
+    OM_uint32 major;
+
+    memset(ecp, 0, sizeof(*ecp));
+
+    major = scanECPMessage(minor, request, &scan);
+    if (GSS_ERROR(major)) {
+        fprintf(stderr, "ERROR: Failure parsing document from SP\n");
+        return major;
+    }
+
+    if (scan.header.end == 0) {
+        fprintf(stderr, "ERROR: No Header in SAML Request from SP\n");
+        *minor = GSSEAP_BAD_TOK_HEADER;
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    }
+
+    if (scan.responseConsumerURL == NULL) {
+        fprintf(stderr, "ERROR: No responseConsumerURL attribute in SAML Request Header from SP\n");
+        *minor = GSSEAP_BAD_TOK_HEADER;
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    }
+
+    if (scan.relayState.end == 0) {
+        fprintf(stderr, "ERROR: No RelayState element in SAML Request from SP\n");
+        *minor = GSSEAP_BAD_TOK_HEADER;
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    }
+
+    if (scan.sessionKey.end != 0) {
+        /* The envelope with only the SessionKey in its header */
+        major = appendElement(minor, base, &scan.sessionKey,
+                              &scan.sessionKeyNs, &ecp->sessionKey);
+        if (GSS_ERROR(major))
+            goto cleanup;
+        major = appendWithHeader(minor, &scan, &ecp->sessionKey, &ecp->body);
+        if (GSS_ERROR(major))
+            goto cleanup;
+    } else {
+        /* The envelope less its header */
+        major = appendSpan(minor, base, 0, scan.header.start, &ecp->body);
+        if (GSS_ERROR(major))
+            goto cleanup;
+        major = appendSpan(minor, base, scan.header.end, request->length, &ecp->body);
+        if (GSS_ERROR(major))
+            goto cleanup;
+    }
+
+    major = appendElement(minor, base, &scan.relayState,
+                          &scan.relayStateNs, &ecp->relayState);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    ecp->responseConsumerURL = scan.responseConsumerURL;
+    scan.responseConsumerURL = NULL;
+    ecp->issuer = scan.issuer.value;
+    scan.issuer.value = NULL;
+    scan.issuer.length = 0;
+
+cleanup:
+    releaseECPScan(&scan);
+    if (GSS_ERROR(major))
+        releaseECPRequest(ecp);
+
+    return major;
+}
+
+/*
+ * Work out until when the IdP's response may be relayed again: only if
+ * it has assertions, none is bound to a request (InResponseTo) or marked
+ * OneTimeUse, and at least one NotOnOrAfter bounds them. Returns 0 if it
+ * may not be reused.
+ */
+static time_t
+assertionReuseTime(struct gss_eap_ecp_scan *scan)
+{
+    if (scan->noReuse || scan->assertions == 0 ||
+        scan->notOnOrAfter <= GSSEAP_ASSERTION_CACHE_SKEW)
+        return 0;
+
+    return scan->notOnOrAfter - GSSEAP_ASSERTION_CACHE_SKEW;
+}
+
+/*
+ * Take the key the IdP generated from the samlec:SessionKey block in its
+ * response header. The SP gets its copy from the (encrypted) assertion.
+ */
+static OM_uint32
+parseSessionKey(OM_uint32 *minor, struct gss_eap_ecp_scan *scan,
+                struct gss_eap_session_key *sessionKey)
+{
+    char encoded[4 * ((RFC3961_KEY_MAX + 2) / 3) + 1];
+    unsigned char decoded[3 * (sizeof(encoded) / 4)];
+    const char *p;
+    size_t i;
+    ssize_t len;
+
+    sessionKey->enctype = ENCTYPE_NULL;
+    sessionKey->length = 0;
+
+    if (scan->generatedKey.value == NULL) {
+        *minor = 0;
+        return GSS_S_COMPLETE;
+    }
+
+    if (scan->encType.value == NULL)
+        goto bad;
+
+    /* The key may be wrapped, or indented like the rest of the message */
+    for (i = 0, p = scan->generatedKey.value; *p != '\0'; p++) {
+        if (isspace((unsigned char)*p))
+            continue;
+        if (i == sizeof(encoded) - 1)
+            goto bad;
+        encoded[i++] = *p;
+    }
+    encoded[i] = '\0';
+
+    if (i == 0 || (i % 4) != 0 || !base64Valid(encoded))
+        goto bad;
+
+    len = base64Decode(encoded, decoded);
+    if (len <= 0 || (size_t)len > sizeof(sessionKey->key))
+        goto bad;
+
+    sessionKey->enctype = gssEapEnctypeFromString(scan->encType.value);
+    if (sessionKey->enctype == ENCTYPE_NULL) {
+        fprintf(stderr, "ERROR: IdP chose unsupported session key type %s\n",
+                (char *)scan->encType.value);
+        OPENSSL_cleanse(encoded, sizeof(encoded));
+        OPENSSL_cleanse(decoded, sizeof(decoded));
+        *minor = GSSEAP_BAD_ENCTYPE;
+        return GSS_S_FAILURE;
+    }
+
+    memcpy(sessionKey->key, decoded, len);
+    sessionKey->length = len;
+
+    OPENSSL_cleanse(encoded, sizeof(encoded));
+    OPENSSL_cleanse(decoded, sizeof(decoded));
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+
+bad:
+    fprintf(stderr, "ERROR: Malformed SessionKey in SAML Response from IdP\n");
+    OPENSSL_cleanse(encoded, sizeof(encoded));
+    OPENSSL_cleanse(decoded, sizeof(decoded));
+    *minor = GSSEAP_BAD_SESSION_KEY;
+    return GSS_S_FAILURE;
+}
+
+/*
+ * Check the IdP's response against the SP's request, and replace the
+ * contents of its header with the SP's RelayState, producing the token
+ * for the SP.
+ */
+static OM_uint32
+relayIdPResponse(OM_uint32 *minor, struct gss_eap_ecp_request *ecp,
+                 gss_buffer_t idp_response, gss_buffer_t response,
+                 time_t *pReuseUntil, struct gss_eap_session_key *sessionKey)
+{
+    struct gss_eap_ecp_scan scan;
+    gss_buffer_desc token = GSS_C_EMPTY_BUFFER;
+    OM_uint32 major, tmpMinor;
+
+    if (idp_response->value == NULL) {
+        fprintf(stderr, "ERROR: No response from IdP\n");
+        *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
+        return GSS_S_FAILURE;
+    }
+
+    major = scanECPMessage(minor, idp_response, &scan);
+    if (GSS_ERROR(major)) {
+        fprintf(stderr, "ERROR: No response from IdP\n");
+        *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
+        return GSS_S_FAILURE;
+    }
+
+    /* Compare responseConsumerURL from original request with
+     * AssertionConsumerServiceURL from response from IdP */
+    if (scan.assertionConsumerServiceURL == NULL) {
+        fprintf(stderr, "ERROR: No AssertionConsumerServiceURL attribute in SAML Response from IdP\n");
+        *minor = GSSEAP_BAD_TOK_HEADER;
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    }
+
+    if (strcmp(ecp->responseConsumerURL, scan.assertionConsumerServiceURL)) {
+        fprintf(stderr, "ERROR: responseConsumerURL (%s) and "
+                "AssertionConsumerServiceURL (%s) do not match\n",
+                ecp->responseConsumerURL, scan.assertionConsumerServiceURL);
+        *minor = GSSEAP_PEER_AUTH_FAILURE;
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    } else
+        fprintf(stdout, "NOTE: responseConsumerURL (%s) and "
+                "AssertionConsumerServiceURL (%s) match\n",
+                ecp->responseConsumerURL, scan.assertionConsumerServiceURL);
+
+    if (scan.header.end == 0) {
+        fprintf(stderr, "ERROR: No Header element in SAML Response from IdP\n");
+        *minor = GSSEAP_BAD_TOK_HEADER;
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    }
+
+    major = parseSessionKey(minor, &scan, sessionKey);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    /* The SP's RelayState in place of the header's contents */
+    major = appendWithHeader(minor, &scan, &ecp->relayState, &token);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    if (pReuseUntil != NULL)
+        *pReuseUntil = assertionReuseTime(&scan);
+
+    *response = token;
+    token.length = 0;
+    token.value = NULL;
+
+    major = GSS_S_COMPLETE;
+    *minor = 0;
+
+cleanup:
+    releaseECPScan(&scan);
+    gss_release_buffer(&tmpMinor, &token);
+
+    return major;
+}
+
+/*
+ * Key the cache by IdP URL, the Issuer of the SP's AuthnRequest and the
+ * responseConsumerURL from the SP's PAOS header.
+ */
+static char *
+assertionCacheKey(const char *idp, struct gss_eap_ecp_request *ecp)
+{
+    char *key;
+    size_t len;
+
+    if (ecp->issuer == NULL)
+        return NULL;
+
+    len = strlen(idp) + strlen(ecp->issuer) + strlen(ecp->responseConsumerURL) + 3;
+    key = GSSEAP_MALLOC(len);
+    if (key != NULL)
+        snprintf(key, len, "%s\n%s\n%s", idp, ecp->issuer, ecp->responseConsumerURL);
+
+    return key;
+}
+
+static int
+assertionCacheLookup(struct gss_eap_assertion_cache *cache,
+                     const char *key,
+                     gss_buffer_t response)
+{
+    OM_uint32 tmpMinor;
+    time_t now = time(NULL);
+    unsigned int i;
+    int found = 0;
+
+    GSSEAP_MUTEX_LOCK(&cache->mutex);
+    for (i = 0; i < cache->count; ) {
+        struct gss_eap_assertion_entry *entry = &cache->entries[i];
+
+        if (entry->expiryTime <= now) {
+            releaseAssertionEntry(entry);
+            *entry = cache->entries[--cache->count];
+            memset(&cache->entries[cache->count], 0, sizeof(*entry));
+            continue;
+        }
+        if (!found && strcmp(entry->key, key) == 0) {
+            found = !GSS_ERROR(duplicateBuffer(&tmpMinor, &entry->response,
+                                               response));
+        }
+        i++;
+    }
+    GSSEAP_MUTEX_UNLOCK(&cache->mutex);
+
+    return found;
+}
+
+static void
+assertionCacheStore(struct gss_eap_assertion_cache *cache,
+                    const char *key,
+                    gss_buffer_t response,
+                    time_t expiryTime)
+{
+    OM_uint32 tmpMinor;
+    struct gss_eap_assertion_entry entry, *slot = NULL;
+    unsigned int i;
+
+    if (expiryTime <= time(NULL))
+        return;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.key = GSSEAP_MALLOC(strlen(key) + 1);
+    if (entry.key == NULL ||
+        GSS_ERROR(duplicateBuffer(&tmpMinor, response, &entry.response))) {
+        releaseAssertionEntry(&entry);
+        return;
+    }
+    strcpy(entry.key, key);
+    entry.expiryTime = expiryTime;
+
+    GSSEAP_MUTEX_LOCK(&cache->mutex);
+    for (i = 0; i < cache->count; i++) {
+        if (strcmp(cache->entries[i].key, key) == 0) {
+            slot = &cache->entries[i];
+            break;
+        }
+    }
+    if (slot == NULL && cache->count < GSSEAP_ASSERTION_CACHE_MAX)
+        slot = &cache->entries[cache->count++];
+    if (slot == NULL) {
+        /* Evict whichever entry would expire first */
+        slot = &cache->entries[0];
+        for (i = 1; i < cache->count; i++) {
+            if (cache->entries[i].expiryTime < slot->expiryTime)
+                slot = &cache->entries[i];
+        }
+    }
+    releaseAssertionEntry(slot);
+    *slot = entry;
+    GSSEAP_MUTEX_UNLOCK(&cache->mutex);
+}
+
+OM_uint32
+processSAMLRequest(OM_uint32 *minor, struct gss_eap_assertion_cache *cache,
+                 const char *user, const char *password,
+                 gss_buffer_t request, gss_buffer_t response,
+                 struct gss_eap_session_key *sessionKey)
+{
+    char *idp = getenv(SAML_EC_IDP);
+    struct gss_eap_ecp_request ecp;
+    gss_buffer_desc response_from_idp = {0, NULL};
+    char *cacheKey = NULL;
+    time_t reuseUntil = 0;
+    OM_uint32 major;
+    OM_uint32 tmpMinor = 0;
+
+    major = checkSAMLRequestParams(minor, idp, user);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = prepareSAMLRequest(minor, request, &ecp);
+    if (GSS_ERROR(major))
+        return major;
+
+    if (cache != NULL) {
+        cacheKey = assertionCacheKey(idp, &ecp);
+        if (cacheKey != NULL &&
+            assertionCacheLookup(cache, cacheKey, &response_from_idp)) {
+            fprintf(stdout, "REUSING CACHED RESPONSE FROM IdP (%s)\n", idp);
+            major = relayIdPResponse(minor, &ecp,
+                                     &response_from_idp, response, NULL,
+                                     sessionKey);
+            goto cleanup;
+        }
+    }
+
+    /* Send doc to IdP */
+    /* TODO: Error checking here and elsewhere */
+    major = sendToIdP(minor, &ecp.body, idp, user, password, &response_from_idp);
+    if (major != GSS_S_COMPLETE) {
+        fprintf(stderr, "ERROR: Failure sending SAML Request to IdP\n");
+        goto cleanup;
+    }
+
+    major = relayIdPResponse(minor, &ecp, &response_from_idp, response,
+                             cacheKey != NULL ? &reuseUntil : NULL,
+                             sessionKey);
+    if (major == GSS_S_COMPLETE && reuseUntil != 0)
+        assertionCacheStore(cache, cacheKey, &response_from_idp, reuseUntil);
+
+cleanup:
+    releaseECPRequest(&ecp);
+    GSSEAP_FREE(cacheKey);
+
+    if (response_from_idp.value)
+        gss_release_buffer(&tmpMinor, &response_from_idp);
+
+    return major;
+}
+
+/*
+ * State of a SAML request whose IdP round trip is being driven by the
+ * caller's event loop (GSS_EAP_ASYNC_IDP_FLAG).
+ */
+struct gss_eap_saml_pending {
+    struct gss_eap_ecp_request ecp;
+    char *cacheKey;
+    struct gss_eap_http_request *request;
+};
+
+void
+gssEapReleaseSamlPending(struct gss_eap_saml_pending *pending)
+{
+    if (pending == NULL)
+        return;
+
+    gssEapHttpRequestFree(pending->request);
+    releaseECPRequest(&pending->ecp);
+    GSSEAP_FREE(pending->cacheKey);
+    GSSEAP_FREE(pending);
+}
+
+struct gss_eap_http_request *
+gssEapPendingIdPRequest(gss_ctx_id_t ctx)
+{
+    struct gss_eap_saml_pending *pending = ctx->initiatorCtx.samlPending;
+
+    return pending != NULL ? pending->request : NULL;
+}
+
+/*
+ * Make what progress we can on a pending request without blocking. While
+ * it is in flight, return GSS_S_CONTINUE_NEEDED with an empty token.
+ */
+static OM_uint32
+continueSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx,
+                    struct gss_eap_assertion_cache *cache,
+                    gss_buffer_t response,
+                    struct gss_eap_session_key *sessionKey)
+{
+    struct gss_eap_saml_pending *pending = ctx->initiatorCtx.samlPending;
+    gss_buffer_desc response_from_idp = {0, NULL};
+    time_t reuseUntil = 0;
+    OM_uint32 major, tmpMinor;
+
+    GSSEAP_ASSERT(pending != NULL);
+
+    major = gssEapHttpRequestStep(minor, pending->request, &response_from_idp);
+    if (major == GSS_S_CONTINUE_NEEDED) {
+        response->length = 0;
+        response->value = NULL;
+        *minor = GSSEAP_IDP_REQUEST_PENDING;
+        return major;
+    }
+
+    if (major == GSS_S_COMPLETE) {
+        major = relayIdPResponse(minor, &pending->ecp, &response_from_idp, response,
+                                 (cache != NULL && pending->cacheKey != NULL) ? &reuseUntil : NULL,
+                                 sessionKey);
+        if (major == GSS_S_COMPLETE && reuseUntil != 0)
+            assertionCacheStore(cache, pending->cacheKey, &response_from_idp, reuseUntil);
+    } else
+        fprintf(stderr, "ERROR: Failure sending SAML Request to IdP\n");
+
+    ctx->initiatorCtx.samlPending = NULL;
+    gssEapReleaseSamlPending(pending);
+
+    if (response_from_idp.value)
+        gss_release_buffer(&tmpMinor, &response_from_idp);
+
+    return major;
+}
+
+static OM_uint32
+startSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx,
+                 struct gss_eap_assertion_cache *cache,
+                 const char *user, const char *password,
+                 gss_buffer_t request, gss_buffer_t response,
+                 struct gss_eap_session_key *sessionKey)
+{
+    char *idp = getenv(SAML_EC_IDP);
+    struct gss_eap_saml_pending *pending;
+    OM_uint32 major;
+
+    GSSEAP_ASSERT(ctx->initiatorCtx.samlPending == NULL);
+
+    major = checkSAMLRequestParams(minor, idp, user);
+    if (GSS_ERROR(major))
+        return major;
+
+    pending = GSSEAP_CALLOC(1, sizeof(*pending));
+    if (pending == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    major = prepareSAMLRequest(minor, request, &pending->ecp);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    if (cache != NULL) {
+        gss_buffer_desc response_from_idp = GSS_C_EMPTY_BUFFER;
+        OM_uint32 tmpMinor;
+
+        pending->cacheKey = assertionCacheKey(idp, &pending->ecp);
+        if (pending->cacheKey != NULL &&
+            assertionCacheLookup(cache, pending->cacheKey, &response_from_idp)) {
+            fprintf(stdout, "REUSING CACHED RESPONSE FROM IdP (%s)\n", idp);
+            major = relayIdPResponse(minor, &pending->ecp,
+                                     &response_from_idp, response, NULL,
+                                     sessionKey);
+            gss_release_buffer(&tmpMinor, &response_from_idp);
+            goto cleanup;
+        }
+    }
+
+    fprintf(stdout, "STARTING HTTP POST to IdP (%s) using Basic Auth user"
+                    " (%s)\n", idp, user);
+
+    major = gssEapHttpPostStart(minor, idp, user, password,
+                                pending->ecp.body.value, pending->ecp.body.length,
+                                &pending->request);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    ctx->initiatorCtx.samlPending = pending;
+    pending = NULL;
+
+    major = continueSAMLRequest(minor, ctx, cache, response, sessionKey);
+
+cleanup:
+    gssEapReleaseSamlPending(pending);
+
+    return major;
+}
+
+/*
+ * Copy the user name and password out of the credential, so that the
+ * credential need not stay locked while we talk to the IdP.
+ */
+static OM_uint32
+snapshotCredentials(OM_uint32 *minor, gss_cred_id_t cred,
+                    char **pUser, char **pPassword)
+{
+    OM_uint32 major;
+
+    *pUser = NULL;
+    *pPassword = NULL;
+
+    if (cred->name != GSS_C_NO_NAME && cred->name->username.value != NULL) {
+        major = bufferToString(minor, &cred->name->username, pUser);
+        if (GSS_ERROR(major))
+            return major;
+    }
+
+    if (cred->password.value != NULL) {
+        major = bufferToString(minor, &cred->password, pPassword);
+        if (GSS_ERROR(major)) {
+            GSSEAP_FREE(*pUser);
+            *pUser = NULL;
+            return major;
+        }
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static void
+releaseCredentials(char *user, char *password)
+{
+    if (password != NULL) {
+        memset(password, 0, strlen(password));
+        GSSEAP_FREE(password);
+    }
+    if (user != NULL)
+        GSSEAP_FREE(user);
+}
+
+static OM_uint32
+eapGssSmInitAuthenticate(OM_uint32 *minor,
+                         gss_cred_id_t cred GSSEAP_UNUSED,
+                         gss_ctx_id_t ctx,
+                         gss_name_t target GSSEAP_UNUSED,
+                         gss_OID mech GSSEAP_UNUSED,
+                         OM_uint32 reqFlags GSSEAP_UNUSED,
+                         OM_uint32 timeReq GSSEAP_UNUSED,
+                         gss_channel_bindings_t chanBindings GSSEAP_UNUSED,
+                         gss_buffer_t inputToken GSSEAP_UNUSED,
+                         gss_buffer_t outputToken,
+                         OM_uint32 *smFlags)
+{
+    OM_uint32 major;
+    OM_uint32 tmpMinor;
+    struct wpabuf *resp = NULL;
+    char *saml_response = NULL;
+
+    *minor = 0;
+
+    GSSEAP_ASSERT(inputToken != GSS_C_NO_BUFFER);
+
+#ifdef MECH_EAP
+    major = peerConfigInit(minor, ctx);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    GSSEAP_ASSERT(ctx->initiatorCtx.eap != NULL);
+    GSSEAP_ASSERT(ctx->flags & CTX_FLAG_EAP_PORT_ENABLED);
+
+    ctx->flags |= CTX_FLAG_EAP_REQ; /* we have a Request from the acceptor */
+
+    wpabuf_set(&ctx->initiatorCtx.reqData,
+               inputToken->value, inputToken->length);
+
+    major = GSS_S_CONTINUE_NEEDED;
+
+    eap_peer_sm_step(ctx->initiatorCtx.eap);
+    if (ctx->flags & CTX_FLAG_EAP_RESP) {
+        ctx->flags &= ~(CTX_FLAG_EAP_RESP);
+
+        resp = eap_get_eapRespData(ctx->initiatorCtx.eap);
+    } else if (ctx->flags & CTX_FLAG_EAP_SUCCESS) {
+        major = initReady(minor, ctx, reqFlags);
+        if (GSS_ERROR(major))
+            goto cleanup;
+
+        ctx->flags &= ~(CTX_FLAG_EAP_SUCCESS);
+        major = GSS_S_CONTINUE_NEEDED;
+        GSSEAP_SM_TRANSITION_NEXT(ctx);
+    } else if (ctx->flags & CTX_FLAG_EAP_FAIL) {
+        major = GSS_S_DEFECTIVE_CREDENTIAL;
+        *minor = GSSEAP_PEER_AUTH_FAILURE;
+    } else {
+        major = GSS_S_DEFECTIVE_TOKEN;
+        *minor = GSSEAP_PEER_BAD_MESSAGE;
+    }
+
+cleanup:
+    if (resp != NULL) {
+        OM_uint32 tmpMajor;
+        gss_buffer_desc respBuf;
+
+        GSSEAP_ASSERT(major == GSS_S_CONTINUE_NEEDED);
+
+        respBuf.length = wpabuf_len(resp);
+        respBuf.value = (void *)wpabuf_head(resp);
+
+        tmpMajor = duplicateBuffer(&tmpMinor, &respBuf, outputToken);
+        if (GSS_ERROR(tmpMajor)) {
+            major = tmpMajor;
+            *minor = tmpMinor;
+        }
+
+        *smFlags |= SM_FLAG_OUTPUT_TOKEN_CRITICAL;
+    }
+
+    wpabuf_set(&ctx->initiatorCtx.reqData, NULL, 0);
+    peerConfigFree(&tmpMinor, ctx);
+
+    GSSEAP_SM_TRANSITION_NEXT(ctx);
+        *smFlags |= SM_FLAG_OUTPUT_TOKEN_CRITICAL;
+#else
+    major = GSS_S_UNAVAILABLE;
+#endif
 
     return major;
 }
@@ -1127,6 +2144,9 @@ gssEapInitSecContext(OM_uint32 *minor,
 {
     OM_uint32 major, tmpMinor;
     int initialContextToken = (ctx->mechanismUsed == GSS_C_NO_OID);
+#ifndef MECH_EAP
+    struct gss_eap_session_key sessionKey;
+#endif
 
     /*
      * XXX is acquiring the credential lock here necessary? The password is
@@ -1174,6 +2194,8 @@ gssEapInitSecContext(OM_uint32 *minor,
                          eapGssInitiatorSm,
                          sizeof(eapGssInitiatorSm) / sizeof(eapGssInitiatorSm[0]));
 #else
+    memset(&sessionKey, 0, sizeof(sessionKey));
+
     if (initialContextToken) {
         gss_buffer_desc innerToken = GSS_C_EMPTY_BUFFER;
 
@@ -1181,13 +2203,63 @@ gssEapInitSecContext(OM_uint32 *minor,
                    output_token);
         if (major == GSS_S_COMPLETE)
             major = GSS_S_CONTINUE_NEEDED;
+    } else if (ctx->initiatorCtx.samlPending != NULL) {
+        major = continueSAMLRequest(minor, ctx, cred->assertionCache,
+                                    output_token, &sessionKey);
+        if (GSS_ERROR(major)) {
+            fprintf(stderr, "ERROR: SOAP FAULT RESPONSE BEING SENT>>>>>>>>>>>>>>>\n");
+            makeStringBuffer(&tmpMinor, SOAP_FAULT_MSG, output_token);
+        }
     } else {
-        major = processSAMLRequest(minor, cred, input_token, output_token);
-        if (major != GSS_S_COMPLETE) {
+        char *user = NULL, *password = NULL;
+        int async = ((cred->flags & GSS_EAP_ASYNC_IDP_FLAG) != 0);
+
+        if ((cred->flags & GSS_EAP_CACHE_IDP_FLAG) &&
+            cred->assertionCache == NULL) {
+            major = gssEapCreateAssertionCache(minor, &cred->assertionCache);
+            if (GSS_ERROR(major))
+                goto cleanup;
+        }
+
+        major = snapshotCredentials(minor, cred, &user, &password);
+        if (GSS_ERROR(major))
+            goto cleanup;
+
+        /*
+         * The IdP round trip can take seconds, so don't serialise other
+         * initiators using this credential behind it. The caller still
+         * holds the context lock, which keeps ctx->cred alive.
+         */
+        GSSEAP_MUTEX_UNLOCK(&ctx->cred->mutex);
+        GSSEAP_MUTEX_UNLOCK(&cred->mutex);
+
+        if (async)
+            major = startSAMLRequest(minor, ctx, cred->assertionCache,
+                                     user, password,
+                                     input_token, output_token,
+                                     &sessionKey);
+        else
+            major = processSAMLRequest(minor, cred->assertionCache,
+                                       user, password,
+                                       input_token, output_token,
+                                       &sessionKey);
+
+        GSSEAP_MUTEX_LOCK(&cred->mutex);
+        GSSEAP_MUTEX_LOCK(&ctx->cred->mutex);
+
+        releaseCredentials(user, password);
+
+        if (GSS_ERROR(major)) {
             fprintf(stderr, "ERROR: SOAP FAULT RESPONSE BEING SENT>>>>>>>>>>>>>>>\n");
             makeStringBuffer(&tmpMinor, SOAP_FAULT_MSG, output_token);
         }
     }
+
+    /* The SP has nothing more to say once it has the IdP's response */
+    if (major == GSS_S_COMPLETE)
+        major = gssEapSamlContextReady(minor, ctx, sessionKey.enctype,
+                                       sessionKey.key, sessionKey.length);
+    OPENSSL_cleanse(&sessionKey, sizeof(sessionKey));
 #endif
     if (GSS_ERROR(major))
         goto cleanup;
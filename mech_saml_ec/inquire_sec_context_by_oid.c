@@ -96,6 +96,60 @@ inquireNegoExKey(OM_uint32 *minor,
     return major;
 }
 
+static OM_uint32
+inquireIdPPollSet(OM_uint32 *minor,
+                  const gss_ctx_id_t ctx,
+                  const gss_OID desired_object GSSEAP_UNUSED,
+                  gss_buffer_set_t *dataSet)
+{
+    OM_uint32 major, tmpMinor;
+    struct gss_eap_http_request *request;
+    struct gss_eap_http_pollfd *fds = NULL;
+    unsigned char buf[8];
+    gss_buffer_desc element;
+    unsigned int i, count;
+    long timeout;
+
+    request = CTX_IS_INITIATOR(ctx) ? gssEapPendingIdPRequest(ctx) : NULL;
+    if (request == NULL) {
+        *minor = GSSEAP_NO_IDP_REQUEST;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    major = gssEapHttpRequestPollSet(minor, request, &timeout, &fds, &count);
+    if (GSS_ERROR(major))
+        return major;
+
+    element.length = 4;
+    element.value = buf;
+    store_uint32_be(timeout < 0 ? 0xFFFFFFFF : (uint32_t)timeout, buf);
+
+    major = gss_add_buffer_set_member(minor, &element, dataSet);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    for (i = 0; i < count; i++) {
+        element.length = 8;
+        store_uint32_be((uint32_t)fds[i].fd, &buf[0]);
+        store_uint32_be(((fds[i].events & GSSEAP_HTTP_POLL_IN) ? GSS_EAP_POLL_IN : 0) |
+                        ((fds[i].events & GSSEAP_HTTP_POLL_OUT) ? GSS_EAP_POLL_OUT : 0),
+                        &buf[4]);
+
+        major = gss_add_buffer_set_member(minor, &element, dataSet);
+        if (GSS_ERROR(major))
+            goto cleanup;
+    }
+
+    *minor = 0;
+
+cleanup:
+    if (GSS_ERROR(major))
+        gss_release_buffer_set(&tmpMinor, dataSet);
+    GSSEAP_FREE(fds);
+
+    return major;
+}
+
 static struct {
     gss_OID_desc oid;
     OM_uint32 (*inquire)(OM_uint32 *, const gss_ctx_id_t,
@@ -116,8 +170,15 @@ static struct {
         { 11, "\x2a\x86\x48\x86\xf7\x12\x01\x02\x02\x05\x07" },
         inquireNegoExKey
     },
+    {
+        /* 1.3.6.1.4.1.5322.22.3.4.1 */
+        { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x04\x01" },
+        inquireIdPPollSet
+    },
 };
 
+gss_OID GSS_EAP_INQ_IDP_POLL_SET = &inquireCtxOps[3].oid;
+
 OM_uint32 GSSAPI_CALLCONV
 gss_inquire_sec_context_by_oid(OM_uint32 *minor,
                                const gss_ctx_id_t ctx,
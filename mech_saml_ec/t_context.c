@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Established contexts for tests and benchmarks of the per-message
+ * services.
+ */
+
+#include "gssapiP_eap.h"
+
+#include "t_context.h"
+
+gss_ctx_id_t
+testMakeContext(int enctype, const unsigned char *keyData,
+                size_t keyLength, int initiator)
+{
+    OM_uint32 major, minor;
+    gss_ctx_id_t ctx;
+
+    ctx = GSSEAP_CALLOC(1, sizeof(*ctx));
+    if (ctx == NULL)
+        return GSS_C_NO_CONTEXT;
+
+    if (GSSEAP_MUTEX_INIT(&ctx->mutex) != 0) {
+        GSSEAP_FREE(ctx);
+        return GSS_C_NO_CONTEXT;
+    }
+    if (GSSEAP_MUTEX_INIT(&ctx->seqMutex) != 0) {
+        GSSEAP_MUTEX_DESTROY(&ctx->mutex);
+        GSSEAP_FREE(ctx);
+        return GSS_C_NO_CONTEXT;
+    }
+
+    ctx->state = GSSEAP_STATE_ESTABLISHED;
+    ctx->flags = initiator ? CTX_FLAG_INITIATOR : 0;
+    ctx->gssFlags = GSS_C_INTEG_FLAG | GSS_C_CONF_FLAG |
+                    GSS_C_SEQUENCE_FLAG | GSS_C_REPLAY_FLAG;
+
+    major = gssEapMakeRfc3961Key(&minor, enctype, keyData, keyLength,
+                                 &ctx->rfc3961Key);
+    if (!GSS_ERROR(major))
+        major = sequenceInit(&minor, &ctx->seqState, 0, 1, 1, 1);
+    if (GSS_ERROR(major)) {
+        testReleaseContext(ctx);
+        return GSS_C_NO_CONTEXT;
+    }
+
+    return ctx;
+}
+
+void
+testReleaseContext(gss_ctx_id_t ctx)
+{
+    OM_uint32 minor;
+
+    if (ctx == GSS_C_NO_CONTEXT)
+        return;
+
+    gssEapReleaseRfc3961Key(&ctx->rfc3961Key);
+    sequenceFree(&minor, &ctx->seqState);
+    GSSEAP_MUTEX_DESTROY(&ctx->seqMutex);
+    GSSEAP_MUTEX_DESTROY(&ctx->mutex);
+    GSSEAP_FREE(ctx);
+}
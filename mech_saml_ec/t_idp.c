@@ -0,0 +1,967 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Stand-in IdP for tests and benchmarks.
+ *
+ * This speaks just enough HTTP/2 (RFC 7540) over TLS to answer libcurl:
+ * it never decodes a request's headers, only notes when a stream's
+ * request is complete, and answers with a header block built from the
+ * HPACK static table. Flow control is honoured in both directions. One
+ * thread serves every connection, so that the delay before each answer
+ * models the IdP's latency rather than a queue at the server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "t_idp.h"
+
+#define H2_DATA                 0x0
+#define H2_HEADERS              0x1
+#define H2_RST_STREAM           0x3
+#define H2_SETTINGS             0x4
+#define H2_PING                 0x6
+#define H2_GOAWAY               0x7
+#define H2_WINDOW_UPDATE        0x8
+
+#define H2_FLAG_END_STREAM      0x1
+#define H2_FLAG_ACK             0x1
+#define H2_FLAG_END_HEADERS     0x4
+
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+
+#define H2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH       24
+#define H2_FRAME_HEADER_LENGTH  9
+/* The largest frame either side must accept, which we never raise */
+#define H2_MAX_FRAME            16384
+#define H2_DEFAULT_WINDOW       65535
+
+const char testIdpAuthnRequest[] =
+    "<S:Envelope xmlns:S=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+    "<S:Header>"
+    "<paos:Request xmlns:paos=\"urn:liberty:paos:2003-08\""
+    " S:actor=\"http://schemas.xmlsoap.org/soap/actor/next\""
+    " S:mustUnderstand=\"1\""
+    " responseConsumerURL=\"" TEST_IDP_ACS_URL "\""
+    " service=\"urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp\"/>"
+    "<ecp:RelayState xmlns:ecp=\"urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp\""
+    " S:actor=\"http://schemas.xmlsoap.org/soap/actor/next\""
+    " S:mustUnderstand=\"1\">ss:mem:0123456789abcdef</ecp:RelayState>"
+    "</S:Header>"
+    "<S:Body>"
+    "<samlp:AuthnRequest xmlns:samlp=\"urn:oasis:names:tc:SAML:2.0:protocol\""
+    " AssertionConsumerServiceURL=\"" TEST_IDP_ACS_URL "\""
+    " ID=\"_0123456789abcdef\" IssueInstant=\"2026-01-01T00:00:00Z\""
+    " ProtocolBinding=\"urn:oasis:names:tc:SAML:2.0:bindings:PAOS\""
+    " Version=\"2.0\">"
+    "<saml:Issuer xmlns:saml=\"urn:oasis:names:tc:SAML:2.0:assertion\">"
+    "https://sp.example.org/shibboleth</saml:Issuer>"
+    "</samlp:AuthnRequest>"
+    "</S:Body>"
+    "</S:Envelope>";
+
+static const char idpResponse[] =
+    "<S:Envelope xmlns:S=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+    "<S:Header>"
+    "<ecp:Response xmlns:ecp=\"urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp\""
+    " S:actor=\"http://schemas.xmlsoap.org/soap/actor/next\""
+    " S:mustUnderstand=\"1\""
+    " AssertionConsumerServiceURL=\"" TEST_IDP_ACS_URL "\"/>"
+    "</S:Header>"
+    "<S:Body>"
+    "<samlp:Response xmlns:samlp=\"urn:oasis:names:tc:SAML:2.0:protocol\""
+    " Destination=\"" TEST_IDP_ACS_URL "\""
+    " ID=\"_fedcba9876543210\" InResponseTo=\"_0123456789abcdef\""
+    " IssueInstant=\"2026-01-01T00:00:00Z\" Version=\"2.0\">"
+    "<samlp:Status>"
+    "<samlp:StatusCode Value=\"urn:oasis:names:tc:SAML:2.0:status:Success\"/>"
+    "</samlp:Status>"
+    "</samlp:Response>"
+    "</S:Body>"
+    "</S:Envelope>";
+
+struct idp_stream {
+    struct idp_stream *next;
+    uint32_t id;
+    int complete;               /* the whole request has arrived */
+    uint64_t due;               /* when to answer it, in ms */
+    const char *response;       /* and with what */
+    int headersSent;
+    size_t bodySent;
+    long window;                /* ours, for sending on this stream */
+};
+
+struct idp_conn {
+    struct idp_conn *next;
+    int fd;
+    SSL *ssl;
+    int handshakeDone;
+    int wantWrite;
+    int prefaceDone;
+    int closing;
+    unsigned char *in;
+    size_t inLength, inCapacity;
+    unsigned char *out;
+    size_t outLength, outCapacity;
+    long window;                /* ours, for sending on the connection */
+    long initialWindow;         /* the client's initial stream window */
+    struct idp_stream *streams;
+};
+
+struct test_idp {
+    pthread_t thread;
+    int listenFd;
+    int wakeFds[2];
+    unsigned int delayMs;
+    const char *response;
+    SSL_CTX *sslCtx;
+    struct idp_conn *conns;
+    char url[64];
+    pthread_mutex_t mutex;
+    struct test_idp_stats stats;
+};
+
+static uint64_t
+nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+reserve(unsigned char **buf, size_t *capacity, size_t needed)
+{
+    unsigned char *p;
+    size_t n;
+
+    if (needed <= *capacity)
+        return 0;
+
+    for (n = *capacity ? *capacity : 4096; n < needed; n *= 2)
+        ;
+    p = realloc(*buf, n);
+    if (p == NULL)
+        return -1;
+    *buf = p;
+    *capacity = n;
+    return 0;
+}
+
+static void
+putFrame(struct idp_conn *conn, unsigned int type, unsigned int flags,
+         uint32_t streamId, const void *payload, size_t length)
+{
+    unsigned char *p;
+
+    if (reserve(&conn->out, &conn->outCapacity,
+                conn->outLength + H2_FRAME_HEADER_LENGTH + length) != 0) {
+        conn->closing = 1;
+        return;
+    }
+
+    p = conn->out + conn->outLength;
+    p[0] = (length >> 16) & 0xff;
+    p[1] = (length >> 8) & 0xff;
+    p[2] = length & 0xff;
+    p[3] = type;
+    p[4] = flags;
+    p[5] = (streamId >> 24) & 0x7f;
+    p[6] = (streamId >> 16) & 0xff;
+    p[7] = (streamId >> 8) & 0xff;
+    p[8] = streamId & 0xff;
+    if (length != 0)
+        memcpy(p + H2_FRAME_HEADER_LENGTH, payload, length);
+    conn->outLength += H2_FRAME_HEADER_LENGTH + length;
+}
+
+static void
+putWindowUpdate(struct idp_conn *conn, uint32_t streamId, uint32_t increment)
+{
+    unsigned char payload[4];
+
+    payload[0] = (increment >> 24) & 0x7f;
+    payload[1] = (increment >> 16) & 0xff;
+    payload[2] = (increment >> 8) & 0xff;
+    payload[3] = increment & 0xff;
+    putFrame(conn, H2_WINDOW_UPDATE, 0, streamId, payload, sizeof(payload));
+}
+
+static uint32_t
+getUint32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static struct idp_stream *
+findStream(struct idp_conn *conn, uint32_t id, int create)
+{
+    struct idp_stream *stream;
+
+    for (stream = conn->streams; stream != NULL; stream = stream->next) {
+        if (stream->id == id)
+            return stream;
+    }
+
+    if (!create)
+        return NULL;
+
+    stream = calloc(1, sizeof(*stream));
+    if (stream == NULL) {
+        conn->closing = 1;
+        return NULL;
+    }
+    stream->id = id;
+    stream->window = conn->initialWindow;
+    stream->next = conn->streams;
+    conn->streams = stream;
+
+    return stream;
+}
+
+static void
+removeStream(struct idp_conn *conn, struct idp_stream *stream)
+{
+    struct idp_stream **prev;
+
+    for (prev = &conn->streams; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == stream) {
+            *prev = stream->next;
+            free(stream);
+            return;
+        }
+    }
+}
+
+static void
+requestComplete(struct test_idp *idp, struct idp_stream *stream)
+{
+    stream->complete = 1;
+    stream->due = nowMs() + idp->delayMs;
+
+    pthread_mutex_lock(&idp->mutex);
+    stream->response = idp->response;
+    pthread_mutex_unlock(&idp->mutex);
+}
+
+static void
+processSettings(struct idp_conn *conn, const unsigned char *payload,
+                size_t length)
+{
+    struct idp_stream *stream;
+    size_t i;
+
+    for (i = 0; i + 6 <= length; i += 6) {
+        unsigned int id = (payload[i] << 8) | payload[i + 1];
+        long value = (long)getUint32(&payload[i + 2]);
+
+        if (id != H2_SETTINGS_INITIAL_WINDOW_SIZE)
+            continue;
+
+        /* A change applies to the windows of open streams as well */
+        for (stream = conn->streams; stream != NULL; stream = stream->next)
+            stream->window += value - conn->initialWindow;
+        conn->initialWindow = value;
+    }
+
+    putFrame(conn, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+}
+
+static void
+processFrame(struct test_idp *idp, struct idp_conn *conn, unsigned int type,
+             unsigned int flags, uint32_t streamId,
+             const unsigned char *payload, size_t length)
+{
+    struct idp_stream *stream;
+
+    switch (type) {
+    case H2_HEADERS:
+        stream = findStream(conn, streamId, 1);
+        if (stream != NULL && (flags & H2_FLAG_END_STREAM))
+            requestComplete(idp, stream);
+        break;
+    case H2_DATA:
+        stream = findStream(conn, streamId, 0);
+        /* Give back what the body took of the windows */
+        if (length != 0) {
+            putWindowUpdate(conn, 0, length);
+            if (stream != NULL && !(flags & H2_FLAG_END_STREAM))
+                putWindowUpdate(conn, streamId, length);
+        }
+        if (stream != NULL && (flags & H2_FLAG_END_STREAM))
+            requestComplete(idp, stream);
+        break;
+    case H2_SETTINGS:
+        if (!(flags & H2_FLAG_ACK))
+            processSettings(conn, payload, length);
+        break;
+    case H2_PING:
+        if (!(flags & H2_FLAG_ACK))
+            putFrame(conn, H2_PING, H2_FLAG_ACK, 0, payload, length);
+        break;
+    case H2_WINDOW_UPDATE:
+        if (length != 4)
+            break;
+        if (streamId == 0)
+            conn->window += getUint32(payload) & 0x7fffffff;
+        else if ((stream = findStream(conn, streamId, 0)) != NULL)
+            stream->window += getUint32(payload) & 0x7fffffff;
+        break;
+    case H2_RST_STREAM:
+        if ((stream = findStream(conn, streamId, 0)) != NULL)
+            removeStream(conn, stream);
+        break;
+    case H2_GOAWAY:
+        conn->closing = 1;
+        break;
+    default:
+        /* PRIORITY, CONTINUATION and the rest need no answer */
+        break;
+    }
+}
+
+static void
+processInput(struct test_idp *idp, struct idp_conn *conn)
+{
+    size_t offset = 0;
+
+    if (!conn->prefaceDone) {
+        if (conn->inLength < H2_PREFACE_LENGTH)
+            return;
+        if (memcmp(conn->in, H2_PREFACE, H2_PREFACE_LENGTH) != 0) {
+            conn->closing = 1;
+            return;
+        }
+        conn->prefaceDone = 1;
+        offset = H2_PREFACE_LENGTH;
+        putFrame(conn, H2_SETTINGS, 0, 0, NULL, 0);
+    }
+
+    while (!conn->closing &&
+           conn->inLength - offset >= H2_FRAME_HEADER_LENGTH) {
+        const unsigned char *p = conn->in + offset;
+        size_t length = ((size_t)p[0] << 16) | (p[1] << 8) | p[2];
+
+        if (length > H2_MAX_FRAME) {
+            conn->closing = 1;
+            break;
+        }
+        if (conn->inLength - offset < H2_FRAME_HEADER_LENGTH + length)
+            break;
+
+        processFrame(idp, conn, p[3], p[4], getUint32(&p[5]) & 0x7fffffff,
+                     p + H2_FRAME_HEADER_LENGTH, length);
+        offset += H2_FRAME_HEADER_LENGTH + length;
+    }
+
+    memmove(conn->in, conn->in + offset, conn->inLength - offset);
+    conn->inLength -= offset;
+}
+
+/*
+ * Answer the streams that are due, as far as flow control allows. Returns
+ * the time until the next answer falls due, or -1 if none is waiting.
+ */
+static int
+sendResponses(struct test_idp *idp, struct idp_conn *conn, uint64_t now)
+{
+    struct idp_stream *stream, *next;
+    size_t bodyLength;
+    int timeout = -1;
+
+    for (stream = conn->streams; stream != NULL; stream = next) {
+        next = stream->next;
+
+        if (!stream->complete)
+            continue;
+
+        bodyLength = strlen(stream->response);
+
+        if (stream->due > now) {
+            if (timeout < 0 || stream->due - now < (uint64_t)timeout)
+                timeout = (int)(stream->due - now);
+            continue;
+        }
+
+        if (!stream->headersSent) {
+            unsigned char block[64];
+            size_t n = 0;
+            int len;
+
+            block[n++] = 0x88;                          /* :status 200 */
+            block[n++] = 0x0f; block[n++] = 0x10;       /* content-type */
+            block[n++] = 8;
+            memcpy(&block[n], "text/xml", 8);
+            n += 8;
+            block[n++] = 0x0f; block[n++] = 0x0d;       /* content-length */
+            len = snprintf((char *)&block[n + 1], sizeof(block) - n - 1,
+                           "%lu", (unsigned long)bodyLength);
+            block[n++] = len;
+            n += len;
+
+            putFrame(conn, H2_HEADERS, H2_FLAG_END_HEADERS, stream->id,
+                     block, n);
+            stream->headersSent = 1;
+        }
+
+        while (stream->bodySent < bodyLength) {
+            long chunk = bodyLength - stream->bodySent;
+
+            if (chunk > H2_MAX_FRAME)
+                chunk = H2_MAX_FRAME;
+            if (chunk > conn->window)
+                chunk = conn->window;
+            if (chunk > stream->window)
+                chunk = stream->window;
+            if (chunk <= 0)
+                break;
+
+            stream->bodySent += chunk;
+            conn->window -= chunk;
+            stream->window -= chunk;
+            putFrame(conn, H2_DATA,
+                     stream->bodySent == bodyLength ? H2_FLAG_END_STREAM : 0,
+                     stream->id, stream->response + stream->bodySent - chunk,
+                     chunk);
+        }
+
+        if (stream->bodySent == bodyLength) {
+            removeStream(conn, stream);
+            pthread_mutex_lock(&idp->mutex);
+            idp->stats.requests++;
+            pthread_mutex_unlock(&idp->mutex);
+        }
+    }
+
+    return timeout;
+}
+
+static void
+flushOutput(struct idp_conn *conn)
+{
+    conn->wantWrite = 0;
+
+    while (conn->outLength != 0) {
+        int n = SSL_write(conn->ssl, conn->out, conn->outLength);
+
+        if (n <= 0) {
+            int err = SSL_get_error(conn->ssl, n);
+
+            if (err == SSL_ERROR_WANT_WRITE)
+                conn->wantWrite = 1;
+            else if (err != SSL_ERROR_WANT_READ)
+                conn->closing = 1;
+            return;
+        }
+
+        memmove(conn->out, conn->out + n, conn->outLength - n);
+        conn->outLength -= n;
+    }
+}
+
+static void
+readInput(struct test_idp *idp, struct idp_conn *conn)
+{
+    if (!conn->handshakeDone) {
+        int ret = SSL_accept(conn->ssl);
+
+        if (ret != 1) {
+            int err = SSL_get_error(conn->ssl, ret);
+
+            if (err == SSL_ERROR_WANT_WRITE)
+                conn->wantWrite = 1;
+            else if (err != SSL_ERROR_WANT_READ)
+                conn->closing = 1;
+            return;
+        }
+        conn->handshakeDone = 1;
+        conn->wantWrite = 0;
+    }
+
+    for (;;) {
+        int n, err;
+
+        if (reserve(&conn->in, &conn->inCapacity, conn->inLength + 16384) != 0) {
+            conn->closing = 1;
+            return;
+        }
+
+        n = SSL_read(conn->ssl, conn->in + conn->inLength, 16384);
+        if (n > 0) {
+            conn->inLength += n;
+            continue;
+        }
+
+        err = SSL_get_error(conn->ssl, n);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+            conn->closing = 1;
+        break;
+    }
+
+    processInput(idp, conn);
+}
+
+static void
+freeConn(struct idp_conn *conn)
+{
+    struct idp_stream *stream, *next;
+
+    for (stream = conn->streams; stream != NULL; stream = next) {
+        next = stream->next;
+        free(stream);
+    }
+    if (conn->ssl != NULL)
+        SSL_free(conn->ssl);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+static void
+acceptConn(struct test_idp *idp)
+{
+    struct idp_conn *conn;
+    int fd, one = 1;
+
+    fd = accept(idp->listenFd, NULL, NULL);
+    if (fd < 0)
+        return;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->window = H2_DEFAULT_WINDOW;
+    conn->initialWindow = H2_DEFAULT_WINDOW;
+    conn->ssl = SSL_new(idp->sslCtx);
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, fd) != 1) {
+        freeConn(conn);
+        return;
+    }
+
+    conn->next = idp->conns;
+    idp->conns = conn;
+
+    pthread_mutex_lock(&idp->mutex);
+    idp->stats.connections++;
+    pthread_mutex_unlock(&idp->mutex);
+}
+
+static void *
+serve(void *arg)
+{
+    struct test_idp *idp = arg;
+    struct pollfd *fds = NULL;
+    size_t fdsCapacity = 0;
+
+    for (;;) {
+        struct idp_conn *conn, **prev;
+        uint64_t now = nowMs();
+        size_t nfds = 2, i;
+        int timeout = -1;
+
+        /* Answer what is due, and drop connections that are finished */
+        for (prev = &idp->conns; (conn = *prev) != NULL; ) {
+            if (conn->handshakeDone && !conn->closing) {
+                int t = sendResponses(idp, conn, now);
+
+                if (t >= 0 && (timeout < 0 || t < timeout))
+                    timeout = t;
+                flushOutput(conn);
+            }
+            if (conn->closing) {
+                *prev = conn->next;
+                freeConn(conn);
+            } else {
+                prev = &conn->next;
+                nfds++;
+            }
+        }
+
+        if (reserve((unsigned char **)&fds, &fdsCapacity,
+                    nfds * sizeof(*fds)) != 0)
+            break;
+
+        fds[0].fd = idp->wakeFds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = idp->listenFd;
+        fds[1].events = POLLIN;
+        for (i = 2, conn = idp->conns; conn != NULL; conn = conn->next, i++) {
+            fds[i].fd = conn->fd;
+            fds[i].events = POLLIN;
+            if (conn->wantWrite || conn->outLength != 0)
+                fds[i].events |= POLLOUT;
+        }
+
+        if (poll(fds, nfds, timeout) < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents != 0)
+            break;
+
+        for (i = 2, conn = idp->conns; conn != NULL; conn = conn->next, i++) {
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+                conn->closing = 1;
+            else if (fds[i].revents != 0)
+                readInput(idp, conn);
+        }
+
+        if (fds[1].revents & POLLIN)
+            acceptConn(idp);
+    }
+
+    free(fds);
+    return NULL;
+}
+
+static int
+selectAlpn(SSL *ssl, const unsigned char **out, unsigned char *outLength,
+           const unsigned char *in, unsigned int inLength, void *arg)
+{
+    static const unsigned char h2[] = "\x02h2";
+
+    if (SSL_select_next_proto((unsigned char **)out, outLength,
+                              h2, sizeof(h2) - 1,
+                              in, inLength) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static int
+addExtension(X509 *cert, int nid, const char *value)
+{
+    X509V3_CTX v3;
+    X509_EXTENSION *ext;
+    int ret;
+
+    X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+    ext = X509V3_EXT_conf_nid(NULL, &v3, nid, (char *)value);
+    if (ext == NULL)
+        return 0;
+    ret = X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+
+    return ret;
+}
+
+/*
+ * Every IdP in the process has the same self-signed certificate for
+ * 127.0.0.1, so that SAML_EC_IDP_CA_FILE, which the transport reads only
+ * once, stays right for IdPs started later. The file is removed at exit.
+ */
+static pthread_once_t certificateOnce = PTHREAD_ONCE_INIT;
+static X509 *certificate;
+static EVP_PKEY *certificateKey;
+static char caFile[256];
+
+static void
+removeCaFile(void)
+{
+    unlink(caFile);
+}
+
+static void
+makeCertificate(void)
+{
+    EVP_PKEY_CTX *keyCtx;
+    EVP_PKEY *key = NULL;
+    X509 *cert = NULL;
+    X509_NAME *name;
+    const char *tmpdir;
+    FILE *fp = NULL;
+    int fd, ok = 0;
+
+    keyCtx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (keyCtx == NULL ||
+        EVP_PKEY_keygen_init(keyCtx) <= 0 ||
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyCtx, NID_X9_62_prime256v1) <= 0 ||
+        EVP_PKEY_keygen(keyCtx, &key) <= 0)
+        goto cleanup;
+
+    cert = X509_new();
+    if (cert == NULL ||
+        !X509_set_version(cert, 2) ||
+        !ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) ||
+        X509_gmtime_adj(X509_getm_notBefore(cert), -3600) == NULL ||
+        X509_gmtime_adj(X509_getm_notAfter(cert), 86400) == NULL ||
+        !X509_set_pubkey(cert, key))
+        goto cleanup;
+
+    name = X509_get_subject_name(cert);
+    if (!X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                    (const unsigned char *)"127.0.0.1",
+                                    -1, -1, 0) ||
+        !X509_set_issuer_name(cert, name) ||
+        !addExtension(cert, NID_basic_constraints, "critical,CA:TRUE") ||
+        !addExtension(cert, NID_subject_key_identifier, "hash") ||
+        !addExtension(cert, NID_subject_alt_name, "IP:127.0.0.1") ||
+        !X509_sign(cert, key, EVP_sha256()))
+        goto cleanup;
+
+    tmpdir = getenv("TMPDIR");
+    snprintf(caFile, sizeof(caFile), "%s/t_idp.XXXXXX",
+             tmpdir != NULL ? tmpdir : "/tmp");
+    fd = mkstemp(caFile);
+    if (fd < 0)
+        goto cleanup;
+    atexit(removeCaFile);
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        goto cleanup;
+    }
+    ok = (PEM_write_X509(fp, cert) == 1);
+    if (fclose(fp) != 0)
+        ok = 0;
+
+cleanup:
+    if (ok) {
+        certificate = cert;
+        certificateKey = key;
+    } else {
+        X509_free(cert);
+        EVP_PKEY_free(key);
+    }
+    EVP_PKEY_CTX_free(keyCtx);
+}
+
+static void
+freeIdp(struct test_idp *idp)
+{
+    struct idp_conn *conn, *next;
+
+    for (conn = idp->conns; conn != NULL; conn = next) {
+        next = conn->next;
+        freeConn(conn);
+    }
+    if (idp->listenFd >= 0)
+        close(idp->listenFd);
+    if (idp->wakeFds[0] >= 0) {
+        close(idp->wakeFds[0]);
+        close(idp->wakeFds[1]);
+    }
+    SSL_CTX_free(idp->sslCtx);
+    pthread_mutex_destroy(&idp->mutex);
+    free(idp);
+}
+
+int
+testIdpStart(unsigned int delayMs, struct test_idp **pIdp)
+{
+    struct test_idp *idp;
+    struct sockaddr_in sin;
+    socklen_t sinLength = sizeof(sin);
+
+    *pIdp = NULL;
+
+    idp = calloc(1, sizeof(*idp));
+    if (idp == NULL)
+        return -1;
+    idp->delayMs = delayMs;
+    idp->response = idpResponse;
+    idp->listenFd = -1;
+    idp->wakeFds[0] = idp->wakeFds[1] = -1;
+    pthread_mutex_init(&idp->mutex, NULL);
+
+    pthread_once(&certificateOnce, makeCertificate);
+    if (certificate == NULL)
+        goto fail;
+
+    idp->sslCtx = SSL_CTX_new(TLS_server_method());
+    if (idp->sslCtx == NULL ||
+        SSL_CTX_set_min_proto_version(idp->sslCtx, TLS1_2_VERSION) != 1 ||
+        SSL_CTX_use_certificate(idp->sslCtx, certificate) != 1 ||
+        SSL_CTX_use_PrivateKey(idp->sslCtx, certificateKey) != 1)
+        goto fail;
+    SSL_CTX_set_mode(idp->sslCtx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_alpn_select_cb(idp->sslCtx, selectAlpn, NULL);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    idp->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (idp->listenFd < 0 ||
+        bind(idp->listenFd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(idp->listenFd, 128) != 0 ||
+        getsockname(idp->listenFd, (struct sockaddr *)&sin, &sinLength) != 0 ||
+        pipe(idp->wakeFds) != 0)
+        goto fail;
+    fcntl(idp->listenFd, F_SETFL, fcntl(idp->listenFd, F_GETFL) | O_NONBLOCK);
+
+    snprintf(idp->url, sizeof(idp->url),
+             "https://127.0.0.1:%u/idp/profile/SAML2/SOAP/ECP",
+             ntohs(sin.sin_port));
+
+    if (pthread_create(&idp->thread, NULL, serve, idp) != 0)
+        goto fail;
+
+    *pIdp = idp;
+    return 0;
+
+fail:
+    freeIdp(idp);
+    return -1;
+}
+
+void
+testIdpStop(struct test_idp *idp)
+{
+    if (idp == NULL)
+        return;
+
+    if (write(idp->wakeFds[1], "", 1) == 1)
+        pthread_join(idp->thread, NULL);
+    freeIdp(idp);
+}
+
+const char *
+testIdpUrl(struct test_idp *idp)
+{
+    return idp->url;
+}
+
+const char *
+testIdpCaFile(struct test_idp *idp)
+{
+    return caFile;
+}
+
+void
+testIdpStats(struct test_idp *idp, struct test_idp_stats *stats)
+{
+    pthread_mutex_lock(&idp->mutex);
+    *stats = idp->stats;
+    pthread_mutex_unlock(&idp->mutex);
+}
+
+void
+testIdpSetResponse(struct test_idp *idp, const char *response)
+{
+    pthread_mutex_lock(&idp->mutex);
+    idp->response = (response != NULL) ? response : idpResponse;
+    pthread_mutex_unlock(&idp->mutex);
+}
+
+void
+testDisplayStatus(const char *prog, const char *what,
+                  OM_uint32 major, OM_uint32 minor)
+{
+    OM_uint32 tmpMinor, context = 0;
+    gss_buffer_desc message = GSS_C_EMPTY_BUFFER;
+
+    fprintf(stderr, "%s: %s failed: ", prog, what);
+    do {
+        if (GSS_ERROR(gss_display_status(&tmpMinor, minor, GSS_C_MECH_CODE,
+                                         GSS_C_NO_OID, &context, &message)))
+            break;
+        fprintf(stderr, "%.*s ", (int)message.length, (char *)message.value);
+        gss_release_buffer(&tmpMinor, &message);
+    } while (context != 0);
+    fprintf(stderr, "(major %08x)\n", major);
+}
+
+OM_uint32
+testInitContext(OM_uint32 *minor, gss_cred_id_t cred,
+                pthread_barrier_t *barrier, const char **what,
+                double *latency)
+{
+    OM_uint32 major, tmpMinor;
+    gss_ctx_id_t ctx = GSS_C_NO_CONTEXT;
+    gss_buffer_desc request, outputToken = GSS_C_EMPTY_BUFFER;
+    struct timeval start, end;
+
+    *what = "gss_init_sec_context (first leg)";
+    major = gss_init_sec_context(minor, cred, &ctx, GSS_C_NO_NAME,
+                                 GSS_C_NO_OID, 0, GSS_C_INDEFINITE,
+                                 GSS_C_NO_CHANNEL_BINDINGS, GSS_C_NO_BUFFER,
+                                 NULL, &outputToken, NULL, NULL);
+    gss_release_buffer(&tmpMinor, &outputToken);
+
+    if (barrier != NULL)
+        pthread_barrier_wait(barrier);
+
+    if (major != GSS_S_CONTINUE_NEEDED)
+        goto cleanup;
+
+    request.value = (void *)testIdpAuthnRequest;
+    request.length = strlen(testIdpAuthnRequest);
+
+    *what = "gss_init_sec_context (second leg)";
+    gettimeofday(&start, NULL);
+    major = gss_init_sec_context(minor, cred, &ctx, GSS_C_NO_NAME,
+                                 GSS_C_NO_OID, 0, GSS_C_INDEFINITE,
+                                 GSS_C_NO_CHANNEL_BINDINGS, &request,
+                                 NULL, &outputToken, NULL, NULL);
+    gettimeofday(&end, NULL);
+    gss_release_buffer(&tmpMinor, &outputToken);
+
+    if (latency != NULL)
+        *latency = (end.tv_sec - start.tv_sec) * 1e3 +
+                   (end.tv_usec - start.tv_usec) / 1e3;
+
+cleanup:
+    gss_delete_sec_context(&tmpMinor, &ctx, GSS_C_NO_BUFFER);
+
+    return major;
+}
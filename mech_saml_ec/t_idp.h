@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A stand-in IdP for tests and benchmarks: an HTTP/2 server on the
+ * loopback interface, with a certificate generated at startup, that
+ * answers every POST with a canned ECP response, or one the test sets,
+ * after a fixed delay.
+ * Also the GSS-API helpers that the tests and benchmarks share.
+ */
+
+#ifndef _T_IDP_H_
+#define _T_IDP_H_ 1
+
+#include <pthread.h>
+
+#include <gssapi/gssapi.h>
+
+/* The SP's AssertionConsumerServiceURL, as named in both canned messages */
+#define TEST_IDP_ACS_URL    "https://sp.example.org/Shibboleth.sso/SAML2/ECP"
+
+struct test_idp;
+
+struct test_idp_stats {
+    unsigned long connections;  /* accepted since startup */
+    unsigned long requests;     /* answered since startup */
+};
+
+/*
+ * Start the IdP in a thread of its own. Returns 0, or -1 if it could not
+ * be started.
+ */
+int
+testIdpStart(unsigned int delayMs, struct test_idp **pIdp);
+
+void
+testIdpStop(struct test_idp *idp);
+
+/* The URL to set SAML_EC_IDP to */
+const char *
+testIdpUrl(struct test_idp *idp);
+
+/*
+ * A PEM file with the certificate to set SAML_EC_IDP_CA_FILE to; it is
+ * the same for every IdP in the process.
+ */
+const char *
+testIdpCaFile(struct test_idp *idp);
+
+void
+testIdpStats(struct test_idp *idp, struct test_idp_stats *stats);
+
+/*
+ * Answer requests that are complete from now on with response, which
+ * must stay valid until they have been answered, or with the canned
+ * response if it is NULL.
+ */
+void
+testIdpSetResponse(struct test_idp *idp, const char *response);
+
+/* The PAOS request an SP sends in reply to the initiator's first token */
+extern const char testIdpAuthnRequest[];
+
+/*
+ * Report on stderr that what failed, as prog: what failed: followed by
+ * the mechanism's messages for minor.
+ */
+void
+testDisplayStatus(const char *prog, const char *what,
+                  OM_uint32 major, OM_uint32 minor);
+
+/*
+ * Both legs of one initiator context with cred: the first token, then
+ * testIdpAuthnRequest as the SP's reply, which is relayed to the IdP.
+ * If barrier is set, wait at it between the legs; if latency is set,
+ * store there how long the second leg took, in ms. *what names the call
+ * that was made last, for testDisplayStatus().
+ */
+OM_uint32
+testInitContext(OM_uint32 *minor, gss_cred_id_t cred,
+                pthread_barrier_t *barrier, const char **what,
+                double *latency);
+
+#endif /* _T_IDP_H_ */
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Initiators sharing a credential must not queue behind one another's
+ * IdP round trip. Several threads, all using one credential, relay the
+ * SP's request to a stand-in IdP that takes a fixed time to answer, and
+ * together they must finish in about that time rather than a multiple of
+ * it.
+ *
+ * Run with "make check", or t_init_threads [-t threads] [-d IdP delay ms].
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <gssapi/gssapi.h>
+#include <gssapi/gssapi_ext.h>
+
+#include "t_idp.h"
+
+/* Exit status for a test that could not be run */
+#define SKIP    77
+
+static gss_cred_id_t sharedCred = GSS_C_NO_CREDENTIAL;
+static pthread_barrier_t barrier;
+
+struct init_thread {
+    pthread_t thread;
+    OM_uint32 major, minor;
+    const char *what;
+};
+
+static void *
+initThread(void *arg)
+{
+    struct init_thread *t = (struct init_thread *)arg;
+
+    t->major = testInitContext(&t->minor, sharedCred, &barrier, &t->what,
+                               NULL);
+
+    return NULL;
+}
+
+static double
+elapsedMs(const struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+
+    return (end.tv_sec - start->tv_sec) * 1e3 +
+           (end.tv_usec - start->tv_usec) / 1e3;
+}
+
+int
+main(int argc, char **argv)
+{
+    OM_uint32 major, minor, tmpMinor;
+    gss_buffer_desc nameBuf = { 4, "test" };
+    gss_buffer_desc password = { 4, "test" };
+    gss_name_t name = GSS_C_NO_NAME;
+    struct test_idp *idp;
+    struct init_thread *threads;
+    struct timeval start;
+    const char *what;
+    int c, i, started, nthreads = 8, delayMs = 500, failed = 0;
+    double elapsed;
+
+    while ((c = getopt(argc, argv, "t:d:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            delayMs = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-d IdP delay ms]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (nthreads < 2 || delayMs < 1) {
+        fprintf(stderr, "%s: need at least two threads and a delay\n",
+                argv[0]);
+        return 2;
+    }
+
+    if (testIdpStart(delayMs, &idp) != 0) {
+        fprintf(stderr, "%s: cannot start the stand-in IdP\n", argv[0]);
+        return SKIP;
+    }
+    setenv("SAML_EC_IDP", testIdpUrl(idp), 1);
+    setenv("SAML_EC_IDP_CA_FILE", testIdpCaFile(idp), 1);
+
+    major = gss_import_name(&minor, &nameBuf, GSS_C_NT_USER_NAME, &name);
+    if (!GSS_ERROR(major))
+        major = gss_acquire_cred_with_password(&minor, name, &password,
+                                               GSS_C_INDEFINITE,
+                                               GSS_C_NO_OID_SET,
+                                               GSS_C_INITIATE, &sharedCred,
+                                               NULL, NULL);
+    gss_release_name(&tmpMinor, &name);
+    if (GSS_ERROR(major)) {
+        testDisplayStatus("t_init_threads",
+                          "gss_acquire_cred_with_password", major, minor);
+        testIdpStop(idp);
+        return 1;
+    }
+
+    /* Connect to the IdP before timing anything */
+    major = testInitContext(&minor, sharedCred, NULL, &what, NULL);
+    if (GSS_ERROR(major)) {
+        testDisplayStatus("t_init_threads", what, major, minor);
+        failed = 1;
+        goto cleanup;
+    }
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (threads == NULL ||
+        pthread_barrier_init(&barrier, NULL, nthreads + 1) != 0) {
+        free(threads);
+        failed = 1;
+        goto cleanup;
+    }
+
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started].thread, NULL,
+                           initThread, &threads[started]) != 0)
+            break;
+    }
+    if (started < nthreads) {
+        /* The barrier would never open; nothing to do but give up */
+        fprintf(stderr, "%s: cannot start %d threads\n", argv[0], nthreads);
+        return 1;
+    }
+
+    pthread_barrier_wait(&barrier);
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        if (GSS_ERROR(threads[i].major) && !failed) {
+            testDisplayStatus("t_init_threads", threads[i].what,
+                              threads[i].major, threads[i].minor);
+            failed = 1;
+        }
+    }
+    elapsed = elapsedMs(&start);
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+
+    printf("%d initiators, IdP delay %d ms: %.0f ms\n",
+           nthreads, delayMs, elapsed);
+
+    /* Serialised, they would take nthreads times the delay */
+    if (!failed && elapsed >= 2.0 * delayMs) {
+        fprintf(stderr, "%s: initiators were serialised on the IdP round "
+                "trip (%.0f ms for %d, against %d ms for one)\n",
+                argv[0], elapsed, nthreads, delayMs);
+        failed = 1;
+    }
+
+cleanup:
+    gss_release_cred(&tmpMinor, &sharedCred);
+    testIdpStop(idp);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The replay window in util_ordering.c against a reference model that
+ * remembers far more sequence numbers than any window holds. Streams
+ * that are mostly in order, with gaps, reordering, replays and numbers
+ * far below the window, go through windows of each width, including
+ * SAML_EC_REPLAY_WINDOW values that must be rounded up or capped, with
+ * 32- and 64-bit sequence numbers starting just below the point where
+ * they wrap, and the window is serialized and restored early in each
+ * stream.
+ *
+ * Run with "make check", or t_ordering [-n checks per stream].
+ */
+
+#include "gssapiP_eap.h"
+
+/* Sequence numbers below the highest that the model remembers */
+#define MODEL_SPAN          (1 << 20)
+
+/* Check after which the window is serialized and restored */
+#define ROUND_TRIP_AT       10000
+
+struct model {
+    /* Indexed by sequence number modulo MODEL_SPAN */
+    unsigned char seen[MODEL_SPAN];
+    /* Highest sequence number seen, or -1 */
+    long long high;
+    uint32_t width;
+    int doReplay;
+    int doSequence;
+};
+
+static struct model model;
+
+static uint64_t randomState = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t
+nextRandom(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+
+    return (uint32_t)(randomState >> 32);
+}
+
+/*
+ * What sequenceCheck() should return for the number delta past the
+ * first, following the rules of RFC 2743 section 1.2.3.
+ */
+static OM_uint32
+modelCheck(struct model *m, long long delta)
+{
+    int replayOnly = m->doReplay && !m->doSequence;
+    OM_uint32 status;
+
+    if (delta > m->high) {
+        status = (delta == m->high + 1 || replayOnly)
+                 ? GSS_S_COMPLETE : GSS_S_GAP_TOKEN;
+        /* Forget the numbers the ring now reuses */
+        while (m->high < delta)
+            m->seen[++m->high % MODEL_SPAN] = 0;
+        m->seen[delta % MODEL_SPAN] = 1;
+        return status;
+    }
+
+    if (delta < 0 || m->high - delta >= m->width)
+        return replayOnly ? GSS_S_OLD_TOKEN : GSS_S_UNSEQ_TOKEN;
+
+    if (m->seen[delta % MODEL_SPAN])
+        return GSS_S_DUPLICATE_TOKEN;
+    m->seen[delta % MODEL_SPAN] = 1;
+
+    return replayOnly ? GSS_S_COMPLETE : GSS_S_UNSEQ_TOKEN;
+}
+
+/* Serialize the window and restore it into a new one */
+static int
+roundTrip(void **vqueue)
+{
+    OM_uint32 minor;
+    unsigned char *buf, *p;
+    size_t length, remain;
+    void *copy = NULL;
+    int ret = -1;
+
+    length = sequenceSize(*vqueue);
+    buf = GSSEAP_MALLOC(length);
+    if (buf == NULL)
+        return -1;
+
+    p = buf;
+    remain = length;
+    if (GSS_ERROR(sequenceExternalize(&minor, *vqueue, &p, &remain)) ||
+        remain != 0)
+        goto cleanup;
+
+    p = buf;
+    remain = length;
+    if (GSS_ERROR(sequenceInternalize(&minor, &copy, &p, &remain)) ||
+        remain != 0)
+        goto cleanup;
+
+    sequenceFree(&minor, vqueue);
+    *vqueue = copy;
+    ret = 0;
+
+cleanup:
+    GSSEAP_FREE(buf);
+
+    return ret;
+}
+
+/*
+ * Run a stream through a window made with SAML_EC_REPLAY_WINDOW set to
+ * value, which should give one width sequence numbers wide.
+ */
+static int
+runStream(const char *value, uint32_t width, int doReplay, int doSequence,
+          int wide, long checks)
+{
+    OM_uint32 major, minor, expected;
+    uint64_t firstnum, mask;
+    void *vqueue = NULL;
+    long i, failures = 0;
+    long long delta, high;
+
+    setenv("SAML_EC_REPLAY_WINDOW", value, 1);
+
+    mask = wide ? ~(uint64_t)0 : 0xFFFFFFFF;
+    firstnum = mask - 0xFFF;
+
+    memset(model.seen, 0, sizeof(model.seen));
+    model.high = -1;
+    model.width = width;
+    model.doReplay = doReplay;
+    model.doSequence = doSequence;
+
+    major = sequenceInit(&minor, &vqueue, firstnum,
+                         doReplay, doSequence, wide);
+    if (GSS_ERROR(major)) {
+        fprintf(stderr, "t_ordering: sequenceInit failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < checks; i++) {
+        uint32_t r = nextRandom() % 100;
+
+        if (r < 60)         /* next in order */
+            delta = model.high + 1;
+        else if (r < 70)    /* a gap */
+            delta = model.high + 1 + nextRandom() % (width / 2 + 1);
+        else if (r < 95)    /* late, or a replay, near the window */
+            delta = model.high - nextRandom() % (width + 20);
+        else                /* well below the window */
+            delta = model.high - nextRandom() % (3 * width);
+        if (delta < -5)
+            delta = -5;
+
+        high = model.high;
+        major = sequenceCheck(&minor, &vqueue,
+                              (firstnum + (uint64_t)delta) & mask);
+        expected = modelCheck(&model, delta);
+        if (major != expected) {
+            if (failures++ < 5)
+                fprintf(stderr, "t_ordering: window %s replay %d sequence %d "
+                        "wide %d: first + %lld after first + %lld gave "
+                        "%08x, expected %08x\n", value, doReplay, doSequence,
+                        wide, delta, high, major, expected);
+        }
+
+        if (i == MIN(ROUND_TRIP_AT, checks / 2) && roundTrip(&vqueue) != 0) {
+            fprintf(stderr, "t_ordering: window %s did not serialize\n",
+                    value);
+            failures++;
+            break;
+        }
+    }
+
+    if (i != checks) {
+        fprintf(stderr, "t_ordering: window %s stopped after %ld of %ld "
+                "checks\n", value, i, checks);
+        failures++;
+    }
+
+    sequenceFree(&minor, &vqueue);
+
+    return failures != 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct {
+        int doReplay, doSequence;
+    } modes[] = { { 1, 1 }, { 1, 0 }, { 0, 1 } };
+    /* SAML_EC_REPLAY_WINDOW, and the width it should give */
+    static const struct {
+        const char *value;
+        uint32_t width;
+    } windows[] = {
+        { "", 64 }, { "64", 64 }, { "100", 128 }, { "128", 128 },
+        { "256", 256 }, { "512", 512 }, { "1000", 1024 }, { "1024", 1024 },
+        { "2048", 2048 }, { "4096", 4096 }, { "100000", 4096 },
+    };
+    long checks = 1000000;
+    size_t i, j;
+    int c, wide, failed = 0;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            checks = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n checks per stream]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (checks < 2) {
+        fprintf(stderr, "%s: need at least two checks per stream\n",
+                argv[0]);
+        return 2;
+    }
+
+    for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        for (j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+            for (wide = 0; wide <= 1; wide++)
+                failed |= runStream(windows[i].value, windows[i].width,
+                                    modes[j].doReplay, modes[j].doSequence,
+                                    wide, checks);
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The rules for reusing an IdP response (GSS_EAP_CACHE_IDP_FLAG). The
+ * stand-in IdP answers with responses that may or may not be reused,
+ * and two logins in a row through a fresh credential must reach the IdP
+ * once or twice accordingly. A response is reused only if it carries an
+ * assertion, neither it nor its SubjectConfirmationData names a request
+ * (InResponseTo), no assertion is encrypted or marked OneTimeUse, and
+ * at least one valid NotOnOrAfter bounds it; and then only until the
+ * earliest NotOnOrAfter less 30 seconds for clock skew.
+ *
+ * Run with "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <gssapi/gssapi.h>
+#include <gssapi/gssapi_ext.h>
+
+#include "gssapi_eap.h"
+#include "t_idp.h"
+
+/* Exit status for a test that could not be run */
+#define SKIP    77
+
+/* How long the stand-in IdP takes to answer, in ms */
+#define IDP_DELAY   10
+
+/* The allowance for clock skew taken off the earliest NotOnOrAfter */
+#define CACHE_SKEW  30
+
+struct reuse_case {
+    const char *what;
+    int assertion;              /* whether there is a plain Assertion */
+    const char *responseAttrs;  /* further attributes of the Response */
+    const char *confirmAttrs;   /* and of the SubjectConfirmationData */
+    long confirmLife;           /* its NotOnOrAfter from now, in s, or 0 */
+    long conditionsLife;        /* the Conditions' NotOnOrAfter, or 0 */
+    const char *conditions;     /* the Conditions' content */
+    const char *after;          /* what follows the Assertion */
+    int reused;
+};
+
+static const struct reuse_case cases[] = {
+    { "no assertion",
+      0, "", "", 0, 0, "", "", 0 },
+    { "bearer assertion",
+      1, "", "", 600, 600, "", "", 1 },
+    { "Conditions NotOnOrAfter alone",
+      1, "", "", 0, 600, "", "", 1 },
+    { "SubjectConfirmationData NotOnOrAfter alone",
+      1, "", "", 600, 0, "", "", 1 },
+    { "no NotOnOrAfter",
+      1, "", "", 0, 0, "", "", 0 },
+    { "Response InResponseTo",
+      1, " InResponseTo=\"_0123456789abcdef\"", "", 600, 600, "", "", 0 },
+    { "SubjectConfirmationData InResponseTo",
+      1, "", " InResponseTo=\"_0123456789abcdef\"", 600, 600, "", "", 0 },
+    { "OneTimeUse",
+      1, "", "", 600, 600, "<saml:OneTimeUse/>", "", 0 },
+    { "EncryptedAssertion",
+      1, "", "", 600, 600, "",
+      "<saml:EncryptedAssertion>"
+      "<xenc:EncryptedData xmlns:xenc=\"http://www.w3.org/2001/04/xmlenc#\"/>"
+      "</saml:EncryptedAssertion>", 0 },
+    { "malformed NotOnOrAfter",
+      1, "", " NotOnOrAfter=\"tomorrow\"", 0, 600, "", "", 0 },
+    { "expired",
+      1, "", "", 600, -60, "", "", 0 },
+    { "earliest SubjectConfirmationData NotOnOrAfter within the skew",
+      1, "", "", CACHE_SKEW - 10, 600, "", "", 0 },
+    { "earliest Conditions NotOnOrAfter within the skew",
+      1, "", "", 600, CACHE_SKEW - 10, "", "", 0 },
+};
+
+/* Reused until 3 s from now, and no longer, if the skew is taken off */
+#define SHORT_LIFE  (CACHE_SKEW + 3)
+#define SHORT_WAIT  5
+
+static void
+formatTime(char *buf, size_t size, long fromNow)
+{
+    time_t t = time(NULL) + fromNow;
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void
+notOnOrAfter(char *buf, size_t size, long fromNow)
+{
+    char when[32];
+
+    if (fromNow == 0) {
+        buf[0] = '\0';
+        return;
+    }
+
+    formatTime(when, sizeof(when), fromNow);
+    snprintf(buf, size, " NotOnOrAfter=\"%s\"", when);
+}
+
+static void
+makeResponse(char *buf, size_t size, const struct reuse_case *c)
+{
+    char now[32], confirm[64], conditions[64], assertion[2048];
+
+    formatTime(now, sizeof(now), 0);
+    notOnOrAfter(confirm, sizeof(confirm), c->confirmLife);
+    notOnOrAfter(conditions, sizeof(conditions), c->conditionsLife);
+
+    assertion[0] = '\0';
+    if (c->assertion) {
+        snprintf(assertion, sizeof(assertion),
+            "<saml:Assertion ID=\"_a0123456789abcdef\""
+            " IssueInstant=\"%s\" Version=\"2.0\">"
+            "<saml:Issuer>https://idp.example.org/idp/shibboleth</saml:Issuer>"
+            "<saml:Subject>"
+            "<saml:NameID>test</saml:NameID>"
+            "<saml:SubjectConfirmation"
+            " Method=\"urn:oasis:names:tc:SAML:2.0:cm:bearer\">"
+            "<saml:SubjectConfirmationData"
+            " Recipient=\"" TEST_IDP_ACS_URL "\"%s%s/>"
+            "</saml:SubjectConfirmation>"
+            "</saml:Subject>"
+            "<saml:Conditions NotBefore=\"%s\"%s>%s</saml:Conditions>"
+            "</saml:Assertion>",
+            now, confirm, c->confirmAttrs, now, conditions, c->conditions);
+    }
+
+    snprintf(buf, size,
+        "<S:Envelope xmlns:S=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+        "<S:Header>"
+        "<ecp:Response xmlns:ecp=\"urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp\""
+        " S:actor=\"http://schemas.xmlsoap.org/soap/actor/next\""
+        " S:mustUnderstand=\"1\""
+        " AssertionConsumerServiceURL=\"" TEST_IDP_ACS_URL "\"/>"
+        "</S:Header>"
+        "<S:Body>"
+        "<samlp:Response xmlns:samlp=\"urn:oasis:names:tc:SAML:2.0:protocol\""
+        " xmlns:saml=\"urn:oasis:names:tc:SAML:2.0:assertion\""
+        " Destination=\"" TEST_IDP_ACS_URL "\""
+        " ID=\"_r0123456789abcdef\" IssueInstant=\"%s\" Version=\"2.0\"%s>"
+        "<samlp:Status>"
+        "<samlp:StatusCode Value=\"urn:oasis:names:tc:SAML:2.0:status:Success\"/>"
+        "</samlp:Status>"
+        "%s%s"
+        "</samlp:Response>"
+        "</S:Body>"
+        "</S:Envelope>",
+        now, c->responseAttrs, assertion, c->after);
+}
+
+/* A credential with a response cache of its own */
+static OM_uint32
+acquireCachingCred(OM_uint32 *minor, gss_cred_id_t *pCred, const char **what)
+{
+    OM_uint32 major, tmpMinor;
+    gss_buffer_desc nameBuf = { 4, "test" };
+    gss_buffer_desc password = { 4, "test" };
+    gss_name_t name = GSS_C_NO_NAME;
+    unsigned char flag[4];
+    gss_buffer_desc flagBuf = { sizeof(flag), flag };
+
+    *what = "gss_import_name";
+    major = gss_import_name(minor, &nameBuf, GSS_C_NT_USER_NAME, &name);
+    if (GSS_ERROR(major))
+        return major;
+
+    *what = "gss_acquire_cred_with_password";
+    major = gss_acquire_cred_with_password(minor, name, &password,
+                                           GSS_C_INDEFINITE,
+                                           GSS_C_NO_OID_SET,
+                                           GSS_C_INITIATE, pCred,
+                                           NULL, NULL);
+    gss_release_name(&tmpMinor, &name);
+    if (GSS_ERROR(major))
+        return major;
+
+    flag[0] = (GSS_EAP_CACHE_IDP_FLAG >> 24) & 0xff;
+    flag[1] = (GSS_EAP_CACHE_IDP_FLAG >> 16) & 0xff;
+    flag[2] = (GSS_EAP_CACHE_IDP_FLAG >> 8) & 0xff;
+    flag[3] = GSS_EAP_CACHE_IDP_FLAG & 0xff;
+
+    *what = "gssspi_set_cred_option";
+    major = gssspi_set_cred_option(minor, pCred, GSS_EAP_CRED_SET_CRED_FLAG,
+                                   &flagBuf);
+    if (GSS_ERROR(major))
+        gss_release_cred(&tmpMinor, pCred);
+
+    return major;
+}
+
+static unsigned long
+idpRequests(struct test_idp *idp)
+{
+    struct test_idp_stats stats;
+
+    testIdpStats(idp, &stats);
+
+    return stats.requests;
+}
+
+/*
+ * Log in logins times through a fresh credential, waiting wait seconds
+ * before the last. Returns how many of them reached the IdP, or -1 if
+ * one failed.
+ */
+static long
+runLogins(struct test_idp *idp, int logins, int wait)
+{
+    OM_uint32 major, minor, tmpMinor;
+    gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
+    const char *what;
+    unsigned long before;
+    int i;
+
+    major = acquireCachingCred(&minor, &cred, &what);
+    if (GSS_ERROR(major)) {
+        testDisplayStatus("t_reuse", what, major, minor);
+        return -1;
+    }
+
+    before = idpRequests(idp);
+
+    for (i = 0; i < logins; i++) {
+        if (i == logins - 1 && wait != 0)
+            sleep(wait);
+
+        major = testInitContext(&minor, cred, NULL, &what, NULL);
+        if (GSS_ERROR(major)) {
+            testDisplayStatus("t_reuse", what, major, minor);
+            gss_release_cred(&tmpMinor, &cred);
+            return -1;
+        }
+    }
+
+    gss_release_cred(&tmpMinor, &cred);
+
+    return idpRequests(idp) - before;
+}
+
+static int
+checkCase(struct test_idp *idp, const struct reuse_case *c)
+{
+    static char response[8192];
+    long requests;
+
+    makeResponse(response, sizeof(response), c);
+    testIdpSetResponse(idp, response);
+
+    requests = runLogins(idp, 2, 0);
+    if (requests < 0)
+        return 1;
+
+    if (requests != (c->reused ? 1 : 2)) {
+        fprintf(stderr, "t_reuse: %s: response was %sreused\n",
+                c->what, c->reused ? "not " : "");
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * A response that may be reused until the skew allowance before its
+ * NotOnOrAfter, SHORT_LIFE from now, must be reused at once but not
+ * once that time has passed.
+ */
+static int
+checkSkew(struct test_idp *idp)
+{
+    static const struct reuse_case c = {
+        "short-lived", 1, "", "", 600, SHORT_LIFE, "", "", 1
+    };
+    static char response[8192];
+    long requests;
+
+    makeResponse(response, sizeof(response), &c);
+    testIdpSetResponse(idp, response);
+
+    requests = runLogins(idp, 3, SHORT_WAIT);
+    if (requests < 0)
+        return 1;
+
+    if (requests != 2) {
+        fprintf(stderr, "t_reuse: a response with NotOnOrAfter %d s away "
+                "reached the IdP %ld times in 3 logins over %d s, "
+                "rather than 2\n", SHORT_LIFE, requests, SHORT_WAIT);
+        return 1;
+    }
+
+    return 0;
+}
+
+int
+main(void)
+{
+    struct test_idp *idp;
+    size_t i;
+    int failed = 0;
+
+    if (testIdpStart(IDP_DELAY, &idp) != 0) {
+        fprintf(stderr, "t_reuse: cannot start the stand-in IdP\n");
+        return SKIP;
+    }
+    setenv("SAML_EC_IDP", testIdpUrl(idp), 1);
+    setenv("SAML_EC_IDP_CA_FILE", testIdpCaFile(idp), 1);
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+        failed |= checkCase(idp, &cases[i]);
+
+    failed |= checkSkew(idp);
+
+    testIdpStop(idp);
+
+    if (!failed)
+        printf("%u reuse rules checked\n",
+               (unsigned int)(sizeof(cases) / sizeof(cases[0]) + 1));
+
+    return failed;
+}
@@ -0,0 +1,831 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * RFC 3961/3962 primitives and RFC 4121 per-message tokens.
+ *
+ * n-fold, key derivation, AES-CBC-CTS and HMAC-SHA1 are checked against
+ * the vectors of RFC 3961 appendix A.1, MIT krb5's AES key derivation
+ * tests, RFC 3962 appendix B and RFC 2202. These are static, so this
+ * includes util_crypt.c rather than linking it. Then initiator and
+ * acceptor contexts sharing a key exchange wrap and MIC tokens in each
+ * buffer layout, and damaged, misdirected and replayed tokens must be
+ * refused, one at a time and in batches.
+ *
+ * Run with "make check", or t_wrap.
+ */
+
+#include "util_crypt.c"
+
+#include "t_context.h"
+
+static int failures;
+
+static void
+expect(int ok, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (ok)
+        return;
+
+    fprintf(stderr, "t_wrap: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+
+    failures++;
+}
+
+static size_t
+fromHex(const char *hex, unsigned char *out)
+{
+    size_t n;
+    unsigned int byte;
+
+    for (n = 0; hex[2 * n] != '\0'; n++) {
+        sscanf(hex + 2 * n, "%2x", &byte);
+        out[n] = (unsigned char)byte;
+    }
+
+    return n;
+}
+
+/* RFC 3961 appendix A.1 */
+static const struct {
+    const char *input;
+    size_t outLength;
+    const char *output;
+} nfoldVectors[] = {
+    { "012345", 8, "be072631276b1955" },
+    { "password", 7, "78a07b6caf85fa" },
+    { "Rough Consensus, and Running Code", 8, "bb6ed30870b7f0e0" },
+    { "password", 21, "59e4a8ca7c0385c3c37b3f6d2000247cb6e6bd5b3e" },
+    { "MASSACHVSETTS INSTITVTE OF TECHNOLOGY", 24,
+      "db3b0d8f0b061e603282b308a50841229ad798fab9540c1b" },
+    { "Q", 21, "518a54a215a8452a518a54a215a8452a518a54a215" },
+    { "ba", 21, "fb25d531ae8974499f52fd92ea9857c4ba24cf297e" },
+    { "kerberos", 8, "6b65726265726f73" },
+    { "kerberos", 16, "6b65726265726f737b9b5b2b93132b93" },
+    { "kerberos", 21, "8372c236344e5f1550cd0747e15d62ca7a5a3bcea4" },
+    { "kerberos", 32,
+      "6b65726265726f737b9b5b2b93132b935c9bdcdad95c9899c4cae4dee6d6cae4" },
+};
+
+/* DK(key, usage | constant), from MIT krb5's t_derive.c */
+static const struct {
+    int enctype;
+    const char *key;
+    int usage;
+    unsigned char constant;
+    const char *output;
+} deriveVectors[] = {
+    { ENCTYPE_AES128_CTS_HMAC_SHA1_96, "42263c6e89f4fc28b8df68ee09799f15",
+      2, 0x99, "34280a382bc92769b2da2f9ef066854b" },
+    { ENCTYPE_AES128_CTS_HMAC_SHA1_96, "42263c6e89f4fc28b8df68ee09799f15",
+      2, 0xAA, "5b14fc4e250e14ddf9dccf1af6674f53" },
+    { ENCTYPE_AES128_CTS_HMAC_SHA1_96, "42263c6e89f4fc28b8df68ee09799f15",
+      2, 0x55, "4ed31063621684f09ae8d89991af3e8f" },
+    { ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+      "fe697b52bc0d3ce14432ba036a92e65bbb52280990a2fa27883998d72af30161",
+      2, 0x99,
+      "bfab388bdcb238e9f9c98d6a878304f04d30c82556375ac507a7a852790f4674" },
+    { ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+      "fe697b52bc0d3ce14432ba036a92e65bbb52280990a2fa27883998d72af30161",
+      2, 0xAA,
+      "c7cfd9cd75fe793a586a542d87e0d1396f1134a104bb1a9190b8c90ada3ddf37" },
+    { ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+      "fe697b52bc0d3ce14432ba036a92e65bbb52280990a2fa27883998d72af30161",
+      2, 0x55,
+      "97151b4c76945063e2eb0529dc067d97d7bba90776d8126d91f34f3101aea8ba" },
+};
+
+/* RFC 3962 appendix B, with the AES-128 key "chicken teriyaki" */
+#define CTS_KEY     "636869636b656e207465726979616b69"
+
+static const struct {
+    const char *input;
+    const char *output;
+} ctsVectors[] = {
+    { "I would like the ",
+      "c6353568f2bf8cb4d8a580362da7ff7f97" },
+    { "I would like the General Gau's ",
+      "fc00783e0efdb2c1d445d4c8eff7ed2297687268d6ecccc0c07b25e25ecfe5" },
+    { "I would like the General Gau's C",
+      "39312523a78662d5be7fcbcc98ebf5a897687268d6ecccc0c07b25e25ecfe584" },
+    { "I would like the General Gau's Chicken, please,",
+      "97687268d6ecccc0c07b25e25ecfe584b3fffd940c16a18c1b5549d2f838029e"
+      "39312523a78662d5be7fcbcc98ebf5" },
+    { "I would like the General Gau's Chicken, please, ",
+      "97687268d6ecccc0c07b25e25ecfe5849dad8bbb96c4cdc03bc103e1a194bbd8"
+      "39312523a78662d5be7fcbcc98ebf5a8" },
+    { "I would like the General Gau's Chicken, please, and wonton soup.",
+      "97687268d6ecccc0c07b25e25ecfe58439312523a78662d5be7fcbcc98ebf5a8"
+      "4807efe836ee89a526730dbc2f7bc8409dad8bbb96c4cdc03bc103e1a194bbd8" },
+};
+
+/* RFC 2202 section 3, truncated to HMAC-SHA1-96 */
+static const struct {
+    const char *key;
+    const char *input;
+    const char *output;
+} hmacVectors[] = {
+    { "0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b", "Hi There",
+      "b617318655057264e28bc0b6" },
+    { "4a656665", "what do ya want for nothing?",
+      "effcdf6ae5eb2fa2d27416d5" },
+};
+
+static void
+testNfold(void)
+{
+    unsigned char expected[32], out[32];
+    size_t i;
+
+    for (i = 0; i < sizeof(nfoldVectors) / sizeof(nfoldVectors[0]); i++) {
+        fromHex(nfoldVectors[i].output, expected);
+        nfold((const unsigned char *)nfoldVectors[i].input,
+              strlen(nfoldVectors[i].input), out, nfoldVectors[i].outLength);
+        expect(memcmp(out, expected, nfoldVectors[i].outLength) == 0,
+               "%lu-fold(\"%s\") is wrong",
+               (unsigned long)nfoldVectors[i].outLength * 8,
+               nfoldVectors[i].input);
+    }
+}
+
+static void
+testDeriveKey(void)
+{
+    struct gss_eap_rfc3961_key key;
+    EVP_CIPHER_CTX *base;
+    unsigned char expected[RFC3961_KEY_MAX], out[RFC3961_KEY_MAX];
+    size_t i;
+    int code;
+
+    for (i = 0; i < sizeof(deriveVectors) / sizeof(deriveVectors[0]); i++) {
+        memset(&key, 0, sizeof(key));
+        key.enctype = deriveVectors[i].enctype;
+        key.length = fromHex(deriveVectors[i].key, key.key);
+        fromHex(deriveVectors[i].output, expected);
+
+        code = makeCipher(&key, key.key, 1, &base);
+        if (code == 0) {
+            code = deriveKey(&key, base, deriveVectors[i].usage,
+                             deriveVectors[i].constant, out);
+            EVP_CIPHER_CTX_free(base);
+        }
+        expect(code == 0 && memcmp(out, expected, key.length) == 0,
+               "DK for enctype %d, usage %d, constant %02x is wrong",
+               key.enctype, deriveVectors[i].usage, deriveVectors[i].constant);
+    }
+}
+
+/*
+ * Run AES-CTS over data as one DATA buffer, and again split into DATA
+ * buffers of chunk bytes, with empty DATA and SIGN_ONLY buffers between
+ * them that must be left alone.
+ */
+static int
+ctsOver(const EVP_CIPHER_CTX *cipher, unsigned char *data, size_t length,
+        size_t chunk, int encrypt)
+{
+    struct gss_eap_crypt_cursor cursor;
+    gss_iov_buffer_desc iov[3 * 64];
+    unsigned char signOnly[] = "not encrypted";
+    size_t offset;
+    int n = 0, code;
+
+    for (offset = 0; offset < length; offset += chunk) {
+        iov[n].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[n].buffer.value = data + offset;
+        iov[n].buffer.length = MIN(chunk, length - offset);
+        n++;
+        iov[n].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[n].buffer.value = NULL;
+        iov[n].buffer.length = 0;
+        n++;
+        iov[n].type = GSS_IOV_BUFFER_TYPE_SIGN_ONLY;
+        iov[n].buffer.value = signOnly;
+        iov[n].buffer.length = sizeof(signOnly) - 1;
+        n++;
+    }
+
+    cursorInit(&cursor, NULL, 0, iov, n, NULL, 0, 0);
+    code = cbcCts(cipher, &cursor, encrypt);
+
+    if (memcmp(signOnly, "not encrypted", sizeof(signOnly)) != 0)
+        code = GSSEAP_CRYPTO_FAILURE;
+
+    return code;
+}
+
+static void
+testCts(void)
+{
+    static const size_t chunks[] = { 64, 16, 7, 1 };
+    struct gss_eap_rfc3961_key key;
+    EVP_CIPHER_CTX *encrypt = NULL, *decrypt = NULL;
+    unsigned char expected[64], data[64];
+    size_t i, j, length;
+    int code;
+
+    memset(&key, 0, sizeof(key));
+    key.enctype = ENCTYPE_AES128_CTS_HMAC_SHA1_96;
+    key.length = fromHex(CTS_KEY, key.key);
+
+    if (makeCipher(&key, key.key, 1, &encrypt) != 0 ||
+        makeCipher(&key, key.key, 0, &decrypt) != 0) {
+        expect(0, "cannot key AES-128-CBC");
+        goto cleanup;
+    }
+
+    for (i = 0; i < sizeof(ctsVectors) / sizeof(ctsVectors[0]); i++) {
+        length = fromHex(ctsVectors[i].output, expected);
+
+        for (j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+            memcpy(data, ctsVectors[i].input, length);
+
+            code = ctsOver(encrypt, data, length, chunks[j], 1);
+            expect(code == 0 && memcmp(data, expected, length) == 0,
+                   "AES-CTS of %lu bytes in %lu byte buffers is wrong",
+                   (unsigned long)length, (unsigned long)chunks[j]);
+
+            code = ctsOver(decrypt, data, length, chunks[j], 0);
+            expect(code == 0 &&
+                   memcmp(data, ctsVectors[i].input, length) == 0,
+                   "AES-CTS decryption of %lu bytes in %lu byte buffers "
+                   "is wrong", (unsigned long)length,
+                   (unsigned long)chunks[j]);
+        }
+    }
+
+cleanup:
+    EVP_CIPHER_CTX_free(encrypt);
+    EVP_CIPHER_CTX_free(decrypt);
+}
+
+static void
+testHmac(void)
+{
+    struct gss_eap_rfc3961_key key;
+    struct gss_eap_rfc3961_hmac mac;
+    struct gss_eap_crypt_cursor cursor;
+    gss_iov_buffer_desc iov;
+    unsigned char keyData[64], expected[RFC3961_CHECKSUM_LENGTH];
+    unsigned char checksum[RFC3961_CHECKSUM_LENGTH];
+    size_t i;
+    int code;
+
+    for (i = 0; i < sizeof(hmacVectors) / sizeof(hmacVectors[0]); i++) {
+        memset(&key, 0, sizeof(key));
+        key.length = fromHex(hmacVectors[i].key, keyData);
+        fromHex(hmacVectors[i].output, expected);
+
+        iov.type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov.buffer.value = (void *)hmacVectors[i].input;
+        iov.buffer.length = strlen(hmacVectors[i].input);
+        cursorInit(&cursor, NULL, 0, &iov, 1, NULL, 0, 1);
+
+        code = makeMac(&key, keyData, &mac);
+        if (code == 0)
+            code = hmacSha1(&mac, &cursor, checksum);
+        expect(code == 0 && memcmp(checksum, expected, sizeof(expected)) == 0,
+               "HMAC-SHA1 of \"%s\" is wrong", hmacVectors[i].input);
+
+        EVP_MD_CTX_free(mac.inner);
+        EVP_MD_CTX_free(mac.outer);
+    }
+}
+
+/* Message lengths around the AES block size and across many blocks */
+static const size_t messageLengths[] = { 0, 1, 15, 16, 17, 100, 4099 };
+
+#define MESSAGE_MAX 4099
+
+static const int enctypes[] = {
+    ENCTYPE_AES128_CTS_HMAC_SHA1_96,
+    ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+};
+
+static int
+makePair(int enctype, gss_ctx_id_t *initiator, gss_ctx_id_t *acceptor)
+{
+    unsigned char keyData[RFC3961_KEY_MAX];
+    size_t i, keyLength;
+
+    keyLength = (enctype == ENCTYPE_AES128_CTS_HMAC_SHA1_96) ? 16 : 32;
+    for (i = 0; i < keyLength; i++)
+        keyData[i] = (unsigned char)(i * 7 + 1);
+
+    *initiator = testMakeContext(enctype, keyData, keyLength, 1);
+    *acceptor = testMakeContext(enctype, keyData, keyLength, 0);
+    if (*initiator == GSS_C_NO_CONTEXT || *acceptor == GSS_C_NO_CONTEXT) {
+        expect(0, "cannot make contexts for enctype %d", enctype);
+        testReleaseContext(*initiator);
+        testReleaseContext(*acceptor);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+fillMessage(unsigned char *data, size_t length, unsigned int seed)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        data[i] = (unsigned char)(i * 31 + seed);
+}
+
+/*
+ * A message laid out as HEADER | SIGN_ONLY | DATA | TRAILER, in caller
+ * buffers sized by gss_wrap_iov_length().
+ */
+struct message {
+    gss_iov_buffer_desc iov[4];
+    unsigned char header[64];
+    unsigned char signOnly[8];
+    unsigned char data[MESSAGE_MAX];
+    unsigned char trailer[64];
+};
+
+static OM_uint32
+wrapMessage(gss_ctx_id_t ctx, int conf, struct message *m, size_t length,
+            unsigned int seed, int *confState)
+{
+    OM_uint32 major, minor;
+
+    fillMessage(m->data, length, seed);
+    memcpy(m->signOnly, "assoc.", 6);
+
+    m->iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+    m->iov[1].type = GSS_IOV_BUFFER_TYPE_SIGN_ONLY;
+    m->iov[1].buffer.value = m->signOnly;
+    m->iov[1].buffer.length = 6;
+    m->iov[2].type = GSS_IOV_BUFFER_TYPE_DATA;
+    m->iov[2].buffer.value = m->data;
+    m->iov[2].buffer.length = length;
+    m->iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+
+    major = gss_wrap_iov_length(&minor, ctx, conf, GSS_C_QOP_DEFAULT,
+                                NULL, m->iov, 4);
+    if (GSS_ERROR(major))
+        return major;
+    m->iov[0].buffer.value = m->header;
+    m->iov[3].buffer.value = m->trailer;
+
+    return gss_wrap_iov(&minor, ctx, conf, GSS_C_QOP_DEFAULT, confState,
+                        m->iov, 4);
+}
+
+static int
+checkMessage(const struct message *m, size_t length, unsigned int seed)
+{
+    unsigned char expected[MESSAGE_MAX];
+
+    fillMessage(expected, length, seed);
+
+    return memcmp(m->data, expected, length) == 0 &&
+           memcmp(m->signOnly, "assoc.", 6) == 0;
+}
+
+/* HEADER | SIGN_ONLY | DATA | TRAILER */
+static void
+testSeparateTrailer(gss_ctx_id_t initiator, gss_ctx_id_t acceptor, int conf)
+{
+    OM_uint32 major, minor;
+    struct message m;
+    size_t i;
+    int confState;
+    gss_qop_t qop;
+
+    for (i = 0; i < sizeof(messageLengths) / sizeof(messageLengths[0]); i++) {
+        size_t length = messageLengths[i];
+
+        major = wrapMessage(initiator, conf, &m, length, (unsigned int)i,
+                            &confState);
+        expect(major == GSS_S_COMPLETE && confState == conf,
+               "wrap of %lu bytes with conf %d failed",
+               (unsigned long)length, conf);
+
+        major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, m.iov, 4);
+        expect(major == GSS_S_COMPLETE && confState == conf &&
+               checkMessage(&m, length, (unsigned int)i),
+               "unwrap of %lu bytes with conf %d failed (major %08x, "
+               "minor %u)", (unsigned long)length, conf, major, minor);
+    }
+}
+
+/*
+ * HEADER | DATA, where the trailer follows the token header (RRC), and
+ * the same token as one STREAM buffer.
+ */
+static void
+testHeaderOnly(gss_ctx_id_t initiator, gss_ctx_id_t acceptor, int conf)
+{
+    OM_uint32 major, minor, tmpMinor;
+    gss_iov_buffer_desc iov[2];
+    gss_buffer_desc stream, output = GSS_C_EMPTY_BUFFER;
+    unsigned char data[MESSAGE_MAX], expected[MESSAGE_MAX];
+    unsigned char token[64 + MESSAGE_MAX];
+    size_t i;
+    int confState;
+    gss_qop_t qop;
+
+    for (i = 0; i < sizeof(messageLengths) / sizeof(messageLengths[0]); i++) {
+        size_t length = messageLengths[i], headerLength;
+
+        fillMessage(data, length, (unsigned int)i);
+        fillMessage(expected, length, (unsigned int)i);
+
+        iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER | GSS_IOV_BUFFER_FLAG_ALLOCATE;
+        iov[0].buffer.value = NULL;
+        iov[0].buffer.length = 0;
+        iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        iov[1].buffer.value = data;
+        iov[1].buffer.length = length;
+
+        major = gss_wrap_iov(&minor, initiator, conf, GSS_C_QOP_DEFAULT,
+                             &confState, iov, 2);
+        expect(major == GSS_S_COMPLETE && confState == conf &&
+               load_uint16_be((unsigned char *)iov[0].buffer.value + 6) != 0,
+               "header-only wrap of %lu bytes with conf %d failed",
+               (unsigned long)length, conf);
+        if (GSS_ERROR(major))
+            continue;
+
+        headerLength = iov[0].buffer.length;
+        memcpy(token, iov[0].buffer.value, headerLength);
+        memcpy(token + headerLength, data, length);
+
+        /* As a stream */
+        stream.value = token;
+        stream.length = headerLength + length;
+        major = gss_unwrap(&minor, acceptor, &stream, &output,
+                           &confState, &qop);
+        expect(major == GSS_S_COMPLETE && confState == conf &&
+               output.length == length &&
+               memcmp(output.value, expected, length) == 0,
+               "stream unwrap of %lu bytes with conf %d failed (major %08x, "
+               "minor %u)", (unsigned long)length, conf, major, minor);
+        gss_release_buffer(&tmpMinor, &output);
+
+        /* And again as HEADER | DATA, which is now a replay */
+        major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, iov, 2);
+        expect(major == GSS_S_DUPLICATE_TOKEN &&
+               memcmp(data, expected, length) == 0,
+               "header-only replay of %lu bytes with conf %d gave %08x, "
+               "minor %u", (unsigned long)length, conf, major, minor);
+
+        gss_release_buffer(&tmpMinor, &iov[0].buffer);
+    }
+}
+
+/* gss_wrap() and gss_unwrap(), which use a STREAM buffer */
+static void
+testBuffers(gss_ctx_id_t initiator, gss_ctx_id_t acceptor, int conf)
+{
+    OM_uint32 major, minor, tmpMinor;
+    gss_buffer_desc input, token = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc output = GSS_C_EMPTY_BUFFER;
+    unsigned char data[MESSAGE_MAX];
+    size_t i;
+    int confState;
+    gss_qop_t qop;
+
+    for (i = 0; i < sizeof(messageLengths) / sizeof(messageLengths[0]); i++) {
+        fillMessage(data, messageLengths[i], (unsigned int)i);
+        input.value = data;
+        input.length = messageLengths[i];
+
+        major = gss_wrap(&minor, initiator, conf, GSS_C_QOP_DEFAULT,
+                         &input, &confState, &token);
+        expect(major == GSS_S_COMPLETE && confState == conf,
+               "gss_wrap of %lu bytes with conf %d failed",
+               (unsigned long)input.length, conf);
+
+        major = gss_unwrap(&minor, acceptor, &token, &output,
+                           &confState, &qop);
+        expect(major == GSS_S_COMPLETE && confState == conf &&
+               output.length == input.length &&
+               memcmp(output.value, data, input.length) == 0,
+               "gss_unwrap of %lu bytes with conf %d failed (major %08x, "
+               "minor %u)", (unsigned long)input.length, conf, major, minor);
+
+        gss_release_buffer(&tmpMinor, &token);
+        gss_release_buffer(&tmpMinor, &output);
+    }
+}
+
+static void
+testMic(gss_ctx_id_t initiator, gss_ctx_id_t acceptor)
+{
+    OM_uint32 major, minor, tmpMinor;
+    gss_buffer_desc message, token = GSS_C_EMPTY_BUFFER;
+    unsigned char data[MESSAGE_MAX];
+    size_t i;
+    gss_qop_t qop;
+
+    for (i = 0; i < sizeof(messageLengths) / sizeof(messageLengths[0]); i++) {
+        fillMessage(data, messageLengths[i], (unsigned int)i);
+        message.value = data;
+        message.length = messageLengths[i];
+
+        major = gss_get_mic(&minor, initiator, GSS_C_QOP_DEFAULT,
+                            &message, &token);
+        expect(major == GSS_S_COMPLETE, "gss_get_mic of %lu bytes failed",
+               (unsigned long)message.length);
+
+        major = gss_verify_mic(&minor, acceptor, &message, &token, &qop);
+        expect(major == GSS_S_COMPLETE,
+               "gss_verify_mic of %lu bytes failed (major %08x, minor %u)",
+               (unsigned long)message.length, major, minor);
+
+        major = gss_verify_mic(&minor, acceptor, &message, &token, &qop);
+        expect(major == GSS_S_DUPLICATE_TOKEN,
+               "replayed MIC of %lu bytes gave %08x",
+               (unsigned long)message.length, major);
+
+        gss_release_buffer(&tmpMinor, &token);
+    }
+
+    /* A changed message */
+    message.value = data;
+    message.length = 100;
+    major = gss_get_mic(&minor, initiator, GSS_C_QOP_DEFAULT,
+                        &message, &token);
+    data[50] ^= 0x01;
+    major = gss_verify_mic(&minor, acceptor, &message, &token, &qop);
+    expect(major == GSS_S_BAD_SIG, "MIC over a changed message gave %08x",
+           major);
+
+    /* The initiator's own MIC, as if sent back to it */
+    data[50] ^= 0x01;
+    major = gss_verify_mic(&minor, initiator, &message, &token, &qop);
+    expect(major == GSS_S_BAD_SIG && minor == GSSEAP_BAD_DIRECTION,
+           "reflected MIC gave %08x, minor %u", major, minor);
+
+    gss_release_buffer(&tmpMinor, &token);
+}
+
+/* Flipped bits, reflected tokens and replays */
+static void
+testRefused(gss_ctx_id_t initiator, gss_ctx_id_t acceptor, int conf)
+{
+    OM_uint32 major, minor;
+    struct message m, copy;
+    int confState;
+    gss_qop_t qop;
+
+    /* A flipped bit in the data */
+    wrapMessage(initiator, conf, &m, 100, 1, &confState);
+    m.data[37] ^= 0x10;
+    major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, m.iov, 4);
+    expect(major == GSS_S_BAD_SIG,
+           "flipped data bit with conf %d gave %08x", conf, major);
+
+    /* In the associated data */
+    wrapMessage(initiator, conf, &m, 100, 2, &confState);
+    m.signOnly[0] ^= 0x01;
+    major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, m.iov, 4);
+    expect(major == GSS_S_BAD_SIG,
+           "flipped SIGN_ONLY bit with conf %d gave %08x", conf, major);
+
+    /* In the checksum */
+    wrapMessage(initiator, conf, &m, 100, 3, &confState);
+    m.trailer[m.iov[3].buffer.length - 1] ^= 0x80;
+    major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, m.iov, 4);
+    expect(major == GSS_S_BAD_SIG,
+           "flipped checksum bit with conf %d gave %08x", conf, major);
+
+    /* The initiator's own token, as if sent back to it */
+    wrapMessage(initiator, conf, &m, 100, 4, &confState);
+    major = gss_unwrap_iov(&minor, initiator, &confState, &qop, m.iov, 4);
+    expect(major == GSS_S_BAD_SIG && minor == GSSEAP_BAD_DIRECTION,
+           "reflected token with conf %d gave %08x, minor %u",
+           conf, major, minor);
+
+    /* A replay, after the refused tokens left a gap */
+    wrapMessage(initiator, conf, &m, 100, 5, &confState);
+    copy = m;
+    copy.iov[0].buffer.value = copy.header;
+    copy.iov[1].buffer.value = copy.signOnly;
+    copy.iov[2].buffer.value = copy.data;
+    copy.iov[3].buffer.value = copy.trailer;
+    major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, m.iov, 4);
+    expect(major == GSS_S_GAP_TOKEN && checkMessage(&m, 100, 5),
+           "token after a gap with conf %d gave %08x", conf, major);
+    major = gss_unwrap_iov(&minor, acceptor, &confState, &qop, copy.iov, 4);
+    expect(major == GSS_S_DUPLICATE_TOKEN,
+           "replayed token with conf %d gave %08x", conf, major);
+}
+
+#define BATCH_COUNT 40
+
+/*
+ * The batch calls against a loop of single calls: integrity-only tokens
+ * are deterministic, so both must build the same bytes; each must
+ * unwrap the other's tokens; and damaged and replayed members of a batch
+ * must get the status the single call would give them.
+ */
+static void
+testBatch(int enctype, int conf)
+{
+    OM_uint32 major, minor;
+    gss_ctx_id_t batchInitiator, batchAcceptor, initiator, acceptor;
+    static struct message batch[BATCH_COUNT + 2], single[BATCH_COUNT];
+    gss_eap_iov_set_desc sets[BATCH_COUNT + 2];
+    size_t i, length;
+    int confState;
+    gss_qop_t qop;
+
+    if (makePair(enctype, &batchInitiator, &batchAcceptor) != 0)
+        return;
+    if (makePair(enctype, &initiator, &acceptor) != 0) {
+        testReleaseContext(batchInitiator);
+        testReleaseContext(batchAcceptor);
+        return;
+    }
+
+    for (i = 0; i < BATCH_COUNT; i++) {
+        length = messageLengths[i % (sizeof(messageLengths) /
+                                     sizeof(messageLengths[0]))];
+
+        /* Lay out and size the batch's buffers without wrapping */
+        fillMessage(batch[i].data, length, (unsigned int)i);
+        memcpy(batch[i].signOnly, "assoc.", 6);
+        batch[i].iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+        batch[i].iov[1].type = GSS_IOV_BUFFER_TYPE_SIGN_ONLY;
+        batch[i].iov[1].buffer.value = batch[i].signOnly;
+        batch[i].iov[1].buffer.length = 6;
+        batch[i].iov[2].type = GSS_IOV_BUFFER_TYPE_DATA;
+        batch[i].iov[2].buffer.value = batch[i].data;
+        batch[i].iov[2].buffer.length = length;
+        batch[i].iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+        gss_wrap_iov_length(&minor, batchInitiator, conf, GSS_C_QOP_DEFAULT,
+                            NULL, batch[i].iov, 4);
+        batch[i].iov[0].buffer.value = batch[i].header;
+        batch[i].iov[3].buffer.value = batch[i].trailer;
+        sets[i].iov = batch[i].iov;
+        sets[i].iov_count = 4;
+
+        major = wrapMessage(initiator, conf, &single[i], length,
+                            (unsigned int)i, &confState);
+        expect(major == GSS_S_COMPLETE, "single wrap %lu failed",
+               (unsigned long)i);
+    }
+
+    major = gss_eap_wrap_iov_batch(&minor, batchInitiator, conf,
+                                   GSS_C_QOP_DEFAULT, sets, BATCH_COUNT);
+    expect(major == GSS_S_COMPLETE,
+           "batch wrap with conf %d failed (major %08x, minor %u)",
+           conf, major, minor);
+
+    for (i = 0; i < BATCH_COUNT; i++) {
+        expect(sets[i].major_status == GSS_S_COMPLETE &&
+               sets[i].conf_state == conf,
+               "batch wrap %lu with conf %d gave %08x", (unsigned long)i,
+               conf, sets[i].major_status);
+        if (!conf) {
+            length = batch[i].iov[2].buffer.length;
+            expect(memcmp(batch[i].header, single[i].header, 16) == 0 &&
+                   memcmp(batch[i].trailer, single[i].trailer,
+                          RFC3961_CHECKSUM_LENGTH) == 0 &&
+                   memcmp(batch[i].data, single[i].data, length) == 0,
+                   "batch and single integrity tokens %lu differ",
+                   (unsigned long)i);
+        }
+    }
+
+    /* Batch tokens, one at a time */
+    for (i = 0; i < BATCH_COUNT; i++) {
+        length = batch[i].iov[2].buffer.length;
+        major = gss_unwrap_iov(&minor, batchAcceptor, &confState, &qop,
+                               batch[i].iov, 4);
+        expect(major == GSS_S_COMPLETE && confState == conf &&
+               checkMessage(&batch[i], length, (unsigned int)i),
+               "single unwrap of batch token %lu with conf %d gave %08x",
+               (unsigned long)i, conf, major);
+    }
+
+    /*
+     * Single tokens, as a batch, with one damaged and two copies of
+     * another appended
+     */
+    single[3].data[0] ^= 0x01;
+    batch[BATCH_COUNT] = single[5];
+    batch[BATCH_COUNT + 1] = single[7];
+    for (i = 0; i < BATCH_COUNT; i++) {
+        sets[i].iov = single[i].iov;
+        sets[i].iov_count = 4;
+    }
+    for (i = BATCH_COUNT; i < BATCH_COUNT + 2; i++) {
+        batch[i].iov[0].buffer.value = batch[i].header;
+        batch[i].iov[1].buffer.value = batch[i].signOnly;
+        batch[i].iov[2].buffer.value = batch[i].data;
+        batch[i].iov[3].buffer.value = batch[i].trailer;
+        sets[i].iov = batch[i].iov;
+        sets[i].iov_count = 4;
+    }
+
+    major = gss_eap_unwrap_iov_batch(&minor, acceptor, sets, BATCH_COUNT + 2);
+    expect(major == GSS_S_BAD_SIG,
+           "batch unwrap with a damaged token gave %08x", major);
+
+    for (i = 0; i < BATCH_COUNT + 2; i++) {
+        OM_uint32 expected;
+
+        if (i == 3)
+            expected = GSS_S_BAD_SIG;
+        else if (i == 4)    /* 3 was never accepted */
+            expected = GSS_S_GAP_TOKEN;
+        else if (i >= BATCH_COUNT)
+            expected = GSS_S_DUPLICATE_TOKEN;
+        else
+            expected = GSS_S_COMPLETE;
+
+        expect(sets[i].major_status == expected,
+               "batch unwrap %lu with conf %d gave %08x, expected %08x",
+               (unsigned long)i, conf, sets[i].major_status, expected);
+        if (i < BATCH_COUNT && i != 3) {
+            length = single[i].iov[2].buffer.length;
+            expect(checkMessage(&single[i], length, (unsigned int)i),
+                   "batch unwrap %lu with conf %d changed the message",
+                   (unsigned long)i, conf);
+        }
+    }
+
+    testReleaseContext(batchInitiator);
+    testReleaseContext(batchAcceptor);
+    testReleaseContext(initiator);
+    testReleaseContext(acceptor);
+}
+
+int
+main(int argc, char **argv)
+{
+    gss_ctx_id_t initiator, acceptor;
+    size_t i;
+    int conf;
+
+    testNfold();
+    testDeriveKey();
+    testCts();
+    testHmac();
+
+    for (i = 0; i < sizeof(enctypes) / sizeof(enctypes[0]); i++) {
+        for (conf = 0; conf <= 1; conf++) {
+            if (makePair(enctypes[i], &initiator, &acceptor) != 0)
+                continue;
+
+            testSeparateTrailer(initiator, acceptor, conf);
+            testHeaderOnly(initiator, acceptor, conf);
+            testBuffers(initiator, acceptor, conf);
+            testRefused(initiator, acceptor, conf);
+
+            testReleaseContext(initiator);
+            testReleaseContext(acceptor);
+
+            testBatch(enctypes[i], conf);
+        }
+
+        if (makePair(enctypes[i], &initiator, &acceptor) == 0) {
+            testMic(initiator, acceptor);
+            testReleaseContext(initiator);
+            testReleaseContext(acceptor);
+        }
+    }
+
+    return failures != 0;
+}
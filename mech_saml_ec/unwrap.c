@@ -44,7 +44,6 @@ gss_unwrap(OM_uint32 *minor,
            int *conf_state,
            gss_qop_t *qop_state)
 {
-#ifdef MECH_EAP
     OM_uint32 major, tmpMinor;
     gss_iov_buffer_desc iov[2];
 
@@ -55,8 +54,6 @@ gss_unwrap(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSEAP_CONTEXT_INCOMPLETE;
@@ -72,7 +69,7 @@ gss_unwrap(OM_uint32 *minor,
 
     major = gssEapUnwrapOrVerifyMIC(minor, ctx, conf_state, qop_state,
                                     iov, 2, TOK_TYPE_WRAP);
-    if (major == GSS_S_COMPLETE) {
+    if (!GSS_ERROR(major)) {
         *output_message_buffer = iov[1].buffer;
     } else {
         if (iov[1].type & GSS_IOV_BUFFER_FLAG_ALLOCATED)
@@ -80,10 +77,5 @@ gss_unwrap(OM_uint32 *minor,
     }
 
 cleanup:
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
-#else
-    return GSS_S_UNAVAILABLE;
-#endif
 }
@@ -82,6 +82,223 @@ rotateLeft(void *ptr, size_t bufsiz, size_t rc)
     return 0;
 }
 
+/*
+ * Verify and, for confidential wrap tokens, decrypt in place an RFC 4121
+ * token laid out as gssEapWrapOrGetMIC() builds it: the trailer is
+ * either in its own buffer (RRC zero) or follows the token header.
+ * If pSeqnum is not NULL, the sequence number is returned there for the
+ * caller to check, instead of being checked here.
+ */
+static OM_uint32
+unwrapToken(OM_uint32 *minor,
+            gss_ctx_id_t ctx,
+            int *conf_state,
+            gss_qop_t *qop_state,
+            gss_iov_buffer_desc *iov,
+            int iov_count,
+            enum gss_eap_token_type toktype,
+            uint64_t *pSeqnum)
+{
+    OM_uint32 major = GSS_S_FAILURE, code = 0;
+    gss_iov_buffer_t header;
+    gss_iov_buffer_t padding;
+    gss_iov_buffer_t trailer;
+    unsigned char flags;
+    unsigned char *ptr = NULL;
+    unsigned char *tbuf;
+    unsigned char cksumHeader[16];
+    int keyUsage;
+    size_t rrc, ec;
+    size_t trailerLen;
+    uint64_t seqnum;
+    int valid = 0;
+    int conf_flag = 0;
+
+    if (ctx->rfc3961Key == NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    if (qop_state != NULL)
+        *qop_state = GSS_C_QOP_DEFAULT;
+
+    header = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_HEADER);
+    if (header == NULL) {
+        code = GSSEAP_MISSING_IOV;
+        goto cleanup;
+    }
+
+    if (header->buffer.length < 16) {
+        code = GSSEAP_TOK_TRUNC;
+        major = GSS_S_DEFECTIVE_TOKEN;
+        goto cleanup;
+    }
+
+    ptr = (unsigned char *)header->buffer.value;
+
+    padding = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_PADDING);
+    if (padding != NULL && padding->buffer.length != 0) {
+        code = GSSEAP_BAD_PADDING_IOV;
+        major = GSS_S_DEFECTIVE_TOKEN;
+        goto cleanup;
+    }
+
+    trailer = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_TRAILER);
+
+    flags = rfc4121Flags(ctx, 1);
+
+    if (toktype == TOK_TYPE_WRAP) {
+        keyUsage = !CTX_IS_INITIATOR(ctx)
+                   ? KEY_USAGE_INITIATOR_SEAL
+                   : KEY_USAGE_ACCEPTOR_SEAL;
+    } else {
+        keyUsage = !CTX_IS_INITIATOR(ctx)
+                   ? KEY_USAGE_INITIATOR_SIGN
+                   : KEY_USAGE_ACCEPTOR_SIGN;
+    }
+
+    if (load_uint16_be(ptr) != toktype) {
+        code = GSSEAP_WRONG_TOK_ID;
+        major = GSS_S_DEFECTIVE_TOKEN;
+        goto cleanup;
+    }
+
+    if ((ptr[2] & TOK_FLAG_SENDER_IS_ACCEPTOR) !=
+        (flags & TOK_FLAG_SENDER_IS_ACCEPTOR)) {
+        code = GSSEAP_BAD_DIRECTION;
+        major = GSS_S_BAD_SIG;
+        goto cleanup;
+    }
+
+    if (ptr[3] != 0xFF)
+        goto defective;
+
+    seqnum = load_uint64_be(ptr + 8);
+
+    if (toktype == TOK_TYPE_WRAP) {
+        conf_flag = ((ptr[2] & TOK_FLAG_WRAP_CONFIDENTIAL) != 0);
+        ec = load_uint16_be(ptr + 4);
+        rrc = load_uint16_be(ptr + 6);
+
+        if (conf_flag) {
+            unsigned char *althdr;
+
+            trailerLen = ec + 16 /* E(Header) */ + RFC3961_CHECKSUM_LENGTH;
+
+            if (trailer == NULL) {
+                if (rrc != trailerLen ||
+                    header->buffer.length != 16 + trailerLen + RFC3961_CONFOUNDER_LENGTH)
+                    goto defective;
+                tbuf = ptr + 16;
+            } else {
+                if (rrc != 0 ||
+                    header->buffer.length != 16 + RFC3961_CONFOUNDER_LENGTH ||
+                    trailer->buffer.length != trailerLen)
+                    goto defective;
+                tbuf = (unsigned char *)trailer->buffer.value;
+            }
+
+            code = gssEapDecrypt(ctx->rfc3961Key, keyUsage,
+                                 ptr + header->buffer.length - RFC3961_CONFOUNDER_LENGTH,
+                                 iov, iov_count,
+                                 tbuf, ec + 16,
+                                 tbuf + ec + 16);
+            if (code == GSSEAP_BAD_WRAP_TOKEN) {
+                major = GSS_S_BAD_SIG;
+                goto cleanup;
+            } else if (code != 0)
+                goto cleanup;
+
+            /* Validate header integrity */
+            althdr = tbuf + ec;
+
+            if (load_uint16_be(althdr) != TOK_TYPE_WRAP ||
+                althdr[2] != ptr[2] ||
+                althdr[3] != ptr[3] ||
+                memcmp(althdr + 8, ptr + 8, 8) != 0) {
+                code = GSSEAP_BAD_WRAP_TOKEN;
+                major = GSS_S_BAD_SIG;
+                goto cleanup;
+            }
+        } else {
+            /* EC is the checksum length, not filler */
+            if (ec != RFC3961_CHECKSUM_LENGTH)
+                goto defective;
+
+            if (trailer == NULL) {
+                if (rrc != RFC3961_CHECKSUM_LENGTH ||
+                    header->buffer.length != 16 + RFC3961_CHECKSUM_LENGTH)
+                    goto defective;
+                tbuf = ptr + 16;
+            } else {
+                if (rrc != 0 ||
+                    header->buffer.length != 16 ||
+                    trailer->buffer.length != RFC3961_CHECKSUM_LENGTH)
+                    goto defective;
+                tbuf = (unsigned char *)trailer->buffer.value;
+            }
+
+            /* EC and RRC are zero while checksumming */
+            memcpy(cksumHeader, ptr, 16);
+            store_uint16_be(0, cksumHeader + 4);
+            store_uint16_be(0, cksumHeader + 6);
+
+            code = gssEapVerify(ctx->rfc3961Key, keyUsage, iov, iov_count,
+                                cksumHeader, tbuf, &valid);
+            if (code != 0)
+                goto cleanup;
+            if (!valid) {
+                code = GSSEAP_BAD_WRAP_TOKEN;
+                major = GSS_S_BAD_SIG;
+                goto cleanup;
+            }
+        }
+    } else if (toktype == TOK_TYPE_MIC) {
+        if (load_uint32_be(ptr + 4) != 0xFFFFFFFF ||
+            header->buffer.length != 16 + RFC3961_CHECKSUM_LENGTH)
+            goto defective;
+
+        code = gssEapVerify(ctx->rfc3961Key, keyUsage, iov, iov_count,
+                            ptr, ptr + 16, &valid);
+        if (code != 0)
+            goto cleanup;
+        if (!valid) {
+            code = GSSEAP_BAD_WRAP_TOKEN;
+            major = GSS_S_BAD_SIG;
+            goto cleanup;
+        }
+    } else {
+        code = GSSEAP_WRONG_TOK_ID;
+        major = GSS_S_DEFECTIVE_TOKEN;
+        goto cleanup;
+    }
+
+    if (pSeqnum != NULL) {
+        *pSeqnum = seqnum;
+        major = GSS_S_COMPLETE;
+    } else {
+        GSSEAP_MUTEX_LOCK(&ctx->seqMutex);
+        major = sequenceCheck(&code, &ctx->seqState, seqnum);
+        GSSEAP_MUTEX_UNLOCK(&ctx->seqMutex);
+        if (GSS_ERROR(major))
+            goto cleanup;
+    }
+
+    if (conf_state != NULL)
+        *conf_state = conf_flag;
+
+    goto cleanup;
+
+defective:
+    code = GSSEAP_BAD_WRAP_TOKEN;
+    major = GSS_S_DEFECTIVE_TOKEN;
+
+cleanup:
+    *minor = code;
+
+    return major;
+}
+
 /*
  * Split a STREAM | SIGN_DATA | DATA into
  *         HEADER | SIGN_DATA | DATA | PADDING | TRAILER
@@ -93,7 +310,8 @@ unwrapStream(OM_uint32 *minor,
              gss_qop_t *qop_state,
              gss_iov_buffer_desc *iov,
              int iov_count,
-             enum gss_eap_token_type toktype)
+             enum gss_eap_token_type toktype,
+             uint64_t *pSeqnum)
 {
     unsigned char *ptr;
     OM_uint32 code = 0, major = GSS_S_FAILURE;
@@ -102,9 +320,6 @@ unwrapStream(OM_uint32 *minor,
     gss_iov_buffer_desc *tiov = NULL;
     gss_iov_buffer_t stream, data = NULL;
     gss_iov_buffer_t theader, tdata = NULL, tpadding, ttrailer;
-#ifdef HAVE_HEIMDAL_VERSION
-    krb5_crypto krbCrypto = NULL;
-#endif
 
     GSSEAP_ASSERT(toktype == TOK_TYPE_WRAP);
 
@@ -171,18 +386,13 @@ unwrapStream(OM_uint32 *minor,
     ttrailer = &tiov[i++];
     ttrailer->type = GSS_IOV_BUFFER_TYPE_TRAILER;
 
-#ifdef HAVE_HEIMDAL_VERSION
-    code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, &krbCrypto);
-    if (code != 0)
-        goto cleanup;
-#endif
-
     {
         size_t ec, rrc;
-        size_t krbHeaderLen = 0;
-        size_t krbTrailerLen = 0;
+        size_t krbHeaderLen;
+        size_t krbTrailerLen = RFC3961_CHECKSUM_LENGTH;
 
         conf_req_flag = ((ptr[0] & TOK_FLAG_WRAP_CONFIDENTIAL) != 0);
+        krbHeaderLen = conf_req_flag ? RFC3961_CONFOUNDER_LENGTH : 0;
         ec = conf_req_flag ? load_uint16_be(ptr + 2) : 0;
         rrc = load_uint16_be(ptr + 4);
 
@@ -238,21 +448,54 @@ unwrapStream(OM_uint32 *minor,
 
     GSSEAP_ASSERT(i <= iov_count + 2);
 
-    *data = *tdata;
+    major = unwrapToken(&code, ctx, conf_state, qop_state,
+                        tiov, i, toktype, pSeqnum);
+    if (!GSS_ERROR(major)) {
+        *data = *tdata;
+    } else if (tdata->type & GSS_IOV_BUFFER_FLAG_ALLOCATED) {
+        OM_uint32 tmp;
+
+        gss_release_buffer(&tmp, &tdata->buffer);
+        tdata->type &= ~(GSS_IOV_BUFFER_FLAG_ALLOCATED);
+    }
 
 cleanup:
     if (tiov != NULL)
         GSSEAP_FREE(tiov);
-#ifdef HAVE_HEIMDAL_VERSION
-    if (krbCrypto != NULL)
-        krb5_crypto_destroy(krbContext, krbCrypto);
-#endif
 
     *minor = code;
 
     return major;
 }
 
+/*
+ * Verify a token. With pSeqnum, its sequence number is returned for the
+ * caller to check, instead of being checked against the replay window.
+ */
+OM_uint32
+gssEapUnwrapToken(OM_uint32 *minor,
+                  gss_ctx_id_t ctx,
+                  int *conf_state,
+                  gss_qop_t *qop_state,
+                  gss_iov_buffer_desc *iov,
+                  int iov_count,
+                  enum gss_eap_token_type toktype,
+                  uint64_t *pSeqnum)
+{
+    OM_uint32 major;
+
+    if (toktype == TOK_TYPE_WRAP &&
+        gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_STREAM) != NULL) {
+        major = unwrapStream(minor, ctx, conf_state, qop_state,
+                             iov, iov_count, toktype, pSeqnum);
+    } else {
+        major = unwrapToken(minor, ctx, conf_state, qop_state,
+                            iov, iov_count, toktype, pSeqnum);
+    }
+
+    return major;
+}
+
 OM_uint32
 gssEapUnwrapOrVerifyMIC(OM_uint32 *minor,
                         gss_ctx_id_t ctx,
@@ -262,10 +505,8 @@ gssEapUnwrapOrVerifyMIC(OM_uint32 *minor,
                         int iov_count,
                         enum gss_eap_token_type toktype)
 {
-    OM_uint32 major;
-
-    *minor = GSSEAP_KEY_UNAVAILABLE;
-    return GSS_S_UNAVAILABLE;
+    return gssEapUnwrapToken(minor, ctx, conf_state, qop_state,
+                             iov, iov_count, toktype, NULL);
 }
 
 OM_uint32 GSSAPI_CALLCONV
@@ -285,8 +526,6 @@ gss_unwrap_iov(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSEAP_CONTEXT_INCOMPLETE;
@@ -299,7 +538,5 @@ gss_unwrap_iov(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
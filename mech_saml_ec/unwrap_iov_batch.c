@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Unwrap many messages on one context in one call. Each chunk of tokens
+ * is verified and decrypted first; their sequence numbers are then
+ * checked against the replay window under a single hold of its lock.
+ */
+
+#include "gssapiP_eap.h"
+
+/* Messages whose sequence numbers are checked together */
+#define BATCH_CHUNK                     64
+
+OM_uint32 GSSAPI_CALLCONV
+gss_eap_unwrap_iov_batch(OM_uint32 *minor,
+                         gss_ctx_id_t ctx,
+                         gss_eap_iov_set_desc *iov_sets,
+                         size_t count)
+{
+    OM_uint32 major = GSS_S_COMPLETE;
+    uint64_t seqnums[BATCH_CHUNK];
+    size_t i, j, n;
+
+    if (ctx == GSS_C_NO_CONTEXT) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_NO_CONTEXT;
+    }
+
+    if (iov_sets == NULL && count != 0) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ;
+    }
+
+    *minor = 0;
+
+    if (!CTX_IS_ESTABLISHED(ctx)) {
+        *minor = GSSEAP_CONTEXT_INCOMPLETE;
+        return GSS_S_NO_CONTEXT;
+    }
+
+    for (i = 0; i < count; i += n) {
+        n = MIN(count - i, BATCH_CHUNK);
+
+        for (j = 0; j < n; j++) {
+            gss_eap_iov_set_t set = &iov_sets[i + j];
+
+            set->major_status =
+                gssEapUnwrapToken(&set->minor_status, ctx,
+                                  &set->conf_state, NULL,
+                                  set->iov, set->iov_count, TOK_TYPE_WRAP,
+                                  &seqnums[j]);
+        }
+
+        GSSEAP_MUTEX_LOCK(&ctx->seqMutex);
+        for (j = 0; j < n; j++) {
+            gss_eap_iov_set_t set = &iov_sets[i + j];
+
+            if (!GSS_ERROR(set->major_status))
+                set->major_status = sequenceCheck(&set->minor_status,
+                                                  &ctx->seqState, seqnums[j]);
+        }
+        GSSEAP_MUTEX_UNLOCK(&ctx->seqMutex);
+
+        for (j = 0; j < n; j++) {
+            gss_eap_iov_set_t set = &iov_sets[i + j];
+
+            if (GSS_ERROR(set->major_status) && !GSS_ERROR(major)) {
+                major = set->major_status;
+                *minor = set->minor_status;
+            }
+        }
+    }
+
+    return major;
+}
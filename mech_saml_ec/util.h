@@ -101,6 +101,14 @@ addToStringBuffer(OM_uint32 *minor,
                  const size_t len,
                  gss_buffer_t buffer);
 
+OM_uint32
+appendToBuffer(OM_uint32 *minor,
+               gss_buffer_t buffer,
+               size_t *pCapacity,
+               const void *ptr,
+               size_t len,
+               size_t sizeHint);
+
 #define makeStringBufferOrCleanup(src, dst)             \
     do {                                                \
         major = makeStringBuffer((minor), (src), (dst));\
@@ -190,6 +198,13 @@ enum gss_eap_token_type {
 OM_uint32 gssEapAllocContext(OM_uint32 *minor, gss_ctx_id_t *pCtx);
 OM_uint32 gssEapReleaseContext(OM_uint32 *minor, gss_ctx_id_t *pCtx);
 
+OM_uint32
+gssEapSamlContextReady(OM_uint32 *minor,
+                       gss_ctx_id_t ctx,
+                       int enctype,
+                       const unsigned char *key,
+                       size_t keyLength);
+
 OM_uint32
 gssEapMakeToken(OM_uint32 *minor,
                 gss_ctx_id_t ctx,
@@ -226,6 +241,11 @@ OM_uint32 gssEapReleaseCred(OM_uint32 *minor, gss_cred_id_t *pCred);
 gss_OID
 gssEapPrimaryMechForCred(gss_cred_id_t cred);
 
+OM_uint32
+gssEapTlsSessionCacheFile(OM_uint32 *minor,
+                          char *path,
+                          size_t pathLength);
+
 OM_uint32
 gssEapAcquireCred(OM_uint32 *minor,
                   const gss_name_t desiredName,
@@ -283,6 +303,161 @@ gssEapIsIntegrityOnly(gss_iov_buffer_desc *iov, int iov_count);
 int
 gssEapAllocIov(gss_iov_buffer_t iov, size_t size);
 
+#ifndef ENCTYPE_NULL
+#define ENCTYPE_NULL                        0
+#define ENCTYPE_AES128_CTS_HMAC_SHA1_96     17
+#define ENCTYPE_AES256_CTS_HMAC_SHA1_96     18
+#endif
+
+#define RFC3961_KEY_MAX                     32
+#define RFC3961_CONFOUNDER_LENGTH           16
+#define RFC3961_CHECKSUM_LENGTH             12  /* HMAC-SHA1-96 */
+
+/* Session key exchange, draft-ietf-kitten-sasl-saml-ec */
+#define SAMLEC_NS                           "urn:ietf:params:xml:ns:samlec"
+#define SAMLEC_PREFIX                       "samlec"
+
+/* HMAC-SHA1 key, as SHA-1 states that have absorbed key ^ ipad and opad */
+struct gss_eap_rfc3961_hmac {
+    struct evp_md_ctx_st *inner;
+    struct evp_md_ctx_st *outer;
+};
+
+/*
+ * Context session key. For each RFC 4121 key usage, OpenSSL contexts are
+ * keyed once with the encryption (Ke), integrity (Ki) and checksum (Kc)
+ * keys derived from it. Messages work on copies of them, so no message
+ * pays for a key schedule and the key is never modified once made.
+ */
+struct gss_eap_rfc3961_key {
+    int enctype;
+    size_t length;
+    unsigned char key[RFC3961_KEY_MAX];
+    struct {
+        struct evp_cipher_ctx_st *encrypt;  /* AES-CBC, Ke */
+        struct evp_cipher_ctx_st *decrypt;  /* AES-CBC, Ke */
+        struct gss_eap_rfc3961_hmac ki;
+        struct gss_eap_rfc3961_hmac kc;
+    } usage[4];                 /* KEY_USAGE_ACCEPTOR_SEAL onwards */
+};
+
+int
+gssEapEnctypeFromString(const char *name);
+
+const char *
+gssEapEnctypeToString(int enctype);
+
+OM_uint32
+gssEapMakeRfc3961Key(OM_uint32 *minor,
+                     int enctype,
+                     const void *keyData,
+                     size_t keyLength,
+                     struct gss_eap_rfc3961_key **pKey);
+
+void
+gssEapReleaseRfc3961Key(struct gss_eap_rfc3961_key **pKey);
+
+int
+gssEapRandom(unsigned char *buf, size_t length);
+
+int
+gssEapEncrypt(const struct gss_eap_rfc3961_key *key,
+              int usage,
+              unsigned char *confounder,
+              gss_iov_buffer_desc *iov,
+              int iov_count,
+              unsigned char *trailer,
+              size_t trailerLength,
+              unsigned char *checksum);
+
+int
+gssEapDecrypt(const struct gss_eap_rfc3961_key *key,
+              int usage,
+              unsigned char *confounder,
+              gss_iov_buffer_desc *iov,
+              int iov_count,
+              unsigned char *trailer,
+              size_t trailerLength,
+              const unsigned char *checksum);
+
+int
+gssEapSign(const struct gss_eap_rfc3961_key *key,
+           int usage,
+           gss_iov_buffer_desc *iov,
+           int iov_count,
+           const unsigned char *header,
+           unsigned char *checksum);
+
+int
+gssEapVerify(const struct gss_eap_rfc3961_key *key,
+             int usage,
+             gss_iov_buffer_desc *iov,
+             int iov_count,
+             const unsigned char *header,
+             const unsigned char *checksum,
+             int *valid);
+
+/* util_http.c */
+OM_uint32
+gssEapHttpPost(OM_uint32 *minor,
+               const char *url,
+               const char *user,
+               const char *password,
+               const void *body,
+               size_t bodyLength,
+               gss_buffer_t response);
+
+struct gss_eap_http_request;
+
+#define GSSEAP_HTTP_POLL_IN         0x01
+#define GSSEAP_HTTP_POLL_OUT        0x02
+
+struct gss_eap_http_pollfd {
+    int fd;
+    int events;
+};
+
+OM_uint32
+gssEapHttpPostStart(OM_uint32 *minor,
+                    const char *url,
+                    const char *user,
+                    const char *password,
+                    const void *body,
+                    size_t bodyLength,
+                    struct gss_eap_http_request **pRequest);
+
+OM_uint32
+gssEapHttpRequestStep(OM_uint32 *minor,
+                      struct gss_eap_http_request *request,
+                      gss_buffer_t response);
+
+OM_uint32
+gssEapHttpRequestPollSet(OM_uint32 *minor,
+                         struct gss_eap_http_request *request,
+                         long *timeout,
+                         struct gss_eap_http_pollfd **pFds,
+                         unsigned int *pCount);
+
+void
+gssEapHttpRequestFree(struct gss_eap_http_request *request);
+
+void
+gssEapHttpFinalize(void);
+
+/*
+ * IdP responses received since startup, with their total size on the
+ * wire and once decoded. The three are read separately, so they may be
+ * a response apart.
+ */
+struct gss_eap_http_stats {
+    uint64_t responses;
+    uint64_t wireBytes;
+    uint64_t decodedBytes;
+};
+
+void
+gssEapHttpStats(struct gss_eap_http_stats *stats);
+
 /* util_krb.c */
 
 #ifndef KRB_MALLOC
@@ -660,6 +835,18 @@ verifyTokenHeader(OM_uint32 *minor,
 #define GSSEAP_MUTEX_DESTROY(m)         DeleteCriticalSection((m))
 #define GSSEAP_MUTEX_LOCK(m)            EnterCriticalSection((m))
 #define GSSEAP_MUTEX_UNLOCK(m)          LeaveCriticalSection((m))
+
+#define GSSEAP_RWLOCK                   SRWLOCK
+#define GSSEAP_RWLOCK_INIT(l)           (InitializeSRWLock((l)), 0)
+#define GSSEAP_RWLOCK_DESTROY(l)        do { } while (0)
+#define GSSEAP_RWLOCK_RDLOCK(l)         AcquireSRWLockShared((l))
+#define GSSEAP_RWLOCK_WRLOCK(l)         AcquireSRWLockExclusive((l))
+#define GSSEAP_RWLOCK_RDUNLOCK(l)       ReleaseSRWLockShared((l))
+#define GSSEAP_RWLOCK_WRUNLOCK(l)       ReleaseSRWLockExclusive((l))
+
+#define GSSEAP_ATOMIC_LOAD64(p)         ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(p), 0, 0))
+#define GSSEAP_ATOMIC_FETCH_ADD64(p, n) ((uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(n)))
+
 #define GSSEAP_ONCE_LEAVE		do { return TRUE; } while (0)
 
 /* Thread-local is handled separately */
@@ -681,6 +868,17 @@ verifyTokenHeader(OM_uint32 *minor,
 #define GSSEAP_MUTEX_LOCK(m)            pthread_mutex_lock((m))
 #define GSSEAP_MUTEX_UNLOCK(m)          pthread_mutex_unlock((m))
 
+#define GSSEAP_RWLOCK                   pthread_rwlock_t
+#define GSSEAP_RWLOCK_INIT(l)           pthread_rwlock_init((l), NULL)
+#define GSSEAP_RWLOCK_DESTROY(l)        pthread_rwlock_destroy((l))
+#define GSSEAP_RWLOCK_RDLOCK(l)         pthread_rwlock_rdlock((l))
+#define GSSEAP_RWLOCK_WRLOCK(l)         pthread_rwlock_wrlock((l))
+#define GSSEAP_RWLOCK_RDUNLOCK(l)       pthread_rwlock_unlock((l))
+#define GSSEAP_RWLOCK_WRUNLOCK(l)       pthread_rwlock_unlock((l))
+
+#define GSSEAP_ATOMIC_LOAD64(p)         __atomic_load_n((p), __ATOMIC_RELAXED)
+#define GSSEAP_ATOMIC_FETCH_ADD64(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+
 #define GSSEAP_THREAD_KEY               pthread_key_t
 #define GSSEAP_KEY_CREATE(k, d)         pthread_key_create((k), (d))
 #define GSSEAP_GETSPECIFIC(k)           pthread_getspecific((k))
@@ -807,9 +1005,11 @@ store_oid(gss_OID oid, void *vp)
 
 /* util_tld.c */
 struct gss_eap_status_info;
+struct gss_eap_xml_parser;
 
 struct gss_eap_thread_local_data {
     struct gss_eap_status_info *statusInfo;
+    struct gss_eap_xml_parser *xmlParser;
 };
 
 struct gss_eap_thread_local_data *
@@ -818,6 +1018,9 @@ gssEapGetThreadLocalData(void);
 void
 gssEapDestroyStatusInfo(struct gss_eap_status_info *status);
 
+void
+gssEapDestroyXmlParser(struct gss_eap_xml_parser *parser);
+
 #ifdef __cplusplus
 }
 #endif
@@ -827,7 +1030,7 @@ gssEapDestroyStatusInfo(struct gss_eap_status_info *status);
 #include "util_json.h"
 #endif
 #include "util_attr.h"
-#include "util_base64.h"
 #endif /* GSSEAP_ENABLE_ACCEPTOR */
+#include "util_base64.h"
 
 #endif /* _UTIL_H_ */
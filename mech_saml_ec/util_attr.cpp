@@ -42,6 +42,13 @@
 #include <exception>
 #include <new>
 
+#if defined(HAVE_OPENSAML) || defined(HAVE_SHIBRESOLVER)
+#include <xercesc/framework/MemBufInputSource.hpp>
+#include <xercesc/framework/Wrapper4InputSource.hpp>
+#include <xmltooling/XMLToolingConfig.h>
+#include <xmltooling/util/ParserPool.h>
+#endif
+
 /* lazy initialisation */
 static GSSEAP_THREAD_ONCE gssEapAttrProvidersInitOnce = GSSEAP_ONCE_INITIALIZER;
 static OM_uint32 gssEapAttrProvidersInitStatus = GSS_S_UNAVAILABLE;
@@ -96,6 +103,14 @@ OM_uint32
 gssEapAttrProvidersFinalize(OM_uint32 *minor)
 {
     if (gssEapAttrProvidersInitStatus == GSS_S_COMPLETE) {
+#if defined(GSSEAP_DEBUG) && (defined(HAVE_OPENSAML) || defined(HAVE_SHIBRESOLVER))
+        struct gss_eap_xml_parser_stats stats;
+
+        gssEapXmlParserStats(&stats);
+        fprintf(stderr, "XML parsers: %lu created, %lu live, "
+                "%lu parses reused, %lu parses shared\n",
+                stats.created, stats.live, stats.reused, stats.shared);
+#endif
 #ifdef HAVE_SHIBRESOLVER
         gssEapLocalAttrProviderFinalize(minor);
 #endif
@@ -112,6 +127,145 @@ gssEapAttrProvidersFinalize(OM_uint32 *minor)
     return GSS_S_COMPLETE;
 }
 
+#if defined(HAVE_OPENSAML) || defined(HAVE_SHIBRESOLVER)
+/*
+ * Each thread parses with its own ParserPool, so that the builders it
+ * caches are reused without contending on the global pool's lock. The
+ * number of thread parsers is bounded; threads beyond the limit share the
+ * global pool. Counters are kept per thread, and read through a registry
+ * of live parsers, so that counting does not itself add contention.
+ */
+#define GSSEAP_XML_PARSER_MAX       32
+
+struct gss_eap_xml_parser {
+    struct gss_eap_xml_parser *prev, *next;
+    xmltooling::ParserPool *pool;   /* NULL if sharing the global pool */
+    unsigned long parses;
+};
+
+static GSSEAP_THREAD_ONCE gssEapXmlParserInitOnce = GSSEAP_ONCE_INITIALIZER;
+static GSSEAP_MUTEX gssEapXmlParserMutex;
+static struct gss_eap_xml_parser *gssEapXmlParsers;
+static unsigned int gssEapXmlParserCount;
+static struct gss_eap_xml_parser_stats gssEapXmlParserRetired;
+
+GSSEAP_ONCE_CALLBACK(gssEapXmlParserInitInternal)
+{
+    GSSEAP_MUTEX_INIT(&gssEapXmlParserMutex);
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+static void
+gssEapXmlParserTally(const struct gss_eap_xml_parser *parser,
+                     struct gss_eap_xml_parser_stats *stats)
+{
+    if (parser->pool != NULL) {
+        stats->created++;
+        if (parser->parses != 0)
+            stats->reused += parser->parses - 1;
+    } else {
+        stats->shared += parser->parses;
+    }
+}
+
+void
+gssEapDestroyXmlParser(struct gss_eap_xml_parser *parser)
+{
+    GSSEAP_MUTEX_LOCK(&gssEapXmlParserMutex);
+
+    if (parser->prev != NULL)
+        parser->prev->next = parser->next;
+    else
+        gssEapXmlParsers = parser->next;
+    if (parser->next != NULL)
+        parser->next->prev = parser->prev;
+
+    gssEapXmlParserTally(parser, &gssEapXmlParserRetired);
+    if (parser->pool != NULL)
+        gssEapXmlParserCount--;
+
+    GSSEAP_MUTEX_UNLOCK(&gssEapXmlParserMutex);
+
+    delete parser->pool;
+    delete parser;
+}
+
+/*
+ * Report parser usage. The per-thread counters of live parsers are read
+ * without synchronising with their owners, so they may lag slightly.
+ */
+void
+gssEapXmlParserStats(struct gss_eap_xml_parser_stats *stats)
+{
+    struct gss_eap_xml_parser *parser;
+
+    GSSEAP_ONCE(&gssEapXmlParserInitOnce, gssEapXmlParserInitInternal);
+
+    GSSEAP_MUTEX_LOCK(&gssEapXmlParserMutex);
+
+    *stats = gssEapXmlParserRetired;
+    for (parser = gssEapXmlParsers; parser != NULL; parser = parser->next)
+        gssEapXmlParserTally(parser, stats);
+    stats->live = gssEapXmlParserCount;
+
+    GSSEAP_MUTEX_UNLOCK(&gssEapXmlParserMutex);
+}
+
+static xmltooling::ParserPool &
+gssEapGetXmlParser(void)
+{
+    struct gss_eap_thread_local_data *tld = gssEapGetThreadLocalData();
+    struct gss_eap_xml_parser *parser;
+
+    if (tld == NULL)
+        return xmltooling::XMLToolingConfig::getConfig().getParser();
+
+    parser = tld->xmlParser;
+    if (parser == NULL) {
+        GSSEAP_ONCE(&gssEapXmlParserInitOnce, gssEapXmlParserInitInternal);
+
+        parser = new gss_eap_xml_parser;
+        parser->prev = NULL;
+        parser->pool = NULL;
+        parser->parses = 0;
+
+        GSSEAP_MUTEX_LOCK(&gssEapXmlParserMutex);
+        if (gssEapXmlParserCount < GSSEAP_XML_PARSER_MAX) {
+            try {
+                parser->pool = new xmltooling::ParserPool;
+                gssEapXmlParserCount++;
+            } catch (std::bad_alloc &e) {
+            }
+        }
+        parser->next = gssEapXmlParsers;
+        if (parser->next != NULL)
+            parser->next->prev = parser;
+        gssEapXmlParsers = parser;
+        GSSEAP_MUTEX_UNLOCK(&gssEapXmlParserMutex);
+
+        tld->xmlParser = parser;
+    }
+
+    parser->parses++;
+
+    if (parser->pool == NULL)
+        return xmltooling::XMLToolingConfig::getConfig().getParser();
+
+    return *parser->pool;
+}
+
+xercesc::DOMDocument *
+gssEapParseXml(const void *data, size_t length)
+{
+    xercesc::MemBufInputSource src((const XMLByte *)data, length,
+                                   "gss-eap", false);
+    xercesc::Wrapper4InputSource dsrc(&src, false);
+
+    return gssEapGetXmlParser().parse(dsrc);
+}
+#endif /* HAVE_OPENSAML || HAVE_SHIBRESOLVER */
+
 static gss_eap_attr_create_provider gssEapAttrFactories[ATTR_TYPE_MAX + 1];
 
 /*
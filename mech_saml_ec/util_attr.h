@@ -305,6 +305,22 @@ duplicateBuffer(std::string &str, gss_buffer_t buffer)
     duplicateBuffer(tmp, buffer);
 }
 
+#if defined(HAVE_OPENSAML) || defined(HAVE_SHIBRESOLVER)
+#include <xercesc/util/XercesDefs.hpp>
+
+XERCES_CPP_NAMESPACE_BEGIN
+class DOMDocument;
+XERCES_CPP_NAMESPACE_END
+
+/*
+ * Parse an XML document in place from a buffer, using a parser owned by
+ * the calling thread. The caller owns the returned document; parse
+ * errors are thrown.
+ */
+XERCES_CPP_NAMESPACE_QUALIFIER DOMDocument *
+gssEapParseXml(const void *data, size_t length);
+#endif
+
 #else
 struct gss_eap_attr_ctx;
 #endif
@@ -390,6 +406,21 @@ gssEapReleaseAttrContext(OM_uint32 *minor,
 OM_uint32
 gssEapAttrProvidersFinalize(OM_uint32 *minor);
 
+/*
+ * Acceptor XML parser usage: parsers created for and currently owned by
+ * threads, parses that reused a thread's parser, and parses that went
+ * through the (locked) global pool because the thread limit was reached.
+ */
+struct gss_eap_xml_parser_stats {
+    unsigned long created;
+    unsigned long live;
+    unsigned long reused;
+    unsigned long shared;
+};
+
+void
+gssEapXmlParserStats(struct gss_eap_xml_parser_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif
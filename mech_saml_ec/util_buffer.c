@@ -74,6 +74,58 @@ addToStringBuffer(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Append len bytes to buffer, NUL terminated like addToStringBuffer(),
+ * where *pCapacity tracks the size of the allocation. The allocation
+ * grows geometrically, so a long run of appends costs linear time; if
+ * sizeHint is larger, it is taken as the expected final length.
+ */
+OM_uint32
+appendToBuffer(OM_uint32 *minor,
+               gss_buffer_t buffer,
+               size_t *pCapacity,
+               const void *ptr,
+               size_t len,
+               size_t sizeHint)
+{
+    size_t need, capacity;
+    void *value;
+
+    if (len > SIZE_MAX - 1 - buffer->length) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+    need = buffer->length + len + 1;
+
+    if (buffer->value == NULL)
+        *pCapacity = 0;
+
+    if (need > *pCapacity) {
+        capacity = *pCapacity < 256 ? 256 : *pCapacity;
+        while (capacity < need && capacity <= SIZE_MAX / 2)
+            capacity *= 2;
+        if (capacity < need)
+            capacity = need;
+        if (sizeHint < SIZE_MAX && sizeHint + 1 > capacity)
+            capacity = sizeHint + 1;
+
+        value = GSSEAP_REALLOC(buffer->value, capacity);
+        if (value == NULL) {
+            *minor = ENOMEM;
+            return GSS_S_FAILURE;
+        }
+        buffer->value = value;
+        *pCapacity = capacity;
+    }
+
+    memcpy((char *)buffer->value + buffer->length, ptr, len);
+    buffer->length += len;
+    ((char *)buffer->value)[buffer->length] = '\0';
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 OM_uint32
 bufferToString(OM_uint32 *minor,
                const gss_buffer_t buffer,
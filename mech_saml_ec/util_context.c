@@ -51,7 +51,8 @@ gssEapAllocContext(OM_uint32 *minor,
         return GSS_S_FAILURE;
     }
 
-    if (GSSEAP_MUTEX_INIT(&ctx->mutex) != 0) {
+    if (GSSEAP_MUTEX_INIT(&ctx->mutex) != 0 ||
+        GSSEAP_MUTEX_INIT(&ctx->seqMutex) != 0) {
         *minor = GSSEAP_GET_LAST_ERROR();
         gssEapReleaseContext(&tmpMinor, &ctx);
         return GSS_S_FAILURE;
@@ -89,6 +90,7 @@ releaseInitiatorContext(struct gss_eap_initiator_ctx *ctx)
 #ifdef MECH_EAP
     eap_peer_sm_deinit(ctx->eap);
 #endif
+    gssEapReleaseSamlPending(ctx->samlPending);
 }
 
 #ifdef GSSEAP_ENABLE_ACCEPTOR
@@ -136,9 +138,11 @@ gssEapReleaseContext(OM_uint32 *minor,
     gssEapReleaseName(&tmpMinor, &ctx->initiatorName);
     gssEapReleaseName(&tmpMinor, &ctx->acceptorName);
     gssEapReleaseOid(&tmpMinor, &ctx->mechanismUsed);
+    gssEapReleaseRfc3961Key(&ctx->rfc3961Key);
     sequenceFree(&tmpMinor, &ctx->seqState);
     gssEapReleaseCred(&tmpMinor, &ctx->cred);
 
+    GSSEAP_MUTEX_DESTROY(&ctx->seqMutex);
     GSSEAP_MUTEX_DESTROY(&ctx->mutex);
 
     memset(ctx, 0, sizeof(*ctx));
@@ -149,6 +153,47 @@ gssEapReleaseContext(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Complete a SAML EC context. If the IdP generated a session key for it
+ * (enctype is not ENCTYPE_NULL), per-message protection is keyed from
+ * it; otherwise the context is established without those services.
+ */
+OM_uint32
+gssEapSamlContextReady(OM_uint32 *minor,
+                       gss_ctx_id_t ctx,
+                       int enctype,
+                       const unsigned char *key,
+                       size_t keyLength)
+{
+    OM_uint32 major;
+
+    if (enctype != ENCTYPE_NULL) {
+        major = gssEapMakeRfc3961Key(minor, enctype, key, keyLength,
+                                     &ctx->rfc3961Key);
+        if (GSS_ERROR(major))
+            return major;
+
+        ctx->gssFlags |= GSS_C_INTEG_FLAG    |
+                         GSS_C_CONF_FLAG     |
+                         GSS_C_SEQUENCE_FLAG |
+                         GSS_C_REPLAY_FLAG;
+    }
+
+    major = sequenceInit(minor,
+                         &ctx->seqState,
+                         ctx->recvSeq,
+                         ((ctx->gssFlags & GSS_C_REPLAY_FLAG) != 0),
+                         ((ctx->gssFlags & GSS_C_SEQUENCE_FLAG) != 0),
+                         1);
+    if (GSS_ERROR(major))
+        return major;
+
+    GSSEAP_SM_TRANSITION(ctx, GSSEAP_STATE_ESTABLISHED);
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 OM_uint32
 gssEapMakeToken(OM_uint32 *minor,
                 gss_ctx_id_t ctx,
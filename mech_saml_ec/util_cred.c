@@ -101,6 +101,8 @@ gssEapReleaseCred(OM_uint32 *minor, gss_cred_id_t *pCred)
     gss_release_buffer(&tmpMinor, &cred->subjectNameConstraint);
     gss_release_buffer(&tmpMinor, &cred->subjectAltNameConstraint);
 
+    gssEapReleaseAssertionCache(cred->assertionCache);
+
     GSSEAP_MUTEX_DESTROY(&cred->mutex);
     memset(cred, 0, sizeof(*cred));
     GSSEAP_FREE(cred);
@@ -223,6 +225,62 @@ cleanup:
     return major;
 }
 
+/*
+ * Locate the file-backed TLS session cache used for connections to the
+ * IdP. It is optional: GSSEAP_TLS_SESSION_CACHE names the file, or, if
+ * set but empty, selects the per-user default under $XDG_CACHE_HOME (or
+ * ~/.cache). Returns GSS_S_UNAVAILABLE if no cache should be used.
+ */
+OM_uint32
+gssEapTlsSessionCacheFile(OM_uint32 *minor,
+                          char *path,
+                          size_t pathLength)
+{
+    char *cacheName;
+#ifndef WIN32
+    char *cacheHome;
+    struct passwd *pw = NULL, pwd;
+    char pwbuf[BUFSIZ];
+#endif
+
+    cacheName = getenv("GSSEAP_TLS_SESSION_CACHE");
+    if (cacheName == NULL) {
+        *minor = 0;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    if (*cacheName != '\0') {
+        if (strlen(cacheName) >= pathLength) {
+            *minor = ENAMETOOLONG;
+            return GSS_S_FAILURE;
+        }
+        strcpy(path, cacheName);
+        *minor = 0;
+        return GSS_S_COMPLETE;
+    }
+
+#ifdef WIN32
+    *minor = 0;
+    return GSS_S_UNAVAILABLE;
+#else
+    cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome != NULL && *cacheHome == '/') {
+        snprintf(path, pathLength, "%s/gss_eap_tls_sessions", cacheHome);
+    } else {
+        if (getpwuid_r(getuid(), &pwd, pwbuf, sizeof(pwbuf), &pw) != 0 ||
+            pw == NULL || pw->pw_dir == NULL) {
+            *minor = GSSEAP_GET_LAST_ERROR();
+            return GSS_S_UNAVAILABLE;
+        }
+
+        snprintf(path, pathLength, "%s/.cache/gss_eap_tls_sessions", pw->pw_dir);
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+#endif /* WIN32 */
+}
+
 gss_OID
 gssEapPrimaryMechForCred(gss_cred_id_t cred)
 {
@@ -302,6 +360,11 @@ gssEapAcquireCred(OM_uint32 *minor,
             goto cleanup;
 
         rs_context_destroy(radContext);
+#elif defined(HAVE_SHIBRESOLVER)
+        /* Load the ServiceProvider now rather than on the first token */
+        major = gssEapSamlSPInit(minor, cred->name);
+        if (GSS_ERROR(major))
+            goto cleanup;
 #endif
     }
 #endif
@@ -83,6 +83,10 @@
 
 #include "gssapiP_eap.h"
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
 gss_iov_buffer_t
 gssEapLocateIov(gss_iov_buffer_desc *iov, int iov_count, OM_uint32 type)
 {
@@ -183,3 +187,712 @@ gssEapAllocIov(gss_iov_buffer_t iov, size_t size)
 
     return 0;
 }
+
+/*
+ * RFC 3961 simplified profile, for aes128-cts-hmac-sha1-96 and
+ * aes256-cts-hmac-sha1-96 (RFC 3962). Buffers are processed in place:
+ * a cursor walks the caller's IOVs, and only a cipher block that
+ * straddles two buffers, or the last two blocks (which ciphertext
+ * stealing swaps), are staged on the stack.
+ */
+#define RFC3961_BLOCK_LENGTH            16
+#define SHA1_BLOCK_LENGTH               64
+
+#define KEY_USAGE_INDEX(usage)          ((usage) - KEY_USAGE_ACCEPTOR_SEAL)
+
+static const struct {
+    int enctype;
+    const char *name;
+    size_t keyLength;
+} rfc3961Enctypes[] = {
+    { ENCTYPE_AES256_CTS_HMAC_SHA1_96, "aes256-cts-hmac-sha1-96", 32 },
+    { ENCTYPE_AES128_CTS_HMAC_SHA1_96, "aes128-cts-hmac-sha1-96", 16 },
+};
+
+static const EVP_CIPHER *
+cbcCipher(const struct gss_eap_rfc3961_key *key)
+{
+    return key->enctype == ENCTYPE_AES256_CTS_HMAC_SHA1_96 ?
+        EVP_aes_256_cbc() : EVP_aes_128_cbc();
+}
+
+/*
+ * n-fold as defined in RFC 3961 section 5.1: replicate the input with a
+ * 13-bit rotation per copy, then add the result in outLength-sized
+ * pieces with end-around carry.
+ */
+static void
+nfold(const unsigned char *in, size_t inLength,
+      unsigned char *out, size_t outLength)
+{
+    size_t a, b, c, lcm;
+    int byte, i, msbit;
+
+    a = outLength;
+    b = inLength;
+    while (b != 0) {
+        c = b;
+        b = a % b;
+        a = c;
+    }
+    lcm = outLength * inLength / a;
+
+    memset(out, 0, outLength);
+    byte = 0;
+
+    for (i = (int)lcm - 1; i >= 0; i--) {
+        msbit = (int)((((inLength << 3) - 1) +
+                       (((inLength << 3) + 13) * (i / inLength)) +
+                       ((inLength - (i % inLength)) << 3)) % (inLength << 3));
+
+        byte += (((in[((inLength - 1) - (msbit >> 3)) % inLength] << 8) |
+                  (in[(inLength - (msbit >> 3)) % inLength])) >>
+                 ((msbit & 7) + 1)) & 0xFF;
+        byte += out[i % outLength];
+        out[i % outLength] = byte & 0xFF;
+        byte >>= 8;
+    }
+
+    if (byte != 0) {
+        for (i = (int)outLength - 1; i >= 0; i--) {
+            byte += out[i];
+            out[i] = byte & 0xFF;
+            byte >>= 8;
+        }
+    }
+}
+
+/*
+ * DK(base-key, usage | constant), RFC 3961 section 5.1; base is keyed
+ * with the base key.
+ */
+static int
+deriveKey(const struct gss_eap_rfc3961_key *key, EVP_CIPHER_CTX *base,
+          int usage, unsigned char constant, unsigned char *out)
+{
+    unsigned char in[5], block[RFC3961_BLOCK_LENGTH];
+    unsigned char iv[RFC3961_BLOCK_LENGTH] = { 0 };
+    size_t n;
+    int len, code = GSSEAP_CRYPTO_FAILURE;
+
+    store_uint32_be(usage, in);
+    in[4] = constant;
+    nfold(in, sizeof(in), block, sizeof(block));
+
+    /* Each block is encrypted afresh, so the chaining IV is reset */
+    for (n = 0; n < key->length; n += RFC3961_BLOCK_LENGTH) {
+        if (EVP_EncryptInit_ex(base, NULL, NULL, NULL, iv) != 1 ||
+            EVP_EncryptUpdate(base, block, &len, block, sizeof(block)) != 1)
+            goto cleanup;
+        memcpy(out + n, block, MIN(sizeof(block), key->length - n));
+    }
+
+    code = 0;
+
+cleanup:
+    OPENSSL_cleanse(block, sizeof(block));
+
+    return code;
+}
+
+static int
+makeCipher(const struct gss_eap_rfc3961_key *key, const unsigned char *keyData,
+           int encrypt, EVP_CIPHER_CTX **pCipher)
+{
+    unsigned char iv[RFC3961_BLOCK_LENGTH] = { 0 };
+    EVP_CIPHER_CTX *cipher;
+
+    cipher = EVP_CIPHER_CTX_new();
+    if (cipher == NULL)
+        return ENOMEM;
+
+    if (EVP_CipherInit_ex(cipher, cbcCipher(key), NULL, keyData, iv, encrypt) != 1 ||
+        EVP_CIPHER_CTX_set_padding(cipher, 0) != 1) {
+        EVP_CIPHER_CTX_free(cipher);
+        return GSSEAP_CRYPTO_FAILURE;
+    }
+
+    *pCipher = cipher;
+    return 0;
+}
+
+/*
+ * HMAC (RFC 2104) is kept as the two SHA-1 states it starts from, which
+ * are cheaper to copy per message than an EVP_PKEY signing context.
+ */
+static int
+makeMac(const struct gss_eap_rfc3961_key *key, const unsigned char *keyData,
+        struct gss_eap_rfc3961_hmac *mac)
+{
+    unsigned char pad[SHA1_BLOCK_LENGTH];
+    size_t i;
+    int code = 0;
+
+    mac->inner = EVP_MD_CTX_new();
+    mac->outer = EVP_MD_CTX_new();
+    if (mac->inner == NULL || mac->outer == NULL)
+        return ENOMEM;
+
+    /* RFC 3961 keys are never longer than a SHA-1 block */
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, keyData, key->length);
+
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= 0x36;
+    if (EVP_DigestInit_ex(mac->inner, EVP_sha1(), NULL) != 1 ||
+        EVP_DigestUpdate(mac->inner, pad, sizeof(pad)) != 1)
+        code = GSSEAP_CRYPTO_FAILURE;
+
+    for (i = 0; i < sizeof(pad); i++)
+        pad[i] ^= 0x36 ^ 0x5C;
+    if (EVP_DigestInit_ex(mac->outer, EVP_sha1(), NULL) != 1 ||
+        EVP_DigestUpdate(mac->outer, pad, sizeof(pad)) != 1)
+        code = GSSEAP_CRYPTO_FAILURE;
+
+    OPENSSL_cleanse(pad, sizeof(pad));
+
+    return code;
+}
+
+int
+gssEapEnctypeFromString(const char *name)
+{
+    size_t i;
+    char *end;
+    long enctype;
+
+    for (i = 0; i < sizeof(rfc3961Enctypes) / sizeof(rfc3961Enctypes[0]); i++) {
+        if (strcmp(name, rfc3961Enctypes[i].name) == 0)
+            return rfc3961Enctypes[i].enctype;
+    }
+
+    /* Also accept the enctype number */
+    enctype = strtol(name, &end, 10);
+    if (end != name && *end == '\0') {
+        for (i = 0; i < sizeof(rfc3961Enctypes) / sizeof(rfc3961Enctypes[0]); i++) {
+            if (enctype == rfc3961Enctypes[i].enctype)
+                return rfc3961Enctypes[i].enctype;
+        }
+    }
+
+    return ENCTYPE_NULL;
+}
+
+const char *
+gssEapEnctypeToString(int enctype)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(rfc3961Enctypes) / sizeof(rfc3961Enctypes[0]); i++) {
+        if (enctype == rfc3961Enctypes[i].enctype)
+            return rfc3961Enctypes[i].name;
+    }
+
+    return NULL;
+}
+
+OM_uint32
+gssEapMakeRfc3961Key(OM_uint32 *minor,
+                     int enctype,
+                     const void *keyData,
+                     size_t keyLength,
+                     struct gss_eap_rfc3961_key **pKey)
+{
+    struct gss_eap_rfc3961_key *key;
+    EVP_CIPHER_CTX *base = NULL;
+    unsigned char ke[RFC3961_KEY_MAX], ki[RFC3961_KEY_MAX], kc[RFC3961_KEY_MAX];
+    size_t i;
+    int usage, code = 0;
+
+    *pKey = NULL;
+
+    for (i = 0; i < sizeof(rfc3961Enctypes) / sizeof(rfc3961Enctypes[0]); i++) {
+        if (enctype == rfc3961Enctypes[i].enctype)
+            break;
+    }
+    if (i == sizeof(rfc3961Enctypes) / sizeof(rfc3961Enctypes[0])) {
+        *minor = GSSEAP_BAD_ENCTYPE;
+        return GSS_S_UNAVAILABLE;
+    }
+    if (keyLength != rfc3961Enctypes[i].keyLength) {
+        *minor = GSSEAP_BAD_SESSION_KEY;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    key = (struct gss_eap_rfc3961_key *)GSSEAP_CALLOC(1, sizeof(*key));
+    if (key == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    key->enctype = enctype;
+    key->length = keyLength;
+    memcpy(key->key, keyData, keyLength);
+
+    code = makeCipher(key, key->key, 1, &base);
+
+    for (usage = KEY_USAGE_ACCEPTOR_SEAL;
+         usage <= KEY_USAGE_INITIATOR_SIGN && code == 0;
+         usage++) {
+        int u = KEY_USAGE_INDEX(usage);
+
+        code = deriveKey(key, base, usage, 0xAA, ke);
+        if (code == 0)
+            code = deriveKey(key, base, usage, 0x55, ki);
+        if (code == 0)
+            code = deriveKey(key, base, usage, 0x99, kc);
+        if (code == 0)
+            code = makeCipher(key, ke, 1, &key->usage[u].encrypt);
+        if (code == 0)
+            code = makeCipher(key, ke, 0, &key->usage[u].decrypt);
+        if (code == 0)
+            code = makeMac(key, ki, &key->usage[u].ki);
+        if (code == 0)
+            code = makeMac(key, kc, &key->usage[u].kc);
+    }
+
+    EVP_CIPHER_CTX_free(base);
+    OPENSSL_cleanse(ke, sizeof(ke));
+    OPENSSL_cleanse(ki, sizeof(ki));
+    OPENSSL_cleanse(kc, sizeof(kc));
+
+    if (code != 0) {
+        gssEapReleaseRfc3961Key(&key);
+        *minor = code;
+        return GSS_S_FAILURE;
+    }
+
+    *pKey = key;
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+void
+gssEapReleaseRfc3961Key(struct gss_eap_rfc3961_key **pKey)
+{
+    struct gss_eap_rfc3961_key *key = *pKey;
+    int i;
+
+    if (key == NULL)
+        return;
+
+    for (i = 0; i < 4; i++) {
+        EVP_CIPHER_CTX_free(key->usage[i].encrypt);
+        EVP_CIPHER_CTX_free(key->usage[i].decrypt);
+        EVP_MD_CTX_free(key->usage[i].ki.inner);
+        EVP_MD_CTX_free(key->usage[i].ki.outer);
+        EVP_MD_CTX_free(key->usage[i].kc.inner);
+        EVP_MD_CTX_free(key->usage[i].kc.outer);
+    }
+
+    OPENSSL_cleanse(key, sizeof(*key));
+    GSSEAP_FREE(*pKey);
+    *pKey = NULL;
+}
+
+/*
+ * The bytes an operation covers: an optional leading segment, the DATA
+ * and PADDING buffers (and, when signing, the SIGN_ONLY buffers) in IOV
+ * order, then an optional trailing segment.
+ */
+struct gss_eap_crypt_cursor {
+    unsigned char *head;
+    size_t headLength;
+    gss_iov_buffer_desc *iov;
+    int iov_count;
+    unsigned char *tail;
+    size_t tailLength;
+    int signOnly;
+    int index;                  /* -1 is head, iov_count is tail */
+    size_t offset;
+};
+
+static void
+cursorInit(struct gss_eap_crypt_cursor *cursor,
+           unsigned char *head, size_t headLength,
+           gss_iov_buffer_desc *iov, int iov_count,
+           unsigned char *tail, size_t tailLength,
+           int signOnly)
+{
+    cursor->head = head;
+    cursor->headLength = (head != NULL) ? headLength : 0;
+    cursor->iov = iov;
+    cursor->iov_count = iov_count;
+    cursor->tail = tail;
+    cursor->tailLength = (tail != NULL) ? tailLength : 0;
+    cursor->signOnly = signOnly;
+    cursor->index = -1;
+    cursor->offset = 0;
+}
+
+static size_t
+cursorSegment(const struct gss_eap_crypt_cursor *cursor, int index,
+              unsigned char **pData)
+{
+    OM_uint32 type;
+
+    if (index < 0) {
+        *pData = cursor->head;
+        return cursor->headLength;
+    } else if (index == cursor->iov_count) {
+        *pData = cursor->tail;
+        return cursor->tailLength;
+    } else if (index > cursor->iov_count) {
+        *pData = NULL;
+        return 0;
+    }
+
+    type = GSS_IOV_BUFFER_TYPE(cursor->iov[index].type);
+    if (type == GSS_IOV_BUFFER_TYPE_DATA ||
+        type == GSS_IOV_BUFFER_TYPE_PADDING ||
+        (type == GSS_IOV_BUFFER_TYPE_SIGN_ONLY && cursor->signOnly)) {
+        *pData = (unsigned char *)cursor->iov[index].buffer.value;
+        return cursor->iov[index].buffer.length;
+    }
+
+    *pData = NULL;
+    return 0;
+}
+
+/* Contiguous bytes available at the cursor; zero at the end */
+static size_t
+cursorPeek(struct gss_eap_crypt_cursor *cursor, unsigned char **pData)
+{
+    unsigned char *data;
+    size_t length;
+
+    while (cursor->index <= cursor->iov_count) {
+        length = cursorSegment(cursor, cursor->index, &data);
+        if (cursor->offset < length) {
+            *pData = data + cursor->offset;
+            return length - cursor->offset;
+        }
+        cursor->index++;
+        cursor->offset = 0;
+    }
+
+    *pData = NULL;
+    return 0;
+}
+
+static size_t
+cursorLength(const struct gss_eap_crypt_cursor *cursor)
+{
+    unsigned char *data;
+    size_t length = 0;
+    int i;
+
+    for (i = -1; i <= cursor->iov_count; i++)
+        length += cursorSegment(cursor, i, &data);
+
+    return length;
+}
+
+static void
+cursorRead(struct gss_eap_crypt_cursor *cursor, unsigned char *out, size_t length)
+{
+    unsigned char *data;
+    size_t n;
+
+    while (length != 0) {
+        n = MIN(cursorPeek(cursor, &data), length);
+        GSSEAP_ASSERT(n != 0);
+        memcpy(out, data, n);
+        cursor->offset += n;
+        out += n;
+        length -= n;
+    }
+}
+
+static void
+cursorWrite(struct gss_eap_crypt_cursor *cursor, const unsigned char *in, size_t length)
+{
+    unsigned char *data;
+    size_t n;
+
+    while (length != 0) {
+        n = MIN(cursorPeek(cursor, &data), length);
+        GSSEAP_ASSERT(n != 0);
+        memcpy(data, in, n);
+        cursor->offset += n;
+        in += n;
+        length -= n;
+    }
+}
+
+/* HMAC-SHA1-96 over the cursor, with a copy of the keyed context */
+static int
+hmacSha1(const struct gss_eap_rfc3961_hmac *keyed,
+         struct gss_eap_crypt_cursor *cursor,
+         unsigned char *checksum)
+{
+    EVP_MD_CTX *md;
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned char *data;
+    size_t length;
+    unsigned int macLength;
+    int code = GSSEAP_CRYPTO_FAILURE;
+
+    md = EVP_MD_CTX_new();
+    if (md == NULL)
+        return ENOMEM;
+
+    if (EVP_MD_CTX_copy_ex(md, keyed->inner) != 1)
+        goto cleanup;
+
+    while ((length = cursorPeek(cursor, &data)) != 0) {
+        if (EVP_DigestUpdate(md, data, length) != 1)
+            goto cleanup;
+        cursor->offset += length;
+    }
+
+    if (EVP_DigestFinal_ex(md, mac, &macLength) != 1 ||
+        EVP_MD_CTX_copy_ex(md, keyed->outer) != 1 ||
+        EVP_DigestUpdate(md, mac, macLength) != 1 ||
+        EVP_DigestFinal_ex(md, mac, &macLength) != 1 ||
+        macLength < RFC3961_CHECKSUM_LENGTH)
+        goto cleanup;
+
+    memcpy(checksum, mac, RFC3961_CHECKSUM_LENGTH);
+    code = 0;
+
+cleanup:
+    EVP_MD_CTX_free(md);
+    OPENSSL_cleanse(mac, sizeof(mac));
+
+    return code;
+}
+
+/*
+ * AES-CBC with ciphertext stealing (RFC 3962): zero IV, and the last two
+ * blocks always swapped, even when the last one is full. Whole blocks
+ * are transformed in the caller's buffers, with a copy of the keyed
+ * context.
+ */
+static int
+cbcCts(const EVP_CIPHER_CTX *keyed,
+       struct gss_eap_crypt_cursor *cursor, int encrypt)
+{
+    EVP_CIPHER_CTX *cipher;
+    unsigned char iv[RFC3961_BLOCK_LENGTH] = { 0 };
+    unsigned char prev[RFC3961_BLOCK_LENGTH] = { 0 };
+    unsigned char tail[2 * RFC3961_BLOCK_LENGTH], out[2 * RFC3961_BLOCK_LENGTH];
+    struct gss_eap_crypt_cursor saved;
+    unsigned char *data;
+    size_t total, bulk, tailLength, n, i;
+    int len, code = GSSEAP_CRYPTO_FAILURE;
+
+    total = cursorLength(cursor);
+    if (total < RFC3961_BLOCK_LENGTH)
+        return GSSEAP_WRONG_SIZE;
+
+    cipher = EVP_CIPHER_CTX_new();
+    if (cipher == NULL)
+        return ENOMEM;
+
+    if (EVP_CIPHER_CTX_copy(cipher, keyed) != 1 ||
+        EVP_CipherInit_ex(cipher, NULL, NULL, NULL, iv, -1) != 1)
+        goto cleanup;
+
+    /* All but the last two blocks, the last of which may be partial */
+    if (total == RFC3961_BLOCK_LENGTH)
+        tailLength = total;
+    else
+        tailLength = ((total - 1) % RFC3961_BLOCK_LENGTH) + 1 + RFC3961_BLOCK_LENGTH;
+    bulk = total - tailLength;
+
+    while (bulk != 0) {
+        n = MIN(cursorPeek(cursor, &data), bulk);
+        n -= n % RFC3961_BLOCK_LENGTH;
+
+        if (n != 0) {
+            if (!encrypt)
+                memcpy(prev, data + n - RFC3961_BLOCK_LENGTH, RFC3961_BLOCK_LENGTH);
+            if (EVP_CipherUpdate(cipher, data, &len, data, (int)n) != 1)
+                goto cleanup;
+            cursor->offset += n;
+        } else {
+            /* A block split between buffers */
+            n = RFC3961_BLOCK_LENGTH;
+            saved = *cursor;
+            cursorRead(cursor, tail, n);
+            if (!encrypt)
+                memcpy(prev, tail, n);
+            if (EVP_CipherUpdate(cipher, tail, &len, tail, (int)n) != 1)
+                goto cleanup;
+            cursorWrite(&saved, tail, n);
+        }
+        bulk -= n;
+    }
+
+    saved = *cursor;
+    cursorRead(cursor, tail, tailLength);
+
+    if (tailLength == RFC3961_BLOCK_LENGTH) {
+        if (EVP_CipherUpdate(cipher, out, &len, tail, RFC3961_BLOCK_LENGTH) != 1)
+            goto cleanup;
+    } else if (encrypt) {
+        n = tailLength - RFC3961_BLOCK_LENGTH;
+
+        /* Encrypt the zero-padded final block, then swap */
+        memset(tail + tailLength, 0, sizeof(tail) - tailLength);
+        if (EVP_CipherUpdate(cipher, tail, &len, tail, sizeof(tail)) != 1)
+            goto cleanup;
+        memcpy(out, tail + RFC3961_BLOCK_LENGTH, RFC3961_BLOCK_LENGTH);
+        memcpy(out + RFC3961_BLOCK_LENGTH, tail, n);
+    } else {
+        n = tailLength - RFC3961_BLOCK_LENGTH;
+
+        /*
+         * Decrypting the first (swapped) block yields the final plaintext
+         * XORed with the penultimate ciphertext block, whose missing
+         * bytes are those of the padding.
+         */
+        memset(iv, 0, sizeof(iv));
+        if (EVP_CipherInit_ex(cipher, NULL, NULL, NULL, iv, -1) != 1 ||
+            EVP_CipherUpdate(cipher, out, &len, tail, RFC3961_BLOCK_LENGTH) != 1)
+            goto cleanup;
+        memcpy(tail, tail + RFC3961_BLOCK_LENGTH, n);
+        memcpy(tail + n, out + n, RFC3961_BLOCK_LENGTH - n);
+        for (i = 0; i < n; i++)
+            out[RFC3961_BLOCK_LENGTH + i] = out[i] ^ tail[i];
+
+        if (EVP_CipherInit_ex(cipher, NULL, NULL, NULL, prev, -1) != 1 ||
+            EVP_CipherUpdate(cipher, out, &len, tail, RFC3961_BLOCK_LENGTH) != 1)
+            goto cleanup;
+    }
+
+    cursorWrite(&saved, out, tailLength);
+    code = 0;
+
+cleanup:
+    EVP_CIPHER_CTX_free(cipher);
+    OPENSSL_cleanse(tail, sizeof(tail));
+    OPENSSL_cleanse(out, sizeof(out));
+
+    return code;
+}
+
+/* Random bytes, e.g. confounders for gssEapEncrypt() */
+int
+gssEapRandom(unsigned char *buf, size_t length)
+{
+    if (RAND_bytes(buf, (int)length) != 1)
+        return GSSEAP_CRYPTO_FAILURE;
+
+    return 0;
+}
+
+/*
+ * Encrypt confounder | DATA and PADDING buffers | trailer in place, and
+ * compute the HMAC over them (and over any SIGN_ONLY buffers). The
+ * caller fills in the confounder with gssEapRandom().
+ */
+int
+gssEapEncrypt(const struct gss_eap_rfc3961_key *key,
+              int usage,
+              unsigned char *confounder,
+              gss_iov_buffer_desc *iov,
+              int iov_count,
+              unsigned char *trailer,
+              size_t trailerLength,
+              unsigned char *checksum)
+{
+    struct gss_eap_crypt_cursor cursor;
+    int code;
+
+    GSSEAP_ASSERT(usage >= KEY_USAGE_ACCEPTOR_SEAL && usage <= KEY_USAGE_INITIATOR_SIGN);
+
+    cursorInit(&cursor, confounder, RFC3961_CONFOUNDER_LENGTH,
+               iov, iov_count, trailer, trailerLength, 1);
+    code = hmacSha1(&key->usage[KEY_USAGE_INDEX(usage)].ki, &cursor, checksum);
+    if (code != 0)
+        return code;
+
+    cursorInit(&cursor, confounder, RFC3961_CONFOUNDER_LENGTH,
+               iov, iov_count, trailer, trailerLength, 0);
+    return cbcCts(key->usage[KEY_USAGE_INDEX(usage)].encrypt, &cursor, 1);
+}
+
+/*
+ * The reverse of gssEapEncrypt(). Returns GSSEAP_BAD_WRAP_TOKEN if the
+ * HMAC does not match.
+ */
+int
+gssEapDecrypt(const struct gss_eap_rfc3961_key *key,
+              int usage,
+              unsigned char *confounder,
+              gss_iov_buffer_desc *iov,
+              int iov_count,
+              unsigned char *trailer,
+              size_t trailerLength,
+              const unsigned char *checksum)
+{
+    struct gss_eap_crypt_cursor cursor;
+    unsigned char computed[RFC3961_CHECKSUM_LENGTH];
+    int code;
+
+    GSSEAP_ASSERT(usage >= KEY_USAGE_ACCEPTOR_SEAL && usage <= KEY_USAGE_INITIATOR_SIGN);
+
+    cursorInit(&cursor, confounder, RFC3961_CONFOUNDER_LENGTH,
+               iov, iov_count, trailer, trailerLength, 0);
+    code = cbcCts(key->usage[KEY_USAGE_INDEX(usage)].decrypt, &cursor, 0);
+    if (code != 0)
+        return code;
+
+    cursorInit(&cursor, confounder, RFC3961_CONFOUNDER_LENGTH,
+               iov, iov_count, trailer, trailerLength, 1);
+    code = hmacSha1(&key->usage[KEY_USAGE_INDEX(usage)].ki, &cursor, computed);
+    if (code != 0)
+        return code;
+
+    if (CRYPTO_memcmp(computed, checksum, sizeof(computed)) != 0)
+        return GSSEAP_BAD_WRAP_TOKEN;
+
+    return 0;
+}
+
+/*
+ * Checksum the DATA, SIGN_ONLY and PADDING buffers followed by the token
+ * header, as for MIC and integrity-only wrap tokens.
+ */
+int
+gssEapSign(const struct gss_eap_rfc3961_key *key,
+           int usage,
+           gss_iov_buffer_desc *iov,
+           int iov_count,
+           const unsigned char *header,
+           unsigned char *checksum)
+{
+    struct gss_eap_crypt_cursor cursor;
+
+    GSSEAP_ASSERT(usage >= KEY_USAGE_ACCEPTOR_SEAL && usage <= KEY_USAGE_INITIATOR_SIGN);
+
+    cursorInit(&cursor, NULL, 0, iov, iov_count,
+               (unsigned char *)header, 16, 1);
+
+    return hmacSha1(&key->usage[KEY_USAGE_INDEX(usage)].kc, &cursor, checksum);
+}
+
+int
+gssEapVerify(const struct gss_eap_rfc3961_key *key,
+             int usage,
+             gss_iov_buffer_desc *iov,
+             int iov_count,
+             const unsigned char *header,
+             const unsigned char *checksum,
+             int *valid)
+{
+    unsigned char computed[RFC3961_CHECKSUM_LENGTH];
+    int code;
+
+    *valid = 0;
+
+    code = gssEapSign(key, usage, iov, iov_count, header, computed);
+    if (code != 0)
+        return code;
+
+    *valid = (CRYPTO_memcmp(computed, checksum, sizeof(computed)) == 0);
+
+    return 0;
+}
@@ -0,0 +1,1546 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * HTTP transport to the IdP's ECP endpoint.
+ *
+ * libcurl easy handles are pooled per process and handed back, keyed by
+ * URL, to later requests for the same endpoint. All transfers, blocking
+ * or not, run on one process-wide multi handle, which owns the
+ * connections; where the IdP supports HTTP/2, concurrent requests are
+ * multiplexed over a single connection rather than each opening its
+ * own. The handles are also attached to one share object, so the DNS
+ * and TLS session caches are common to all threads.
+ *
+ * An IdP may be given as a list of equivalent ECP endpoints. Each request
+ * tries them in order of health and recent latency, and moves on to the
+ * next as soon as one cannot be reached or times out.
+ */
+
+#include "gssapiP_eap.h"
+
+#include <ctype.h>
+#include <limits.h>
+
+#include <curl/curl.h>
+
+/*
+ * curl 7.x and 8.x before 8.12 cannot import or export TLS sessions, so
+ * the file-backed session cache is only available with newer libraries.
+ */
+#if !defined(WIN32) && LIBCURL_VERSION_NUM >= 0x080c00
+#define GSSEAP_TLS_SESSION_CACHE 1
+#include <sys/param.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+/* Tells which connection a transfer is on, even while it is in flight */
+#if LIBCURL_VERSION_NUM >= 0x080200
+#define GSSEAP_HTTP_CONN_ID         1
+#endif
+
+/* Maximum number of idle handles kept in the pool */
+#define GSSEAP_HTTP_POOL_MAX        8
+
+/* Default limit on the size of a response; see SAML_EC_IDP_MAX_RESPONSE */
+#define GSSEAP_HTTP_RESPONSE_MAX    (4 * 1024 * 1024)
+
+/* Default timeouts; see SAML_EC_IDP_CONNECT_TIMEOUT and SAML_EC_IDP_TIMEOUT */
+#define GSSEAP_HTTP_CONNECT_TIMEOUT 5000    /* ms */
+#define GSSEAP_HTTP_TIMEOUT         60000   /* ms */
+
+/* Maximum number of endpoints tried for one request */
+#define GSSEAP_HTTP_ENDPOINTS_MAX   8
+
+/* A failed endpoint is passed over for this long, doubling per failure */
+#define GSSEAP_HTTP_RETRY_MIN       30      /* s */
+#define GSSEAP_HTTP_RETRY_MAX       600     /* s */
+
+struct gss_eap_http_handle {
+    struct gss_eap_http_handle *next;
+    char *url;
+    CURL *curl;
+};
+
+static GSSEAP_THREAD_ONCE gssEapHttpInitOnce = GSSEAP_ONCE_INITIALIZER;
+static OM_uint32 gssEapHttpInitStatus = GSS_S_UNAVAILABLE;
+static GSSEAP_MUTEX gssEapHttpPoolMutex;
+static struct gss_eap_http_handle *gssEapHttpPool;
+static unsigned int gssEapHttpPoolCount;
+static CURLSH *gssEapHttpShare;
+static GSSEAP_MUTEX gssEapHttpMultiMutex;
+static CURLM *gssEapHttpMulti;
+static GSSEAP_MUTEX gssEapHttpPromptMutex;
+static uint64_t gssEapHttpMultiWanted;
+static uint64_t gssEapHttpResponses;
+static uint64_t gssEapHttpWireBytes;
+static uint64_t gssEapHttpDecodedBytes;
+static size_t gssEapHttpMaxResponse = GSSEAP_HTTP_RESPONSE_MAX;
+static long gssEapHttpConnectTimeout = GSSEAP_HTTP_CONNECT_TIMEOUT;
+static long gssEapHttpTimeout = GSSEAP_HTTP_TIMEOUT;
+static char *gssEapHttpAcceptEncoding;
+static char *gssEapHttpCaFile;
+static GSSEAP_MUTEX gssEapHttpShareMutex[CURL_LOCK_DATA_LAST];
+
+/*
+ * A socket the transport is waiting on, as libcurl reported it to
+ * socketChanged(), with the transfer that last asked for it.
+ */
+struct gss_eap_http_socket {
+    curl_socket_t fd;
+    int events;
+    CURL *curl;
+#ifdef GSSEAP_HTTP_CONN_ID
+    curl_off_t connId;          /* of the connection it carries */
+#endif
+};
+
+/* Guarded by the multi mutex */
+static struct gss_eap_http_socket *gssEapHttpSockets;
+static unsigned int gssEapHttpSocketCount;
+static unsigned int gssEapHttpSocketCapacity;
+
+/*
+ * What we have learnt about one IdP endpoint. Records are kept, keyed by
+ * URL, for the life of the process.
+ */
+struct gss_eap_http_endpoint {
+    struct gss_eap_http_endpoint *next;
+    char *url;
+    long latency;               /* smoothed, in ms; 0 if never measured */
+    unsigned int failures;      /* consecutive */
+    time_t retryAfter;          /* passed over until then */
+};
+
+static GSSEAP_MUTEX gssEapHttpEndpointMutex;
+static struct gss_eap_http_endpoint *gssEapHttpEndpoints;
+
+static void
+gssEapHttpShareLock(CURL *curl GSSEAP_UNUSED,
+                    curl_lock_data data,
+                    curl_lock_access access GSSEAP_UNUSED,
+                    void *userptr GSSEAP_UNUSED)
+{
+    GSSEAP_MUTEX_LOCK(&gssEapHttpShareMutex[data]);
+}
+
+static void
+gssEapHttpShareUnlock(CURL *curl GSSEAP_UNUSED,
+                      curl_lock_data data,
+                      void *userptr GSSEAP_UNUSED)
+{
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpShareMutex[data]);
+}
+
+#ifdef GSSEAP_TLS_SESSION_CACHE
+/*
+ * File-backed TLS session cache, so that short-lived processes can resume
+ * a session established by an earlier one. The file is a fixed array of
+ * slots, mapped shared and serialised between processes with flock().
+ * As a flock() lock belongs to the open file, which all our threads
+ * share, threads are serialised by gssEapTlsCacheMutex as well. Sessions
+ * are imported into the share when the transport is initialised, and the
+ * share's sessions are written back after each successful request.
+ */
+#define TLS_CACHE_MAGIC             0x47454154  /* "GEAT" */
+#define TLS_CACHE_VERSION           1
+#define TLS_CACHE_SLOTS             8
+#define TLS_CACHE_SHMAC_MAX         128
+#define TLS_CACHE_SDATA_MAX         4096
+
+struct tls_cache_slot {
+    int64_t validUntil;
+    uint32_t shmacLength;
+    uint32_t sdataLength;
+    unsigned char shmac[TLS_CACHE_SHMAC_MAX];
+    unsigned char sdata[TLS_CACHE_SDATA_MAX];
+};
+
+struct tls_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    struct tls_cache_slot slots[TLS_CACHE_SLOTS];
+};
+
+static int gssEapTlsCacheFd = -1;
+static struct tls_cache_file *gssEapTlsCache;
+static GSSEAP_MUTEX gssEapTlsCacheMutex;
+
+static void
+tlsCacheOpen(void)
+{
+    OM_uint32 major, minor;
+    char path[MAXPATHLEN];
+    struct stat sb;
+    void *map;
+    int fd;
+
+    major = gssEapTlsSessionCacheFile(&minor, path, sizeof(path));
+    if (major != GSS_S_COMPLETE)
+        return;
+
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return;
+
+    /* The file holds session secrets; insist that only we can read it */
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+        sb.st_uid != getuid() || (sb.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+        goto fail;
+
+    if (flock(fd, LOCK_EX) != 0)
+        goto fail;
+    if (sb.st_size != sizeof(struct tls_cache_file) &&
+        ftruncate(fd, sizeof(struct tls_cache_file)) != 0) {
+        flock(fd, LOCK_UN);
+        goto fail;
+    }
+
+    map = mmap(NULL, sizeof(struct tls_cache_file),
+               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        flock(fd, LOCK_UN);
+        goto fail;
+    }
+
+    gssEapTlsCache = map;
+    if (gssEapTlsCache->magic != TLS_CACHE_MAGIC ||
+        gssEapTlsCache->version != TLS_CACHE_VERSION ||
+        gssEapTlsCache->count > TLS_CACHE_SLOTS) {
+        memset(gssEapTlsCache, 0, sizeof(*gssEapTlsCache));
+        gssEapTlsCache->magic = TLS_CACHE_MAGIC;
+        gssEapTlsCache->version = TLS_CACHE_VERSION;
+    }
+    flock(fd, LOCK_UN);
+
+    if (GSSEAP_MUTEX_INIT(&gssEapTlsCacheMutex) != 0) {
+        munmap(gssEapTlsCache, sizeof(*gssEapTlsCache));
+        gssEapTlsCache = NULL;
+        goto fail;
+    }
+
+    gssEapTlsCacheFd = fd;
+    return;
+
+fail:
+    close(fd);
+}
+
+static void
+tlsCacheClose(void)
+{
+    if (gssEapTlsCache != NULL)
+        munmap(gssEapTlsCache, sizeof(*gssEapTlsCache));
+    gssEapTlsCache = NULL;
+
+    if (gssEapTlsCacheFd >= 0) {
+        close(gssEapTlsCacheFd);
+        GSSEAP_MUTEX_DESTROY(&gssEapTlsCacheMutex);
+    }
+    gssEapTlsCacheFd = -1;
+}
+
+static void
+tlsCacheImport(void)
+{
+    struct tls_cache_slot *slot;
+    time_t now = time(NULL);
+    CURL *curl;
+    uint32_t i;
+
+    if (gssEapTlsCache == NULL)
+        return;
+
+    curl = curl_easy_init();
+    if (curl == NULL)
+        return;
+
+    GSSEAP_MUTEX_LOCK(&gssEapTlsCacheMutex);
+
+    if (curl_easy_setopt(curl, CURLOPT_SHARE, gssEapHttpShare) == CURLE_OK &&
+        flock(gssEapTlsCacheFd, LOCK_SH) == 0) {
+        for (i = 0; i < gssEapTlsCache->count; i++) {
+            slot = &gssEapTlsCache->slots[i];
+
+            if (slot->validUntil <= now ||
+                slot->shmacLength > TLS_CACHE_SHMAC_MAX ||
+                slot->sdataLength > TLS_CACHE_SDATA_MAX)
+                continue;
+
+            curl_easy_ssls_import(curl, NULL,
+                                  slot->shmac, slot->shmacLength,
+                                  slot->sdata, slot->sdataLength);
+        }
+        flock(gssEapTlsCacheFd, LOCK_UN);
+    }
+
+    GSSEAP_MUTEX_UNLOCK(&gssEapTlsCacheMutex);
+
+    curl_easy_cleanup(curl);
+}
+
+static CURLcode
+tlsCacheExportSession(CURL *curl GSSEAP_UNUSED,
+                      void *userptr GSSEAP_UNUSED,
+                      const char *sessionKey GSSEAP_UNUSED,
+                      const unsigned char *shmac,
+                      size_t shmacLength,
+                      const unsigned char *sdata,
+                      size_t sdataLength,
+                      curl_off_t validUntil,
+                      int ietfTlsId GSSEAP_UNUSED,
+                      const char *alpn GSSEAP_UNUSED,
+                      size_t earlyDataMax GSSEAP_UNUSED)
+{
+    struct tls_cache_slot *slot;
+
+    if (gssEapTlsCache->count == TLS_CACHE_SLOTS ||
+        shmacLength > TLS_CACHE_SHMAC_MAX ||
+        sdataLength > TLS_CACHE_SDATA_MAX)
+        return CURLE_OK;
+
+    slot = &gssEapTlsCache->slots[gssEapTlsCache->count++];
+    slot->validUntil = validUntil;
+    slot->shmacLength = shmacLength;
+    slot->sdataLength = sdataLength;
+    memcpy(slot->shmac, shmac, shmacLength);
+    memcpy(slot->sdata, sdata, sdataLength);
+
+    return CURLE_OK;
+}
+
+/*
+ * Replace the file's contents with the sessions now in the share, which
+ * include those imported from the file at startup.
+ */
+static void
+tlsCacheExport(CURL *curl)
+{
+    if (gssEapTlsCache == NULL)
+        return;
+
+    GSSEAP_MUTEX_LOCK(&gssEapTlsCacheMutex);
+
+    if (flock(gssEapTlsCacheFd, LOCK_EX) == 0) {
+        gssEapTlsCache->count = 0;
+        curl_easy_ssls_export(curl, tlsCacheExportSession, NULL);
+        memset(&gssEapTlsCache->slots[gssEapTlsCache->count], 0,
+               (TLS_CACHE_SLOTS - gssEapTlsCache->count) * sizeof(struct tls_cache_slot));
+
+        flock(gssEapTlsCacheFd, LOCK_UN);
+    }
+
+    GSSEAP_MUTEX_UNLOCK(&gssEapTlsCacheMutex);
+}
+#endif /* GSSEAP_TLS_SESSION_CACHE */
+
+/*
+ * Read a positive decimal number from the environment, leaving *pValue
+ * unchanged if the variable is unset or malformed.
+ */
+static void
+getenvNumber(const char *name, unsigned long *pValue)
+{
+    const char *value = getenv(name);
+    char *end;
+    unsigned long n;
+
+    if (value == NULL || *value == '\0')
+        return;
+
+    n = strtoul(value, &end, 10);
+    if (*end == '\0' && n != 0 && n <= LONG_MAX)
+        *pValue = n;
+}
+
+/*
+ * CURLMOPT_SOCKETFUNCTION: keep the table of sockets up to date. It is
+ * called from within the curl_multi_*() calls, so with the multi mutex
+ * held.
+ */
+static int
+socketChanged(CURL *curl,
+              curl_socket_t fd,
+              int what,
+              void *userp GSSEAP_UNUSED,
+              void *socketp GSSEAP_UNUSED)
+{
+    struct gss_eap_http_socket *sock;
+    unsigned int i;
+
+    for (i = 0; i < gssEapHttpSocketCount; i++) {
+        if (gssEapHttpSockets[i].fd == fd)
+            break;
+    }
+
+    if (what == CURL_POLL_REMOVE) {
+        if (i < gssEapHttpSocketCount)
+            gssEapHttpSockets[i] = gssEapHttpSockets[--gssEapHttpSocketCount];
+        return 0;
+    }
+
+    if (i == gssEapHttpSocketCount) {
+        if (gssEapHttpSocketCount == gssEapHttpSocketCapacity) {
+            unsigned int capacity = gssEapHttpSocketCapacity ?
+                                    2 * gssEapHttpSocketCapacity : 8;
+
+            sock = GSSEAP_REALLOC(gssEapHttpSockets, capacity * sizeof(*sock));
+            if (sock == NULL)
+                return -1;
+            gssEapHttpSockets = sock;
+            gssEapHttpSocketCapacity = capacity;
+        }
+        gssEapHttpSocketCount++;
+    }
+
+    sock = &gssEapHttpSockets[i];
+    sock->fd = fd;
+    sock->events = 0;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+        sock->events |= GSSEAP_HTTP_POLL_IN;
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+        sock->events |= GSSEAP_HTTP_POLL_OUT;
+    sock->curl = curl;
+#ifdef GSSEAP_HTTP_CONN_ID
+    sock->connId = -1;
+    curl_easy_getinfo(curl, CURLINFO_CONN_ID, &sock->connId);
+#endif
+
+    return 0;
+}
+
+/*
+ * The transfer on curl has left the multi handle; it no longer owns
+ * whatever sockets it last asked for. Called with the multi mutex held.
+ */
+static void
+forgetSockets(CURL *curl)
+{
+    unsigned int i;
+
+    for (i = 0; i < gssEapHttpSocketCount; i++) {
+        if (gssEapHttpSockets[i].curl == curl)
+            gssEapHttpSockets[i].curl = NULL;
+    }
+}
+
+GSSEAP_ONCE_CALLBACK(gssEapHttpInitInternal)
+{
+    const char *acceptEncoding, *caFile;
+    unsigned long n;
+    int i;
+
+    GSSEAP_ASSERT(gssEapHttpInitStatus == GSS_S_UNAVAILABLE);
+
+    gssEapHttpInitStatus = GSS_S_FAILURE;
+
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+        goto cleanup;
+
+    n = gssEapHttpMaxResponse;
+    getenvNumber("SAML_EC_IDP_MAX_RESPONSE", &n);
+    gssEapHttpMaxResponse = n;
+
+    n = gssEapHttpConnectTimeout;
+    getenvNumber("SAML_EC_IDP_CONNECT_TIMEOUT", &n);
+    gssEapHttpConnectTimeout = n;
+
+    n = gssEapHttpTimeout;
+    getenvNumber("SAML_EC_IDP_TIMEOUT", &n);
+    gssEapHttpTimeout = n;
+
+    /*
+     * Ask for a compressed response only if configured to: an empty
+     * value offers every encoding libcurl was built with (gzip, deflate
+     * and, where available, br and zstd), otherwise it is sent as is.
+     */
+    acceptEncoding = getenv("SAML_EC_IDP_ACCEPT_ENCODING");
+    if (acceptEncoding != NULL) {
+        gssEapHttpAcceptEncoding = GSSEAP_MALLOC(strlen(acceptEncoding) + 1);
+        if (gssEapHttpAcceptEncoding == NULL)
+            goto cleanup;
+        strcpy(gssEapHttpAcceptEncoding, acceptEncoding);
+    }
+
+    /* Trust only these CAs for the IdP, rather than the system's */
+    caFile = getenv("SAML_EC_IDP_CA_FILE");
+    if (caFile != NULL && *caFile != '\0') {
+        gssEapHttpCaFile = GSSEAP_MALLOC(strlen(caFile) + 1);
+        if (gssEapHttpCaFile == NULL)
+            goto cleanup;
+        strcpy(gssEapHttpCaFile, caFile);
+    }
+
+    GSSEAP_MUTEX_INIT(&gssEapHttpPoolMutex);
+    GSSEAP_MUTEX_INIT(&gssEapHttpEndpointMutex);
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        GSSEAP_MUTEX_INIT(&gssEapHttpShareMutex[i]);
+
+    gssEapHttpShare = curl_share_init();
+    if (gssEapHttpShare == NULL)
+        goto cleanup;
+
+    curl_share_setopt(gssEapHttpShare, CURLSHOPT_LOCKFUNC, gssEapHttpShareLock);
+    curl_share_setopt(gssEapHttpShare, CURLSHOPT_UNLOCKFUNC, gssEapHttpShareUnlock);
+    curl_share_setopt(gssEapHttpShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(gssEapHttpShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    /*
+     * Connections are not shared: they belong to the multi handle, which
+     * is the only place HTTP/2 streams can be multiplexed onto them.
+     */
+    GSSEAP_MUTEX_INIT(&gssEapHttpMultiMutex);
+    GSSEAP_MUTEX_INIT(&gssEapHttpPromptMutex);
+    gssEapHttpMulti = curl_multi_init();
+    if (gssEapHttpMulti == NULL)
+        goto cleanup;
+#ifdef CURLPIPE_MULTIPLEX
+    curl_multi_setopt(gssEapHttpMulti, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+    curl_multi_setopt(gssEapHttpMulti, CURLMOPT_SOCKETFUNCTION, socketChanged);
+
+#ifdef GSSEAP_TLS_SESSION_CACHE
+    tlsCacheOpen();
+    tlsCacheImport();
+#endif
+
+    gssEapHttpInitStatus = GSS_S_COMPLETE;
+
+cleanup:
+    GSSEAP_ONCE_LEAVE;
+}
+
+static OM_uint32
+gssEapHttpInit(OM_uint32 *minor)
+{
+    GSSEAP_ONCE(&gssEapHttpInitOnce, gssEapHttpInitInternal);
+
+    if (GSS_ERROR(gssEapHttpInitStatus)) {
+        *minor = GSSEAP_BAD_USAGE;
+        return gssEapHttpInitStatus;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static void
+releaseHandle(struct gss_eap_http_handle *handle)
+{
+    if (handle->curl != NULL)
+        curl_easy_cleanup(handle->curl);
+    GSSEAP_FREE(handle->url);
+    GSSEAP_FREE(handle);
+}
+
+void
+gssEapHttpFinalize(void)
+{
+    struct gss_eap_http_handle *handle, *next;
+    struct gss_eap_http_endpoint *endpoint, *nextEndpoint;
+    int i;
+
+    if (gssEapHttpInitStatus != GSS_S_COMPLETE)
+        return;
+
+#ifdef GSSEAP_DEBUG
+    {
+        struct gss_eap_http_stats stats;
+
+        gssEapHttpStats(&stats);
+        fprintf(stderr, "IdP responses: %llu, %llu bytes received, "
+                "%llu bytes decoded\n",
+                (unsigned long long)stats.responses,
+                (unsigned long long)stats.wireBytes,
+                (unsigned long long)stats.decodedBytes);
+    }
+#endif
+
+    for (endpoint = gssEapHttpEndpoints; endpoint != NULL; endpoint = nextEndpoint) {
+        nextEndpoint = endpoint->next;
+        GSSEAP_FREE(endpoint->url);
+        GSSEAP_FREE(endpoint);
+    }
+    gssEapHttpEndpoints = NULL;
+    GSSEAP_MUTEX_DESTROY(&gssEapHttpEndpointMutex);
+
+    for (handle = gssEapHttpPool; handle != NULL; handle = next) {
+        next = handle->next;
+        releaseHandle(handle);
+    }
+    gssEapHttpPool = NULL;
+    gssEapHttpPoolCount = 0;
+
+    curl_multi_cleanup(gssEapHttpMulti);
+    gssEapHttpMulti = NULL;
+    GSSEAP_FREE(gssEapHttpSockets);
+    gssEapHttpSockets = NULL;
+    gssEapHttpSocketCount = 0;
+    gssEapHttpSocketCapacity = 0;
+    GSSEAP_MUTEX_DESTROY(&gssEapHttpMultiMutex);
+    GSSEAP_MUTEX_DESTROY(&gssEapHttpPromptMutex);
+
+    curl_share_cleanup(gssEapHttpShare);
+    gssEapHttpShare = NULL;
+
+    GSSEAP_FREE(gssEapHttpAcceptEncoding);
+    gssEapHttpAcceptEncoding = NULL;
+    GSSEAP_FREE(gssEapHttpCaFile);
+    gssEapHttpCaFile = NULL;
+
+#ifdef GSSEAP_TLS_SESSION_CACHE
+    tlsCacheClose();
+#endif
+
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        GSSEAP_MUTEX_DESTROY(&gssEapHttpShareMutex[i]);
+    GSSEAP_MUTEX_DESTROY(&gssEapHttpPoolMutex);
+
+    curl_global_cleanup();
+
+    gssEapHttpInitStatus = GSS_S_UNAVAILABLE;
+}
+
+/*
+ * Take an idle handle for url from the pool, preferring one that last
+ * talked to url (and so may hold a live connection to it), or make a new
+ * one.
+ */
+static struct gss_eap_http_handle *
+acquireHandle(const char *url)
+{
+    struct gss_eap_http_handle *handle, **prev;
+
+    GSSEAP_MUTEX_LOCK(&gssEapHttpPoolMutex);
+    for (prev = &gssEapHttpPool; *prev != NULL; prev = &(*prev)->next) {
+        if (strcmp((*prev)->url, url) == 0)
+            break;
+    }
+    if (*prev == NULL && gssEapHttpPool != NULL)
+        prev = &gssEapHttpPool;
+    handle = *prev;
+    if (handle != NULL) {
+        *prev = handle->next;
+        gssEapHttpPoolCount--;
+    }
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpPoolMutex);
+
+    if (handle != NULL) {
+        if (strcmp(handle->url, url) != 0) {
+            char *s = GSSEAP_MALLOC(strlen(url) + 1);
+
+            if (s == NULL) {
+                releaseHandle(handle);
+                return NULL;
+            }
+            strcpy(s, url);
+            GSSEAP_FREE(handle->url);
+            handle->url = s;
+        }
+        return handle;
+    }
+
+    handle = GSSEAP_CALLOC(1, sizeof(*handle));
+    if (handle == NULL)
+        return NULL;
+
+    handle->url = GSSEAP_MALLOC(strlen(url) + 1);
+    handle->curl = curl_easy_init();
+    if (handle->url == NULL || handle->curl == NULL) {
+        releaseHandle(handle);
+        return NULL;
+    }
+    strcpy(handle->url, url);
+
+    return handle;
+}
+
+static void
+returnHandle(struct gss_eap_http_handle *handle)
+{
+    /* Forget the credentials and buffers, but not the connection */
+    curl_easy_reset(handle->curl);
+
+    GSSEAP_MUTEX_LOCK(&gssEapHttpPoolMutex);
+    if (gssEapHttpPoolCount < GSSEAP_HTTP_POOL_MAX) {
+        handle->next = gssEapHttpPool;
+        gssEapHttpPool = handle;
+        gssEapHttpPoolCount++;
+        handle = NULL;
+    }
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpPoolMutex);
+
+    if (handle != NULL)
+        releaseHandle(handle);
+}
+
+/* Called with the endpoint mutex held */
+static struct gss_eap_http_endpoint *
+findEndpoint(const char *url, size_t urlLength)
+{
+    struct gss_eap_http_endpoint *endpoint;
+
+    for (endpoint = gssEapHttpEndpoints; endpoint != NULL; endpoint = endpoint->next) {
+        if (strlen(endpoint->url) == urlLength &&
+            memcmp(endpoint->url, url, urlLength) == 0)
+            return endpoint;
+    }
+
+    endpoint = GSSEAP_CALLOC(1, sizeof(*endpoint));
+    if (endpoint == NULL)
+        return NULL;
+
+    endpoint->url = GSSEAP_MALLOC(urlLength + 1);
+    if (endpoint->url == NULL) {
+        GSSEAP_FREE(endpoint);
+        return NULL;
+    }
+    memcpy(endpoint->url, url, urlLength);
+    endpoint->url[urlLength] = '\0';
+
+    endpoint->next = gssEapHttpEndpoints;
+    gssEapHttpEndpoints = endpoint;
+
+    return endpoint;
+}
+
+/*
+ * Order the endpoints of a whitespace separated list for a request:
+ * those in good health first, by smoothed latency, with endpoints not
+ * yet measured ahead so that they are tried once; then those that failed
+ * recently, which are still worth a try if nothing else answers. Ties
+ * keep the configured order. Returns the number of endpoints.
+ */
+static unsigned int
+selectEndpoints(const char *urls,
+                struct gss_eap_http_endpoint **endpoints)
+{
+    struct gss_eap_http_endpoint *endpoint;
+    long rank[GSSEAP_HTTP_ENDPOINTS_MAX];
+    unsigned int count = 0, i;
+    time_t now = time(NULL);
+    const char *p = urls;
+
+    GSSEAP_MUTEX_LOCK(&gssEapHttpEndpointMutex);
+    while (*p != '\0') {
+        size_t length;
+        long r;
+
+        while (isspace((unsigned char)*p))
+            p++;
+        for (length = 0; p[length] != '\0' && !isspace((unsigned char)p[length]); length++)
+            ;
+        if (length == 0)
+            break;
+
+        if (count == GSSEAP_HTTP_ENDPOINTS_MAX) {
+            fprintf(stderr, "WARNING: only the first %d IdP endpoints "
+                            "are used\n", GSSEAP_HTTP_ENDPOINTS_MAX);
+            break;
+        }
+
+        endpoint = findEndpoint(p, length);
+        p += length;
+        if (endpoint == NULL)
+            continue;
+
+        r = endpoint->retryAfter > now ? LONG_MAX : endpoint->latency;
+
+        /* Insertion sort, after any equal ranks */
+        for (i = count; i > 0 && rank[i - 1] > r; i--) {
+            endpoints[i] = endpoints[i - 1];
+            rank[i] = rank[i - 1];
+        }
+        endpoints[i] = endpoint;
+        rank[i] = r;
+        count++;
+    }
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpEndpointMutex);
+
+    return count;
+}
+
+static void
+endpointSucceeded(struct gss_eap_http_endpoint *endpoint, long latency)
+{
+    if (latency < 1)
+        latency = 1;
+
+    GSSEAP_MUTEX_LOCK(&gssEapHttpEndpointMutex);
+    endpoint->failures = 0;
+    endpoint->retryAfter = 0;
+    if (endpoint->latency == 0)
+        endpoint->latency = latency;
+    else
+        endpoint->latency = (7 * endpoint->latency + latency) / 8;
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpEndpointMutex);
+}
+
+static void
+endpointFailed(struct gss_eap_http_endpoint *endpoint)
+{
+    time_t backoff = GSSEAP_HTTP_RETRY_MIN;
+    unsigned int i;
+
+    GSSEAP_MUTEX_LOCK(&gssEapHttpEndpointMutex);
+    endpoint->failures++;
+    for (i = 1; i < endpoint->failures && backoff < GSSEAP_HTTP_RETRY_MAX; i++)
+        backoff *= 2;
+    if (backoff > GSSEAP_HTTP_RETRY_MAX)
+        backoff = GSSEAP_HTTP_RETRY_MAX;
+    endpoint->retryAfter = time(NULL) + backoff;
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpEndpointMutex);
+}
+
+/*
+ * Whether a transfer failed in a way that says nothing about the request
+ * itself, so that another endpoint may well succeed. A 500 is not one of
+ * these: it is how SOAP faults are returned.
+ */
+static int
+isEndpointFailure(CURLcode result, long httpCode)
+{
+    switch (result) {
+    case CURLE_OK:
+        return httpCode == 502 || httpCode == 503 || httpCode == 504;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+
+
+/* Upper bound on how long a caller waits between checks */
+#define GSSEAP_HTTP_POLL_INTERVAL   100 /* ms */
+
+struct gss_eap_http_request {
+    struct gss_eap_http_handle *handle;
+    struct gss_eap_http_endpoint *endpoints[GSSEAP_HTTP_ENDPOINTS_MAX];
+    unsigned int endpointCount;
+    unsigned int endpointIndex;
+    char *user;
+    char *password;
+    void *body;
+    size_t bodyLength;
+    gss_buffer_desc response;
+    size_t responseCapacity;
+    int tooLarge;
+    int attached;
+    int done;
+    CURLcode result;
+    char errbuf[CURL_ERROR_SIZE];
+};
+
+static size_t
+writeResponse(void *ptr, size_t size, size_t nmemb, void *userp)
+{
+    struct gss_eap_http_request *request = userp;
+    size_t numbytes = size * nmemb;
+    size_t sizeHint = 0;
+    OM_uint32 tmpMinor;
+
+    if (numbytes > gssEapHttpMaxResponse - request->response.length) {
+        request->tooLarge = 1;
+        return 0;
+    }
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+    /*
+     * Size the buffer for the whole body at once, if we know its length.
+     * For a compressed body this is only a lower bound, and the limit
+     * applies to the decoded bytes.
+     */
+    if (request->response.value == NULL) {
+        curl_off_t contentLength = -1;
+
+        if (curl_easy_getinfo(request->handle->curl,
+                              CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                              &contentLength) == CURLE_OK &&
+            contentLength > 0 &&
+            (curl_off_t)gssEapHttpMaxResponse >= contentLength)
+            sizeHint = (size_t)contentLength;
+    }
+#endif
+
+    if (GSS_ERROR(appendToBuffer(&tmpMinor, &request->response,
+                                 &request->responseCapacity,
+                                 ptr, numbytes, sizeHint)))
+        return 0;
+
+    return numbytes;
+}
+
+static CURLcode
+setPostOptions(CURL *curl,
+               struct gss_eap_http_request *request,
+               const char *url)
+{
+    const char *user = request->user;
+    const char *password = request->password;
+    size_t bodyLength = request->bodyLength;
+    CURLcode res;
+
+    request->errbuf[0] = '\0';
+
+    if ((res = curl_easy_setopt(curl, CURLOPT_SHARE, gssEapHttpShare)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_PRIVATE, request)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, request->errbuf)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_URL, url)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, gssEapHttpConnectTimeout)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, gssEapHttpTimeout)) != CURLE_OK ||
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        (res = curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS)) != CURLE_OK ||
+        /* Wait for a connection that can be multiplexed, rather than open another */
+        (res = curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L)) != CURLE_OK ||
+#endif
+        (res = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L)) != CURLE_OK ||
+        (gssEapHttpCaFile != NULL &&
+         (res = curl_easy_setopt(curl, CURLOPT_CAINFO, gssEapHttpCaFile)) != CURLE_OK) ||
+        (res = curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_USERNAME, user)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_PASSWORD, password ? password : "")) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_POST, 1L)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->body)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)bodyLength)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, gssEapHttpAcceptEncoding)) != CURLE_OK ||
+        /* Refuse early if the IdP announces a body that is too large */
+        (res = curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)gssEapHttpMaxResponse)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, request)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeResponse)) != CURLE_OK)
+        fprintf(stderr, "ERROR: curl_easy_setopt failure; %s\n", curl_easy_strerror(res));
+
+    return res;
+}
+
+/*
+ * Count how much of the response crossed the network against its size
+ * once decoded, to show what compression saves on a given link.
+ */
+static void
+countTransferSize(CURL *curl, size_t decodedLength)
+{
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t wireLength = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wireLength);
+#else
+    double wireLength = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &wireLength);
+#endif
+
+    GSSEAP_ATOMIC_FETCH_ADD64(&gssEapHttpResponses, 1);
+    GSSEAP_ATOMIC_FETCH_ADD64(&gssEapHttpWireBytes, (uint64_t)wireLength);
+    GSSEAP_ATOMIC_FETCH_ADD64(&gssEapHttpDecodedBytes, (uint64_t)decodedLength);
+}
+
+void
+gssEapHttpStats(struct gss_eap_http_stats *stats)
+{
+    stats->responses = GSSEAP_ATOMIC_LOAD64(&gssEapHttpResponses);
+    stats->wireBytes = GSSEAP_ATOMIC_LOAD64(&gssEapHttpWireBytes);
+    stats->decodedBytes = GSSEAP_ATOMIC_LOAD64(&gssEapHttpDecodedBytes);
+}
+
+/*
+ * Drive every transfer on the multi handle as far as it will go without
+ * blocking, and mark those that have finished. Called with the multi
+ * mutex held; any caller may complete any other caller's transfer.
+ */
+static void
+driveMulti(void)
+{
+    struct gss_eap_http_request *request;
+    curl_socket_t *fds;
+    unsigned int i, count = gssEapHttpSocketCount;
+    CURLMsg *msg;
+    int running, queued;
+
+    /*
+     * Let libcurl check every socket for itself, as curl_multi_perform()
+     * would, but through curl_multi_socket_action() so that it keeps
+     * socketChanged() informed. Acting on one socket can change the
+     * table, so work from a copy.
+     */
+    fds = count != 0 ? GSSEAP_MALLOC(count * sizeof(*fds)) : NULL;
+    if (fds == NULL)
+        count = 0;
+    for (i = 0; i < count; i++)
+        fds[i] = gssEapHttpSockets[i].fd;
+    for (i = 0; i < count; i++)
+        curl_multi_socket_action(gssEapHttpMulti, fds[i], 0, &running);
+    GSSEAP_FREE(fds);
+
+    /* Then whatever has fallen due, including transfers not yet started */
+    curl_multi_socket_action(gssEapHttpMulti, CURL_SOCKET_TIMEOUT, 0, &running);
+
+    while ((msg = curl_multi_info_read(gssEapHttpMulti, &queued)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        request = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+        curl_multi_remove_handle(gssEapHttpMulti, msg->easy_handle);
+        forgetSockets(msg->easy_handle);
+        if (request != NULL) {
+            request->result = msg->data.result;
+            request->attached = 0;
+            request->done = 1;
+        }
+    }
+}
+
+/*
+ * Take the multi mutex on behalf of a caller that must not block. A
+ * blocking caller may hold it while it waits in curl_multi_poll(), so
+ * ask that caller to let go, and have the others stand aside in
+ * waitMulti() until unlockMulti().
+ */
+static void
+lockMulti(void)
+{
+    GSSEAP_MUTEX_LOCK(&gssEapHttpPromptMutex);
+    GSSEAP_ATOMIC_FETCH_ADD64(&gssEapHttpMultiWanted, 1);
+#if LIBCURL_VERSION_NUM >= 0x074400
+    curl_multi_wakeup(gssEapHttpMulti);
+#endif
+    GSSEAP_MUTEX_LOCK(&gssEapHttpMultiMutex);
+}
+
+static void
+unlockMulti(void)
+{
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpMultiMutex);
+    GSSEAP_ATOMIC_FETCH_ADD64(&gssEapHttpMultiWanted, (uint64_t)-1);
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpPromptMutex);
+}
+
+void
+gssEapHttpRequestFree(struct gss_eap_http_request *request)
+{
+    OM_uint32 tmpMinor;
+
+    if (request == NULL)
+        return;
+
+    if (request->handle != NULL) {
+        lockMulti();
+        if (request->attached) {
+            curl_multi_remove_handle(gssEapHttpMulti, request->handle->curl);
+            forgetSockets(request->handle->curl);
+        }
+        unlockMulti();
+        /* Its state is unknown, so don't hand it to another request */
+        releaseHandle(request->handle);
+    }
+    if (request->password != NULL) {
+        memset(request->password, 0, strlen(request->password));
+        GSSEAP_FREE(request->password);
+    }
+    GSSEAP_FREE(request->user);
+    GSSEAP_FREE(request->body);
+    gss_release_buffer(&tmpMinor, &request->response);
+    GSSEAP_FREE(request);
+}
+
+static char *
+copyString(const char *s)
+{
+    char *copy = GSSEAP_MALLOC(strlen(s) + 1);
+
+    if (copy != NULL)
+        strcpy(copy, s);
+
+    return copy;
+}
+
+/*
+ * Send the request to its current endpoint, on a handle from the pool.
+ */
+static OM_uint32
+startTransfer(OM_uint32 *minor, struct gss_eap_http_request *request)
+{
+    const char *url = request->endpoints[request->endpointIndex]->url;
+    CURLMcode mres;
+
+    GSSEAP_ASSERT(request->handle == NULL);
+
+    request->handle = acquireHandle(url);
+    if (request->handle == NULL) {
+        fprintf(stderr, "ERROR: curl_easy_init failed\n");
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    if (setPostOptions(request->handle->curl, request, url) != CURLE_OK) {
+        releaseHandle(request->handle);
+        request->handle = NULL;
+        *minor = GSSEAP_BAD_USAGE;
+        return GSS_S_FAILURE;
+    }
+
+    lockMulti();
+    mres = curl_multi_add_handle(gssEapHttpMulti, request->handle->curl);
+    if (mres == CURLM_OK) {
+        request->attached = 1;
+        driveMulti();
+    }
+    unlockMulti();
+
+    if (mres != CURLM_OK) {
+        fprintf(stderr, "ERROR: curl_multi_add_handle failure; %s\n",
+                curl_multi_strerror(mres));
+        releaseHandle(request->handle);
+        request->handle = NULL;
+        *minor = GSSEAP_BAD_USAGE;
+        return GSS_S_FAILURE;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * Start a POST of body to url, with HTTP Basic authentication, on the
+ * shared multi handle. url may list several endpoints, separated by
+ * white space, to fail over between. The body is copied. Use
+ * gssEapHttpRequestStep() to collect the response.
+ */
+OM_uint32
+gssEapHttpPostStart(OM_uint32 *minor,
+                    const char *url,
+                    const char *user,
+                    const char *password,
+                    const void *body,
+                    size_t bodyLength,
+                    struct gss_eap_http_request **pRequest)
+{
+    OM_uint32 major;
+    struct gss_eap_http_request *request;
+
+    *pRequest = NULL;
+
+    major = gssEapHttpInit(minor);
+    if (GSS_ERROR(major))
+        return major;
+
+    request = GSSEAP_CALLOC(1, sizeof(*request));
+    if (request == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    request->endpointCount = selectEndpoints(url, request->endpoints);
+    if (request->endpointCount == 0) {
+        major = GSS_S_FAILURE;
+        *minor = GSSEAP_BAD_SERVICE_NAME;
+        goto cleanup;
+    }
+
+    request->body = GSSEAP_MALLOC(bodyLength ? bodyLength : 1);
+    request->user = copyString(user);
+    request->password = copyString(password ? password : "");
+    if (request->body == NULL || request->user == NULL ||
+        request->password == NULL) {
+        major = GSS_S_FAILURE;
+        *minor = ENOMEM;
+        goto cleanup;
+    }
+    memcpy(request->body, body, bodyLength);
+    request->bodyLength = bodyLength;
+
+    major = startTransfer(minor, request);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    *pRequest = request;
+    request = NULL;
+
+    major = GSS_S_COMPLETE;
+    *minor = 0;
+
+cleanup:
+    gssEapHttpRequestFree(request);
+
+    return major;
+}
+
+/*
+ * Finish with the current endpoint's transfer, recording how it went.
+ * If the endpoint failed and another remains, start over on that and
+ * return GSS_S_CONTINUE_NEEDED.
+ */
+static OM_uint32
+finishTransfer(OM_uint32 *minor, struct gss_eap_http_request *request)
+{
+    struct gss_eap_http_endpoint *endpoint;
+    CURL *curl = request->handle->curl;
+    long httpCode = 0;
+    OM_uint32 tmpMinor;
+
+    endpoint = request->endpoints[request->endpointIndex];
+
+    if (request->result == CURLE_OK)
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpCode);
+
+    if (request->tooLarge || !isEndpointFailure(request->result, httpCode)) {
+        if (request->result == CURLE_OK) {
+#if LIBCURL_VERSION_NUM >= 0x073d00
+            curl_off_t totalTime = 0;
+
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &totalTime);
+            endpointSucceeded(endpoint, (long)(totalTime / 1000));
+#else
+            double totalTime = 0;
+
+            curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &totalTime);
+            endpointSucceeded(endpoint, (long)(totalTime * 1000));
+#endif
+        }
+        return GSS_S_COMPLETE;
+    }
+
+    endpointFailed(endpoint);
+
+    if (request->endpointIndex + 1 == request->endpointCount)
+        return GSS_S_COMPLETE;
+
+    fprintf(stderr, "WARNING: IdP endpoint (%s) failed with return code "
+                    "(%d), HTTP status (%ld) and error (%s); trying (%s)\n",
+            endpoint->url, request->result, httpCode, request->errbuf,
+            request->endpoints[request->endpointIndex + 1]->url);
+
+    /* The connection may be unusable; don't keep the handle */
+    releaseHandle(request->handle);
+    request->handle = NULL;
+
+    gss_release_buffer(&tmpMinor, &request->response);
+    request->responseCapacity = 0;
+    request->result = CURLE_OK;
+    request->done = 0;
+    request->endpointIndex++;
+
+    if (GSS_ERROR(startTransfer(minor, request)))
+        return GSS_S_FAILURE;
+
+    return GSS_S_CONTINUE_NEEDED;
+}
+
+/*
+ * Collect the outcome of a request that has finished. Returns
+ * GSS_S_CONTINUE_NEEDED if it has moved on to another endpoint instead.
+ */
+static OM_uint32
+collectResponse(OM_uint32 *minor,
+                struct gss_eap_http_request *request,
+                gss_buffer_t response)
+{
+    struct gss_eap_http_handle *handle;
+    OM_uint32 major;
+
+    major = finishTransfer(minor, request);
+    if (major == GSS_S_CONTINUE_NEEDED) {
+        *minor = 0;
+        return major;
+    } else if (GSS_ERROR(major))
+        return major;
+
+    handle = request->handle;
+    request->handle = NULL;
+
+    if (request->result != CURLE_OK) {
+        fprintf(stderr, "ERROR: IdP request failed with return code "
+                        "(%d) and error (%s)\n", request->result, request->errbuf);
+        /* The connection may be unusable; don't keep the handle */
+        releaseHandle(handle);
+        if (request->tooLarge || request->result == CURLE_FILESIZE_EXCEEDED)
+            *minor = GSSEAP_IDP_RESPONSE_TOO_LARGE;
+        else
+            *minor = GSSEAP_BAD_USAGE;
+        return GSS_S_FAILURE;
+    }
+
+    countTransferSize(handle->curl, request->response.length);
+
+#ifdef GSSEAP_TLS_SESSION_CACHE
+    tlsCacheExport(handle->curl);
+#endif
+
+    returnHandle(handle);
+
+    *response = request->response;
+    request->response.length = 0;
+    request->response.value = NULL;
+    request->responseCapacity = 0;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * Make whatever progress is possible without blocking. Returns
+ * GSS_S_CONTINUE_NEEDED if the request is still in flight, otherwise
+ * the outcome, with the response body on success. Either way, once the
+ * request has finished it is of no further use except to be freed.
+ */
+OM_uint32
+gssEapHttpRequestStep(OM_uint32 *minor,
+                      struct gss_eap_http_request *request,
+                      gss_buffer_t response)
+{
+    int done;
+
+    if (request->handle == NULL) {
+        *minor = GSSEAP_BAD_USAGE;
+        return GSS_S_FAILURE;
+    }
+
+    lockMulti();
+    if (!request->done)
+        driveMulti();
+    done = request->done;
+    unlockMulti();
+
+    if (!done) {
+        *minor = 0;
+        return GSS_S_CONTINUE_NEEDED;
+    }
+
+    return collectResponse(minor, request, response);
+}
+
+/*
+ * Whether sock belongs to the transfer on curl: libcurl last asked for
+ * it on the transfer's behalf or, where libcurl can say so, it carries
+ * the connection the transfer is multiplexed onto.
+ */
+static int
+isRequestSocket(const struct gss_eap_http_socket *sock, CURL *curl)
+{
+#ifdef GSSEAP_HTTP_CONN_ID
+    curl_off_t connId = -1;
+#endif
+
+    if (sock->curl == curl)
+        return 1;
+
+#ifdef GSSEAP_HTTP_CONN_ID
+    curl_easy_getinfo(curl, CURLINFO_CONN_ID, &connId);
+    if (connId != -1 && sock->connId == connId)
+        return 1;
+#endif
+
+    return 0;
+}
+
+/*
+ * Add the socket at index i of the table to the poll set, unless it is
+ * there already.
+ */
+static OM_uint32
+addPollFd(OM_uint32 *minor,
+          unsigned int i,
+          struct gss_eap_http_pollfd **pFds,
+          unsigned int *pCount)
+{
+    struct gss_eap_http_pollfd *fds;
+    unsigned int j;
+
+    for (j = 0; j < *pCount; j++) {
+        if ((*pFds)[j].fd == (int)gssEapHttpSockets[i].fd)
+            return GSS_S_COMPLETE;
+    }
+
+    fds = GSSEAP_REALLOC(*pFds, (*pCount + 1) * sizeof(*fds));
+    if (fds == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    fds[*pCount].fd = (int)gssEapHttpSockets[i].fd;
+    fds[*pCount].events = gssEapHttpSockets[i].events;
+    *pFds = fds;
+    (*pCount)++;
+
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * Describe what this request is waiting for: a timeout in milliseconds
+ * (-1 for none) and the sockets of its own transfer, with the
+ * GSSEAP_HTTP_POLL_* events of interest. The sockets are returned in
+ * *pFds, which the caller frees with GSSEAP_FREE(). A request with no
+ * socket of its own, such as a stream waiting for another request's
+ * connection to come up, is given a short timeout instead.
+ */
+OM_uint32
+gssEapHttpRequestPollSet(OM_uint32 *minor,
+                         struct gss_eap_http_request *request,
+                         long *timeout,
+                         struct gss_eap_http_pollfd **pFds,
+                         unsigned int *pCount)
+{
+    OM_uint32 major = GSS_S_COMPLETE;
+    CURL *curl;
+    unsigned int i;
+
+    *timeout = -1;
+    *pFds = NULL;
+    *pCount = 0;
+
+    lockMulti();
+    if (request->done || request->handle == NULL) {
+        /* Ready now; the caller should step it without waiting */
+        *timeout = 0;
+    } else {
+        curl = request->handle->curl;
+
+        for (i = 0; i < gssEapHttpSocketCount; i++) {
+            if (!isRequestSocket(&gssEapHttpSockets[i], curl))
+                continue;
+
+            major = addPollFd(minor, i, pFds, pCount);
+            if (GSS_ERROR(major))
+                break;
+        }
+
+        curl_multi_timeout(gssEapHttpMulti, timeout);
+        if (*pCount == 0 &&
+            (*timeout < 0 || *timeout > GSSEAP_HTTP_POLL_INTERVAL))
+            *timeout = GSSEAP_HTTP_POLL_INTERVAL;
+    }
+    unlockMulti();
+
+    if (GSS_ERROR(major)) {
+        GSSEAP_FREE(*pFds);
+        *pFds = NULL;
+        *pCount = 0;
+        return major;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * Wait until one of the transport's sockets is ready or its next
+ * timeout falls due, and drive every transfer; return whether the
+ * request has finished. The multi handle may only be used by one thread
+ * at a time, so the mutex is held throughout, and callers that must not
+ * block take precedence (see lockMulti()).
+ */
+static int
+waitMulti(struct gss_eap_http_request *request)
+{
+    int done;
+
+    if (GSSEAP_ATOMIC_LOAD64(&gssEapHttpMultiWanted) != 0) {
+        /* Stand aside rather than contend with them for the mutex */
+        GSSEAP_MUTEX_LOCK(&gssEapHttpPromptMutex);
+        GSSEAP_MUTEX_UNLOCK(&gssEapHttpPromptMutex);
+    }
+
+    GSSEAP_MUTEX_LOCK(&gssEapHttpMultiMutex);
+    if (!request->done && GSSEAP_ATOMIC_LOAD64(&gssEapHttpMultiWanted) == 0) {
+#if LIBCURL_VERSION_NUM >= 0x074200
+        curl_multi_poll(gssEapHttpMulti, NULL, 0,
+                        GSSEAP_HTTP_POLL_INTERVAL, NULL);
+#else
+        curl_multi_wait(gssEapHttpMulti, NULL, 0,
+                        GSSEAP_HTTP_POLL_INTERVAL, NULL);
+#endif
+        driveMulti();
+    }
+    done = request->done;
+    GSSEAP_MUTEX_UNLOCK(&gssEapHttpMultiMutex);
+
+    return done;
+}
+
+/*
+ * POST body to url with HTTP Basic authentication, appending the
+ * response body to response. Blocks until the IdP has answered, but
+ * shares the transport with any other requests in flight.
+ */
+OM_uint32
+gssEapHttpPost(OM_uint32 *minor,
+               const char *url,
+               const char *user,
+               const char *password,
+               const void *body,
+               size_t bodyLength,
+               gss_buffer_t response)
+{
+    OM_uint32 major, tmpMinor;
+    struct gss_eap_http_request *request = NULL;
+    gss_buffer_desc body_from_idp = GSS_C_EMPTY_BUFFER;
+
+    major = gssEapHttpPostStart(minor, url, user, password,
+                                body, bodyLength, &request);
+    if (GSS_ERROR(major))
+        return major;
+
+    do {
+        while (!waitMulti(request))
+            ;
+        major = collectResponse(minor, request, &body_from_idp);
+    } while (major == GSS_S_CONTINUE_NEEDED);
+
+    if (major == GSS_S_COMPLETE) {
+        if (response->value == NULL) {
+            *response = body_from_idp;
+        } else {
+            major = addToStringBuffer(minor, body_from_idp.value,
+                                      body_from_idp.length, response);
+            gss_release_buffer(&tmpMinor, &body_from_idp);
+        }
+    }
+
+    gssEapHttpRequestFree(request);
+
+    return major;
+}
@@ -53,64 +53,142 @@
 
 /*
  * Functions to check sequence numbers for replay and sequencing
+ *
+ * Sequence numbers are recorded in a sliding window: a bitmap of the
+ * last "width" numbers below the next expected one. Checking a number
+ * and recording it take constant time, and moving the window forward
+ * clears only the bits it passes over.
  */
 
 #include "gssapiP_eap.h"
 
-#define QUEUE_LENGTH 20
+/* Window width, in sequence numbers; see SAML_EC_REPLAY_WINDOW */
+#define WINDOW_MIN          64
+#define WINDOW_MAX          4096
+#define WINDOW_DEFAULT      64
+
+#define WORD_BITS           64
+
+/*
+ * Serialized form, all integers big-endian:
+ *
+ *  0   flags (QUEUE_FLAG_*)
+ *  4   window width, or 0 if there is no state
+ *  8   firstnum
+ *  16  next
+ *  24  bitmap, width / 64 words
+ */
+#define QUEUE_FLAG_REPLAY   0x1
+#define QUEUE_FLAG_SEQUENCE 0x2
+#define QUEUE_FLAG_WIDE     0x4
+
+#define QUEUE_HEADER_LENGTH 24
 
 typedef struct _queue {
     int do_replay;
     int do_sequence;
-    int start;
-    int length;
-    uint64_t firstnum;
-    /* Stored as deltas from firstnum.  This way, the high bit won't
-       overflow unless we've actually gone through 2**n messages, or
-       gotten something *way* out of sequence.  */
-    uint64_t elem[QUEUE_LENGTH];
     /* All ones for 64-bit sequence numbers; 32 ones for 32-bit
        sequence numbers.  */
     uint64_t mask;
+    uint64_t firstnum;
+    /* One more than the highest sequence number seen, counted from
+       firstnum. It is not masked, so it never wraps.  */
+    uint64_t next;
+    /* A power of two, from WINDOW_MIN to WINDOW_MAX */
+    uint32_t width;
+    /* Bit (n % width) is set if n, counted from firstnum, has been seen;
+       n is in [next - width, next).  Allocated as width / 64 words.  */
+    uint64_t bitmap[1];
 } queue;
 
-/* rep invariant:
- *  - the queue is a circular queue.  The first element (q->elem[q->start])
- * is the oldest.  The last element is the newest.
- */
+#define QSIZE(width)        (sizeof(queue) + \
+                             ((width) / WORD_BITS - 1) * sizeof(uint64_t))
 
-#define QSIZE(q) (sizeof((q)->elem)/sizeof((q)->elem[0]))
-#define QELEM(q,i) ((q)->elem[(i)%QSIZE(q)])
+static int
+validWidth(uint32_t width)
+{
+    return width >= WINDOW_MIN && width <= WINDOW_MAX &&
+           (width & (width - 1)) == 0;
+}
 
-static void
-queue_insert(queue *q, int after, uint64_t seqnum)
+static uint32_t
+windowWidth(void)
 {
-    /* insert.  this is not the fastest way, but it's easy, and it's
-       optimized for insert at end, which is the common case */
-    int i;
+    const char *value = getenv("SAML_EC_REPLAY_WINDOW");
+    unsigned long n;
+    uint32_t width;
+    char *end;
 
-    /* common case: at end, after == q->start+q->length-1 */
+    if (value == NULL || *value == '\0')
+        return WINDOW_DEFAULT;
 
-    /* move all the elements (after,last] up one slot */
+    n = strtoul(value, &end, 10);
+    if (*end != '\0')
+        return WINDOW_DEFAULT;
+    if (n > WINDOW_MAX)
+        return WINDOW_MAX;
 
-    for (i = q->start + q->length - 1; i > after; i--)
-        QELEM(q,i+1) = QELEM(q,i);
+    for (width = WINDOW_MIN; width < n; width <<= 1)
+        ;
 
-    /* fill in slot after+1 */
+    return width;
+}
 
-    QELEM(q,after+1) = seqnum;
+static queue *
+queueAlloc(uint32_t width)
+{
+    queue *q;
 
-    /* Either increase the length by one, or move the starting point up
-       one (deleting the first element, which got bashed above), as
-       appropriate. */
+    q = (queue *)GSSEAP_CALLOC(1, QSIZE(width));
+    if (q != NULL)
+        q->width = width;
+
+    return q;
+}
 
-    if (q->length == QSIZE(q)) {
-        q->start++;
-        if (q->start == QSIZE(q))
-            q->start = 0;
+static int
+queueTest(queue *q, uint64_t n)
+{
+    uint32_t bit = n & (q->width - 1);
+
+    return (q->bitmap[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+static void
+queueSet(queue *q, uint64_t n)
+{
+    uint32_t bit = n & (q->width - 1);
+
+    q->bitmap[bit / WORD_BITS] |= (uint64_t)1 << (bit % WORD_BITS);
+}
+
+/*
+ * Move the window forward so that next - 1 + count is the highest number
+ * seen, forgetting whatever the bits passed over recorded.
+ */
+static void
+queueAdvance(queue *q, uint64_t count)
+{
+    uint64_t n, end;
+    uint32_t bit, run;
+
+    if (count >= q->width) {
+        memset(q->bitmap, 0, q->width / 8);
     } else {
-        q->length++;
+        end = q->next + count;
+        for (n = q->next; n < end; n += run) {
+            bit = n & (q->width - 1);
+            run = MIN(WORD_BITS - bit % WORD_BITS, end - n);
+            if (run == WORD_BITS)
+                q->bitmap[bit / WORD_BITS] = 0;
+            else
+                q->bitmap[bit / WORD_BITS] &=
+                    ~((((uint64_t)1 << run) - 1) << (bit % WORD_BITS));
+        }
     }
+
+    q->next += count;
+    queueSet(q, q->next - 1);
 }
 
 OM_uint32
@@ -123,7 +201,7 @@ sequenceInit(OM_uint32 *minor,
 {
     queue *q;
 
-    q = (queue *)GSSEAP_CALLOC(1, sizeof(queue));
+    q = queueAlloc(windowWidth());
     if (q == NULL) {
         *minor = ENOMEM;
         return GSS_S_FAILURE;
@@ -132,11 +210,8 @@ sequenceInit(OM_uint32 *minor,
     q->do_replay = do_replay;
     q->do_sequence = do_sequence;
     q->mask = wide_nums ? ~(uint64_t)0 : 0xffffffffUL;
-
-    q->start = 0;
-    q->length = 1;
     q->firstnum = seqnum;
-    q->elem[q->start] = ((uint64_t)0 - 1) & q->mask;
+    q->next = 0;
 
     *vqueue = (void *)q;
 
@@ -149,8 +224,7 @@ sequenceCheck(OM_uint32 *minor,
               uint64_t seqnum)
 {
     queue *q;
-    int i;
-    uint64_t expected;
+    uint64_t behind;
 
     *minor = 0;
 
@@ -160,76 +234,54 @@ sequenceCheck(OM_uint32 *minor,
         return GSS_S_COMPLETE;
 
     /* All checks are done relative to the initial sequence number, to
-       avoid (or at least put off) the pain of wrapping.  */
-    seqnum -= q->firstnum;
-    /* If we're only doing 32-bit values, adjust for that again.
+       avoid (or at least put off) the pain of wrapping.  If we're only
+       doing 32-bit values, adjust for that again.  */
+    seqnum = (seqnum - q->firstnum) & q->mask;
 
-       Note that this will probably be the wrong thing to if we get
-       2**32 messages sent with 32-bit sequence numbers.  */
-    seqnum &= q->mask;
+    /* How far seqnum is below the expected sequence number */
+    behind = (q->next - seqnum) & q->mask;
 
     /* rule 1: expected sequence number */
 
-    expected = (QELEM(q,q->start+q->length-1)+1) & q->mask;
-    if (seqnum == expected) {
-        queue_insert(q, q->start+q->length-1, seqnum);
+    if (behind == 0) {
+        queueSet(q, q->next++);
         return GSS_S_COMPLETE;
     }
 
-    /* rule 2: > expected sequence number */
+    /* rule 2: > expected sequence number
 
-    if ((seqnum > expected)) {
-        queue_insert(q, q->start+q->length-1, seqnum);
+       The top bit of whatever width we're using tells "behind" from
+       "ahead", which gives us 2**31 or 2**63 messages "new", and just
+       as many "old".  */
+
+    if (behind & (1 + (q->mask >> 1))) {
+        queueAdvance(q, ((seqnum - q->next) & q->mask) + 1);
         if (q->do_replay && !q->do_sequence)
             return GSS_S_COMPLETE;
         else
             return GSS_S_GAP_TOKEN;
     }
 
-    /* rule 3: seqnum < seqnum(first) */
-
-    if ((seqnum < QELEM(q,q->start)) &&
-        /* Is top bit of whatever width we're using set?
-
-           We used to check for greater than or equal to firstnum, but
-           (1) we've since switched to compute values relative to
-           firstnum, so the lowest we can have is 0, and (2) the effect
-           of the original scheme was highly dependent on whether
-           firstnum was close to either side of 0.  (Consider
-           firstnum==0xFFFFFFFE and we miss three packets; the next
-           packet is *new* but would look old.)
+    /* rule 3: seqnum below the window, or below firstnum */
 
-           This check should give us 2**31 or 2**63 messages "new", and
-           just as many "old".  That's not quite right either.  */
-        (seqnum & (1 + (q->mask >> 1)))
-    ) {
+    if (behind > q->width || behind > q->next) {
         if (q->do_replay && !q->do_sequence)
             return GSS_S_OLD_TOKEN;
         else
             return GSS_S_UNSEQ_TOKEN;
     }
 
-    /* rule 4+5: seqnum in [seqnum(first),seqnum(last)]  */
-
-    else {
-        if (seqnum == QELEM(q,q->start+q->length - 1))
-            return GSS_S_DUPLICATE_TOKEN;
-
-        for (i = q->start; i < q->start + q->length - 1; i++) {
-            if (seqnum == QELEM(q,i))
-                return GSS_S_DUPLICATE_TOKEN;
-            if ((seqnum > QELEM(q,i)) && (seqnum < QELEM(q,i+1))) {
-                queue_insert(q, i, seqnum);
-                if (q->do_replay && !q->do_sequence)
-                    return GSS_S_COMPLETE;
-                else
-                    return GSS_S_UNSEQ_TOKEN;
-            }
-        }
-    }
+    /* rule 4+5: seqnum within the window */
 
-    /* this should never happen */
-    return GSS_S_FAILURE;
+    if (queueTest(q, q->next - behind))
+        return GSS_S_DUPLICATE_TOKEN;
+
+    queueSet(q, q->next - behind);
+
+    if (q->do_replay && !q->do_sequence)
+        return GSS_S_COMPLETE;
+    else
+        return GSS_S_UNSEQ_TOKEN;
 }
 
 OM_uint32
@@ -248,12 +300,19 @@ sequenceFree(OM_uint32 *minor, void **vqueue)
 }
 
 /*
- * These support functions are for the serialization routines
+ * These support functions are for the serialization routines. With no
+ * state, the size is that of the fixed part, which is all that is read
+ * before sequenceInternalize() learns the width.
  */
 size_t
-sequenceSize(void *vqueue GSSEAP_UNUSED)
+sequenceSize(void *vqueue)
 {
-    return sizeof(queue);
+    queue *q = (queue *)vqueue;
+
+    if (q == NULL)
+        return QUEUE_HEADER_LENGTH;
+
+    return QUEUE_HEADER_LENGTH + q->width / 8;
 }
 
 OM_uint32
@@ -262,15 +321,40 @@ sequenceExternalize(OM_uint32 *minor,
                     unsigned char **buf,
                     size_t *lenremain)
 {
-    if (*lenremain < sizeof(queue)) {
+    queue *q = (queue *)vqueue;
+    unsigned char *p = *buf;
+    uint32_t flags = 0, i;
+    size_t length = sequenceSize(vqueue);
+
+    if (*lenremain < length) {
         *minor = GSSEAP_WRONG_SIZE;
         return GSS_S_FAILURE;
     }
-    memcpy(*buf, vqueue, sizeof(queue));
-    *buf += sizeof(queue);
-    *lenremain -= sizeof(queue);
 
-    return 0;
+    memset(p, 0, QUEUE_HEADER_LENGTH);
+
+    if (q != NULL) {
+        if (q->do_replay)
+            flags |= QUEUE_FLAG_REPLAY;
+        if (q->do_sequence)
+            flags |= QUEUE_FLAG_SEQUENCE;
+        if (q->mask == ~(uint64_t)0)
+            flags |= QUEUE_FLAG_WIDE;
+
+        store_uint32_be(flags,       &p[0]);
+        store_uint32_be(q->width,    &p[4]);
+        store_uint64_be(q->firstnum, &p[8]);
+        store_uint64_be(q->next,     &p[16]);
+
+        for (i = 0; i < q->width / WORD_BITS; i++)
+            store_uint64_be(q->bitmap[i], &p[QUEUE_HEADER_LENGTH + 8 * i]);
+    }
+
+    *buf += length;
+    *lenremain -= length;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
 }
 
 OM_uint32
@@ -279,22 +363,55 @@ sequenceInternalize(OM_uint32 *minor,
                     unsigned char **buf,
                     size_t *lenremain)
 {
-    void *q;
+    unsigned char *p = *buf;
+    queue *q;
+    uint32_t flags, width, i;
 
-    if (*lenremain < sizeof(queue)) {
+    *vqueue = NULL;
+
+    if (*lenremain < QUEUE_HEADER_LENGTH) {
         *minor = GSSEAP_TOK_TRUNC;
         return GSS_S_DEFECTIVE_TOKEN;
     }
 
-    q = GSSEAP_MALLOC(sizeof(queue));
+    flags = load_uint32_be(&p[0]);
+    width = load_uint32_be(&p[4]);
+
+    if (width == 0) {
+        *buf += QUEUE_HEADER_LENGTH;
+        *lenremain -= QUEUE_HEADER_LENGTH;
+        *minor = 0;
+        return GSS_S_COMPLETE;
+    }
+
+    if (!validWidth(width) ||
+        (flags & ~(QUEUE_FLAG_REPLAY | QUEUE_FLAG_SEQUENCE | QUEUE_FLAG_WIDE))) {
+        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    if (*lenremain < QUEUE_HEADER_LENGTH + width / 8) {
+        *minor = GSSEAP_TOK_TRUNC;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    q = queueAlloc(width);
     if (q == NULL) {
         *minor = ENOMEM;
         return GSS_S_FAILURE;
     }
 
-    memcpy(q, *buf, sizeof(queue));
-    *buf += sizeof(queue);
-    *lenremain -= sizeof(queue);
+    q->do_replay = ((flags & QUEUE_FLAG_REPLAY) != 0);
+    q->do_sequence = ((flags & QUEUE_FLAG_SEQUENCE) != 0);
+    q->mask = (flags & QUEUE_FLAG_WIDE) ? ~(uint64_t)0 : 0xffffffffUL;
+    q->firstnum = load_uint64_be(&p[8]);
+    q->next = load_uint64_be(&p[16]);
+
+    for (i = 0; i < width / WORD_BITS; i++)
+        q->bitmap[i] = load_uint64_be(&p[QUEUE_HEADER_LENGTH + 8 * i]);
+
+    *buf += QUEUE_HEADER_LENGTH + width / 8;
+    *lenremain -= QUEUE_HEADER_LENGTH + width / 8;
     *vqueue = q;
 
     *minor = 0;
@@ -164,13 +164,11 @@ gss_eap_saml_assertion_provider::setAssertion(const gss_buffer_t buffer,
 saml2::Assertion *
 gss_eap_saml_assertion_provider::parseAssertion(const gss_buffer_t buffer)
 {
-    string str((char *)buffer->value, buffer->length);
-    istringstream istream(str);
     DOMDocument *doc;
     const XMLObjectBuilder *b;
 
     try {
-        doc = XMLToolingConfig::getConfig().getParser().parse(istream);
+        doc = gssEapParseXml(buffer->value, buffer->length);
         if (doc == NULL)
             return NULL;
 
@@ -174,9 +174,7 @@ gss_eap_shib_attr_provider::initWithGssContext(const gss_eap_attr_ctx *manager,
         radius->getFragmentedAttribute(PW_SAML_AAA_ASSERTION,
                                        VENDORPEC_UKERNA,
                                        &authenticated, &complete, &value)) {
-        string str((char *)value.value, value.length);
-        istringstream istream(str);
-        DOMDocument *doc = XMLToolingConfig::getConfig().getParser().parse(istream);
+        DOMDocument *doc = gssEapParseXml(value.value, value.length);
         const XMLObjectBuilder *b = XMLObjectBuilder::getBuilder(doc->getDocumentElement());
         resolver->addToken(b->buildFromDocument(doc));
         gss_release_buffer(&minor, &value);
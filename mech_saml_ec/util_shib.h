@@ -117,6 +117,14 @@ extern "C" {
 OM_uint32 gssEapLocalAttrProviderInit(OM_uint32 *minor);
 OM_uint32 gssEapLocalAttrProviderFinalize(OM_uint32 *minor);
 
+/* SAML2XML.cpp */
+OM_uint32 gssEapSamlSPInit(OM_uint32 *minor, gss_name_t acceptorName);
+OM_uint32 gssEapSamlSPFinalize(OM_uint32 *minor);
+
+char *getSAMLRequest2(void);
+int verifySAMLResponse(const char *saml, int len, char **username,
+                       int *enctype, unsigned char *key, size_t *keyLength);
+
 #ifdef __cplusplus
 }
 #endif
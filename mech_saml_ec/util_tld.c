@@ -43,6 +43,11 @@ destroyThreadLocalData(struct gss_eap_thread_local_data *tld)
 {
     if (tld->statusInfo != NULL)
         gssEapDestroyStatusInfo(tld->statusInfo);
+#if defined(GSSEAP_ENABLE_ACCEPTOR) && \
+    (defined(HAVE_OPENSAML) || defined(HAVE_SHIBRESOLVER))
+    if (tld->xmlParser != NULL)
+        gssEapDestroyXmlParser(tld->xmlParser);
+#endif
     GSSEAP_FREE(tld);
 }
 
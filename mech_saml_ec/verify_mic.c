@@ -43,11 +43,15 @@ gss_verify_mic(OM_uint32 *minor,
                gss_buffer_t message_token,
                gss_qop_t *qop_state)
 {
-#ifdef MECH_EAP
     OM_uint32 major;
     gss_iov_buffer_desc iov[3];
     int conf_state;
 
+    if (ctx == GSS_C_NO_CONTEXT) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_NO_CONTEXT;
+    }
+
     if (message_token->length < 16) {
         *minor = GSSEAP_TOK_TRUNC;
         return GSS_S_BAD_SIG;
@@ -61,15 +65,15 @@ gss_verify_mic(OM_uint32 *minor,
     iov[1].type = GSS_IOV_BUFFER_TYPE_HEADER;
     iov[1].buffer = *message_token;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
+    if (!CTX_IS_ESTABLISHED(ctx)) {
+        major = GSS_S_NO_CONTEXT;
+        *minor = GSSEAP_CONTEXT_INCOMPLETE;
+        goto cleanup;
+    }
 
     major = gssEapUnwrapOrVerifyMIC(minor, ctx, &conf_state, qop_state,
                                     iov, 2, TOK_TYPE_MIC);
 
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
+cleanup:
     return major;
-#else
-    return GSS_S_UNAVAILABLE;
-#endif
 }
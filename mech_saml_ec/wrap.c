@@ -45,7 +45,6 @@ gss_wrap(OM_uint32 *minor,
          int *conf_state,
          gss_buffer_t output_message_buffer)
 {
-#ifdef MECH_EAP
     OM_uint32 major;
 
     if (ctx == GSS_C_NO_CONTEXT) {
@@ -55,8 +54,6 @@ gss_wrap(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSEAP_CONTEXT_INCOMPLETE;
@@ -70,12 +67,7 @@ gss_wrap(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
-#else
-    return GSS_S_UNAVAILABLE;
-#endif
 }
 
 OM_uint32
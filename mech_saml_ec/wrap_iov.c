@@ -80,6 +80,301 @@ rfc4121Flags(gss_ctx_id_t ctx, int receiving)
     return flags;
 }
 
+/*
+ * Check, before a sequence number is spent on it, that a wrap or MIC
+ * token can be built in iov: there is a HEADER buffer, and the HEADER
+ * and any TRAILER the token uses are either to be allocated or large
+ * enough. Failures here are the caller's, and leave iov untouched.
+ */
+OM_uint32
+gssEapWrapTokenCheckIov(OM_uint32 *minor,
+                        gss_ctx_id_t ctx,
+                        int conf_req_flag,
+                        gss_iov_buffer_desc *iov,
+                        int iov_count,
+                        enum gss_eap_token_type toktype)
+{
+    gss_iov_buffer_t header;
+    gss_iov_buffer_t trailer;
+    size_t gssHeaderLen, gssTrailerLen;
+
+    if (ctx->rfc3961Key == NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    if (toktype != TOK_TYPE_WRAP && toktype != TOK_TYPE_MIC) {
+        *minor = GSSEAP_WRONG_TOK_ID;
+        return GSS_S_FAILURE;
+    }
+
+    if (conf_req_flag && gssEapIsIntegrityOnly(iov, iov_count))
+        conf_req_flag = 0;
+
+    header = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_HEADER);
+    if (header == NULL) {
+        *minor = GSSEAP_MISSING_IOV;
+        return GSS_S_FAILURE;
+    }
+
+    trailer = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_TRAILER);
+
+    if (toktype == TOK_TYPE_WRAP && conf_req_flag) {
+        gssHeaderLen = 16 + RFC3961_CONFOUNDER_LENGTH;
+        gssTrailerLen = 16 + RFC3961_CHECKSUM_LENGTH;
+    } else {
+        gssHeaderLen = 16;
+        gssTrailerLen = RFC3961_CHECKSUM_LENGTH;
+        if (toktype == TOK_TYPE_MIC)
+            trailer = NULL;
+    }
+
+    if (trailer == NULL)
+        gssHeaderLen += gssTrailerLen;
+
+    if ((header->type & GSS_IOV_BUFFER_FLAG_ALLOCATE) == 0 &&
+        header->buffer.length < gssHeaderLen) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_FAILURE;
+    }
+
+    if (trailer != NULL &&
+        (trailer->type & GSS_IOV_BUFFER_FLAG_ALLOCATE) == 0 &&
+        trailer->buffer.length < gssTrailerLen) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_FAILURE;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * Build an RFC 4121 wrap or MIC token. With confidentiality, the token
+ * is
+ *
+ *      HEADER:  Token header | confounder
+ *      DATA:    encrypted in place
+ *      TRAILER: E(Token header) | HMAC
+ *
+ * and without it, HEADER is the token header and TRAILER the checksum.
+ * If there is no TRAILER buffer, the trailer follows the token header in
+ * HEADER and RRC says so.
+ *
+ * The caller checks iov with gssEapWrapTokenCheckIov(), then reserves
+ * the sequence number and, if it has one ready, the confounder; with
+ * none, it is generated here.
+ */
+OM_uint32
+gssEapWrapToken(OM_uint32 *minor,
+                gss_ctx_id_t ctx,
+                int conf_req_flag,
+                int *conf_state,
+                gss_iov_buffer_desc *iov,
+                int iov_count,
+                enum gss_eap_token_type toktype,
+                uint64_t seqnum,
+                const unsigned char *confounder)
+{
+    OM_uint32 major = GSS_S_FAILURE, code = 0;
+    gss_iov_buffer_t header;
+    gss_iov_buffer_t padding;
+    gss_iov_buffer_t trailer;
+    unsigned char flags;
+    unsigned char *outbuf = NULL;
+    unsigned char *tbuf = NULL;
+    unsigned char cksumHeader[16];
+    int keyUsage;
+    size_t rrc = 0;
+    size_t gssHeaderLen, gssTrailerLen;
+
+    if (ctx->rfc3961Key == NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    flags = rfc4121Flags(ctx, 0);
+
+    if (toktype == TOK_TYPE_WRAP) {
+        keyUsage = CTX_IS_INITIATOR(ctx)
+                   ? KEY_USAGE_INITIATOR_SEAL
+                   : KEY_USAGE_ACCEPTOR_SEAL;
+    } else {
+        keyUsage = CTX_IS_INITIATOR(ctx)
+                   ? KEY_USAGE_INITIATOR_SIGN
+                   : KEY_USAGE_ACCEPTOR_SIGN;
+    }
+
+    if (conf_req_flag && gssEapIsIntegrityOnly(iov, iov_count))
+        conf_req_flag = 0;
+
+    header = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_HEADER);
+    if (header == NULL) {
+        *minor = GSSEAP_MISSING_IOV;
+        return GSS_S_FAILURE;
+    }
+
+    padding = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_PADDING);
+    if (padding != NULL)
+        padding->buffer.length = 0;
+
+    trailer = gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_TRAILER);
+
+    if (toktype == TOK_TYPE_WRAP && conf_req_flag) {
+        size_t ec = 0; /* CTS needs no filler */
+
+        gssHeaderLen = 16 + RFC3961_CONFOUNDER_LENGTH;
+        gssTrailerLen = ec + 16 /* E(Header) */ + RFC3961_CHECKSUM_LENGTH;
+
+        if (trailer == NULL) {
+            rrc = gssTrailerLen;
+            gssHeaderLen += gssTrailerLen;
+        }
+
+        if (header->type & GSS_IOV_BUFFER_FLAG_ALLOCATE) {
+            code = gssEapAllocIov(header, gssHeaderLen);
+        } else if (header->buffer.length < gssHeaderLen)
+            code = GSSEAP_WRONG_SIZE;
+        if (code != 0)
+            goto cleanup;
+        outbuf = (unsigned char *)header->buffer.value;
+        header->buffer.length = gssHeaderLen;
+
+        if (trailer != NULL) {
+            if (trailer->type & GSS_IOV_BUFFER_FLAG_ALLOCATE)
+                code = gssEapAllocIov(trailer, gssTrailerLen);
+            else if (trailer->buffer.length < gssTrailerLen)
+                code = GSSEAP_WRONG_SIZE;
+            if (code != 0)
+                goto cleanup;
+            trailer->buffer.length = gssTrailerLen;
+            tbuf = (unsigned char *)trailer->buffer.value;
+        } else {
+            tbuf = outbuf + 16;
+        }
+
+        /* TOK_ID */
+        store_uint16_be((uint16_t)toktype, outbuf);
+        /* flags */
+        outbuf[2] = flags | TOK_FLAG_WRAP_CONFIDENTIAL;
+        /* filler */
+        outbuf[3] = 0xFF;
+        /* EC */
+        store_uint16_be(ec, outbuf + 4);
+        /* RRC */
+        store_uint16_be(0, outbuf + 6);
+        store_uint64_be(seqnum, outbuf + 8);
+
+        /* EC | copy of header to be encrypted */
+        memset(tbuf, 0xFF, ec);
+        memcpy(tbuf + ec, outbuf, 16);
+
+        if (confounder != NULL)
+            memcpy(outbuf + gssHeaderLen - RFC3961_CONFOUNDER_LENGTH,
+                   confounder, RFC3961_CONFOUNDER_LENGTH);
+        else
+            code = gssEapRandom(outbuf + gssHeaderLen - RFC3961_CONFOUNDER_LENGTH,
+                                RFC3961_CONFOUNDER_LENGTH);
+        if (code != 0)
+            goto cleanup;
+
+        code = gssEapEncrypt(ctx->rfc3961Key, keyUsage,
+                             outbuf + gssHeaderLen - RFC3961_CONFOUNDER_LENGTH,
+                             iov, iov_count,
+                             tbuf, ec + 16,
+                             tbuf + ec + 16);
+        if (code != 0)
+            goto cleanup;
+
+        /* RRC */
+        store_uint16_be(rrc, outbuf + 6);
+    } else if (toktype == TOK_TYPE_WRAP || toktype == TOK_TYPE_MIC) {
+        gssHeaderLen = 16;
+        gssTrailerLen = RFC3961_CHECKSUM_LENGTH;
+
+        /* A MIC token is just the header and checksum */
+        if (toktype == TOK_TYPE_MIC || trailer == NULL) {
+            rrc = gssTrailerLen;
+            gssHeaderLen += gssTrailerLen;
+        }
+
+        if (header->type & GSS_IOV_BUFFER_FLAG_ALLOCATE)
+            code = gssEapAllocIov(header, gssHeaderLen);
+        else if (header->buffer.length < gssHeaderLen)
+            code = GSSEAP_WRONG_SIZE;
+        if (code != 0)
+            goto cleanup;
+        outbuf = (unsigned char *)header->buffer.value;
+        header->buffer.length = gssHeaderLen;
+
+        if (rrc == 0) {
+            if (trailer->type & GSS_IOV_BUFFER_FLAG_ALLOCATE)
+                code = gssEapAllocIov(trailer, gssTrailerLen);
+            else if (trailer->buffer.length < gssTrailerLen)
+                code = GSSEAP_WRONG_SIZE;
+            if (code != 0)
+                goto cleanup;
+            trailer->buffer.length = gssTrailerLen;
+            tbuf = (unsigned char *)trailer->buffer.value;
+        } else {
+            tbuf = outbuf + 16;
+        }
+
+        /* TOK_ID */
+        store_uint16_be((uint16_t)toktype, outbuf);
+        /* flags */
+        outbuf[2] = flags;
+        /* filler */
+        outbuf[3] = 0xFF;
+        if (toktype == TOK_TYPE_WRAP) {
+            /* EC and RRC are zero while checksumming */
+            store_uint16_be(0, outbuf + 4);
+            store_uint16_be(0, outbuf + 6);
+        } else {
+            /* filler */
+            store_uint32_be(0xFFFFFFFF, outbuf + 4);
+        }
+        store_uint64_be(seqnum, outbuf + 8);
+
+        /* The trailer may share the header buffer, so checksum a copy */
+        memcpy(cksumHeader, outbuf, 16);
+
+        code = gssEapSign(ctx->rfc3961Key, keyUsage, iov, iov_count,
+                          cksumHeader, tbuf);
+        if (code != 0)
+            goto cleanup;
+
+        if (toktype == TOK_TYPE_WRAP) {
+            /* EC is the checksum length for integrity-only tokens */
+            store_uint16_be(gssTrailerLen, outbuf + 4);
+            /* RRC */
+            store_uint16_be(rrc, outbuf + 6);
+        }
+    } else {
+        code = GSSEAP_WRONG_TOK_ID;
+        goto cleanup;
+    }
+
+    if (conf_state != NULL)
+        *conf_state = conf_req_flag;
+
+    major = GSS_S_COMPLETE;
+
+cleanup:
+    if (GSS_ERROR(major))
+        gssEapReleaseIov(iov, iov_count);
+
+    *minor = code;
+
+    return major;
+}
+
+/*
+ * Build a token with the next sequence number. Buffers the token cannot
+ * be built in are refused before the number is taken; a token that fails
+ * after that, for want of memory or randomness, leaves a gap in the
+ * sequence.
+ */
 OM_uint32
 gssEapWrapOrGetMIC(OM_uint32 *minor,
                    gss_ctx_id_t ctx,
@@ -89,8 +384,17 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
                    int iov_count,
                    enum gss_eap_token_type toktype)
 {
-    *minor = GSSEAP_KEY_UNAVAILABLE;
-    return GSS_S_UNAVAILABLE;
+    OM_uint32 major;
+
+    major = gssEapWrapTokenCheckIov(minor, ctx, conf_req_flag,
+                                    iov, iov_count, toktype);
+    if (GSS_ERROR(major))
+        return major;
+
+    return gssEapWrapToken(minor, ctx, conf_req_flag, conf_state,
+                           iov, iov_count, toktype,
+                           GSSEAP_ATOMIC_FETCH_ADD64(&ctx->sendSeq, 1),
+                           NULL);
 }
 
 OM_uint32 GSSAPI_CALLCONV
@@ -116,8 +420,6 @@ gss_wrap_iov(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSEAP_CONTEXT_INCOMPLETE;
@@ -130,7 +432,5 @@ gss_wrap_iov(OM_uint32 *minor,
         goto cleanup;
 
 cleanup:
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
 }
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Wrap many messages on one context in one call. Every message's buffers
+ * are checked first, so that one laid out wrongly fails alone without
+ * taking a sequence number; the rest take one range of sequence numbers,
+ * reserved together, and their confounders are drawn from the random
+ * number generator a chunk at a time.
+ */
+
+#include "gssapiP_eap.h"
+
+/* Messages whose confounders are drawn together */
+#define BATCH_CHUNK                     64
+
+OM_uint32 GSSAPI_CALLCONV
+gss_eap_wrap_iov_batch(OM_uint32 *minor,
+                       gss_ctx_id_t ctx,
+                       int conf_req_flag,
+                       gss_qop_t qop_req,
+                       gss_eap_iov_set_desc *iov_sets,
+                       size_t count)
+{
+    OM_uint32 major = GSS_S_COMPLETE;
+    unsigned char confounders[BATCH_CHUNK * RFC3961_CONFOUNDER_LENGTH];
+    uint64_t seqnum;
+    size_t i, valid, used;
+    int code = 0;
+
+    if (ctx == GSS_C_NO_CONTEXT) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_NO_CONTEXT;
+    }
+
+    if (qop_req != GSS_C_QOP_DEFAULT) {
+        *minor = GSSEAP_UNKNOWN_QOP;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    if (iov_sets == NULL && count != 0) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ;
+    }
+
+    *minor = 0;
+
+    if (!CTX_IS_ESTABLISHED(ctx)) {
+        *minor = GSSEAP_CONTEXT_INCOMPLETE;
+        return GSS_S_NO_CONTEXT;
+    }
+
+    if (ctx->rfc3961Key == NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    for (i = 0, valid = 0; i < count; i++) {
+        gss_eap_iov_set_t set = &iov_sets[i];
+
+        set->major_status =
+            gssEapWrapTokenCheckIov(&set->minor_status, ctx, conf_req_flag,
+                                    set->iov, set->iov_count, TOK_TYPE_WRAP);
+        if (!GSS_ERROR(set->major_status))
+            valid++;
+    }
+
+    seqnum = GSSEAP_ATOMIC_FETCH_ADD64(&ctx->sendSeq, valid);
+
+    for (i = 0, used = BATCH_CHUNK; i < count; i++) {
+        gss_eap_iov_set_t set = &iov_sets[i];
+
+        if (!GSS_ERROR(set->major_status)) {
+            /* valid counts the messages still to be wrapped */
+            if (used == BATCH_CHUNK) {
+                if (conf_req_flag)
+                    code = gssEapRandom(confounders, MIN(valid, BATCH_CHUNK) *
+                                                     RFC3961_CONFOUNDER_LENGTH);
+                used = 0;
+            }
+
+            if (code != 0) {
+                set->major_status = GSS_S_FAILURE;
+                set->minor_status = code;
+            } else {
+                set->major_status =
+                    gssEapWrapToken(&set->minor_status, ctx,
+                                    conf_req_flag, &set->conf_state,
+                                    set->iov, set->iov_count, TOK_TYPE_WRAP,
+                                    seqnum++,
+                                    &confounders[used * RFC3961_CONFOUNDER_LENGTH]);
+            }
+            used++;
+            valid--;
+        }
+
+        if (GSS_ERROR(set->major_status) && !GSS_ERROR(major)) {
+            major = set->major_status;
+            *minor = set->minor_status;
+        }
+    }
+
+    return major;
+}
@@ -44,7 +44,6 @@ gss_wrap_size_limit(OM_uint32 *minor,
                     OM_uint32 req_output_size,
                     OM_uint32 *max_input_size)
 {
-#ifdef MECH_EAP
     gss_iov_buffer_desc iov[4];
     OM_uint32 major, overhead;
 
@@ -55,8 +54,6 @@ gss_wrap_size_limit(OM_uint32 *minor,
 
     *minor = 0;
 
-    GSSEAP_MUTEX_LOCK(&ctx->mutex);
-
     if (!CTX_IS_ESTABLISHED(ctx)) {
         major = GSS_S_NO_CONTEXT;
         *minor = GSSEAP_CONTEXT_INCOMPLETE;
@@ -92,10 +89,5 @@ gss_wrap_size_limit(OM_uint32 *minor,
         *max_input_size = 0;
 
 cleanup:
-    GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
-
     return major;
-#else
-    return GSS_S_UNAVAILABLE;
-#endif
 }